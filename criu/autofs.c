@@ -880,7 +880,8 @@ static int autofs_create_fle(struct pstree_item *task, FdinfoEntry *fe,
 
 	collect_gen_fd(le, rst_info);
 
-	collect_used_fd(le, rst_info);
+	if (collect_used_fd(le, rst_info))
+		return -1;
 
 	list_add_tail(&le->desc_list, &desc->fd_info_head);
 	le->desc = desc;
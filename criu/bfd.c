@@ -315,7 +315,14 @@ int bread(struct bfd *bfd, void *buf, int size)
 			filled += chunk;
 		}
 
-		if (filled < size)
+		if (size - filled >= BUFSIZE) {
+			/* Big reads go directly to the caller's buffer */
+			more = read(bfd->fd, buf + filled, size - filled);
+			if (more < 0)
+				pr_perror("Error reading file");
+			else
+				filled += more;
+		} else if (filled < size)
 			more = brefill(bfd);
 		else {
 			BUG_ON(filled > size);
@@ -961,6 +961,7 @@ static int (*chk_feature)(void);
 int cr_check(void)
 {
 	struct ns_id ns = { .type = NS_CRIU, .ns_pid = PROC_SELF, .nd = &mnt_ns_desc };
+	struct mount_info *pm;
 	int ret = 0;
 
 	if (!is_root_user())
@@ -977,9 +978,10 @@ int cr_check(void)
 
 	ns.id = root_item->ids->mnt_ns_id;
 
-	mntinfo = collect_mntinfo(&ns, false);
-	if (mntinfo == NULL)
+	pm = collect_mntinfo(&ns, false);
+	if (pm == NULL)
 		return -1;
+	mntinfo_add_list(pm);
 
 	if (chk_feature) {
 		if (chk_feature())
@@ -50,6 +50,14 @@ int cr_dedup(void)
 			if (ret < 0)
 				break;
 		}
+
+		ret = sscanf(ent->d_name, "pagemap-sysv-shmem-%d.img", &id);
+		if (ret == 1) {
+			pr_info("sysv shmid=%d\n", id);
+			ret = cr_dedup_one_pagemap(id, PR_SYSV_SHMEM);
+			if (ret < 0)
+				break;
+		}
 	}
 
 err:
@@ -88,7 +96,7 @@ static int cr_dedup_one_pagemap(int id, int flags)
 
 	while (1) {
 		pr_debug("dedup iovec base=%p, len=%zu\n", iov.iov_base, iov.iov_len);
-		if (!pr.pe->in_parent) {
+		if (!pagemap_in_parent(pr.pe)) {
 			ret = dedup_one_iovec(prp, &iov);
 			if (ret)
 				goto exit;
@@ -51,6 +51,7 @@
 #include "parasite-syscall.h"
 #include "files.h"
 #include "files-reg.h"
+#include "pipes.h"
 #include "shmem.h"
 #include "sk-inet.h"
 #include "pstree.h"
@@ -81,6 +82,8 @@
 #include "seccomp.h"
 #include "seize.h"
 #include "fault-injection.h"
+#include "mempolicy.h"
+#include "img-stream.h"
 
 #include "asm/dump.h"
 
@@ -93,6 +96,7 @@ void free_mappings(struct vm_area_list *vma_area_list)
 	list_for_each_entry_safe(vma_area, p, &vma_area_list->h, list) {
 		if (!vma_area->file_borrowed)
 			free(vma_area->vmst);
+		free_vma_mempolicy(vma_area);
 		free(vma_area);
 	}
 
@@ -1203,12 +1207,16 @@ static int dump_one_task(struct pstree_item *item)
 		 */
 		return 0;
 
+	span_set_task(pid);
+
 	pr_info("Obtaining task stat ... \n");
 	ret = parse_pid_stat(pid, &pps_buf);
 	if (ret < 0)
 		goto err;
 
+	span_start(SPAN_COLLECT_MAPPINGS);
 	ret = collect_mappings(pid, &vmas, dump_filemap);
+	span_stop(SPAN_COLLECT_MAPPINGS);
 	if (ret) {
 		pr_err("Collect mappings (pid: %d) failed with %d\n", pid, ret);
 		goto err;
@@ -1242,7 +1250,9 @@ static int dump_one_task(struct pstree_item *item)
 		goto err;
 	}
 
+	span_start(SPAN_INFECT);
 	parasite_ctl = parasite_infect_seized(pid, item, &vmas);
+	span_stop(SPAN_INFECT);
 	if (!parasite_ctl) {
 		pr_err("Can't infect (pid: %d) with parasite\n", pid);
 		goto err;
@@ -1280,6 +1290,12 @@ static int dump_one_task(struct pstree_item *item)
 		goto err_cure_imgset;
 	}
 
+	ret = parasite_dump_mempolicy_seized(parasite_ctl, &vmas, item->core[0]->tc);
+	if (ret) {
+		pr_err("Can't dump memory policies (pid: %d)\n", pid);
+		goto err_cure_imgset;
+	}
+
 	ret = parasite_dump_misc_seized(parasite_ctl, &misc);
 	if (ret) {
 		pr_err("Can't dump misc (pid: %d)\n", pid);
@@ -1311,7 +1327,9 @@ static int dump_one_task(struct pstree_item *item)
 	}
 
 	if (dfds) {
+		span_start(SPAN_DUMP_FILES);
 		ret = dump_task_files_seized(parasite_ctl, item, dfds);
+		stats_task_files(pid, dfds->nr_fds, span_stop(SPAN_DUMP_FILES));
 		if (ret) {
 			pr_err("Dump files (pid: %d) failed with %d\n", pid, ret);
 			goto err_cure;
@@ -1320,7 +1338,9 @@ static int dump_one_task(struct pstree_item *item)
 
 	mdc.pre_dump = false;
 
+	span_start(SPAN_DUMP_PAGES);
 	ret = parasite_dump_pages_seized(item, &vmas, &mdc, parasite_ctl);
+	span_stop(SPAN_DUMP_PAGES);
 	if (ret)
 		goto err_cure;
 
@@ -1360,7 +1380,9 @@ static int dump_one_task(struct pstree_item *item)
 		goto err;
 	}
 
+	span_start(SPAN_CURE);
 	ret = parasite_cure_seized(parasite_ctl);
+	span_stop(SPAN_CURE);
 	if (ret) {
 		pr_err("Can't cure (pid: %d) from parasite\n", pid);
 		goto err;
@@ -1381,6 +1403,7 @@ static int dump_one_task(struct pstree_item *item)
 	close_cr_imgset(&cr_imgset);
 	exit_code = 0;
 err:
+	span_set_task(0);
 	close_pid_proc();
 	free_mappings(&vmas);
 	xfree(dfds);
@@ -1451,7 +1474,7 @@ static int cr_pre_dump_finish(int ret)
 
 		pr_info("\tPre-dumping %d\n", item->pid.virt);
 		timing_start(TIME_MEMWRITE);
-		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, item->pid.virt);
+		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, item->pid.virt, 0);
 		if (ret < 0)
 			goto err;
 
@@ -1480,7 +1503,7 @@ err:
 	if (disconnect_from_page_server())
 		ret = -1;
 
-	if (bfd_flush_images())
+	if (bfd_flush_images() || fsync_images())
 		ret = -1;
 
 	if (ret)
@@ -1561,6 +1584,12 @@ err:
 	return cr_pre_dump_finish(ret);
 }
 
+static void write_dump_stats(void)
+{
+	cnt_add(CNT_KCMP_CALLS, kid_kcmp_calls());
+	write_stats(DUMP_STATS);
+}
+
 static int cr_dump_finish(int ret)
 {
 	int post_dump_ret = 0;
@@ -1570,7 +1599,20 @@ static int cr_dump_finish(int ret)
 
 	close_cr_imgset(&glob_imgset);
 
-	if (bfd_flush_images())
+	if (bfd_flush_images() || fsync_images())
+		ret = -1;
+
+	/*
+	 * With images stream the stats and trace go into the stream
+	 * as well, so they are written before it's sealed and count
+	 * the frozen time up to here.
+	 */
+	if (!ret && opts.stream_images) {
+		timing_stop(TIME_FROZEN);
+		write_dump_stats();
+	}
+
+	if (img_stream_finish(ret))
 		ret = -1;
 
 	cr_plugin_fini(CR_PLUGIN_STAGE__DUMP, ret);
@@ -1635,7 +1677,8 @@ static int cr_dump_finish(int ret)
 	if (ret) {
 		pr_err("Dumping FAILED.\n");
 	} else {
-		write_stats(DUMP_STATS);
+		if (!opts.stream_images)
+			write_dump_stats();
 		pr_info("Dumping finished successfully\n");
 	}
 	return post_dump_ret ? : (ret != 0);
@@ -1665,6 +1708,9 @@ int cr_dump_tasks(pid_t pid)
 	if (init_stats(DUMP_STATS))
 		goto err;
 
+	if (img_stream_open())
+		goto err;
+
 	if (cr_plugin_init(CR_PLUGIN_STAGE__DUMP))
 		goto err;
 
@@ -1736,6 +1782,9 @@ int cr_dump_tasks(pid_t pid)
 			goto err;
 	}
 
+	if (flush_pipes_data())
+		goto err;
+
 	/*
 	 * It may happen that a process has completed but its files in
 	 * /proc/PID/ are still open by another process. If the PID has been
@@ -1746,8 +1795,10 @@ int cr_dump_tasks(pid_t pid)
 		goto err;
 
 	/* MNT namespaces are dumped after files to save remapped links */
+	span_start(SPAN_MNT_NS);
 	if (dump_mnt_namespaces() < 0)
 		goto err;
+	span_stop(SPAN_MNT_NS);
 
 	if (dump_file_locks())
 		goto err;
@@ -1765,7 +1816,9 @@ int cr_dump_tasks(pid_t pid)
 		if (dump_namespaces(root_item, root_ns_mask) < 0)
 			goto err;
 
+	span_start(SPAN_CGROUPS);
 	ret = dump_cgroups();
+	span_stop(SPAN_CGROUPS);
 	if (ret)
 		goto err;
 
@@ -72,6 +72,8 @@
 #include "action-scripts.h"
 #include "shmem.h"
 #include "aio.h"
+#include "mempolicy.h"
+#include "img-stream.h"
 #include "lsm.h"
 #include "seccomp.h"
 #include "fault-injection.h"
@@ -523,7 +525,7 @@ static int prepare_proc_misc(pid_t pid, TaskCoreEntry *tc)
 	if (tc->has_oom_score_adj && tc->oom_score_adj != 0)
 		prepare_oom_score_adj(tc->oom_score_adj);
 
-	return 0;
+	return prepare_task_mempolicy(tc);
 }
 
 static int prepare_itimers(int pid, struct task_restore_args *args, CoreEntry *core);
@@ -545,14 +547,18 @@ static int restore_one_alive_task(int pid, CoreEntry *core)
 
 	memzero(ta, args_len);
 
+	span_start(SPAN_RST_FILES);
 	if (prepare_fds(current))
 		return -1;
+	span_stop(SPAN_RST_FILES);
 
 	if (prepare_file_locks(pid))
 		return -1;
 
+	span_start(SPAN_RST_VMAS);
 	if (open_vmas(current))
 		return -1;
+	span_stop(SPAN_RST_VMAS);
 
 	if (prepare_aios(current, ta))
 		return -1;
@@ -724,6 +730,8 @@ static int restore_one_zombie(CoreEntry *core)
 			signr = SIGABRT;
 		}
 
+		log_flush();
+
 		if (kill(current->pid.virt, signr) < 0)
 			pr_perror("Can't kill myself, will just exit");
 
@@ -938,6 +946,7 @@ static inline int fork_with_pid(struct pstree_item *item)
 	 * The cgroup namespace is also unshared explicitly in the
 	 * move_in_cgroup(), so drop this flag here as well.
 	 */
+	log_flush();
 	ret = clone(restore_task_with_children, ca.stack_ptr,
 		    (ca.clone_flags & ~(CLONE_NEWNET | CLONE_NEWCGROUP)) | SIGCHLD, &ca);
 
@@ -1314,8 +1323,10 @@ static int restore_task_with_children(void *_arg)
 		if (prepare_namespace(current, ca->clone_flags))
 			goto err;
 
+		span_start(SPAN_RST_SHARED);
 		if (root_prepare_shared())
 			goto err;
+		span_stop(SPAN_RST_SHARED);
 
 		if (restore_finish_stage(task_entries, CR_STATE_RESTORE_SHARED) < 0)
 			goto err;
@@ -1324,8 +1335,10 @@ static int restore_task_with_children(void *_arg)
 	if (restore_task_mnt_ns(current))
 		goto err;
 
+	span_start(SPAN_RST_MAPPINGS);
 	if (prepare_mappings(current))
 		goto err;
+	span_stop(SPAN_RST_MAPPINGS);
 
 	if (prepare_sigactions() < 0)
 		goto err;
@@ -1335,8 +1348,10 @@ static int restore_task_with_children(void *_arg)
 		BUG();
 	}
 
+	span_start(SPAN_RST_FORK);
 	if (create_children_and_session())
 		goto err;
+	span_stop(SPAN_RST_FORK);
 
 
 	if (unmap_guard_pages(current))
@@ -1414,8 +1429,15 @@ static void __restore_switch_stage(int next_stage)
 
 static int restore_switch_stage(int next_stage)
 {
+	int span = SPAN_STAGE_RESTORE_NS + next_stage - CR_STATE_RESTORE_NS;
+	int ret;
+
+	span_start(span);
 	__restore_switch_stage(next_stage);
-	return restore_wait_inprogress_tasks();
+	ret = restore_wait_inprogress_tasks();
+	span_stop(span);
+
+	return ret;
 }
 
 static int attach_to_tasks(bool root_seized)
@@ -1685,6 +1707,11 @@ static int restore_root_task(struct pstree_item *init)
 	if (prepare_namespace_before_tasks())
 		return -1;
 
+	/*
+	 * The first stage is set in prepare_task_entries() and
+	 * is entered by the tasks as they are forked.
+	 */
+	span_start(SPAN_STAGE_RESTORE_NS);
 	futex_set(&task_entries->nr_in_progress,
 			stage_participants(CR_STATE_RESTORE_NS));
 
@@ -1726,6 +1753,7 @@ static int restore_root_task(struct pstree_item *init)
 
 	pr_info("Wait until namespaces are created\n");
 	ret = restore_wait_inprogress_tasks();
+	span_stop(SPAN_STAGE_RESTORE_NS);
 	if (ret)
 		goto out_kill;
 
@@ -1912,6 +1940,9 @@ int cr_restore_tasks(void)
 {
 	int ret = -1;
 
+	if (img_stream_unpack())
+		return -1;
+
 	if (cr_plugin_init(CR_PLUGIN_STAGE__RESTORE))
 		return -1;
 
@@ -1951,6 +1982,7 @@ int cr_restore_tasks(void)
 
 	ret = restore_root_task(root_item);
 err:
+	pb_collect_arena_fini();
 	cr_plugin_fini(CR_PLUGIN_STAGE__RESTORE, ret);
 	return ret;
 }
@@ -2757,6 +2789,7 @@ static int sigreturn_restore(pid_t pid, struct task_restore_args *task_args, uns
 	sigset_t blockmask;
 
 	pr_info("Restore via sigreturn\n");
+	span_start(SPAN_RST_SIGRETURN);
 
 	/* pr_info_vma_list(&self_vma_list); */
 
@@ -3054,6 +3087,8 @@ static int sigreturn_restore(pid_t pid, struct task_restore_args *task_args, uns
 	 * and restoring core is extremely destructive.
 	 */
 
+	span_stop(SPAN_RST_SIGRETURN);
+	log_flush();
 	JUMP_TO_RESTORER_BLOB(new_sp, restore_task_exec_start, task_args);
 
 err:
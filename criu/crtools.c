@@ -280,6 +280,12 @@ int main(int argc, char *argv[], char *envp[])
 		{ "cgroup-dump-controller",	required_argument,	0, 1082	},
 		{ SK_INFLIGHT_PARAM,		no_argument,		0, 1083	},
 		{ "deprecated",			no_argument,		0, 1084 },
+		{ "numa-pages",			no_argument,		0, 1085 },
+		{ "pages-direct",		no_argument,		0, 1086 },
+		{ "fsync-images",		no_argument,		0, 1087 },
+		{ "stream-images",		required_argument,	0, 1088 },
+		{ "trace",			no_argument,		0, 1089 },
+		{ "log-deferred",		no_argument,		0, 1090 },
 		{ },
 	};
 
@@ -592,6 +598,24 @@ int main(int argc, char *argv[], char *envp[])
 			pr_msg("Turn deprecated stuff ON\n");
 			opts.deprecated_ok = true;
 			break;
+		case 1085:
+			opts.numa_pages = true;
+			break;
+		case 1086:
+			opts.pages_direct = true;
+			break;
+		case 1087:
+			opts.fsync_images = true;
+			break;
+		case 1088:
+			opts.stream_images = optarg;
+			break;
+		case 1089:
+			opts.trace = true;
+			break;
+		case 1090:
+			opts.log_deferred = true;
+			break;
 		case 'V':
 			pr_msg("Version: %s\n", CRIU_VERSION);
 			if (strcmp(CRIU_GITID, "0"))
@@ -699,6 +723,21 @@ int main(int argc, char *argv[], char *envp[])
 	if (opts.img_parent)
 		pr_info("Will do snapshot from %s\n", opts.img_parent);
 
+	if (opts.stream_images) {
+		if (strcmp(argv[optind], "dump") && strcmp(argv[optind], "restore")) {
+			pr_err("--stream-images is dump and restore only option\n");
+			return 1;
+		}
+		if (opts.img_parent || opts.use_page_server) {
+			pr_err("--stream-images doesn't work with incremental dumps and page server\n");
+			return 1;
+		}
+		if (opts.pages_direct) {
+			pr_err("--stream-images doesn't work with --pages-direct\n");
+			return 1;
+		}
+	}
+
 	if (!strcmp(argv[optind], "dump")) {
 		preload_socket_modules();
 		preload_netfilter_modules();
@@ -906,6 +945,10 @@ usage:
 "* Logging:\n"
 "  -o|--log-file FILE    log file name\n"
 "     --log-pid          enable per-process logging to separate FILE.pid files\n"
+"     --log-deferred     keep messages in memory and format them later, makes\n"
+"                        high verbosity levels cheap\n"
+"     --trace            write per-task phase spans of dump and restore into\n"
+"                        trace-dump.json and trace-restore.json\n"
 "  -v[NUM]               set logging level (higher level means more output):\n"
 "                          -v1|-v    - only errors and messages\n"
 "                          -v2|-vv   - also warnings (default level)\n"
@@ -920,6 +963,12 @@ usage:
 "                        pages images of previous dump\n"
 "                        when used on restore, as soon as page is restored, it\n"
 "                        will be punched from the image\n"
+"  --numa-pages          on dump record the NUMA node of every private page,\n"
+"                        on restore put pages back on the recorded nodes\n"
+"  --pages-direct        write pages images bypassing the page cache\n"
+"  --fsync-images        make sure images are on disk when dump finishes\n"
+"  --stream-images FILE  put all images into one stream FILE (- for stdout)\n"
+"                        on dump, read them from there on restore\n"
 "\n"
 "Page/Service server options:\n"
 "  --address ADDR        address of server or service\n"
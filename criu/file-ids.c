@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -91,6 +92,30 @@ int fd_id_generate_special(struct fd_parms *p, u32 *id)
 	return 1;
 }
 
+static inline u64 gen_id_mix(u64 h, u64 v)
+{
+	h ^= v;
+	h *= 0xff51afd7ed558ccdULL;
+	return h ^ (h >> 33);
+}
+
+/*
+ * Everything that is the same for all the descriptors of one file.
+ * Fdinfo flags have O_CLOEXEC of the descriptor itself, it's not.
+ */
+static u64 make_gen_id(const struct fd_parms *p)
+{
+	u64 h = 0;
+
+	h = gen_id_mix(h, p->stat.st_dev);
+	h = gen_id_mix(h, p->stat.st_ino);
+	h = gen_id_mix(h, p->pos);
+	h = gen_id_mix(h, p->flags & ~O_CLOEXEC);
+	h = gen_id_mix(h, (u32)p->mnt_id);
+
+	return h;
+}
+
 int fd_id_generate(pid_t pid, FdinfoEntry *fe, struct fd_parms *p)
 {
 	u32 id;
@@ -98,7 +123,7 @@ int fd_id_generate(pid_t pid, FdinfoEntry *fe, struct fd_parms *p)
 	int new_id = 0;
 
 	e.pid = pid;
-	e.genid = fe->id;
+	e.genid = make_gen_id(p);
 	e.idx = fe->fd;
 
 	id = kid_generate_gen(&fd_tree, &e, &new_id);
@@ -205,6 +205,52 @@ static int lock_check_fd(int lfd, struct file_lock *fl)
 	return 1;
 }
 
+/*
+ * With kdat.has_fdinfo_lock locks are collected from the fdinfo-s
+ * of the dumped fds. Reading fdinfo is not needed for anything else
+ * on most fds, so only the inodes from /proc/locks are looked at.
+ */
+static unsigned long *locked_inodes;
+static unsigned int nr_locked_inodes;
+static bool locked_inodes_known;
+
+int note_locked_inode(unsigned long ino)
+{
+	if (xrealloc_safe(&locked_inodes, (nr_locked_inodes + 1) * sizeof(*locked_inodes)))
+		return -1;
+
+	locked_inodes[nr_locked_inodes++] = ino;
+	return 0;
+}
+
+static int cmp_ino(const void *a, const void *b)
+{
+	unsigned long x = *(unsigned long *)a, y = *(unsigned long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void locked_inodes_collected(void)
+{
+	qsort(locked_inodes, nr_locked_inodes, sizeof(*locked_inodes), cmp_ino);
+	locked_inodes_known = true;
+}
+
+/*
+ * The device is not compared, as for btrfs /proc/locks shows
+ * not the one stat() reports, see lock_btrfs_file_match().
+ */
+bool inode_may_have_locks(unsigned long ino)
+{
+	if (!kdat.has_fdinfo_lock)
+		return false;
+	if (!locked_inodes_known)
+		return true;
+
+	return bsearch(&ino, locked_inodes, nr_locked_inodes,
+			sizeof(*locked_inodes), cmp_ino) != NULL;
+}
+
 int note_file_lock(struct pid *pid, int fd, int lfd, struct fd_parms *p)
 {
 	struct file_lock *fl;
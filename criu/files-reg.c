@@ -124,15 +124,48 @@ static int trim_last_parent(char *path)
 	return 0;
 }
 
-static int mkreg_ghost(char *path, u32 mode, struct ghost_file *gf, struct cr_img *img)
+static int restore_ghost_chunks(int gfd, GhostFileEntry *gfe, struct cr_img *img)
+{
+	GhostChunkEntry *gc;
+	off_t off;
+	int ret;
+
+	while (1) {
+		ret = pb_read_one_eof(img, &gc, PB_GHOST_CHUNK);
+		if (ret <= 0)
+			break;
+
+		off = gc->off;
+		ret = copy_file_chunk(img_raw_fd(img), NULL, gfd, &off, gc->len);
+		ghost_chunk_entry__free_unpacked(gc, NULL);
+		if (ret < 0)
+			break;
+	}
+
+	if (ret < 0)
+		return -1;
+
+	/* Trailing hole */
+	if (ftruncate(gfd, gfe->size)) {
+		pr_perror("Can't set ghost file size");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int mkreg_ghost(char *path, GhostFileEntry *gfe, struct ghost_file *gf, struct cr_img *img)
 {
 	int gfd, ret;
 
-	gfd = open(path, O_WRONLY | O_CREAT | O_EXCL, mode);
+	gfd = open(path, O_WRONLY | O_CREAT | O_EXCL, gfe->mode);
 	if (gfd < 0)
 		return -1;
 
-	ret = copy_file(img_raw_fd(img), gfd, 0);
+	if (gfe->chunks)
+		ret = restore_ghost_chunks(gfd, gfe, img);
+	else
+		ret = copy_file(img_raw_fd(img), gfd, 0);
 	if (ret < 0)
 		unlink(path);
 	close(gfd);
@@ -202,7 +235,7 @@ again:
 			goto err;
 		}
 	} else {
-		if ((ret = mkreg_ghost(path, gfe->mode, gf, img)) < 0)
+		if ((ret = mkreg_ghost(path, gfe, gf, img)) < 0)
 			msg = "Can't create ghost regfile";
 	}
 
@@ -563,8 +596,43 @@ static struct collect_image_info remap_cinfo = {
 	.collect = collect_one_remap,
 };
 
+static int dump_ghost_chunks(int fd, off_t size, struct cr_img *img)
+{
+	GhostChunkEntry gc = GHOST_CHUNK_ENTRY__INIT;
+	off_t data, hole = 0;
+
+	while (hole < size) {
+		data = lseek(fd, hole, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break;
+			pr_perror("Can't find data in ghost file");
+			return -1;
+		}
+
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0) {
+			pr_perror("Can't find hole in ghost file");
+			return -1;
+		}
+		if (hole > size)
+			hole = size;
+
+		gc.off = data;
+		gc.len = hole - data;
+		if (pb_write_one(img, &gc, PB_GHOST_CHUNK))
+			return -1;
+
+		if (copy_file_chunk(fd, &data, img_raw_fd(img), NULL, gc.len))
+			return -1;
+	}
+
+	return 0;
+}
+
 static int dump_ghost_file(int _fd, u32 id, const struct stat *st, dev_t phys_dev)
 {
+	int fd = -1, ret = -1;
 	struct cr_img *img;
 	GhostFileEntry gfe = GHOST_FILE_ENTRY__INIT;
 	Timeval atim = TIMEVAL__INIT, mtim = TIMEVAL__INIT;
@@ -595,11 +663,7 @@ static int dump_ghost_file(int _fd, u32 id, const struct stat *st, dev_t phys_de
 		gfe.rdev = st->st_rdev;
 	}
 
-	if (pb_write_one(img, &gfe, PB_GHOST_FILE))
-		return -1;
-
 	if (S_ISREG(st->st_mode)) {
-		int fd, ret;
 		char lpath[PSFDS];
 
 		/*
@@ -610,16 +674,39 @@ static int dump_ghost_file(int _fd, u32 id, const struct stat *st, dev_t phys_de
 		fd = open(lpath, O_RDONLY);
 		if (fd < 0) {
 			pr_perror("Can't open ghost original file");
-			return -1;
+			goto err;
 		}
-		ret = copy_file(fd, img_raw_fd(img), st->st_size);
-		close(fd);
+
+		/*
+		 * Unlinked files are often big and sparse (logs, databases),
+		 * so only data extents are dumped if the file system can
+		 * report them.
+		 */
+		if (lseek(fd, 0, SEEK_DATA) >= 0 || errno == ENXIO) {
+			gfe.has_chunks = gfe.chunks = true;
+			gfe.has_size = true;
+			gfe.size = st->st_size;
+		}
+	}
+
+	if (pb_write_one(img, &gfe, PB_GHOST_FILE))
+		goto err;
+
+	if (fd >= 0) {
+		if (gfe.chunks)
+			ret = dump_ghost_chunks(fd, st->st_size, img);
+		else
+			ret = copy_file(fd, img_raw_fd(img), st->st_size);
 		if (ret)
-			return -1;
+			goto err;
 	}
 
+	ret = 0;
+err:
+	if (fd >= 0)
+		close(fd);
 	close_image(img);
-	return 0;
+	return ret;
 }
 
 void remap_put(struct file_remap *remap)
@@ -653,12 +740,19 @@ static int dump_ghost_remap(char *path, const struct stat *st,
 	struct ghost_file *gf;
 	RemapFilePathEntry rpe = REMAP_FILE_PATH_ENTRY__INIT;
 	dev_t phys_dev;
+	u64 size;
 
 	pr_info("Dumping ghost file for fd %d id %#x\n", lfd, id);
 
-	if (st->st_size > opts.ghost_limit) {
-		pr_err("Can't dump ghost file %s of %"PRIu64" size, increase limit\n",
-				path, st->st_size);
+	/*
+	 * Holes are not dumped, so it's the allocated data that's
+	 * limited, not the file size. Blocks past the size (e.g.
+	 * preallocated ones) are not dumped either.
+	 */
+	size = min_t(u64, st->st_size, (u64)st->st_blocks * 512);
+	if (size > opts.ghost_limit) {
+		pr_err("Can't dump ghost file %s of %"PRIu64" size (%"PRIu64" of data), increase limit\n",
+				path, st->st_size, size);
 		return -1;
 	}
 
@@ -1708,7 +1802,7 @@ static struct collect_image_info reg_file_cinfo = {
 	.pb_type = PB_REG_FILE,
 	.priv_size = sizeof(struct reg_file_info),
 	.collect = collect_one_regfile,
-	.flags = COLLECT_SHARED,
+	.flags = COLLECT_SHARED | COLLECT_ARENA,
 };
 
 int prepare_shared_reg_files(void)
@@ -11,7 +11,11 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <poll.h>
 
 #include "files.h"
 #include "file-ids.h"
@@ -40,6 +44,7 @@
 #include "fdinfo.h"
 #include "cr_options.h"
 #include "autofs.h"
+#include "asm/atomic.h"
 
 #include "parasite.h"
 #include "parasite-syscall.h"
@@ -50,19 +55,57 @@
 
 #include "plugin.h"
 
-#define FDESC_HASH_SIZE	64
-static struct hlist_head file_desc_hash[FDESC_HASH_SIZE];
+/*
+ * The hash starts small and is doubled each time it gets more
+ * descriptors than chains, so that collecting a million files
+ * doesn't walk chains of thousands.
+ */
+#define FDESC_HASH_MIN	64
+static struct hlist_head *file_desc_hash;
+static unsigned int fdesc_hash_size, nr_file_descs;
 
 int prepare_shared_fdinfo(void)
 {
 	int i;
 
-	for (i = 0; i < FDESC_HASH_SIZE; i++)
+	file_desc_hash = xmalloc(FDESC_HASH_MIN * sizeof(*file_desc_hash));
+	if (!file_desc_hash)
+		return -1;
+
+	fdesc_hash_size = FDESC_HASH_MIN;
+	for (i = 0; i < fdesc_hash_size; i++)
 		INIT_HLIST_HEAD(&file_desc_hash[i]);
 
 	return 0;
 }
 
+static void file_desc_hash_grow(void)
+{
+	unsigned int i, size = fdesc_hash_size * 2;
+	struct hlist_head *hash;
+	struct hlist_node *n, *t;
+
+	/* Long chains are slow but still work, so it's not an error */
+	hash = xmalloc(size * sizeof(*hash));
+	if (!hash)
+		return;
+
+	for (i = 0; i < size; i++)
+		INIT_HLIST_HEAD(&hash[i]);
+
+	for (i = 0; i < fdesc_hash_size; i++)
+		hlist_for_each_safe(n, t, &file_desc_hash[i]) {
+			struct file_desc *d;
+
+			d = hlist_entry(n, struct file_desc, hash);
+			hlist_add_head(n, &hash[d->id % size]);
+		}
+
+	xfree(file_desc_hash);
+	file_desc_hash = hash;
+	fdesc_hash_size = size;
+}
+
 void file_desc_init(struct file_desc *d, u32 id, struct file_desc_ops *ops)
 {
 	INIT_LIST_HEAD(&d->fd_info_head);
@@ -75,7 +118,9 @@ void file_desc_init(struct file_desc *d, u32 id, struct file_desc_ops *ops)
 int file_desc_add(struct file_desc *d, u32 id, struct file_desc_ops *ops)
 {
 	file_desc_init(d, id, ops);
-	hlist_add_head(&d->hash, &file_desc_hash[id % FDESC_HASH_SIZE]);
+	if (++nr_file_descs > fdesc_hash_size)
+		file_desc_hash_grow();
+	hlist_add_head(&d->hash, &file_desc_hash[id % fdesc_hash_size]);
 	return 0; /* this is to make tail-calls in collect_one_foo look nice */
 }
 
@@ -84,7 +129,7 @@ struct file_desc *find_file_desc_raw(int type, u32 id)
 	struct file_desc *d;
 	struct hlist_head *chain;
 
-	chain = &file_desc_hash[id % FDESC_HASH_SIZE];
+	chain = &file_desc_hash[id % fdesc_hash_size];
 	hlist_for_each_entry(d, chain, hash)
 		if (d->ops->type == type && d->id == id)
 			return d;
@@ -97,45 +142,97 @@ static inline struct file_desc *find_file_desc(FdinfoEntry *fe)
 	return find_file_desc_raw(fe->type, fe->id);
 }
 
-struct fdinfo_list_entry *find_used_fd(struct list_head *head, int fd)
+/*
+ * Per-task used fds live in a two-level table indexed by the fd
+ * number: leaves of FD_MAP_LEAF entries are allocated only for the
+ * ranges that have fds, so a lone service fd near the top of a big
+ * rlimit doesn't cost an array of a million entries.
+ */
+#define FD_MAP_LEAF_SHIFT	10
+#define FD_MAP_LEAF		(1 << FD_MAP_LEAF_SHIFT)
+
+static struct fdinfo_list_entry **fd_map_leaf(struct fd_map *map, int fd)
 {
-	struct fdinfo_list_entry *fle;
+	int l = fd >> FD_MAP_LEAF_SHIFT;
 
-	list_for_each_entry_reverse(fle, head, used_list) {
-		if (fle->fe->fd == fd)
-			return fle;
-		/* List is ordered, so let's stop */
-		if (fle->fe->fd < fd)
-			break;
-	}
-	return NULL;
+	return l < map->nr_leaves ? map->leaves[l] : NULL;
 }
 
-unsigned int find_unused_fd(struct list_head *head, int hint_fd)
+int collect_used_fd(struct fdinfo_list_entry *fle, struct rst_info *ri)
 {
-	struct fdinfo_list_entry *fle;
-	int fd = 0, prev_fd;
+	struct fd_map *map = &ri->used;
+	int l = fle->fe->fd >> FD_MAP_LEAF_SHIFT;
 
-	if ((hint_fd >= 0) && (!find_used_fd(head, hint_fd))) {
-		fd = hint_fd;
-		goto out;
+	if (l >= map->nr_leaves) {
+		int nr = max(l + 1, map->nr_leaves * 2);
+
+		if (xrealloc_safe(&map->leaves, nr * sizeof(*map->leaves)))
+			return -1;
+		memzero(map->leaves + map->nr_leaves,
+			(nr - map->nr_leaves) * sizeof(*map->leaves));
+		map->nr_leaves = nr;
 	}
 
-	prev_fd = service_fd_min_fd() - 1;
+	if (!map->leaves[l]) {
+		map->leaves[l] = xzalloc(FD_MAP_LEAF * sizeof(**map->leaves));
+		if (!map->leaves[l])
+			return -1;
+	}
 
-	list_for_each_entry_reverse(fle, head, used_list) {
-		fd = fle->fe->fd;
-		if (prev_fd > fd) {
-			fd++;
-			goto out;
+	map->leaves[l][fle->fe->fd & (FD_MAP_LEAF - 1)] = fle;
+	return 0;
+}
+
+struct fdinfo_list_entry *find_used_fd(struct fd_map *map, int fd)
+{
+	struct fdinfo_list_entry **leaf;
+
+	leaf = fd_map_leaf(map, fd);
+	return leaf ? leaf[fd & (FD_MAP_LEAF - 1)] : NULL;
+}
+
+/* The highest used fd not above @fd or -1 */
+static int prev_used_fd(struct fd_map *map, int fd)
+{
+	while (fd >= 0) {
+		struct fdinfo_list_entry **leaf;
+
+		leaf = fd_map_leaf(map, fd);
+		if (!leaf) {
+			fd = (fd & ~(FD_MAP_LEAF - 1)) - 1;
+			continue;
 		}
-		prev_fd = fd - 1;
+
+		if (leaf[fd & (FD_MAP_LEAF - 1)])
+			break;
+		fd--;
 	}
-	BUG();
-out:
+
 	return fd;
 }
 
+/*
+ * Returns the hint if it's free, otherwise the lowest fd of
+ * the topmost hole below the service fds.
+ */
+unsigned int find_unused_fd(struct fd_map *map, int hint_fd)
+{
+	int fd;
+
+	if ((hint_fd >= 0) && (!find_used_fd(map, hint_fd)))
+		return hint_fd;
+
+	fd = prev_used_fd(map, service_fd_min_fd() - 1);
+	if (fd == service_fd_min_fd() - 1) {
+		while (fd >= 0 && find_used_fd(map, fd))
+			fd--;
+		BUG_ON(fd < 0);
+		fd = prev_used_fd(map, fd);
+	}
+
+	return fd + 1;
+}
+
 /*
  * A file may be shared between several file descriptors. E.g
  * when doing a fork() every fd of a forker and respective fds
@@ -148,16 +245,20 @@ out:
  * 1. Prepare step.
  *    Select which task will create the file (open() one, or
  *    call any other syscall for than (socket, pipe, etc.). All
- *    the others, that share one, create unix sockets under the
- *    respective file descriptor (transport socket).
+ *    the others, that share one, reserve the respective file
+ *    descriptor with a per-task unix socket (transport socket).
  * 2. Open step.
  *    The one who creates the file (the 'master') creates one,
- *    then creates one more unix socket (transport) and sends the
- *    created file over this socket to the other recipients.
+ *    then queues the created file to be sent to the other
+ *    recipients. At the end of the step the queued files are
+ *    sent with as few SCM_RIGHTS messages as possible.
  * 3. Receive step.
- *    Those, who wait for the file to appear, receive one via
- *    the transport socket, then close the socket and dup() the
- *    received file descriptor into its place.
+ *    Those, who wait for the files to appear, receive them via
+ *    the transport socket and dup() them into their places.
+ *
+ * Files, that some master receives itself in its open callback
+ * (pipe and socketpair ends, pty slaves), have a per-fd transport
+ * socket instead and are sent with send_fd_to_peer() right away.
  *
  * There's the 4th step in the states[] array -- the post_open
  * one. This one is not about file-sharing resolving, but about
@@ -187,7 +288,7 @@ void show_saved_files(void)
 	struct file_desc *fd;
 
 	pr_info("File descs:\n");
-	for (i = 0; i < FDESC_HASH_SIZE; i++)
+	for (i = 0; i < fdesc_hash_size; i++)
 		hlist_for_each_entry(fd, &file_desc_hash[i], hash) {
 			struct fdinfo_list_entry *le;
 
@@ -255,11 +356,6 @@ static int fixup_overlayfs(struct fd_parms *p, struct fd_link *link)
  * The kcmp-ids.c engine does this trick, see comments in it for more info.
  */
 
-static u32 make_gen_id(const struct fd_parms *p)
-{
-	return ((u32)p->stat.st_dev) ^ ((u32)p->stat.st_ino) ^ ((u32)p->pos);
-}
-
 int do_dump_gen_file(struct fd_parms *p, int lfd,
 		const struct fdtype_ops *ops, struct cr_img *img)
 {
@@ -267,7 +363,6 @@ int do_dump_gen_file(struct fd_parms *p, int lfd,
 	int ret = -1;
 
 	e.type	= ops->type;
-	e.id	= make_gen_id(p);
 	e.fd	= p->fd;
 	e.flags = p->fd_flags;
 
@@ -304,14 +399,79 @@ int fill_fdlink(int lfd, const struct fd_parms *p, struct fd_link *link)
 	return 0;
 }
 
-static int fill_fd_params(struct pid *owner_pid, int fd, int lfd,
-				struct fd_opts *opts, struct fd_parms *p)
+/*
+ * What fill_fd_params() and fill_fdlink() get from the kernel for
+ * one fd. These syscalls don't depend on each other nor on files
+ * dumped before, so for big batches they are made in advance by
+ * workers, see prep_fds().
+ */
+struct fd_prep {
+	bool			done;
+	bool			has_link;
+	bool			need_fdinfo;
+	struct stat		stat;
+	long			fs_type;
+	struct fdinfo_common	fdinfo;
+	struct fd_link		link;
+};
+
+/*
+ * Files of sockfs, pipefs and anon_inodefs all live on the single
+ * internal mount of their superblock, so one fdinfo tells the
+ * mnt_id for all of them when the parasite can't get it.
+ */
+#define FD_INTERNAL_MNTS	8
+
+static struct {
+	dev_t	dev;
+	int	mnt_id;
+} fd_internal_mnts[FD_INTERNAL_MNTS];
+static int nr_fd_internal_mnts;
+
+static bool fs_is_internal(long fs_type)
+{
+	return fs_type == SOCKFS_MAGIC || fs_type == PIPEFS_MAGIC ||
+		fs_type == ANON_INODE_FS_MAGIC;
+}
+
+static int lookup_internal_mnt_id(struct fd_prep *fp)
+{
+	int i;
+
+	if (!fs_is_internal(fp->fs_type))
+		return -1;
+
+	for (i = 0; i < nr_fd_internal_mnts; i++)
+		if (fd_internal_mnts[i].dev == fp->stat.st_dev)
+			return fd_internal_mnts[i].mnt_id;
+
+	return -1;
+}
+
+static void note_internal_mnt_id(struct fd_prep *fp)
+{
+	if (!fs_is_internal(fp->fs_type) || fp->fdinfo.mnt_id < 0 ||
+	    nr_fd_internal_mnts == FD_INTERNAL_MNTS ||
+	    lookup_internal_mnt_id(fp) >= 0)
+		return;
+
+	fd_internal_mnts[nr_fd_internal_mnts].dev = fp->stat.st_dev;
+	fd_internal_mnts[nr_fd_internal_mnts].mnt_id = fp->fdinfo.mnt_id;
+	nr_fd_internal_mnts++;
+}
+
+/*
+ * The pos, flags and signum come from the parasite (see send_fds()),
+ * as well as the mnt_id on new kernels. The fdinfo file is only read
+ * if something is still unknown, or if the file may have locks, which
+ * are collected from there with kdat.has_fdinfo_lock.
+ */
+static int prep_one_fd(struct pid *owner_pid, int fd, int lfd,
+		       struct fd_opts *opts, struct fd_prep *fp)
 {
-	int ret;
 	struct statfs fsbuf;
-	struct fdinfo_common fdinfo = { .mnt_id = -1, .owner = owner_pid->virt };
 
-	if (fstat(lfd, &p->stat) < 0) {
+	if (fstat(lfd, &fp->stat) < 0) {
 		pr_perror("Can't stat fd %d", lfd);
 		return -1;
 	}
@@ -320,15 +480,55 @@ static int fill_fd_params(struct pid *owner_pid, int fd, int lfd,
 		pr_perror("Can't statfs fd %d", lfd);
 		return -1;
 	}
+	fp->fs_type = fsbuf.f_type;
+
+	fp->fdinfo = (struct fdinfo_common) {
+		.pos	= opts->pos,
+		.flags	= opts->fl_flags,
+		.mnt_id	= opts->mnt_id,
+		.owner	= owner_pid->virt,
+	};
+
+	if (fp->fdinfo.mnt_id < 0)
+		fp->fdinfo.mnt_id = lookup_internal_mnt_id(fp);
+
+	fp->need_fdinfo = !opts->has_pos || fp->fdinfo.mnt_id < 0 ||
+			  inode_may_have_locks(fp->stat.st_ino);
+
+	return 0;
+}
+
+static int prep_fdinfo(struct pid *owner_pid, int fd, struct fd_prep *fp)
+{
+	if (parse_fdinfo_pid(owner_pid->real, fd, FD_TYPES__UND, NULL, &fp->fdinfo))
+		return -1;
+
+	note_internal_mnt_id(fp);
+	fp->need_fdinfo = false;
+	return 0;
+}
+
+static int fill_fd_params(struct pid *owner_pid, int fd, int lfd,
+				struct fd_opts *opts, struct fd_parms *p,
+				struct fd_prep *fp)
+{
+	struct fd_prep tmp;
+
+	if (!fp || !fp->done) {
+		fp = &tmp;
+		if (prep_one_fd(owner_pid, fd, lfd, opts, fp))
+			return -1;
+	}
 
-	if (parse_fdinfo_pid(owner_pid->real, fd, FD_TYPES__UND, NULL, &fdinfo))
+	if (fp->need_fdinfo && prep_fdinfo(owner_pid, fd, fp))
 		return -1;
 
-	p->fs_type	= fsbuf.f_type;
+	p->stat		= fp->stat;
+	p->fs_type	= fp->fs_type;
 	p->fd		= fd;
-	p->pos		= fdinfo.pos;
-	p->flags	= fdinfo.flags;
-	p->mnt_id	= fdinfo.mnt_id;
+	p->pos		= fp->fdinfo.pos;
+	p->flags	= fp->fdinfo.flags;
+	p->mnt_id	= fp->fdinfo.mnt_id;
 	p->pid		= owner_pid->real;
 	p->fd_flags	= opts->flags;
 
@@ -337,12 +537,7 @@ static int fill_fd_params(struct pid *owner_pid, int fd, int lfd,
 	pr_info("%d fdinfo %d: pos: %#16"PRIx64" flags: %16o/%#x\n",
 			owner_pid->real, fd, p->pos, p->flags, (int)p->fd_flags);
 
-	ret = fcntl(lfd, F_GETSIG, 0);
-	if (ret < 0) {
-		pr_perror("Can't get owner signum on %d", lfd);
-		return -1;
-	}
-	p->fown.signum = ret;
+	p->fown.signum = opts->fown.signum;
 
 	if (opts->fown.pid == 0)
 		return 0;
@@ -426,13 +621,14 @@ static int dump_chrdev(struct fd_parms *p, int lfd, struct cr_img *img)
 }
 
 static int dump_one_file(struct pid *pid, int fd, int lfd, struct fd_opts *opts,
-		       struct cr_img *img, struct parasite_ctl *ctl)
+		       struct cr_img *img, struct parasite_ctl *ctl,
+		       struct fd_prep *fp)
 {
 	struct fd_parms p = FD_PARMS_INIT;
 	const struct fdtype_ops *ops;
 	struct fd_link link;
 
-	if (fill_fd_params(pid, fd, lfd, opts, &p) < 0) {
+	if (fill_fd_params(pid, fd, lfd, opts, &p, fp) < 0) {
 		pr_err("Can't get stat on %d\n", fd);
 		return -1;
 	}
@@ -473,7 +669,10 @@ static int dump_one_file(struct pid *pid, int fd, int lfd, struct fd_opts *opts,
 	}
 
 	if (S_ISREG(p.stat.st_mode) || S_ISDIR(p.stat.st_mode)) {
-		if (fill_fdlink(lfd, &p, &link))
+		if (fp && fp->has_link) {
+			memcpy(link.name, fp->link.name, fp->link.len + 1);
+			link.len = fp->link.len;
+		} else if (fill_fdlink(lfd, &p, &link))
 			return -1;
 
 		p.link = &link;
@@ -506,12 +705,237 @@ static int dump_one_file(struct pid *pid, int fd, int lfd, struct fd_opts *opts,
 	return dump_unsupp_fd(&p, lfd, img, "unknown", link.name + 1);
 }
 
+/*
+ * The workers are cloned once per task with the fd table shared, so
+ * they see the fds criu drains from the parasite, and are given the
+ * drained batches one by one. They take chunks of FD_PREP_CHUNK fds
+ * from the shared counter. The fds they fail on are left not done,
+ * and criu repeats the syscalls for them itself, reporting errors
+ * into its own log.
+ */
+#define FD_PREP_MIN_FDS		256
+#define FD_PREP_MAX_WORKERS	8
+#define FD_PREP_CHUNK		32
+#define FD_PREP_STACK		(256 << 10)
+
+struct fd_prep_batch {
+	futex_t			start;	/* batch number, aborted to stop */
+	futex_t			ack[FD_PREP_MAX_WORKERS];
+	atomic_t		next;
+	int			nr;
+	int			*fds;	/* all the task's ones */
+	int			off;
+	struct pid		*pid;
+	int			lfds[PARASITE_MAX_FDS];
+	struct fd_opts		opts[PARASITE_MAX_FDS];
+	struct fd_prep		fds_prep[PARASITE_MAX_FDS];
+
+	/* criu's own part */
+	int			nr_workers;
+	pid_t			workers[FD_PREP_MAX_WORKERS];
+	sigset_t		oldmask;
+};
+
+struct fd_prep_worker {
+	struct fd_prep_batch	*b;
+	int			id;
+};
+
+static void prep_fds_worker(struct fd_prep_batch *b, bool forked)
+{
+	int i, off;
+
+	while ((off = atomic_add_return(FD_PREP_CHUNK, &b->next) - FD_PREP_CHUNK) < b->nr) {
+		for (i = off; i < min(off + FD_PREP_CHUNK, b->nr); i++) {
+			struct fd_prep *fp = &b->fds_prep[i];
+
+			int fd = b->fds[b->off + i];
+
+			if (prep_one_fd(b->pid, fd, b->lfds[i], b->opts + i, fp))
+				continue;
+
+			/*
+			 * Locks found in fdinfo go to the file_lock_list,
+			 * so fds that may have them are left to criu. And
+			 * should a forked worker still meet a lock, its copy
+			 * of the list is not criu's, so such fd is left to
+			 * criu as well.
+			 */
+			if (fp->need_fdinfo && !inode_may_have_locks(fp->stat.st_ino)) {
+				struct list_head *last = file_lock_list.prev;
+
+				if (prep_fdinfo(b->pid, fd, fp))
+					continue;
+				if (forked && file_lock_list.prev != last)
+					continue;
+			}
+
+			/* fixup_overlayfs() may change the mnt_id, leave it to criu */
+			if ((S_ISREG(fp->stat.st_mode) || S_ISDIR(fp->stat.st_mode)) &&
+			    !opts.overlayfs) {
+				struct fd_parms p = { .pid = b->pid->real, .fd = fd, };
+
+				fp->has_link = !fill_fdlink(b->lfds[i], &p, &fp->link);
+			}
+
+			fp->done = true;
+		}
+	}
+}
+
+static int fd_prep_worker(void *arg)
+{
+	struct fd_prep_worker *w = arg;
+	struct fd_prep_batch *b = w->b;
+	u32 batch = 0;
+
+	forget_pid_proc();
+
+	while (1) {
+		futex_wait_while(&b->start, batch);
+		batch = futex_get(&b->start);
+		if (batch & FUTEX_ABORT_FLAG)
+			break;
+
+		prep_fds_worker(b, true);
+		futex_set_and_wake(&b->ack[w->id], batch);
+	}
+
+	close_pid_proc();
+	log_flush();
+	return 0;
+}
+
+static void start_fd_workers(struct fd_prep_batch *b)
+{
+	struct fd_prep_worker args[FD_PREP_MAX_WORKERS];
+	sigset_t blockmask;
+	void *stack;
+	int i, nr;
+
+	nr = sysconf(_SC_NPROCESSORS_ONLN);
+	nr = min(nr, FD_PREP_MAX_WORKERS) - 1;
+	if (nr <= 0)
+		return;
+
+	/* Each worker gets its own copy of it, as of the rest of memory */
+	stack = xmalloc(FD_PREP_STACK);
+	if (!stack)
+		return;
+
+	/* The parasite's SIGCHLD handler doesn't expect our children */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &blockmask, &b->oldmask) == -1) {
+		pr_perror("Can not set mask of blocked signals");
+		xfree(stack);
+		return;
+	}
+
+	futex_init(&b->start);
+	for (i = 0; i < nr; i++) {
+		args[i].b = b;
+		args[i].id = i;
+		futex_init(&b->ack[i]);
+
+		b->workers[i] = clone(fd_prep_worker, stack + FD_PREP_STACK,
+				      CLONE_FILES | SIGCHLD, &args[i]);
+		if (b->workers[i] < 0) {
+			pr_perror("Can't clone fd worker");
+			break;
+		}
+	}
+	b->nr_workers = i;
+
+	if (!b->nr_workers)
+		sigprocmask(SIG_SETMASK, &b->oldmask, NULL);
+	xfree(stack);
+}
+
+/*
+ * A worker is never fatal, the one that died is just not waited for,
+ * as criu re-does the fds it didn't do.
+ */
+static void wait_fd_worker(struct fd_prep_batch *b, int i, u32 batch)
+{
+	struct timespec to = { .tv_sec = 1, };
+	int status;
+
+	while (b->workers[i] > 0 && futex_get(&b->ack[i]) != batch) {
+		sys_futex((u32 *)&b->ack[i].raw.counter, FUTEX_WAIT,
+				futex_get(&b->ack[i]), &to, NULL, 0);
+
+		if (waitpid(b->workers[i], &status, WNOHANG) == b->workers[i]) {
+			pr_warn("fd worker %d died (%#x)\n", b->workers[i], status);
+			b->workers[i] = -1;
+		}
+	}
+}
+
+static void stop_fd_workers(struct fd_prep_batch *b)
+{
+	int i;
+
+	if (!b->nr_workers)
+		return;
+
+	futex_abort_and_wake(&b->start);
+
+	for (i = 0; i < b->nr_workers; i++) {
+		int status;
+
+		if (b->workers[i] < 0)
+			continue;
+
+		if (waitpid(b->workers[i], &status, 0) < 0)
+			pr_perror("Can't wait fd worker %d", b->workers[i]);
+		else if (!WIFEXITED(status) || WEXITSTATUS(status))
+			pr_warn("fd worker %d failed (%#x)\n", b->workers[i], status);
+	}
+
+	if (sigprocmask(SIG_SETMASK, &b->oldmask, NULL) == -1)
+		pr_perror("Can not unset mask of blocked signals");
+}
+
+/*
+ * Hands the drained batch of @nr fds starting at @off to the workers
+ * and does its share of it too. Returns whether there's anybody to
+ * share the work with, otherwise criu does it all in dump_one_file().
+ */
+static bool prep_fds(struct fd_prep_batch *b, int off, int nr)
+{
+	u32 batch;
+	int i;
+
+	if (!b->nr_workers)
+		return false;
+
+	for (i = 0; i < nr; i++) {
+		b->fds_prep[i].done = false;
+		b->fds_prep[i].has_link = false;
+	}
+	b->off = off;
+	b->nr = nr;
+	atomic_set(&b->next, 0);
+
+	futex_inc_and_wake(&b->start);
+	batch = futex_get(&b->start);
+
+	prep_fds_worker(b, false);
+
+	for (i = 0; i < b->nr_workers; i++)
+		wait_fd_worker(b, i, batch);
+
+	return true;
+}
+
 int dump_task_files_seized(struct parasite_ctl *ctl, struct pstree_item *item,
 		struct parasite_drain_fd *dfds)
 {
 	int *lfds = NULL;
 	struct cr_img *img = NULL;
 	struct fd_opts *opts = NULL;
+	struct fd_prep_batch *prep = NULL;
 	int i, ret = -1;
 	int off, nr_fds = min((int) PARASITE_MAX_FDS, dfds->nr_fds);
 
@@ -519,13 +943,30 @@ int dump_task_files_seized(struct parasite_ctl *ctl, struct pstree_item *item,
 	pr_info("Dumping opened files (pid: %d)\n", item->pid.real);
 	pr_info("----------------------------------------\n");
 
-	lfds = xmalloc(nr_fds * sizeof(int));
-	if (!lfds)
-		goto err;
+	if (nr_fds >= FD_PREP_MIN_FDS) {
+		prep = mmap(NULL, sizeof(*prep), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (prep == MAP_FAILED) {
+			pr_perror("Can't map fd workers area");
+			prep = NULL;
+			goto err;
+		}
 
-	opts = xmalloc(nr_fds * sizeof(struct fd_opts));
-	if (!opts)
-		goto err;
+		/* The workers get the drained fds right from there */
+		lfds = prep->lfds;
+		opts = prep->opts;
+		prep->pid = &item->pid;
+		prep->fds = dfds->fds;
+		start_fd_workers(prep);
+	} else {
+		lfds = xmalloc(nr_fds * sizeof(int));
+		if (!lfds)
+			goto err;
+
+		opts = xmalloc(nr_fds * sizeof(struct fd_opts));
+		if (!opts)
+			goto err;
+	}
 
 	img = open_image(CR_FD_FDINFO, O_DUMP, item->ids->files_id);
 	if (!img)
@@ -533,6 +974,8 @@ int dump_task_files_seized(struct parasite_ctl *ctl, struct pstree_item *item,
 
 	ret = 0; /* Don't fail if nr_fds == 0 */
 	for (off = 0; off < dfds->nr_fds; off += nr_fds) {
+		struct fd_prep *fps = NULL;
+
 		if (nr_fds + off > dfds->nr_fds)
 			nr_fds = dfds->nr_fds - off;
 
@@ -541,9 +984,14 @@ int dump_task_files_seized(struct parasite_ctl *ctl, struct pstree_item *item,
 		if (ret)
 			goto err;
 
+		if (prep && nr_fds >= FD_PREP_MIN_FDS &&
+		    prep_fds(prep, off, nr_fds))
+			fps = prep->fds_prep;
+
 		for (i = 0; i < nr_fds; i++) {
 			ret = dump_one_file(&item->pid, dfds->fds[i + off],
-						lfds[i], opts + i, img, ctl);
+						lfds[i], opts + i, img, ctl,
+						fps ? fps + i : NULL);
 			close(lfds[i]);
 			if (ret)
 				break;
@@ -554,8 +1002,13 @@ int dump_task_files_seized(struct parasite_ctl *ctl, struct pstree_item *item,
 err:
 	if (img)
 		close_image(img);
-	xfree(opts);
-	xfree(lfds);
+	if (prep) {
+		stop_fd_workers(prep);
+		munmap(prep, sizeof(*prep));
+	} else {
+		xfree(opts);
+		xfree(lfds);
+	}
 	return ret;
 }
 
@@ -700,7 +1153,8 @@ static int collect_fd(int pid, FdinfoEntry *e, struct rst_info *rst_info)
 	else
 		collect_gen_fd(new_le, rst_info);
 
-	collect_used_fd(new_le, rst_info);
+	if (collect_used_fd(new_le, rst_info))
+		return -1;
 
 	list_add_tail(&new_le->desc_list, &le->desc_list);
 	new_le->desc = fdesc;
@@ -771,7 +1225,6 @@ int prepare_fd_pid(struct pstree_item *item)
 	pid_t pid = item->pid.virt;
 	struct rst_info *rst_info = rsti(item);
 
-	INIT_LIST_HEAD(&rst_info->used);
 	INIT_LIST_HEAD(&rst_info->fds);
 	INIT_LIST_HEAD(&rst_info->eventpoll);
 	INIT_LIST_HEAD(&rst_info->tty_slaves);
@@ -890,6 +1343,298 @@ static int should_open_transport(FdinfoEntry *fe, struct file_desc *fd)
 		return 0;
 }
 
+/*
+ * Files for other tasks are queued per receiver and sent when the
+ * open step is over in messages of up to CR_SCM_MAX_FD files, each
+ * one accompanied with its place in the payload.
+ */
+struct fd_peer_slot {
+	int			fd;
+	int			flags;
+};
+
+struct fd_peer {
+	int			pid;	/* real pid of the receiver */
+	int			nr;
+	int			size;
+	int			*fds;
+	struct fd_peer_slot	*slots;
+	struct fd_peer		*next;
+};
+
+#define FD_PEER_HASH_SIZE	64
+static struct fd_peer *fd_peers[FD_PEER_HASH_SIZE];
+
+/* Files this task waits for on its TRANSPORT_RCV_OFF socket */
+static int fd_peer_rcv_pending;
+
+static void peer_transport_name_gen(struct sockaddr_un *addr, int *len, int pid)
+{
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, UNIX_PATH_MAX, "x/crtools-fds-%d", pid);
+	*len = SUN_LEN(addr);
+	*addr->sun_path = '\0';
+}
+
+static int open_peer_transport(void)
+{
+	struct sockaddr_un saddr;
+	int sock, sun_len;
+
+	peer_transport_name_gen(&saddr, &sun_len, getpid());
+	pr_info("\t\tCreate transport socket %s\n", saddr.sun_path + 1);
+
+	sock = socket(PF_UNIX, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		pr_perror("Can't create socket");
+		return -1;
+	}
+
+	if (bind(sock, (struct sockaddr *)&saddr, sun_len) < 0) {
+		pr_perror("Can't bind unix socket %s", saddr.sun_path + 1);
+		close(sock);
+		return -1;
+	}
+
+	sun_len = install_service_fd(TRANSPORT_RCV_OFF, sock);
+	close(sock);
+	return sun_len;
+}
+
+/* Keeps the fd busy with the transport socket until the file comes */
+static int reserve_peer_fd(struct fdinfo_list_entry *fle)
+{
+	int sock, fd = fle->fe->fd;
+
+	sock = get_service_fd(TRANSPORT_RCV_OFF);
+	if (sock < 0) {
+		sock = open_peer_transport();
+		if (sock < 0)
+			return -1;
+	}
+
+	/* make sure we won't clash with an inherit fd */
+	if (inherit_fd_resolve_clash(fd) < 0)
+		return -1;
+
+	if (dup2(sock, fd) != fd) {
+		pr_perror("Can't reserve fd %d", fd);
+		return -1;
+	}
+
+	fd_peer_rcv_pending++;
+
+	pr_info("\t\tWake up fdinfo pid=%d fd=%d\n", fle->pid, fd);
+	futex_set_and_wake(&fle->real_pid, getpid());
+	want_recv_stage();
+
+	return 0;
+}
+
+/*
+ * Receives the files sent to this task and puts them into their
+ * places. With @nowait only the ones already queued are taken.
+ */
+static int recv_fds_from_peers(bool nowait)
+{
+	struct fd_peer_slot slots[CR_SCM_MAX_FD];
+	char cbuf[CMSG_SPACE(sizeof(int) * CR_SCM_MAX_FD)];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int sock, i, nr, ret;
+	int *fds;
+
+	sock = get_service_fd(TRANSPORT_RCV_OFF);
+
+	while (fd_peer_rcv_pending > 0) {
+		iov.iov_base = slots;
+		iov.iov_len = sizeof(slots);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		ret = recvmsg(sock, &msg, nowait ? MSG_DONTWAIT : 0);
+		if (ret < 0) {
+			if (nowait && errno == EAGAIN)
+				break;
+			pr_perror("Can't receive fds (%d pending)", fd_peer_rcv_pending);
+			return -1;
+		}
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+		    (msg.msg_flags & (MSG_CTRUNC | MSG_TRUNC))) {
+			pr_err("Bad fds message\n");
+			return -1;
+		}
+
+		fds = (int *)CMSG_DATA(cmsg);
+		nr = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (nr * sizeof(slots[0]) != ret) {
+			pr_err("Got %d fds in %d bytes\n", nr, ret);
+			return -1;
+		}
+
+		pr_info("\tReceived %d fds\n", nr);
+
+		for (i = 0; i < nr; i++) {
+			int fd = slots[i].fd;
+
+			/* This replaces the transport socket */
+			if (dup2(fds[i], fd) != fd) {
+				pr_perror("Can't dup %d into %d", fds[i], fd);
+				return -1;
+			}
+			close(fds[i]);
+
+			if (slots[i].flags && fcntl(fd, F_SETFD, slots[i].flags) == -1) {
+				pr_perror("Unable to set file descriptor flags");
+				return -1;
+			}
+		}
+
+		fd_peer_rcv_pending -= nr;
+	}
+
+	return 0;
+}
+
+static int send_peer_msg(int sock, struct msghdr *msg, int pid)
+{
+	struct pollfd pfd = { .events = POLLIN, };
+
+	pfd.fd = get_service_fd(TRANSPORT_RCV_OFF);
+
+	while (sendmsg(sock, msg, MSG_DONTWAIT) < 0) {
+		if (errno != EAGAIN) {
+			pr_perror("Can't send fds to %d", pid);
+			return -1;
+		}
+
+		/*
+		 * The receiver's queue is full and it may be sending
+		 * files to us just the same way, so don't just block.
+		 */
+		if (recv_fds_from_peers(true))
+			return -1;
+		poll(&pfd, pfd.fd >= 0, 1);
+	}
+
+	return 0;
+}
+
+static int send_peer_fds(int sock, struct fd_peer *p)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * CR_SCM_MAX_FD)];
+	struct sockaddr_un saddr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg = {};
+	struct iovec iov;
+	int i, nr, len;
+
+	peer_transport_name_gen(&saddr, &len, p->pid);
+	pr_info("\t\tSend %d fds to %s\n", p->nr, saddr.sun_path + 1);
+
+	msg.msg_name = &saddr;
+	msg.msg_namelen = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+
+	for (i = 0; i < p->nr; i += nr) {
+		nr = min(CR_SCM_MAX_FD, p->nr - i);
+
+		iov.iov_base = p->slots + i;
+		iov.iov_len = nr * sizeof(p->slots[0]);
+
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nr);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr);
+		memcpy(CMSG_DATA(cmsg), p->fds + i, sizeof(int) * nr);
+
+		if (send_peer_msg(sock, &msg, p->pid))
+			return -1;
+	}
+
+	p->nr = 0;
+	return 0;
+}
+
+static int queue_fd_to_peer(int fd, struct fdinfo_list_entry *fle)
+{
+	struct fd_peer *p;
+	int pid;
+
+	pr_info("\t\tWait fdinfo pid=%d fd=%d\n", fle->pid, fle->fe->fd);
+	futex_wait_while(&fle->real_pid, 0);
+	pid = futex_get(&fle->real_pid);
+
+	for (p = fd_peers[pid % FD_PEER_HASH_SIZE]; p; p = p->next)
+		if (p->pid == pid)
+			break;
+
+	if (!p) {
+		p = xzalloc(sizeof(*p));
+		if (!p)
+			return -1;
+
+		p->pid = pid;
+		p->next = fd_peers[pid % FD_PEER_HASH_SIZE];
+		fd_peers[pid % FD_PEER_HASH_SIZE] = p;
+	}
+
+	if (p->nr == p->size) {
+		int size = p->size ? 2 * p->size : CR_SCM_MAX_FD;
+
+		if (xrealloc_safe(&p->fds, size * sizeof(*p->fds)) ||
+		    xrealloc_safe(&p->slots, size * sizeof(*p->slots)))
+			return -1;
+		p->size = size;
+	}
+
+	p->fds[p->nr] = fd;
+	p->slots[p->nr].fd = fle->fe->fd;
+	p->slots[p->nr].flags = fle->fe->flags;
+	p->nr++;
+
+	return 0;
+}
+
+static int flush_fds_to_peers(void)
+{
+	struct fd_peer *p;
+	int i, sock = -1, ret = 0;
+
+	for (i = 0; i < FD_PEER_HASH_SIZE && !ret; i++)
+		for (p = fd_peers[i]; p && !ret; p = p->next) {
+			if (!p->nr)
+				continue;
+
+			/*
+			 * Not the TRANSPORT_FD_OFF one, it's shared by all
+			 * the tasks and full send buffer would block them.
+			 */
+			if (sock < 0) {
+				sock = socket(PF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+				if (sock < 0) {
+					pr_perror("Can't create socket");
+					return -1;
+				}
+			}
+
+			ret = send_peer_fds(sock, p);
+		}
+
+	close_safe(&sock);
+	return ret;
+}
+
 static int open_transport_fd(int pid, struct fdinfo_list_entry *fle)
 {
 	struct fdinfo_list_entry *flem;
@@ -899,21 +1644,21 @@ static int open_transport_fd(int pid, struct fdinfo_list_entry *fle)
 
 	flem = file_master(fle->desc);
 
-	if (flem->pid == pid) {
-		if (flem->fe->fd != fle->fe->fd)
-			/* dup-ed file. Will be opened in the open_fd */
-			return 0;
+	if (flem->pid != pid)
+		return reserve_peer_fd(fle);
 
-		if (!should_open_transport(fle->fe, fle->desc))
-			/* pure master file */
-			return 0;
+	if (flem->fe->fd != fle->fe->fd)
+		/* dup-ed file. Will be opened in the open_fd */
+		return 0;
 
-		/*
-		 * some master file, that wants a transport, e.g.
-		 * a pipe or unix socket pair 'slave' end
-		 */
-	}
+	if (!should_open_transport(fle->fe, fle->desc))
+		/* pure master file */
+		return 0;
 
+	/*
+	 * some master file, that wants a transport, e.g.
+	 * a pipe or unix socket pair 'slave' end
+	 */
 	transport_name_gen(&saddr, &sun_len, getpid(), fle->fe->fd);
 
 	pr_info("\t\tCreate transport fd %s\n", saddr.sun_path + 1);
@@ -936,7 +1681,6 @@ static int open_transport_fd(int pid, struct fdinfo_list_entry *fle)
 
 	pr_info("\t\tWake up fdinfo pid=%d fd=%d\n", fle->pid, fle->fe->fd);
 	futex_set_and_wake(&fle->real_pid, getpid());
-	want_recv_stage();
 
 	return 0;
 err:
@@ -957,7 +1701,7 @@ int send_fd_to_peer(int fd, struct fdinfo_list_entry *fle, int sock)
 	return send_fd(sock, &saddr, len, fd);
 }
 
-static int send_fd_to_self(int fd, struct fdinfo_list_entry *fle, int sock)
+static int send_fd_to_self(int fd, struct fdinfo_list_entry *fle)
 {
 	int dfd = fle->fe->fd;
 
@@ -968,8 +1712,6 @@ static int send_fd_to_self(int fd, struct fdinfo_list_entry *fle, int sock)
 	if (inherit_fd_resolve_clash(dfd) < 0)
 		return -1;
 
-	BUG_ON(dfd == sock);
-
 	pr_info("\t\t\tGoing to dup %d into %d\n", fd, dfd);
 	if (dup2(fd, dfd) != dfd) {
 		pr_perror("Can't dup local fd %d -> %d", fd, dfd);
@@ -1003,18 +1745,16 @@ static int post_open_fd(int pid, struct fdinfo_list_entry *fle)
 
 static int serve_out_fd(int pid, int fd, struct file_desc *d)
 {
-	int sock, ret;
+	int ret;
 	struct fdinfo_list_entry *fle;
 
-	sock = get_service_fd(TRANSPORT_FD_OFF);
-
 	pr_info("\t\tCreate fd for %d\n", fd);
 
 	list_for_each_entry(fle, &d->fd_info_head, desc_list) {
 		if (pid == fle->pid)
-			ret = send_fd_to_self(fd, fle, sock);
+			ret = send_fd_to_self(fd, fle);
 		else
-			ret = send_fd_to_peer(fd, fle, sock);
+			ret = queue_fd_to_peer(fd, fle);
 
 		if (ret) {
 			pr_err("Can't sent fd %d to %d\n", fd, fle->pid);
@@ -1055,31 +1795,14 @@ static int open_fd(int pid, struct fdinfo_list_entry *fle)
 
 static int receive_fd(int pid, struct fdinfo_list_entry *fle)
 {
-	int tmp;
 	struct fdinfo_list_entry *flem;
 
 	flem = file_master(fle->desc);
 	if (flem->pid == pid)
 		return 0;
 
-	pr_info("\tReceive fd for %d\n", fle->fe->fd);
-
-	tmp = recv_fd(fle->fe->fd);
-	if (tmp < 0) {
-		pr_err("Can't get fd %d\n", tmp);
-		return -1;
-	}
-	close(fle->fe->fd);
-
-	if (reopen_fd_as(fle->fe->fd, tmp) < 0)
-		return -1;
-
-	if (fcntl(fle->fe->fd, F_SETFD, fle->fe->flags) == -1) {
-		pr_perror("Unable to set file descriptor flags");
-		return -1;
-	}
-
-	return 0;
+	/* The first one gets all the files, that are sent to us */
+	return recv_fds_from_peers(false);
 }
 
 static int open_fdinfo(int pid, struct fdinfo_list_entry *fle, int state)
@@ -1196,6 +1919,10 @@ int prepare_fds(struct pstree_item *me)
 		ret = open_fdinfos(me->pid.virt, &rsti(me)->eventpoll, state);
 		if (ret)
 			break;
+
+		ret = flush_fds_to_peers();
+		if (ret)
+			break;
 	}
 
 	if (ret)
@@ -1214,12 +1941,17 @@ int prepare_fds(struct pstree_item *me)
 		ret = open_fdinfos(me->pid.virt, &rsti(me)->tty_ctty, state);
 		if (ret)
 			break;
+
+		ret = flush_fds_to_peers();
+		if (ret)
+			break;
 	}
 out_w:
 	if (rsti(me)->fdt)
 		futex_inc_and_wake(&rsti(me)->fdt->fdt_lock);
 out:
 	close_service_fd(CR_PROC_FD_OFF);
+	close_service_fd(TRANSPORT_RCV_OFF);
 	tty_fini_fds();
 	return ret;
 }
@@ -29,6 +29,7 @@ struct cr_fd_desc_tmpl imgset_template[CR_FD_MAX] = {
 	FD_ENTRY(FDINFO,	"fdinfo-%d"),
 	FD_ENTRY(PAGEMAP,	"pagemap-%ld"),
 	FD_ENTRY(SHMEM_PAGEMAP,	"pagemap-shmem-%ld"),
+	FD_ENTRY(SYSV_SHMEM_PAGEMAP, "pagemap-sysv-shmem-%ld"),
 	FD_ENTRY(REG_FILES,	"reg-files"),
 	FD_ENTRY(EXT_FILES,	"ext-files"),
 	FD_ENTRY(NS_FILES,	"ns-files"),
@@ -70,10 +71,10 @@ struct cr_fd_desc_tmpl imgset_template[CR_FD_MAX] = {
 	FD_ENTRY(MNTS,		"mountpoints-%d"),
 	FD_ENTRY(NETDEV,	"netdev-%d"),
 	FD_ENTRY(NETNS,		"netns-%d"),
-	FD_ENTRY_F(IFADDR,	"ifaddr-%d", O_NOBUF),
-	FD_ENTRY_F(ROUTE,	"route-%d", O_NOBUF),
-	FD_ENTRY_F(ROUTE6,	"route6-%d", O_NOBUF),
-	FD_ENTRY_F(RULE,	"rule-%d", O_NOBUF),
+	FD_ENTRY(IFADDR,	"ifaddr-%d"),
+	FD_ENTRY(ROUTE,		"route-%d"),
+	FD_ENTRY(ROUTE6,	"route6-%d"),
+	FD_ENTRY(RULE,		"rule-%d"),
 	FD_ENTRY_F(IPTABLES,	"iptables-%d", O_NOBUF),
 	FD_ENTRY_F(IP6TABLES,	"ip6tables-%d", O_NOBUF),
 	FD_ENTRY_F(TMPFS_IMG,	"tmpfs-%d.tar.gz", O_NOBUF),
@@ -89,6 +90,8 @@ struct cr_fd_desc_tmpl imgset_template[CR_FD_MAX] = {
 	FD_ENTRY_F(PAGES,	"pages-%u", O_NOBUF),
 	FD_ENTRY_F(PAGES_OLD,	"pages-%d", O_NOBUF),
 	FD_ENTRY_F(SHM_PAGES_OLD, "pages-shmem-%ld", O_NOBUF),
+	FD_ENTRY(SHMEM_HASHES,	"shmem-hashes-%ld"),
+	FD_ENTRY(SYSV_SHMEM_HASHES, "sysv-shmem-hashes-%ld"),
 	FD_ENTRY(SIGNAL,	"signal-s-%d"),
 	FD_ENTRY(PSIGNAL,	"signal-p-%d"),
 	FD_ENTRY(TUNFILE,	"tunfile"),
@@ -10,6 +10,7 @@
 #include "stats.h"
 #include "cgroup.h"
 #include "lsm.h"
+#include "img-stream.h"
 #include "protobuf.h"
 #include "images/inventory.pb-c.h"
 #include "images/pagemap.pb-c.h"
@@ -243,6 +244,7 @@ struct cr_img *open_image_at(int dfd, int type, unsigned long flags, ...)
 	if (!img)
 		return NULL;
 
+	img->stream_name = NULL;
 	oflags = flags | imgset_template[type].oflags;
 
 	va_start(args, flags);
@@ -387,6 +389,11 @@ void close_image(struct cr_img *img)
 	} else if (!empty_image(img))
 		bclose(&img->_x);
 
+	if (img->stream_name) {
+		img_stream_add(img->stream_name);
+		xfree(img->stream_name);
+	}
+
 	xfree(img);
 }
 
@@ -397,6 +404,7 @@ struct cr_img *img_from_fd(int fd)
 	img = xmalloc(sizeof(*img));
 	if (img) {
 		img->_x.fd = fd;
+		img->stream_name = NULL;
 		bfd_setraw(&img->_x);
 	}
 
@@ -441,6 +449,19 @@ void close_image_dir(void)
 	close_service_fd(IMG_FD_OFF);
 }
 
+int fsync_images(void)
+{
+	if (!opts.fsync_images)
+		return 0;
+
+	if (syncfs(get_service_fd(IMG_FD_OFF))) {
+		pr_perror("Unable to sync images");
+		return -1;
+	}
+
+	return 0;
+}
+
 static unsigned long page_ids = 1;
 
 void up_page_ids_base(void)
@@ -457,29 +478,79 @@ void up_page_ids_base(void)
 	page_ids += 0x10000;
 }
 
-struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi)
+/*
+ * Shmem segments are dumped by forked workers, which would all count
+ * the IDs from the same value, so the IDs for them are reserved here
+ * in advance and passed to open_pages_image_id().
+ */
+unsigned long reserve_page_ids(unsigned long nr)
 {
-	unsigned id;
+	unsigned long base = page_ids;
 
-	if (flags == O_RDONLY || flags == O_RDWR) {
-		PagemapHead *h;
-		if (pb_read_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
-			return NULL;
-		id = h->pages_id;
-		pagemap_head__free_unpacked(h, NULL);
-	} else {
-		PagemapHead h = PAGEMAP_HEAD__INIT;
-		id = h.pages_id = page_ids++;
-		if (pb_write_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
+	page_ids += nr;
+	return base;
+}
+
+static struct cr_img *write_pages_head(int dfd, unsigned long flags,
+		struct cr_img *pmi, unsigned id)
+{
+	PagemapHead h = PAGEMAP_HEAD__INIT;
+	struct cr_img *img;
+
+	h.pages_id = id;
+	h.has_packed = h.packed = true;
+	if (pb_write_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
+		return NULL;
+
+	img = open_image_at(dfd, CR_FD_PAGES, flags, id);
+	/*
+	 * Pages are the bulk of the images, so they are spliced
+	 * right into the stream (see write_pages_stream()) under
+	 * this name and the image file itself stays empty.
+	 */
+	if (img && opts.stream_images) {
+		img->stream_name = xsprintf(imgset_template[CR_FD_PAGES].fmt, id);
+		if (!img->stream_name) {
+			close_image(img);
 			return NULL;
+		}
 	}
 
+	return img;
+}
+
+/*
+ * Reads or writes the pagemap head and opens the pages image it
+ * points to. On read the @packed tells how the entries are stored,
+ * the new images are always written packed.
+ */
+struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi,
+		bool *packed)
+{
+	PagemapHead *h;
+	unsigned id;
+
+	if (flags != O_RDONLY && flags != O_RDWR)
+		return write_pages_head(dfd, flags, pmi, page_ids++);
+
+	if (pb_read_one(pmi, &h, PB_PAGEMAP_HEAD) < 0)
+		return NULL;
+	id = h->pages_id;
+	*packed = h->has_packed && h->packed;
+	pagemap_head__free_unpacked(h, NULL);
+
 	return open_image_at(dfd, CR_FD_PAGES, flags, id);
 }
 
-struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi)
+/* Same as open_pages_image() for dump, with the ID from reserve_page_ids() */
+struct cr_img *open_pages_image_id(struct cr_img *pmi, unsigned long id)
+{
+	return write_pages_head(get_service_fd(IMG_FD_OFF), O_DUMP, pmi, id);
+}
+
+struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi, bool *packed)
 {
-	return open_pages_image_at(get_service_fd(IMG_FD_OFF), flags, pmi);
+	return open_pages_image_at(get_service_fd(IMG_FD_OFF), flags, pmi, packed);
 }
 
 /*
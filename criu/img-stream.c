@@ -0,0 +1,704 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+
+#include "cr_options.h"
+#include "servicefd.h"
+#include "xmalloc.h"
+#include "magic.h"
+#include "log.h"
+#include "util.h"
+#include "img-stream.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "stream: "
+
+#define STREAM_BUF_SIZE		(1 << 20)
+
+#ifndef SYS_fsopen
+# define SYS_fsopen		430
+# define SYS_fsconfig		431
+# define SYS_fsmount		432
+#endif
+
+#ifndef FSOPEN_CLOEXEC
+# define FSOPEN_CLOEXEC		0x1
+# define FSCONFIG_SET_STRING	1
+# define FSCONFIG_CMD_CREATE	6
+# define FSMOUNT_CLOEXEC	0x1
+#endif
+
+struct stream_file {
+	char	*name;
+	u64	off;
+	u64	size;
+};
+
+static int stream_fd = -1;
+static u64 stream_off;
+static bool stream_failed;
+
+static struct stream_file *files;
+static unsigned int nr_files, max_files;
+
+/*
+ * Pages are not staged, but go right into the stream. They come in
+ * runs of a few pages, so not to have an entry for each run they
+ * are collected in this pipe and put into the stream by big entries.
+ */
+static int pages_pipe[2] = { -1, -1 };
+static unsigned long pages_pipe_fill;
+static char *pages_name;
+
+static int stream_write(const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(stream_fd, buf, len);
+		if (ret <= 0) {
+			pr_perror("Unable to write image stream");
+			return -1;
+		}
+
+		buf += ret;
+		len -= ret;
+		stream_off += ret;
+	}
+
+	return 0;
+}
+
+static int stream_read(void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = read(stream_fd, buf, len);
+		if (ret < 0) {
+			pr_perror("Unable to read image stream");
+			return -1;
+		}
+		if (ret == 0) {
+			pr_err("Image stream is truncated at %"PRIu64"\n", stream_off);
+			return -1;
+		}
+
+		buf += ret;
+		len -= ret;
+		stream_off += ret;
+	}
+
+	return 0;
+}
+
+static int add_stream_file(char *name, u64 off, u64 size)
+{
+	struct stream_file *f;
+
+	if (nr_files == max_files) {
+		unsigned int max = max_files ? max_files * 2 : 16;
+
+		f = xrealloc(files, max * sizeof(*f));
+		if (!f)
+			return -1;
+		files = f;
+		max_files = max;
+	}
+
+	f = &files[nr_files++];
+	f->name = name;
+	f->off = off;
+	f->size = size;
+
+	return 0;
+}
+
+static void free_stream_files(void)
+{
+	while (nr_files)
+		xfree(files[--nr_files].name);
+	xfree(files);
+	files = NULL;
+	max_files = 0;
+}
+
+/*
+ * The images that are not streamed as they are written are staged
+ * in a tmpfs which is not mounted anywhere and goes away with its
+ * last fd, so that neither dump nor restore with the stream need
+ * local disk. It becomes the images directory for the rest of the
+ * run. Without the new mount API the images directory is used.
+ */
+static int open_stage_dir(void)
+{
+	int fsfd, fd, ret = -1;
+
+	fsfd = syscall(SYS_fsopen, "tmpfs", FSOPEN_CLOEXEC);
+	if (fsfd < 0) {
+		pr_warn("Can't create tmpfs (%d), staging images in the images dir\n", errno);
+		return 0;
+	}
+
+	/* Restore unpacks all the images there, so it's not limited */
+	if (syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_STRING, "size", "0", 0) ||
+	    syscall(SYS_fsconfig, fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0)) {
+		pr_perror("Unable to create tmpfs for images");
+		goto out;
+	}
+
+	fd = syscall(SYS_fsmount, fsfd, FSMOUNT_CLOEXEC, 0);
+	if (fd < 0) {
+		pr_perror("Unable to mount tmpfs for images");
+		goto out;
+	}
+
+	ret = install_service_fd(IMG_FD_OFF, fd);
+	close(fd);
+	if (ret >= 0) {
+		pr_info("Staging images in tmpfs\n");
+		ret = 0;
+	}
+out:
+	close(fsfd);
+	return ret;
+}
+
+static int flush_pages_pipe(void)
+{
+	struct img_stream_entry e = { .type = IMG_STREAM_FILE, };
+	u64 off = stream_off;
+	char *sname;
+
+	if (!pages_pipe_fill)
+		return 0;
+
+	e.name_len = strlen(pages_name);
+	e.size = pages_pipe_fill;
+	if (stream_write(&e, sizeof(e)) || stream_write(pages_name, e.name_len))
+		return -1;
+
+	while (pages_pipe_fill) {
+		ssize_t ret;
+
+		ret = splice(pages_pipe[0], NULL, stream_fd, NULL,
+				pages_pipe_fill, SPLICE_F_MOVE);
+		if (ret <= 0) {
+			pr_perror("Unable to splice %s into image stream", pages_name);
+			return -1;
+		}
+
+		pages_pipe_fill -= ret;
+		stream_off += ret;
+	}
+
+	sname = xstrdup(pages_name);
+	if (!sname || add_stream_file(sname, off, e.size)) {
+		xfree(sname);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Puts @len bytes from the @p pipe into the stream as the next part
+ * of the @name image. The image itself stays empty.
+ */
+int img_stream_splice(const char *name, int p, unsigned long len)
+{
+	if (pages_name && strcmp(pages_name, name)) {
+		if (flush_pages_pipe())
+			goto err;
+		xfree(pages_name);
+		pages_name = NULL;
+	}
+
+	if (!pages_name) {
+		pages_name = xstrdup(name);
+		if (!pages_name)
+			goto err;
+	}
+
+	while (len) {
+		ssize_t ret;
+
+		ret = splice(p, NULL, pages_pipe[1], NULL, len,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret < 0 && errno == EAGAIN && pages_pipe_fill) {
+			if (flush_pages_pipe())
+				goto err;
+			continue;
+		}
+		if (ret <= 0) {
+			pr_perror("Unable to splice pages of %s", name);
+			goto err;
+		}
+
+		pages_pipe_fill += ret;
+		len -= ret;
+	}
+
+	return 0;
+
+err:
+	stream_failed = true;
+	return -1;
+}
+
+int img_stream_open(void)
+{
+	struct img_stream_head h = {
+		.magic = IMG_STREAM_MAGIC,
+		.version = IMG_STREAM_VERSION,
+	};
+
+	if (!opts.stream_images)
+		return 0;
+
+	if (!strcmp(opts.stream_images, "-")) {
+		/*
+		 * Messages are printed to stdout, send them
+		 * to stderr so that they don't spoil the stream.
+		 */
+		stream_fd = dup(STDOUT_FILENO);
+		if (stream_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+			pr_perror("Unable to take stdout for image stream");
+			return -1;
+		}
+	} else {
+		stream_fd = open(opts.stream_images,
+				O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (stream_fd < 0) {
+			pr_perror("Unable to open image stream %s", opts.stream_images);
+			return -1;
+		}
+	}
+
+	if (pipe2(pages_pipe, O_CLOEXEC)) {
+		pr_perror("Unable to create pages pipe for image stream");
+		return -1;
+	}
+	fcntl(pages_pipe[1], F_SETPIPE_SZ, STREAM_BUF_SIZE);
+
+	if (open_stage_dir())
+		return -1;
+
+	stream_off = 0;
+	return stream_write(&h, sizeof(h));
+}
+
+/*
+ * Moves the @name file from the images directory into the stream.
+ * For pages images the parts collected so far go first.
+ */
+int img_stream_add(const char *name)
+{
+	struct img_stream_entry e = { .type = IMG_STREAM_FILE, };
+	int dfd = get_service_fd(IMG_FD_OFF);
+	u64 off = stream_off;
+	struct stat st;
+	char *sname;
+	int fd;
+
+	if (stream_fd < 0)
+		return 0;
+
+	if (pages_name && !strcmp(pages_name, name)) {
+		if (flush_pages_pipe())
+			goto err;
+		xfree(pages_name);
+		pages_name = NULL;
+		off = stream_off;
+	}
+
+	fd = openat(dfd, name, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Unable to open %s for image stream", name);
+		goto err;
+	}
+
+	if (fstat(fd, &st)) {
+		pr_perror("Unable to stat %s", name);
+		goto err_close;
+	}
+
+	e.name_len = strlen(name);
+	e.size = st.st_size;
+	if (stream_write(&e, sizeof(e)) || stream_write(name, e.name_len))
+		goto err_close;
+
+	while (st.st_size) {
+		ssize_t ret;
+
+		ret = sendfile(stream_fd, fd, NULL, st.st_size);
+		if (ret <= 0) {
+			pr_perror("Unable to send %s into image stream", name);
+			goto err_close;
+		}
+
+		st.st_size -= ret;
+		stream_off += ret;
+	}
+
+	close(fd);
+
+	sname = xstrdup(name);
+	if (!sname || add_stream_file(sname, off, e.size)) {
+		xfree(sname);
+		goto err;
+	}
+
+	if (unlinkat(dfd, name, 0)) {
+		pr_perror("Unable to remove streamed %s", name);
+		goto err;
+	}
+
+	pr_debug("Streamed %s (%"PRIu64" bytes)\n", name, e.size);
+	return 0;
+
+err_close:
+	close(fd);
+err:
+	/* Called from close_image, so remember the failure for img_stream_finish */
+	stream_failed = true;
+	return -1;
+}
+
+static int collect_image_names(char ***names, int *nr)
+{
+	struct stat log_st, stream_st, st;
+	struct dirent *de;
+	DIR *d;
+	int dfd, ret = -1;
+
+	/* The log may live in the images directory, skip it */
+	if (fstat(log_get_fd(), &log_st))
+		memset(&log_st, 0, sizeof(log_st));
+	/* And so may the stream itself */
+	if (fstat(stream_fd, &stream_st))
+		memset(&stream_st, 0, sizeof(stream_st));
+
+	dfd = dup(get_service_fd(IMG_FD_OFF));
+	if (dfd < 0) {
+		pr_perror("Unable to dup images dir");
+		return -1;
+	}
+
+	d = fdopendir(dfd);
+	if (!d) {
+		pr_perror("Unable to open images dir");
+		close(dfd);
+		return -1;
+	}
+
+	*names = NULL;
+	*nr = 0;
+
+	while ((de = readdir(d)) != NULL) {
+		char **n;
+
+		if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			pr_perror("Unable to stat %s", de->d_name);
+			goto out;
+		}
+
+		if (!S_ISREG(st.st_mode))
+			continue;
+		if (st.st_dev == log_st.st_dev && st.st_ino == log_st.st_ino)
+			continue;
+		if (st.st_dev == stream_st.st_dev && st.st_ino == stream_st.st_ino)
+			continue;
+
+		n = xrealloc(*names, (*nr + 1) * sizeof(char *));
+		if (!n)
+			goto out;
+		*names = n;
+
+		n[*nr] = xstrdup(de->d_name);
+		if (!n[*nr])
+			goto out;
+		(*nr)++;
+	}
+
+	ret = 0;
+out:
+	closedir(d);
+	return ret;
+}
+
+static int write_stream_index(void)
+{
+	struct img_stream_entry e = { .type = IMG_STREAM_INDEX, };
+	struct img_stream_tail t = {
+		.magic = IMG_STREAM_TAIL_MAGIC,
+		.nr_files = nr_files,
+		.index_off = stream_off,
+	};
+	unsigned int i;
+
+	for (i = 0; i < nr_files; i++)
+		e.size += sizeof(struct img_stream_idx) + strlen(files[i].name);
+
+	if (stream_write(&e, sizeof(e)))
+		return -1;
+
+	for (i = 0; i < nr_files; i++) {
+		struct img_stream_idx idx = {
+			.off = files[i].off,
+			.size = files[i].size,
+			.name_len = strlen(files[i].name),
+		};
+
+		if (stream_write(&idx, sizeof(idx)) ||
+		    stream_write(files[i].name, idx.name_len))
+			return -1;
+	}
+
+	return stream_write(&t, sizeof(t));
+}
+
+/*
+ * Puts the rest of the images directory into the stream and
+ * closes it. If the dump has failed the stream is left without
+ * the tail, so that readers can't take it for a complete one.
+ */
+int img_stream_finish(int ret)
+{
+	char **names = NULL;
+	int i, nr = 0;
+
+	if (stream_fd < 0)
+		return 0;
+
+	if (!ret && !stream_failed) {
+		ret = collect_image_names(&names, &nr);
+		for (i = 0; !ret && i < nr; i++)
+			ret = img_stream_add(names[i]);
+		if (!ret)
+			ret = write_stream_index();
+	}
+
+	if (!ret && stream_failed)
+		ret = -1;
+
+	if (!ret)
+		pr_info("Streamed %u images (%"PRIu64" bytes)\n", nr_files, stream_off);
+	else
+		pr_err("Image stream is left unfinished\n");
+
+	for (i = 0; i < nr; i++)
+		xfree(names[i]);
+	xfree(names);
+	free_stream_files();
+
+	xfree(pages_name);
+	pages_name = NULL;
+	pages_pipe_fill = 0;
+	close_safe(&pages_pipe[0]);
+	close_safe(&pages_pipe[1]);
+
+	close(stream_fd);
+	stream_fd = -1;
+	return ret ? -1 : 0;
+}
+
+static bool stream_file_seen(const char *name)
+{
+	unsigned int i;
+
+	/* The parts mostly go one after another, so look from the end */
+	for (i = nr_files; i > 0; i--)
+		if (!strcmp(files[i - 1].name, name))
+			return true;
+
+	return false;
+}
+
+static int unpack_file(struct img_stream_entry *e, void *buf)
+{
+	int dfd = get_service_fd(IMG_FD_OFF);
+	u64 off = stream_off - sizeof(*e);
+	char *name;
+	u64 size;
+	int fd;
+
+	if (!e->name_len || e->name_len > NAME_MAX) {
+		pr_err("Bad file name length %u in image stream\n", e->name_len);
+		return -1;
+	}
+
+	name = xmalloc(e->name_len + 1);
+	if (!name)
+		return -1;
+
+	if (stream_read(name, e->name_len))
+		goto err;
+	name[e->name_len] = '\0';
+
+	if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+		pr_err("Bad file name %s in image stream\n", name);
+		goto err;
+	}
+
+	/* Big images come in parts, which are appended to the first one */
+	fd = openat(dfd, name, O_WRONLY | O_CREAT |
+			(stream_file_seen(name) ? O_APPEND : O_TRUNC), 0600);
+	if (fd < 0) {
+		pr_perror("Unable to create %s", name);
+		goto err;
+	}
+
+	for (size = e->size; size; ) {
+		size_t len = min_t(u64, size, STREAM_BUF_SIZE);
+
+		if (stream_read(buf, len))
+			goto err_close;
+
+		if (write(fd, buf, len) != len) {
+			pr_perror("Unable to write %s", name);
+			goto err_close;
+		}
+
+		size -= len;
+	}
+
+	close(fd);
+
+	if (add_stream_file(name, off, e->size))
+		goto err;
+
+	pr_debug("Unpacked %s (%"PRIu64" bytes)\n", name, e->size);
+	return 0;
+
+err_close:
+	close(fd);
+err:
+	xfree(name);
+	return -1;
+}
+
+static int check_stream_index(struct img_stream_entry *e, void *buf)
+{
+	u64 index_off = stream_off - sizeof(*e);
+	struct img_stream_tail t;
+	unsigned int i;
+
+	for (i = 0; i < nr_files; i++) {
+		struct stream_file *f = &files[i];
+		struct img_stream_idx idx;
+
+		if (stream_read(&idx, sizeof(idx)))
+			return -1;
+
+		if (idx.name_len > NAME_MAX) {
+			pr_err("Bad file name length %u in stream index\n", idx.name_len);
+			return -1;
+		}
+
+		if (stream_read(buf, idx.name_len))
+			return -1;
+
+		if (idx.off != f->off || idx.size != f->size ||
+		    idx.name_len != strlen(f->name) ||
+		    memcmp(buf, f->name, idx.name_len)) {
+			pr_err("Image stream index mismatch for %s\n", f->name);
+			return -1;
+		}
+	}
+
+	if (stream_read(&t, sizeof(t)))
+		return -1;
+
+	if (t.magic != IMG_STREAM_TAIL_MAGIC || t.nr_files != nr_files ||
+	    t.index_off != index_off) {
+		pr_err("Bad image stream tail\n");
+		return -1;
+	}
+
+	if (read(stream_fd, buf, 1) != 0) {
+		pr_err("Garbage after image stream tail\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Unpacks the stream before restore. Restore reads the images in no
+ * particular order and from many tasks, so they are all unpacked into
+ * the staging tmpfs (see open_stage_dir()) first.
+ */
+int img_stream_unpack(void)
+{
+	struct img_stream_head h;
+	struct img_stream_entry e;
+	void *buf;
+	int ret = -1;
+
+	if (!opts.stream_images)
+		return 0;
+
+	if (!strcmp(opts.stream_images, "-"))
+		stream_fd = dup(STDIN_FILENO);
+	else
+		stream_fd = open(opts.stream_images, O_RDONLY | O_CLOEXEC);
+	if (stream_fd < 0) {
+		pr_perror("Unable to open image stream %s", opts.stream_images);
+		return -1;
+	}
+
+	if (open_stage_dir())
+		goto out_close;
+
+	buf = mmap(NULL, STREAM_BUF_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED) {
+		pr_perror("Unable to allocate stream buffer");
+		goto out_close;
+	}
+
+	stream_off = 0;
+	if (stream_read(&h, sizeof(h)))
+		goto out;
+
+	/* Version 1 streams are the same, just without the parts */
+	if (h.magic != IMG_STREAM_MAGIC || !h.version || h.version > IMG_STREAM_VERSION) {
+		pr_err("Not an image stream or unsupported version (%#x/%u)\n",
+				h.magic, h.version);
+		goto out;
+	}
+
+	while (1) {
+		if (stream_read(&e, sizeof(e)))
+			goto out;
+
+		if (e.type == IMG_STREAM_INDEX) {
+			ret = check_stream_index(&e, buf);
+			break;
+		}
+
+		if (e.type != IMG_STREAM_FILE) {
+			pr_err("Unknown entry %u in image stream\n", e.type);
+			goto out;
+		}
+
+		if (unpack_file(&e, buf))
+			goto out;
+	}
+
+	if (!ret)
+		pr_info("Unpacked %u images (%"PRIu64" bytes)\n", nr_files, stream_off);
+out:
+	free_stream_files();
+	munmap(buf, STREAM_BUF_SIZE);
+out_close:
+	close(stream_fd);
+	stream_fd = -1;
+	return ret;
+}
@@ -67,6 +67,7 @@ struct cr_options {
 	bool			evasive_devices;
 	bool			link_remap_ok;
 	bool			log_file_per_pid;
+	bool			log_deferred;
 	bool			swrk_restore;
 	char			*output;
 	char			*root;
@@ -85,6 +86,11 @@ struct cr_options {
 	bool			track_mem;
 	char			*img_parent;
 	bool			auto_dedup;
+	bool			numa_pages;
+	bool			pages_direct;
+	bool			fsync_images;
+	char			*stream_images;
+	bool			trace;
 	unsigned int		cpu_cap;
 	bool			force_irmap;
 	char			**exec_cmd;
@@ -57,6 +57,9 @@ extern struct collect_image_info file_locks_cinfo;
 struct pid;
 struct fd_parms;
 extern int note_file_lock(struct pid *, int fd, int lfd, struct fd_parms *);
+extern int note_locked_inode(unsigned long ino);
+extern void locked_inodes_collected(void);
+extern bool inode_may_have_locks(unsigned long ino);
 extern int dump_file_locks(void);
 
 #define OPT_FILE_LOCKS	"file-locks"
@@ -19,6 +19,7 @@ struct pstree_item;
 struct file_desc;
 struct cr_imgset;
 struct rst_info;
+struct fd_map;
 struct parasite_ctl;
 
 struct fd_link {
@@ -68,7 +69,6 @@ struct fdinfo_list_entry {
 	struct list_head	desc_list;	/* To chain on  @fd_info_head */
 	struct file_desc	*desc;		/* Associated file descriptor */
 	struct list_head	ps_list;	/* To chain  per-task files */
-	struct list_head	used_list;	/* To chain per-task used fds */
 	int			pid;
 	futex_t			real_pid;
 	FdinfoEntry		*fe;
@@ -110,25 +110,14 @@ struct file_desc_ops {
 	char *			(*name)(struct file_desc *, char *b, size_t s);
 };
 
-static inline void collect_used_fd(struct fdinfo_list_entry *new_fle, struct rst_info *ri)
-{
-	struct fdinfo_list_entry *fle;
-
-	list_for_each_entry(fle, &ri->used, used_list) {
-		if (new_fle->fe->fd < fle->fe->fd)
-			break;
-	}
-
-	list_add_tail(&new_fle->used_list, &fle->used_list);
-}
-
 static inline void collect_gen_fd(struct fdinfo_list_entry *fle, struct rst_info *ri)
 {
 	list_add_tail(&fle->ps_list, &ri->fds);
 }
 
-unsigned int find_unused_fd(struct list_head *head, int hint_fd);
-struct fdinfo_list_entry *find_used_fd(struct list_head *head, int fd);
+extern int collect_used_fd(struct fdinfo_list_entry *fle, struct rst_info *ri);
+unsigned int find_unused_fd(struct fd_map *map, int hint_fd);
+struct fdinfo_list_entry *find_used_fd(struct fd_map *map, int fd);
 
 struct file_desc {
 	u32			id;		/* File id, unique */
@@ -50,6 +50,7 @@ enum {
 
 	CR_FD_PSTREE,
 	CR_FD_SHMEM_PAGEMAP,
+	CR_FD_SYSV_SHMEM_PAGEMAP,
 	CR_FD_GHOST_FILE,
 	CR_FD_TCP_STREAM,
 	CR_FD_FDINFO,
@@ -88,6 +89,8 @@ enum {
 	CR_FD_BINFMT_MISC,
 	CR_FD_BINFMT_MISC_OLD,
 	CR_FD_PAGES,
+	CR_FD_SHMEM_HASHES,
+	CR_FD_SYSV_SHMEM_HASHES,
 
 	CR_FD_VMAS,
 	CR_FD_PAGES_OLD,
@@ -115,6 +115,7 @@ struct cr_img {
 			char *path;
 		};
 	};
+	char *stream_name; /* goes to image stream on close */
 };
 
 #define EMPTY_IMG_FD	(-404)
@@ -145,13 +146,16 @@ extern off_t img_raw_size(struct cr_img *img);
 
 extern int open_image_dir(char *dir);
 extern void close_image_dir(void);
+extern int fsync_images(void);
 
 extern struct cr_img *open_image_at(int dfd, int type, unsigned long flags, ...);
 #define open_image(typ, flags, ...) open_image_at(-1, typ, flags, ##__VA_ARGS__)
 extern int open_image_lazy(struct cr_img *img);
-extern struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi);
-extern struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi);
+extern struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi, bool *packed);
+extern struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi, bool *packed);
+extern struct cr_img *open_pages_image_id(struct cr_img *pmi, unsigned long id);
 extern void up_page_ids_base(void);
+extern unsigned long reserve_page_ids(unsigned long nr);
 
 extern struct cr_img *img_from_fd(int fd); /* for cr-show mostly */
 
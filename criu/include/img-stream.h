@@ -0,0 +1,57 @@
+#ifndef __CR_IMG_STREAM_H__
+#define __CR_IMG_STREAM_H__
+
+#include "asm/types.h"
+
+/*
+ * Image stream is a single sequential file carrying the whole images
+ * directory, so that it can be fed into a pipe or a socket.
+ *
+ *   head | entry* | index | tail
+ *
+ * Each entry is a file from the images directory: the entry header,
+ * the file name (not 0-terminated) and the file contents. Pages images
+ * are written straight into the stream and come in several entries
+ * with the same name, the file is their contents in order. The index
+ * is an entry too, its data is an array of img_stream_idx records
+ * (each followed by the file name) describing all the files in the
+ * stream. The tail points to the index, so that readers with random
+ * access to the stream can find files without scanning it.
+ */
+
+#define IMG_STREAM_VERSION	2
+
+struct img_stream_head {
+	u32	magic;		/* IMG_STREAM_MAGIC */
+	u32	version;
+};
+
+#define IMG_STREAM_FILE		1
+#define IMG_STREAM_INDEX	2
+
+struct img_stream_entry {
+	u32	type;
+	u32	name_len;
+	u64	size;
+};
+
+struct img_stream_idx {
+	u64	off;		/* of the entry header */
+	u64	size;
+	u32	name_len;
+	u32	pad;
+};
+
+struct img_stream_tail {
+	u32	magic;		/* IMG_STREAM_TAIL_MAGIC */
+	u32	nr_files;
+	u64	index_off;	/* of the index entry header */
+};
+
+extern int img_stream_open(void);
+extern int img_stream_add(const char *name);
+extern int img_stream_splice(const char *name, int p, unsigned long len);
+extern int img_stream_finish(int ret);
+extern int img_stream_unpack(void);
+
+#endif /* __CR_IMG_STREAM_H__ */
@@ -1,10 +1,15 @@
 #ifndef __CR_KCMP_IDS_H__
 #define __CR_KCMP_IDS_H__
 
+#include "asm/types.h"
 #include "kcmp.h"
 
+struct kid_entry;
+
 struct kid_tree {
-	struct rb_root root;
+	struct kid_entry **hash;
+	unsigned int hash_bits;
+	unsigned long nr;
 	unsigned kcmp_type;
 	unsigned long subid;
 
@@ -12,18 +17,18 @@ struct kid_tree {
 
 #define DECLARE_KCMP_TREE(name, type)	\
 	struct kid_tree name = {	\
-		.root = RB_ROOT,	\
 		.kcmp_type = type,	\
 		.subid = 1,		\
 	}
 
 struct kid_elem {
 	int pid;
-	unsigned genid;
+	u64 genid;
 	unsigned idx;
 };
 
 extern u32 kid_generate_gen(struct kid_tree *tree,
 			    struct kid_elem *elem, int *new_id);
+extern unsigned long kid_kcmp_calls(void);
 
 #endif /* __CR_KCMP_IDS_H__ */
@@ -37,6 +37,9 @@ struct kerndat_s {
 	bool has_loginuid;
 	enum pagemap_func pmap;
 	unsigned int has_xtlocks;
+	unsigned long thp_size; /* 0 if THP is not available */
+	bool has_numa;
+	unsigned int numa_nodes; /* max possible node id + 1 */
 };
 
 extern struct kerndat_s kdat;
@@ -7,6 +7,9 @@ extern int do_rtnl_req(int nl, void *req, int size,
 		int (*receive_callback)(struct nlmsghdr *h, void *),
 		int (*error_callback)(int err, void *), void *);
 
+extern int do_rtnl_batch(int nl, void *req, int size, int nr,
+		int (*error_callback)(int err, void *), void *arg);
+
 extern int addattr_l(struct nlmsghdr *n, int maxlen, int type,
 		const void *data, int alen);
 
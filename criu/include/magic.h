@@ -27,6 +27,14 @@
 #define IMG_COMMON_MAGIC	0x54564319 /* Sarov (a.k.a. Arzamas-16) */
 #define IMG_SERVICE_MAGIC	0x55105940 /* Zlatoust */
 
+/*
+ * Single-file image streams (see img-stream.c) start with the
+ * IMG_STREAM_MAGIC and end with the IMG_STREAM_TAIL_MAGIC.
+ */
+
+#define IMG_STREAM_MAGIC	0x52434127 /* Tambov */
+#define IMG_STREAM_TAIL_MAGIC	0x52373936 /* Lipetsk */
+
 /*
  * The magic-s below correspond to coordinates
  * of various Russian towns in the NNNNEEEE form.
@@ -37,6 +45,7 @@
 #define FDINFO_MAGIC		0x56213732 /* Dmitrov */
 #define PAGEMAP_MAGIC		0x56084025 /* Vladimir */
 #define SHMEM_PAGEMAP_MAGIC	PAGEMAP_MAGIC
+#define SYSV_SHMEM_PAGEMAP_MAGIC	PAGEMAP_MAGIC
 #define PAGES_MAGIC		RAW_IMAGE_MAGIC
 #define CORE_MAGIC		0x55053847 /* Kolomna */
 #define IDS_MAGIC		0x54432030 /* Konigsberg */
@@ -104,6 +113,8 @@
 #define IP6TABLES_MAGIC		RAW_IMAGE_MAGIC
 #define NETNF_CT_MAGIC		RAW_IMAGE_MAGIC
 #define NETNF_EXP_MAGIC		RAW_IMAGE_MAGIC
+#define SHMEM_HASHES_MAGIC	RAW_IMAGE_MAGIC
+#define SYSV_SHMEM_HASHES_MAGIC	RAW_IMAGE_MAGIC
 
 #define PAGES_OLD_MAGIC		PAGEMAP_MAGIC
 #define SHM_PAGES_OLD_MAGIC	PAGEMAP_MAGIC
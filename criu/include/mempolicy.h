@@ -0,0 +1,32 @@
+#ifndef __CR_MEMPOLICY_H__
+#define __CR_MEMPOLICY_H__
+
+#include <sys/types.h>
+
+#include "asm/int.h"
+#include "images/core.pb-c.h"
+
+/*
+ * The *_mempolicy() and mbind() syscalls cut the last
+ * bit from the maxnode argument, so here's the +1.
+ */
+#define mpol_maxnode(nr_longs)	((nr_longs) * sizeof(long) * 8 + 1)
+
+struct parasite_ctl;
+struct vm_area_list;
+struct vma_area;
+
+extern unsigned int mpol_nodemask_longs(void);
+extern unsigned long mempolicy_args_size(struct vm_area_list *vmas);
+extern int parasite_dump_mempolicy_seized(struct parasite_ctl *ctl,
+		struct vm_area_list *vmas, TaskCoreEntry *tc);
+extern int dump_vma_page_nodes(pid_t pid, struct vma_area *vma, u64 *map);
+extern void free_vma_mempolicy(struct vma_area *vma);
+
+extern int prepare_task_mempolicy(TaskCoreEntry *tc);
+extern int premap_vma_mempolicy(struct vma_area *vma, void *addr);
+extern unsigned long vma_prefer_page_node(struct vma_area *vma,
+		unsigned long va, unsigned long nr);
+extern int restore_vmas_mempolicy(struct vm_area_list *vmas);
+
+#endif /* __CR_MEMPOLICY_H__ */
@@ -14,4 +14,15 @@
 # define MADV_DONTDUMP		16
 #endif
 
+#ifndef MPOL_DEFAULT
+# define MPOL_DEFAULT		0
+# define MPOL_PREFERRED		1
+# define MPOL_BIND		2
+# define MPOL_INTERLEAVE	3
+#endif
+#ifndef MPOL_F_NODE
+# define MPOL_F_NODE		(1 << 0)
+# define MPOL_F_ADDR		(1 << 1)
+#endif
+
 #endif /* __CR_MMAN_H__ */
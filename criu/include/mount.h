@@ -66,6 +66,9 @@ struct mount_info {
 	bool			is_ns_root;
 	bool			deleted;
 	struct mount_info	*next;
+	struct hlist_node	id_hash;	/* see mntinfo_add_list() */
+	struct hlist_node	sdev_hash;
+	struct hlist_node	path_hash;	/* see mount_resolve_path() */
 	struct ns_id		*nsid;
 
 	struct ext_mount	*external;
@@ -105,6 +108,7 @@ extern int __open_mountpoint(struct mount_info *pm, int mnt_fd);
 extern int open_mountpoint(struct mount_info *pm);
 
 extern struct mount_info *collect_mntinfo(struct ns_id *ns, bool for_dump);
+extern void mntinfo_add_list(struct mount_info *new);
 extern int prepare_mnt_ns(void);
 
 extern int pivot_root(const char *new_root, const char *put_old);
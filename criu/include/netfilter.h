@@ -8,6 +8,9 @@ extern int nf_unlock_connection(struct inet_sk_desc *);
 struct inet_sk_info;
 extern int nf_unlock_connection_info(struct inet_sk_info *);
 
+extern void nf_unlock_batch_start(void);
+extern int nf_unlock_batch_end(void);
+
 extern void preload_netfilter_modules(void);
 
 #endif /* __CR_NETFILTER_H__ */
@@ -1,8 +1,27 @@
 #ifndef __CR_PAGE_READ_H__
 #define __CR_PAGE_READ_H__
 
+#include "asm/types.h"
 #include "images/pagemap.pb-c.h"
 
+/*
+ * Pagemap entry as it's kept in memory and in the packed pagemap
+ * images (those with pagemap_head.packed set). Fixed size entries
+ * are loaded with one read, without unpacking and allocating each.
+ */
+struct pagemap_packed {
+	u64	vaddr;
+	u32	nr_pages;
+	u32	flags;
+};
+
+#define PE_PARENT	(1 << 0)	/* pages are in parent snapshot */
+
+static inline bool pagemap_in_parent(struct pagemap_packed *pe)
+{
+	return pe->flags & PE_PARENT;
+}
+
 /*
  * page_read -- engine, that reads pages from image file(s)
  *
@@ -48,6 +67,8 @@ struct page_read {
 	int (*get_pagemap)(struct page_read *, struct iovec *iov);
 	/* reads page from current pagemap */
 	int (*read_pages)(struct page_read *, unsigned long vaddr, int nr, void *);
+	/* sends pages from current pagemap into fd at vaddr offset */
+	int (*send_pages)(struct page_read *, unsigned long vaddr, int nr, int fd);
 	/* stop working on current pagemap */
 	void (*put_pagemap)(struct page_read *);
 	void (*close)(struct page_read *);
@@ -57,7 +78,7 @@ struct page_read {
 	struct cr_img *pmi;
 	struct cr_img *pi;
 
-	PagemapEntry *pe;		/* current pagemap we are on */
+	struct pagemap_packed *pe;	/* current pagemap we are on */
 	struct page_read *parent;	/* parent pagemap (if ->in_parent
 					   pagemap is met in image, then
 					   go to this guy for page, see
@@ -69,16 +90,20 @@ struct page_read {
 					   iovecs to punch together */
 	unsigned id; /* for logging */
 
-	PagemapEntry **pmes;
+	struct pagemap_packed *pmes;
 	int nr_pmes;
 	int curr_pme;
+
+	bool dedup;			/* punch pages out once read */
 };
 
 #define PR_SHMEM	0x1
 #define PR_TASK		0x2
+#define PR_SYSV_SHMEM	0x3
 
 #define PR_TYPE_MASK	0x3
 #define PR_MOD		0x4	/* Will need to modify */
+#define PR_RO		0x8	/* Never modify, even with auto-dedup */
 
 /*
  * -1 -- error
@@ -88,8 +113,8 @@ struct page_read {
 extern int open_page_read(int id, struct page_read *, int pr_flags);
 extern int open_page_read_at(int dfd, int id, struct page_read *pr,
 		int pr_flags);
-extern void pagemap2iovec(PagemapEntry *pe, struct iovec *iov);
-extern void iovec2pagemap(struct iovec *iov, PagemapEntry *pe);
+extern void pagemap2iovec(struct pagemap_packed *pe, struct iovec *iov);
+extern void iovec2pagemap(struct iovec *iov, struct pagemap_packed *pe);
 
 extern int dedup_one_iovec(struct page_read *pr, struct iovec *iov);
 #endif /* __CR_PAGE_READ_H__ */
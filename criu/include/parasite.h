@@ -48,6 +48,7 @@ enum {
 	PARASITE_CMD_CHECK_VDSO_MARK,
 	PARASITE_CMD_CHECK_AIOS,
 	PARASITE_CMD_DUMP_CGROUP,
+	PARASITE_CMD_DUMP_MEMPOLICY,
 
 	PARASITE_CMD_MAX,
 };
@@ -147,6 +148,29 @@ struct parasite_check_aios_args {
 	struct parasite_aio ring[0];
 };
 
+struct parasite_vma_mpol {
+	unsigned long	start;
+	int		mode;
+	unsigned long	nodes[0];
+};
+
+struct parasite_dump_mpol_args {
+	unsigned int	nr_vmas;
+	unsigned int	nr_longs;	/* in each nodemask */
+	int		mode;		/* task's policy */
+	unsigned long	nodes[0];	/* task's nodemask, then vmas */
+};
+
+static inline unsigned long pargs_mpol_vma_size(struct parasite_dump_mpol_args *a)
+{
+	return sizeof(struct parasite_vma_mpol) + a->nr_longs * sizeof(long);
+}
+
+static inline struct parasite_vma_mpol *pargs_mpol_vma(struct parasite_dump_mpol_args *a, int i)
+{
+	return (void *)(a->nodes + a->nr_longs) + i * pargs_mpol_vma_size(a);
+}
+
 static inline int posix_timers_dump_size(int timer_n)
 {
 	return sizeof(int) + sizeof(struct posix_timer) * timer_n;
@@ -13,15 +13,18 @@ static inline u32 pipe_id(const struct fd_parms *p)
 	return p->stat.st_ino;
 }
 
-#define NR_PIPES_WITH_DATA	1024
-
 struct pipe_data_dump {
 	int		img_type;
 	unsigned int	nr;
-	u32		ids[NR_PIPES_WITH_DATA];
+	unsigned int	hash_bits;	/* open addressing set of dumped ids */
+	u32		*ids;
+	char		*batch;		/* entries waiting to be written */
+	unsigned int	batch_len;
+	struct pipe_data_dump *next;
 };
 
 extern int dump_one_pipe_data(struct pipe_data_dump *pd, int lfd, const struct fd_parms *p);
+extern int flush_pipes_data(void);
 
 struct pipe_data_rst {
 	PipeDataEntry		*pde;
@@ -29,7 +32,7 @@ struct pipe_data_rst {
 	struct pipe_data_rst	*next;
 };
 
-#define PIPE_DATA_HASH_BITS	5
+#define PIPE_DATA_HASH_BITS	12
 #define PIPE_DATA_HASH_SIZE	(1 << PIPE_DATA_HASH_BITS)
 #define PIPE_DATA_HASH_MASK	(PIPE_DATA_HASH_SIZE - 1)
 
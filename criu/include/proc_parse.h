@@ -108,5 +108,7 @@ struct pid;
 extern int parse_threads(int pid, struct pid **_t, int *_n);
 
 int parse_children(pid_t pid, pid_t **_c, int *_n);
+int parse_threads_children(pid_t pid, struct pid *threads, int nr_threads,
+			   pid_t **_c, int *_n);
 
 #endif /* __CR_PROC_PARSE_H__ */
@@ -7,12 +7,15 @@
 #include "compiler.h"
 #include "util.h"
 
+#include <google/protobuf-c/protobuf-c.h>
+
 struct cr_img;
 
-extern int do_pb_read_one(struct cr_img *, void **objp, int type, bool eof);
+extern int do_pb_read_one(struct cr_img *, void **objp, int type, bool eof,
+			  ProtobufCAllocator *allocator);
 
-#define pb_read_one(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, false)
-#define pb_read_one_eof(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, true)
+#define pb_read_one(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, false, NULL)
+#define pb_read_one_eof(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, true, NULL)
 
 extern int pb_write_one(struct cr_img *, void *obj, int type);
 
@@ -25,8 +28,6 @@ extern int pb_write_one(struct cr_img *, void *obj, int type);
 #define pb_msg(__base, __type)			\
 	container_of(__base, __type, base)
 
-#include <google/protobuf-c/protobuf-c.h>
-
 struct collect_image_info {
 	int fd_type;
 	int pb_type;
@@ -37,7 +38,9 @@ struct collect_image_info {
 
 #define COLLECT_SHARED		0x1	/* use shared memory for obj-s */
 #define COLLECT_HAPPENED	0x4	/* image was opened and collected */
+#define COLLECT_ARENA		0x8	/* msg-s are never freed, unpack them into arena */
 
 extern int collect_image(struct collect_image_info *);
+extern void pb_collect_arena_fini(void);
 
 #endif /* __CR_PROTOBUF_H__ */
@@ -23,10 +23,18 @@ struct fdt {
 	futex_t			fdt_lock;
 };
 
+struct fdinfo_list_entry;
+
+/* Task's fds by their numbers, see collect_used_fd() */
+struct fd_map {
+	struct fdinfo_list_entry	***leaves;
+	int				nr_leaves;
+};
+
 struct _MmEntry;
 
 struct rst_info {
-	struct list_head	used;
+	struct fd_map		used;
 	struct list_head	fds;
 	struct list_head	eventpoll;
 	struct list_head	tty_slaves;
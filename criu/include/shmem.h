@@ -13,6 +13,7 @@ extern int collect_sysv_shmem(unsigned long shmid, unsigned long size);
 extern int cr_dump_shmem(void);
 extern int add_shmem_area(pid_t pid, VmaEntry *vma, u64 *map);
 extern int fixup_sysv_shmems(void);
+extern int restore_sysv_shmem_content(void *addr, unsigned long size, unsigned long shmid);
 
 #define SYSV_SHMEM_SKIP_FD	(0x7fffffff)
 
@@ -1,6 +1,8 @@
 #ifndef __CR_STATS_H__
 #define __CR_STATS_H__
 
+#include "asm/int.h"
+
 enum {
 	TIME_FREEZING,
 	TIME_FROZEN,
@@ -21,10 +23,63 @@ enum {
 extern void timing_start(int t);
 extern void timing_stop(int t);
 
+/*
+ * Spans are per-task intervals of dump/restore phases. Unlike
+ * timings they work from any task, including restored children.
+ */
+enum {
+	/* dump */
+	SPAN_COLLECT_MAPPINGS,
+	SPAN_INFECT,
+	SPAN_DUMP_FILES,
+	SPAN_DUMP_PAGES,
+	SPAN_PAGE_XFER,
+	SPAN_CURE,
+	SPAN_COLLECT_SOCKETS,
+	SPAN_MNT_NS,
+	SPAN_CGROUPS,
+	SPAN_NET_LOCK,
+	SPAN_NET_UNLOCK,
+
+	/* freezing stages, see collect_pstree() */
+	SPAN_FREEZE_CGROUP,
+	SPAN_SEIZE_SCAN,
+	SPAN_SEIZE_INTERRUPT,
+	SPAN_SEIZE_WAIT,
+	SPAN_UNFREEZE,
+
+	/* restore */
+	SPAN_RST_SHARED,
+	SPAN_RST_MAPPINGS,
+	SPAN_RST_FORK,
+	SPAN_RST_FILES,
+	SPAN_RST_VMAS,
+	SPAN_RST_SIGRETURN,
+	SPAN_RST_COLLECT,
+	SPAN_RST_PAGEMAPS,
+
+	/* restore stages, in the CR_STATE_ order */
+	SPAN_STAGE_RESTORE_NS,
+	SPAN_STAGE_RESTORE_SHARED,
+	SPAN_STAGE_FORKING,
+	SPAN_STAGE_RESTORE,
+	SPAN_STAGE_RESTORE_SIGCHLD,
+	SPAN_STAGE_RESTORE_CREDS,
+
+	SPAN_NR_STATS,
+};
+
+extern void span_start(int s);
+extern u64 span_stop(int s);
+extern void span_set_task(int pid);
+
 enum {
 	CNT_PAGES_SCANNED,
 	CNT_PAGES_SKIPPED_PARENT,
 	CNT_PAGES_WRITTEN,
+	CNT_KCMP_CALLS,
+	CNT_PAGEMAP_READS,
+	CNT_PAGEMAP_BYTES,
 
 	DUMP_CNT_NR_STATS,
 };
@@ -38,6 +93,7 @@ enum {
 };
 
 extern void cnt_add(int c, unsigned long val);
+extern void stats_task_files(int pid, unsigned int nr_fds, u64 usec);
 
 #define DUMP_STATS	1
 #define RESTORE_STATS	2
@@ -25,6 +25,7 @@
 
 struct fd_opts {
 	char flags;
+	bool has_pos;
 	struct {
 		u32 uid;
 		u32 euid;
@@ -32,6 +33,16 @@ struct fd_opts {
 		u32 pid_type;
 		u32 pid;
 	} fown;
+
+	/*
+	 * What /proc/pid/fdinfo/fd would tell, collected by the
+	 * parasite for all the fds in one go. The pos is valid
+	 * with has_pos only, the mnt_id is -1 if the kernel can't
+	 * report it via statx().
+	 */
+	u64 pos;
+	u32 fl_flags;
+	s32 mnt_id;
 };
 
 struct scm_fdset {
@@ -58,6 +58,7 @@ extern int reopen_fd_as_safe(char *file, int line, int new_fd, int old_fd, bool
 extern void close_proc(void);
 extern int open_pid_proc(pid_t pid);
 extern int close_pid_proc(void);
+extern void forget_pid_proc(void);
 extern int set_proc_fd(int fd);
 
 /*
@@ -157,6 +158,7 @@ static inline dev_t kdev_to_odev(u32 kdev)
 }
 
 extern int copy_file(int fd_in, int fd_out, size_t bytes);
+extern int copy_file_chunk(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len);
 extern int is_anon_link_type(char *link, char *type);
 
 #define is_hex_digit(c)				\
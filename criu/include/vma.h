@@ -4,6 +4,7 @@
 #include "asm/types.h"
 #include "image.h"
 #include "list.h"
+#include "mman.h"
 
 #include "images/vma.pb-c.h"
 
@@ -115,4 +116,21 @@ static inline bool vma_area_is_private(struct vma_area *vma,
 	return vma_entry_is_private(vma->e, task_size);
 }
 
+/*
+ * Anonymous private vma-s, which can hold at least one
+ * transparent huge page, are premapped at the same offset
+ * in a huge page as they have in the restored task, so
+ * that the kernel can back them with THP-s and move the
+ * huge pmd-s as a whole in vma_remap().
+ */
+static inline bool vma_entry_can_thp(VmaEntry *entry, unsigned long thp_size)
+{
+	if (!thp_size || !vma_entry_is(entry, VMA_ANON_PRIVATE))
+		return false;
+	if (entry->has_madv && (entry->madv & (1ul << MADV_NOHUGEPAGE)))
+		return false;
+
+	return vma_entry_len(entry) >= thp_size;
+}
+
 #endif /* __CR_VMA_H__ */
@@ -338,32 +338,6 @@ static int ipc_sysctl_req(IpcVarEntry *e, int op)
 	return sysctl_op(req, nr, op, CLONE_NEWIPC);
 }
 
-/*
- * TODO: Function below should be later improved to locate and dump only dirty
- * pages via updated sys_mincore().
- */
-static int dump_ipc_shm_pages(struct cr_img *img, const IpcShmEntry *shm)
-{
-	void *data;
-	int ret;
-
-	data = shmat(shm->desc->id, NULL, SHM_RDONLY);
-	if (data == (void *)-1) {
-		pr_perror("Failed to attach IPC shared memory");
-		return -errno;
-	}
-	ret = write_img_buf(img, data, round_up(shm->size, sizeof(u32)));
-	if (ret < 0) {
-		pr_err("Failed to write IPC shared memory data\n");
-		return ret;
-	}
-	if (shmdt(data)) {
-		pr_perror("Failed to detach IPC shared memory");
-		return -errno;
-	}
-	return 0;
-}
-
 static int dump_ipc_shm_seg(struct cr_img *img, int id, const struct shmid_ds *ds)
 {
 	IpcShmEntry shm = IPC_SHM_ENTRY__INIT;
@@ -375,12 +349,16 @@ static int dump_ipc_shm_seg(struct cr_img *img, int id, const struct shmid_ds *d
 	fill_ipc_desc(id, shm.desc, &ds->shm_perm);
 	pr_info_ipc_shm(&shm);
 
+	/* Contents go to sysv shmem pagemaps, see cr_dump_shmem() */
+	shm.has_in_pagemaps = true;
+	shm.in_pagemaps = true;
+
 	ret = pb_write_one(img, &shm, PB_IPC_SHM);
 	if (ret < 0) {
 		pr_err("Failed to write IPC shared memory segment\n");
 		return ret;
 	}
-	return dump_ipc_shm_pages(img, &shm);
+	return 0;
 }
 
 static int dump_ipc_shm(struct cr_img *img)
@@ -769,7 +747,10 @@ static int prepare_ipc_shm_pages(struct cr_img *img, const IpcShmEntry *shm)
 		pr_perror("Failed to attach IPC shared memory");
 		return -errno;
 	}
-	ret = read_img_buf(img, data, round_up(shm->size, sizeof(u32)));
+	if (shm->has_in_pagemaps && shm->in_pagemaps)
+		ret = restore_sysv_shmem_content(data, shm->size, shm->desc->id);
+	else
+		ret = read_img_buf(img, data, round_up(shm->size, sizeof(u32)));
 	if (ret < 0) {
 		pr_err("Failed to read IPC shared memory data\n");
 		return ret;
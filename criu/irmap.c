@@ -13,7 +13,12 @@
 #include <dirent.h>
 #include <string.h>
 #include <stdio.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "xmalloc.h"
@@ -21,10 +26,12 @@
 #include "mount.h"
 #include "log.h"
 #include "util.h"
+#include "string.h"
 #include "image.h"
 #include "stats.h"
 #include "pstree.h"
 #include "cr_options.h"
+#include "asm/atomic.h"
 
 #include "protobuf.h"
 #include "images/fsnotify.pb-c.h"
@@ -33,13 +40,23 @@
 #undef	LOG_PREFIX
 #define LOG_PREFIX "irmap: "
 
-#define IRMAP_CACHE_BITS	5
-#define IRMAP_CACHE_SIZE	(1 << IRMAP_CACHE_BITS)
-#define IRMAP_CACHE_MASK	(IRMAP_CACHE_SIZE - 1)
+/*
+ * The cache grows with the number of entries in it, as the whole
+ * scanned trees go into it (see irmap_build_index), and lookups
+ * are done for every watch.
+ */
+#define IRMAP_CACHE_MIN_BITS	5
 
-static inline int irmap_hashfn(unsigned int s_dev, unsigned long i_ino)
+static struct irmap **cache;
+static unsigned int cache_bits;
+static unsigned long cache_nr;
+
+static inline unsigned int irmap_hashfn(unsigned int s_dev, unsigned long i_ino,
+		unsigned int bits)
 {
-	return (s_dev + i_ino) & IRMAP_CACHE_MASK;
+	u64 key = ((u64)s_dev << 32) ^ i_ino;
+
+	return (key * 0x9e37fffffffc0001ULL) >> (64 - bits);
 }
 
 struct irmap {
@@ -48,12 +65,10 @@ struct irmap {
 	char *path;
 	struct irmap *next;
 	bool revalidate;
+	bool dumped;
 	int nr_kids;
-	struct irmap *kids;
 };
 
-static struct irmap *cache[IRMAP_CACHE_SIZE];
-
 static struct irmap hints[] = {
 	{ .path = "/etc", .nr_kids = -1, },
 	{ .path = "/var/spool", .nr_kids = -1, },
@@ -67,6 +82,48 @@ static struct irmap hints[] = {
 	{ },
 };
 
+static int irmap_cache_grow(void)
+{
+	unsigned int bits = cache ? cache_bits + 1 : IRMAP_CACHE_MIN_BITS;
+	struct irmap **new, *c;
+	unsigned long h;
+
+	new = xzalloc(sizeof(*new) << bits);
+	if (!new)
+		return -1;
+
+	for (h = 0; cache && h < (1UL << cache_bits); h++) {
+		while ((c = cache[h]) != NULL) {
+			unsigned int hv = irmap_hashfn(c->dev, c->ino, bits);
+
+			cache[h] = c->next;
+			c->next = new[hv];
+			new[hv] = c;
+		}
+	}
+
+	xfree(cache);
+	cache = new;
+	cache_bits = bits;
+	return 0;
+}
+
+static int irmap_cache_add(struct irmap *c)
+{
+	unsigned int hv;
+
+	if (!cache || cache_nr >= (1UL << cache_bits))
+		if (irmap_cache_grow())
+			return -1;
+
+	hv = irmap_hashfn(c->dev, c->ino, cache_bits);
+	c->next = cache[hv];
+	cache[hv] = c;
+	cache_nr++;
+
+	return 0;
+}
+
 /*
  * Update inode (and device) number and cache the entry
  */
@@ -74,7 +131,6 @@ static int irmap_update_stat(struct irmap *i)
 {
 	struct stat st;
 	int mntns_root;
-	unsigned hv;
 
 	if (i->ino)
 		return 0;
@@ -91,102 +147,453 @@ static int irmap_update_stat(struct irmap *i)
 	i->dev = MKKDEV(major(st.st_dev), minor(st.st_dev));
 	i->ino = st.st_ino;
 	if (!S_ISDIR(st.st_mode))
-		i->nr_kids = 0; /* don't irmap_update_dir */
-
-	hv = irmap_hashfn(i->dev, i->ino);
-	i->next = cache[hv];
-	cache[hv] = i;
+		i->nr_kids = 0; /* don't walk */
 
-	return 0;
+	return irmap_cache_add(i);
 }
 
 /*
- * Update list of children, but don't cache any. Later
- * we'll scan them one-by-one and cache.
+ * Index of the scan paths and hints is built in one go by several
+ * forked walkers. The directories right under each path are the
+ * units of work, walkers pick them one by one, scan recursively and
+ * send back what they've found over pipes.
  */
-static int irmap_update_dir(struct irmap *t)
+#define IRMAP_MAX_WALKERS	8
+#define IRMAP_WALK_BUF		(64 << 10)
+#define IRMAP_DENTS_BUF		(16 << 10)
+
+struct irmap_unit {
+	char		*path;
+	bool		recurse;
+};
+
+static struct irmap_unit *units;
+static int nr_units;
+
+struct irmap_rec {
+	u32		dev;
+	u32		len;
+	u64		ino;
+	char		path[0];
+};
+
+struct irmap_walker {
+	pid_t		pid;
+	int		fd;
+	unsigned int	len;
+	char		*buf;
+};
+
+static bool index_built;
+
+static int irmap_add_unit(char *path, bool recurse)
+{
+	struct irmap_unit *u;
+
+	if (!path)
+		return -1;
+
+	if (xrealloc_safe(&units, (nr_units + 1) * sizeof(*units)))
+		return -1;
+
+	u = &units[nr_units++];
+	u->path = path;
+	u->recurse = recurse;
+	return 0;
+}
+
+static int irmap_add_root(struct irmap *r)
 {
-	int fd, nr = 0, mntns_root;
-	DIR *dfd;
+	int fd, mntns_root;
 	struct dirent *de;
+	DIR *d;
 
-	if (t->nr_kids >= 0)
+	/* Hints may well be missing */
+	if (irmap_update_stat(r))
+		return 0;
+	if (r->nr_kids == 0)
 		return 0;
 
-	mntns_root = get_service_fd(ROOT_FD_OFF);
+	if (irmap_add_unit(xstrdup(r->path), false))
+		return -1;
 
-	pr_debug("Refilling %s dir\n", t->path);
-	fd = openat(mntns_root, t->path + 1, O_RDONLY);
+	mntns_root = get_service_fd(ROOT_FD_OFF);
+	fd = openat(mntns_root, r->path + 1, O_RDONLY | O_DIRECTORY);
 	if (fd < 0) {
-		pr_perror("Can't open %s", t->path);
-		return -1;
+		pr_perror("Can't open %s", r->path);
+		return 0;
 	}
 
-	dfd = fdopendir(fd);
-	if (!dfd) {
-		pr_perror("Can't opendir %s", t->path);
+	d = fdopendir(fd);
+	if (!d) {
+		pr_perror("Can't opendir %s", r->path);
+		close(fd);
 		return -1;
 	}
 
-	errno = 0;
-	while ((de = readdir(dfd)) != NULL) {
-		struct irmap *k;
+	while ((de = readdir(d)) != NULL) {
+		struct stat st;
 
 		if (dir_dots(de))
 			continue;
 
-		nr++;
-		if (xrealloc_safe(&t->kids, nr * sizeof(struct irmap)))
-			goto out_err;
+		if (de->d_type == DT_UNKNOWN) {
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+				continue;
+			if (!S_ISDIR(st.st_mode))
+				continue;
+		} else if (de->d_type != DT_DIR)
+			continue;
+
+		if (irmap_add_unit(xsprintf("%s/%s", r->path, de->d_name), true))
+			goto err;
+	}
 
-		k = &t->kids[nr - 1];
+	closedir(d);
+	return 0;
 
-		k->kids = NULL;	 /* for xrealloc above */
-		k->ino = 0;	 /* for irmap_update_stat */
-		k->nr_kids = -1; /* for irmap_update_dir */
-		k->path = xsprintf("%s/%s", t->path, de->d_name);
-		if (!k->path)
-			goto out_err;
+err:
+	closedir(d);
+	return -1;
+}
+
+static struct irmap_walker *wk;
+
+static int irmap_walk_flush(void)
+{
+	char *buf = wk->buf;
+
+	while (wk->len) {
+		ssize_t ret;
+
+		ret = write(wk->fd, buf, wk->len);
+		if (ret <= 0) {
+			pr_perror("Can't send irmap entries");
+			return -1;
+		}
+
+		buf += ret;
+		wk->len -= ret;
 	}
 
-	if (errno) {
-		pr_perror("Readdir failed");
-		goto out_err;
+	return 0;
+}
+
+static int irmap_walk_note(struct stat *st, char *path, int plen)
+{
+	unsigned int size = round_up(sizeof(struct irmap_rec) + plen, sizeof(u64));
+	struct irmap_rec *r;
+
+	if (wk->len + size > IRMAP_WALK_BUF && irmap_walk_flush())
+		return -1;
+
+	r = (struct irmap_rec *)(wk->buf + wk->len);
+	r->dev = MKKDEV(major(st->st_dev), minor(st->st_dev));
+	r->ino = st->st_ino;
+	r->len = plen;
+	memcpy(r->path, path, plen);
+	wk->len += size;
+
+	return 0;
+}
+
+/*
+ * The trees may be deep, up to PATH_MAX / 2 levels, so the dents
+ * buffer of each level lives on the heap, not on the stack.
+ */
+static int irmap_walk(int dfd, char *path, int plen, bool recurse)
+{
+	char *dents;
+	struct linux_dirent64 {
+		u64		d_ino;
+		s64		d_off;
+		unsigned short	d_reclen;
+		unsigned char	d_type;
+		char		d_name[];
+	} *de;
+	int n, off, ret = 0;
+
+	dents = xmalloc(IRMAP_DENTS_BUF);
+	if (!dents)
+		return -1;
+
+	while ((n = syscall(SYS_getdents64, dfd, dents, IRMAP_DENTS_BUF)) > 0) {
+		for (off = 0; off < n; off += de->d_reclen) {
+			struct stat st;
+			int len, fd;
+
+			de = (void *)dents + off;
+			if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+				(de->d_name[1] == '.' && de->d_name[2] == '\0')))
+				continue;
+
+			len = snprintf(path + plen, PATH_MAX - plen, "/%s", de->d_name);
+			if (plen + len >= PATH_MAX)
+				continue;
+
+			if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+				continue;
+			if (irmap_walk_note(&st, path, plen + len))
+				goto err;
+
+			if (!recurse || !S_ISDIR(st.st_mode))
+				continue;
+
+			fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (fd < 0)
+				continue;
+
+			ret = irmap_walk(fd, path, plen + len, true);
+			close(fd);
+			if (ret)
+				goto err;
+		}
 	}
 
-	closedir(dfd);
-	close(fd);
-	t->nr_kids = nr;
+	/* Unreadable dirs are skipped, as unstatable files are */
+	path[plen] = '\0';
+	if (n < 0)
+		pr_debug("Can't read %s: %m\n", path);
+	xfree(dents);
 	return 0;
 
-out_err:
-	xfree(t->kids);
-	closedir(dfd);
-	close(fd);
+err:
+	xfree(dents);
 	return -1;
 }
 
-static struct irmap *irmap_scan(struct irmap *t, unsigned int dev, unsigned long ino)
+static int irmap_walker(atomic_t *next)
+{
+	int idx, fd, mntns_root = get_service_fd(ROOT_FD_OFF);
+	char path[PATH_MAX];
+
+	while ((idx = atomic_inc_return(next) - 1) < nr_units) {
+		struct irmap_unit *u = &units[idx];
+
+		fd = openat(mntns_root, u->path + 1, O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			continue;
+
+		strlcpy(path, u->path, sizeof(path));
+		if (irmap_walk(fd, path, strlen(path), u->recurse)) {
+			close(fd);
+			return -1;
+		}
+		close(fd);
+	}
+
+	return irmap_walk_flush();
+}
+
+static int irmap_index_one(struct irmap_rec *r)
 {
 	struct irmap *c;
-	int i;
 
-	if (irmap_update_stat(t))
-		return NULL;
+	c = xmalloc(sizeof(*c));
+	if (!c)
+		return -1;
 
-	if (t->dev == dev && t->ino == ino)
-		return t;
+	c->path = xmalloc(r->len + 1);
+	if (!c->path) {
+		xfree(c);
+		return -1;
+	}
 
-	if (irmap_update_dir(t))
-		return NULL;
+	memcpy(c->path, r->path, r->len);
+	c->path[r->len] = '\0';
+	c->dev = r->dev;
+	c->ino = r->ino;
+	c->revalidate = false;
+	c->dumped = false;
+	c->nr_kids = 0;
 
-	for (i = 0; i < t->nr_kids; i++) {
-		c = irmap_scan(&t->kids[i], dev, ino);
-		if (c)
-			return c;
+	return irmap_cache_add(c);
+}
+
+/*
+ * Read what the walker has sent so far and put complete
+ * records into the cache. Returns 0 on EOF.
+ */
+static int irmap_index_read(struct irmap_walker *w)
+{
+	unsigned int off = 0;
+	ssize_t ret;
+
+	ret = read(w->fd, w->buf + w->len, IRMAP_WALK_BUF - w->len);
+	if (ret < 0) {
+		pr_perror("Can't read irmap entries");
+		return -1;
 	}
+	w->len += ret;
 
-	return NULL;
+	while (w->len - off >= sizeof(struct irmap_rec)) {
+		struct irmap_rec *r = (struct irmap_rec *)(w->buf + off);
+		unsigned int size = round_up(sizeof(*r) + r->len, sizeof(u64));
+
+		if (w->len - off < size)
+			break;
+		if (irmap_index_one(r))
+			return -1;
+		off += size;
+	}
+
+	memmove(w->buf, w->buf + off, w->len - off);
+	w->len -= off;
+
+	return ret ? 1 : 0;
+}
+
+static int irmap_build_index(void)
+{
+	struct irmap_walker walkers[IRMAP_MAX_WALKERS];
+	struct pollfd pfds[IRMAP_MAX_WALKERS];
+	int i, nr = 0, nr_walkers, live, ret = -1;
+	struct irmap_path_opt *o;
+	sigset_t blockmask, oldmask;
+	atomic_t *next;
+	struct irmap *h;
+
+	index_built = true;
+
+	/* Let's scan any user provided paths first; since the user told us
+	 * about them, hopefully they're more interesting than our hints.
+	 */
+	list_for_each_entry(o, &opts.irmap_scan_paths, node)
+		if (irmap_add_root(o->ir))
+			goto out_units;
+	for (h = hints; h->path; h++)
+		if (irmap_add_root(h))
+			goto out_units;
+
+	if (!nr_units)
+		return 0;
+
+	next = mmap(NULL, sizeof(*next), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (next == MAP_FAILED) {
+		pr_perror("Can't map irmap walkers counter");
+		goto out_units;
+	}
+	atomic_set(next, 0);
+
+	nr_walkers = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_walkers = min(nr_walkers, IRMAP_MAX_WALKERS);
+	nr_walkers = max(min(nr_walkers, nr_units), 1);
+
+	/*
+	 * Parasites may sit in tasks at this point and their SIGCHLD
+	 * handler doesn't expect anyone else to exit, see cr_system.
+	 */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &blockmask, &oldmask) == -1) {
+		pr_perror("Can not set mask of blocked signals");
+		goto out_unmap;
+	}
+
+	pr_info("Building index of %d dirs with %d walkers\n", nr_units, nr_walkers);
+
+	for (nr = 0; nr < nr_walkers; nr++) {
+		struct irmap_walker *w = &walkers[nr];
+		int p[2];
+
+		w->buf = xmalloc(IRMAP_WALK_BUF);
+		if (!w->buf)
+			goto out_kill;
+
+		if (pipe(p)) {
+			pr_perror("Can't make irmap pipe");
+			xfree(w->buf);
+			goto out_kill;
+		}
+
+		w->pid = fork();
+		if (w->pid < 0) {
+			pr_perror("Can't fork irmap walker");
+			close(p[0]);
+			close(p[1]);
+			xfree(w->buf);
+			goto out_kill;
+		}
+
+		if (w->pid == 0) {
+			for (i = 0; i < nr; i++)
+				close(walkers[i].fd);
+			close(p[0]);
+
+			w->fd = p[1];
+			w->len = 0;
+			wk = w;
+			ret = irmap_walker(next);
+			log_flush();
+			_exit(ret ? 1 : 0);
+		}
+
+		close(p[1]);
+		w->fd = p[0];
+		w->len = 0;
+		pfds[nr].fd = w->fd;
+		pfds[nr].events = POLLIN;
+	}
+
+	for (live = nr; live; ) {
+		if (poll(pfds, nr, -1) < 0) {
+			pr_perror("Can't poll irmap walkers");
+			goto out_kill;
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (pfds[i].fd < 0 || !pfds[i].revents)
+				continue;
+
+			ret = irmap_index_read(&walkers[i]);
+			if (ret < 0)
+				goto out_kill;
+			if (ret == 0) {
+				pfds[i].fd = -1;
+				live--;
+			}
+		}
+	}
+
+	ret = 0;
+	goto out_wait;
+
+out_kill:
+	ret = -1;
+	for (i = 0; i < nr; i++)
+		kill(walkers[i].pid, SIGKILL);
+out_wait:
+	for (i = 0; i < nr; i++) {
+		int status;
+
+		if (waitpid(walkers[i].pid, &status, 0) < 0) {
+			pr_perror("Can't wait irmap walker %d", walkers[i].pid);
+			ret = -1;
+		} else if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			pr_err("irmap walker %d failed (%#x)\n", walkers[i].pid, status);
+			ret = -1;
+		}
+
+		close(walkers[i].fd);
+		xfree(walkers[i].buf);
+	}
+
+	if (sigprocmask(SIG_SETMASK, &oldmask, NULL) == -1) {
+		pr_perror("Can not unset mask of blocked signals");
+		ret = -1;
+	}
+out_unmap:
+	munmap(next, sizeof(*next));
+out_units:
+	for (i = 0; i < nr_units; i++)
+		xfree(units[i].path);
+	xfree(units);
+	units = NULL;
+	nr_units = 0;
+
+	pr_info("Index has %lu entries\n", cache_nr);
+	return ret;
 }
 
 static int irmap_revalidate(struct irmap *c, struct irmap **p)
@@ -214,19 +621,41 @@ static int irmap_revalidate(struct irmap *c, struct irmap **p)
 invalid:
 	pr_debug("\t%x:%lx is invalid\n", c->dev, c->ino);
 	*p = c->next;
+	cache_nr--;
 	xfree(c->path);
 	xfree(c);
 	return 1;
 }
 
+static struct irmap *irmap_cache_lookup(unsigned int s_dev, unsigned long i_ino)
+{
+	struct irmap *c, **p;
+
+	if (!cache)
+		return NULL;
+
+	p = &cache[irmap_hashfn(s_dev, i_ino, cache_bits)];
+	while ((c = *p) != NULL) {
+		if (!(c->dev == s_dev && c->ino == i_ino)) {
+			p = &c->next;
+			continue;
+		}
+
+		if (c->revalidate && irmap_revalidate(c, p))
+			continue;
+
+		return c;
+	}
+
+	return NULL;
+}
+
 static bool doing_predump = false;
 
 char *irmap_lookup(unsigned int s_dev, unsigned long i_ino)
 {
-	struct irmap *c, *h, **p;
+	struct irmap *c;
 	char *path = NULL;
-	int hv;
-	struct irmap_path_opt *o;
 
 	pr_debug("Resolving %x:%lx path\n", s_dev, i_ino);
 
@@ -242,42 +671,25 @@ char *irmap_lookup(unsigned int s_dev, unsigned long i_ino)
 
 	timing_start(TIME_IRMAP_RESOLVE);
 
-	hv = irmap_hashfn(s_dev, i_ino);
-	for (p = &cache[hv]; *p; ) {
-		c = *p;
-		if (!(c->dev == s_dev && c->ino == i_ino)) {
-			p = &(*p)->next;
-			continue;
-		}
-
-		if (c->revalidate && irmap_revalidate(c, p))
-			continue;
-
+	c = irmap_cache_lookup(s_dev, i_ino);
+	if (c) {
 		pr_debug("\tFound %s in cache\n", c->path);
 		path = c->path;
 		goto out;
 	}
 
-	/* Let's scan any user provided paths first; since the user told us
-	 * about them, hopefully they're more interesting than our hints.
+	/*
+	 * Not in cache, so either the index is not built yet, or the
+	 * entries loaded from the previous dump are stale. Anyway, the
+	 * file system has to be scanned, but only once.
 	 */
-	list_for_each_entry(o, &opts.irmap_scan_paths, node) {
-		c = irmap_scan(o->ir, s_dev, i_ino);
-		if (c) {
-			pr_debug("\tScanned %s\n", c->path);
-			path = c->path;
-			goto out;
-		}
-	}
+	if (index_built || irmap_build_index())
+		goto out;
 
-	for (h = hints; h->path; h++) {
-		pr_debug("Scanning %s hint\n", h->path);
-		c = irmap_scan(h, s_dev, i_ino);
-		if (c) {
-			pr_debug("\tScanned %s\n", c->path);
-			path = c->path;
-			goto out;
-		}
+	c = irmap_cache_lookup(s_dev, i_ino);
+	if (c) {
+		pr_debug("\tScanned %s\n", c->path);
+		path = c->path;
 	}
 
 out:
@@ -336,6 +748,39 @@ int irmap_predump_prep(void)
 	return __mntns_get_root_fd(root_item->pid.real) < 0 ? -1 : 0;
 }
 
+static int irmap_dump_index(struct cr_img *img)
+{
+	IrmapCacheEntry ic = IRMAP_CACHE_ENTRY__INIT;
+	unsigned long h;
+	struct irmap *c;
+
+	if (!cache)
+		return 0;
+
+	pr_info("Saving irmap index of %lu entries\n", cache_nr);
+
+	for (h = 0; h < (1UL << cache_bits); h++) {
+		for (c = cache[h]; c; c = c->next) {
+			/*
+			 * Entries loaded from the previous image and not
+			 * looked at since may be stale, and the queued ones
+			 * are in the image already.
+			 */
+			if (c->revalidate || c->dumped)
+				continue;
+
+			ic.dev = c->dev;
+			ic.inode = c->ino;
+			ic.path = c->path;
+
+			if (pb_write_one(img, &ic, PB_IRMAP_CACHE))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
 int irmap_predump_run(void)
 {
 	int ret = 0;
@@ -358,6 +803,7 @@ int irmap_predump_run(void)
 
 		if (ip->fh.path) {
 			IrmapCacheEntry ic = IRMAP_CACHE_ENTRY__INIT;
+			struct irmap *c;
 
 			pr_info("Irmap cache %x:%lx -> %s\n", ip->dev, ip->ino, ip->fh.path);
 			ic.dev = ip->dev;
@@ -367,9 +813,20 @@ int irmap_predump_run(void)
 			ret = pb_write_one(img, &ic, PB_IRMAP_CACHE);
 			if (ret)
 				break;
+
+			c = irmap_cache_lookup(ip->dev, ip->ino);
+			if (c)
+				c->dumped = true;
 		}
 	}
 
+	/*
+	 * Keep the whole index for the next (pre-)dump, the entries
+	 * are revalidated one by one when found there.
+	 */
+	if (!ret && index_built)
+		ret = irmap_dump_index(img);
+
 	close_image(img);
 	return ret;
 }
@@ -377,7 +834,6 @@ int irmap_predump_run(void)
 static int irmap_cache_one(IrmapCacheEntry *ie)
 {
 	struct irmap *ic;
-	unsigned hv;
 
 	ic = xmalloc(sizeof(*ic));
 	if (!ic)
@@ -392,6 +848,7 @@ static int irmap_cache_one(IrmapCacheEntry *ie)
 	}
 
 	ic->nr_kids = 0;
+	ic->dumped = false;
 	/*
 	 * We've loaded entry from cache, thus we'll need to check
 	 * whether it's still valid when find it in cache.
@@ -400,11 +857,7 @@ static int irmap_cache_one(IrmapCacheEntry *ie)
 
 	pr_debug("Pre-cache %x:%lx -> %s\n", ic->dev, ic->ino, ic->path);
 
-	hv = irmap_hashfn(ic->dev, ic->ino);
-	ic->next = cache[hv];
-	cache[hv] = ic;
-
-	return 0;
+	return irmap_cache_add(ic);
 }
 
 static int open_irmap_cache(struct cr_img **img)
@@ -8,47 +8,48 @@
 #include "kcmp-ids.h"
 
 /*
- * We track shared files by global rbtree, where each node might
- * be a root for subtree. The reason for that is the nature of data
+ * We track shared objects in a hash table, where each entry might
+ * be a root of an rbtree. The reason for that is the nature of data
  * we obtain from operating system.
  *
  * Basically OS provides us two ways to distinguish files
  *
- *  - information obtained from fstat call
+ *  - information obtained from fstat call and fdinfo
  *  - shiny new sys_kcmp system call (which may compare the file descriptor
  *    pointers inside the kernel and provide us order info)
  *
  * So, to speedup procedure of searching for shared file descriptors
- * we use both techniques. From fstat call we get that named general file
- * IDs (genid) which are carried in the main rbtree.
+ * we use both techniques. From fstat and fdinfo we get a hash of
+ * what is the same for all descriptors of one file, the general
+ * file ID (genid), by which entries are hashed.
  *
  * In case if two genid are the same -- we need to use a second way and
  * call for sys_kcmp. Thus, if kernel tells us that files have identical
  * genid but in real they are different from kernel point of view -- we assign
  * a second unique key (subid) to such file descriptor and put it into a subtree.
  *
- * So the tree will look like
+ * So the table will look like
  *
- *               (root)
- *               genid-1
- *              /    \
- *         genid-2  genid-3
- *            / \    / \
+ *     [0] -> genid-1 -> genid-5
+ *     [1]
+ *     [2] -> genid-3
  *
- * Where each genid node might be a sub-rbtree as well
+ * Where each genid entry might be a sub-rbtree as well
  *
  *               (genid-N)
  *               /      \
  *           subid-1   subid-2
  *            / \       / \
  *
- * Carrying two rbtree at once allow us to minimize the number
- * of sys_kcmp syscalls, also to collect and dump file descriptors
- * in one pass.
+ * The better the genid is, the less kcmp calls are made: for a file
+ * seen for the first time there are none, for a shared one there's
+ * one per subtree level.
  */
 
+#define KID_HASH_MIN_BITS	6
+
 struct kid_entry {
-	struct rb_node	node;
+	struct kid_entry *next;		/* in the genid hash chain */
 
 	struct rb_root	subtree_root;
 	struct rb_node	subtree_node;
@@ -57,6 +58,18 @@ struct kid_entry {
 	struct kid_elem	elem;
 } __aligned(sizeof(long));
 
+static unsigned long nr_kcmp_calls;
+
+unsigned long kid_kcmp_calls(void)
+{
+	return nr_kcmp_calls;
+}
+
+static inline unsigned int kid_hashfn(u64 genid, unsigned int bits)
+{
+	return (genid * 0x9e37fffffffc0001ULL) >> (64 - bits);
+}
+
 static struct kid_entry *alloc_kid_entry(struct kid_tree *tree, struct kid_elem *elem)
 {
 	struct kid_entry *e;
@@ -71,7 +84,6 @@ static struct kid_entry *alloc_kid_entry(struct kid_tree *tree, struct kid_elem
 	/* Make sure no overflow here */
 	BUG_ON(!e->subid);
 
-	rb_init_node(&e->node);
 	rb_init_node(&e->subtree_node);
 	e->subtree_root = RB_ROOT;
 	rb_link_and_balance(&e->subtree_root, &e->subtree_node,
@@ -96,6 +108,7 @@ static u32 kid_generate_sub(struct kid_tree *tree, struct kid_entry *e,
 		int ret = syscall(SYS_kcmp, this->elem.pid, elem->pid, tree->kcmp_type,
 				this->elem.idx, elem->idx);
 
+		nr_kcmp_calls++;
 		parent = *new;
 		if (ret == 1)
 			node = node->rb_left, new = &((*new)->rb_left);
@@ -120,34 +133,52 @@ static u32 kid_generate_sub(struct kid_tree *tree, struct kid_entry *e,
 	return sub->subid;
 }
 
+static int kid_hash_grow(struct kid_tree *tree)
+{
+	unsigned int i, bits = tree->hash_bits ? tree->hash_bits + 1 : KID_HASH_MIN_BITS;
+	struct kid_entry **hash, *e, *n;
+
+	hash = xzalloc(sizeof(*hash) << bits);
+	if (!hash)
+		return -1;
+
+	for (i = 0; tree->hash && i < (1 << tree->hash_bits); i++)
+		for (e = tree->hash[i]; e; e = n) {
+			unsigned int hv = kid_hashfn(e->elem.genid, bits);
+
+			n = e->next;
+			e->next = hash[hv];
+			hash[hv] = e;
+		}
+
+	xfree(tree->hash);
+	tree->hash = hash;
+	tree->hash_bits = bits;
+	return 0;
+}
+
 u32 kid_generate_gen(struct kid_tree *tree,
 		struct kid_elem *elem, int *new_id)
 {
-	struct rb_node *node = tree->root.rb_node;
-	struct kid_entry *e = NULL;
+	struct kid_entry *e;
+	unsigned int hv;
 
-	struct rb_node **new = &tree->root.rb_node;
-	struct rb_node *parent = NULL;
+	if ((!tree->hash || tree->nr >= (1UL << tree->hash_bits)) &&
+	    kid_hash_grow(tree))
+		return 0;
 
-	while (node) {
-		struct kid_entry *this = rb_entry(node, struct kid_entry, node);
-
-		parent = *new;
-		if (elem->genid < this->elem.genid)
-			node = node->rb_left, new = &((*new)->rb_left);
-		else if (elem->genid > this->elem.genid)
-			node = node->rb_right, new = &((*new)->rb_right);
-		else
-			return kid_generate_sub(tree, this, elem, new_id);
-	}
+	hv = kid_hashfn(elem->genid, tree->hash_bits);
+	for (e = tree->hash[hv]; e; e = e->next)
+		if (e->elem.genid == elem->genid)
+			return kid_generate_sub(tree, e, elem, new_id);
 
 	e = alloc_kid_entry(tree, elem);
 	if (!e)
 		return 0;
 
-	rb_link_and_balance(&tree->root, &e->node, parent, new);
+	e->next = tree->hash[hv];
+	tree->hash[hv] = e;
+	tree->nr++;
 	*new_id = 1;
 	return e->subid;
-
 }
-
@@ -354,6 +354,92 @@ static int get_task_size(void)
 	return 0;
 }
 
+#define THP_SYSFS_DIR	"/sys/kernel/mm/transparent_hugepage"
+
+static int get_thp_size(void)
+{
+	unsigned long size;
+	FILE *f;
+
+	kdat.thp_size = 0;
+
+	if (access(THP_SYSFS_DIR, F_OK)) {
+		pr_debug("Transparent huge pages are not supported\n");
+		return 0;
+	}
+
+	/*
+	 * The hpage_pmd_size file appeared in v4.10, before
+	 * that the huge page is always one PMD worth of pages.
+	 */
+	size = PAGE_SIZE * (PAGE_SIZE / sizeof(void *));
+
+	f = fopen(THP_SYSFS_DIR "/hpage_pmd_size", "r");
+	if (f) {
+		if (fscanf(f, "%lu", &size) != 1) {
+			pr_err("Unable to parse hpage_pmd_size\n");
+			fclose(f);
+			return -1;
+		}
+		fclose(f);
+	}
+
+	kdat.thp_size = size;
+	pr_debug("Found THP size of %lx\n", kdat.thp_size);
+	return 0;
+}
+
+static int get_numa_nodes(void)
+{
+	unsigned int first, last;
+	char buf[64], *p;
+	int ret, fd;
+
+	kdat.has_numa = false;
+	kdat.numa_nodes = 1;
+
+	if (syscall(SYS_get_mempolicy, NULL, NULL, 0, NULL, 0) < 0) {
+		/* EPERM comes from seccomp-ed containers */
+		if (errno == ENOSYS || errno == EPERM) {
+			pr_debug("NUMA is not supported\n");
+			return 0;
+		}
+		pr_perror("Unexpected error from get_mempolicy()");
+		return -1;
+	}
+
+	kdat.has_numa = true;
+
+	fd = open("/sys/devices/system/node/possible", O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		pr_perror("Unable to open possible nodes list");
+		return -1;
+	}
+
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret < 0) {
+		pr_perror("Unable to read possible nodes list");
+		return -1;
+	}
+	buf[ret] = '\0';
+
+	/* The list looks like "0" or "0-3" or "0,2-3" */
+	p = strrchr(buf, ',');
+	p = p ? p + 1 : buf;
+	ret = sscanf(p, "%u-%u", &first, &last);
+	if (ret < 1) {
+		pr_err("Unable to parse possible nodes list %s\n", buf);
+		return -1;
+	}
+
+	kdat.numa_nodes = (ret == 2 ? last : first) + 1;
+	pr_debug("Found %u possible NUMA nodes\n", kdat.numa_nodes);
+	return 0;
+}
+
 int kerndat_fdinfo_has_lock()
 {
 	int fd, pfd = -1, exit_code = -1, len;
@@ -474,6 +560,8 @@ int kerndat_init(void)
 		ret = kerndat_fdinfo_has_lock();
 	if (!ret)
 		ret = get_task_size();
+	if (!ret)
+		ret = get_numa_nodes();
 	if (!ret)
 		ret = get_ipv6();
 	if (!ret)
@@ -505,6 +593,10 @@ int kerndat_init_rst(void)
 		ret = kerndat_has_memfd_create();
 	if (!ret)
 		ret = get_task_size();
+	if (!ret)
+		ret = get_thp_size();
+	if (!ret)
+		ret = get_numa_nodes();
 	if (!ret)
 		ret = get_ipv6();
 	if (!ret)
@@ -55,18 +55,11 @@ static int rtnl_return_err(int err, void *arg)
 	return err;
 }
 
-int do_rtnl_req(int nl, void *req, int size,
-		int (*receive_callback)(struct nlmsghdr *h, void *),
-		int (*error_callback)(int err, void *), void *arg)
+static int rtnl_send(int nl, void *req, int size)
 {
 	struct msghdr msg;
 	struct sockaddr_nl nladdr;
 	struct iovec iov;
-	static char buf[16384];
-	int err;
-
-	if (!error_callback)
-		error_callback = rtnl_return_err;
 
 	memset(&msg, 0, sizeof(msg));
 	msg.msg_name	= &nladdr;
@@ -81,11 +74,32 @@ int do_rtnl_req(int nl, void *req, int size,
 	iov.iov_len	= size;
 
 	if (sendmsg(nl, &msg, 0) < 0) {
-		err = -errno;
+		int err = -errno;
+
 		pr_perror("Can't send request message");
-		goto err;
+		return err;
 	}
 
+	return 0;
+}
+
+int do_rtnl_req(int nl, void *req, int size,
+		int (*receive_callback)(struct nlmsghdr *h, void *),
+		int (*error_callback)(int err, void *), void *arg)
+{
+	struct msghdr msg;
+	struct sockaddr_nl nladdr;
+	struct iovec iov;
+	static char buf[16384];
+	int err;
+
+	if (!error_callback)
+		error_callback = rtnl_return_err;
+
+	err = rtnl_send(nl, req, size);
+	if (err)
+		goto err;
+
 	iov.iov_base	= buf;
 	iov.iov_len	= sizeof(buf);
 
@@ -129,6 +143,63 @@ err:
 	return err;
 }
 
+/*
+ * Sends @nr requests at once, each of them should ask for an ACK.
+ * Errors are passed to @error_callback one by one, the first one it
+ * doesn't swallow is returned once all the requests are ACK-ed.
+ */
+int do_rtnl_batch(int nl, void *req, int size, int nr,
+		int (*error_callback)(int err, void *), void *arg)
+{
+	static char buf[16384];
+	struct nlmsghdr *hdr;
+	int len, ret = 0;
+
+	if (!error_callback)
+		error_callback = rtnl_return_err;
+
+	len = rtnl_send(nl, req, size);
+	if (len)
+		return len;
+
+	while (nr > 0) {
+		len = recv(nl, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			pr_perror("Error receiving nl report");
+			return ret;
+		}
+		if (len == 0) {
+			pr_err("Netlink socket closed with %d requests pending\n", nr);
+			return -1;
+		}
+
+		for (hdr = (struct nlmsghdr *)buf; NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+			struct nlmsgerr *err = NLMSG_DATA(hdr);
+
+			if (hdr->nlmsg_seq != CR_NLMSG_SEQ || hdr->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			nr--;
+			if (hdr->nlmsg_len - sizeof(*hdr) < sizeof(*err)) {
+				pr_err("ERROR truncated\n");
+				ret = ret ? : -1;
+				continue;
+			}
+
+			if (err->error) {
+				int cret = error_callback(err->error, arg);
+
+				ret = ret ? : cret;
+			}
+		}
+	}
+
+	return ret;
+}
+
 int addattr_l(struct nlmsghdr *n, int maxlen, int type, const void *data,
 		int alen)
 {
@@ -5,10 +5,13 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <limits.h>
+#include <ctype.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 
 #include <fcntl.h>
 
@@ -48,15 +51,20 @@ static void timediff(struct timeval *from, struct timeval *to)
 	}
 }
 
+static void __print_ts(struct timeval *t)
+{
+	timediff(&start, t);
+	snprintf(buffer, TS_BUF_OFF,
+			"(%02u.%06u)", (unsigned)t->tv_sec, (unsigned)t->tv_usec);
+	buffer[TS_BUF_OFF - 1] = ' '; /* kill the '\0' produced by snprintf */
+}
+
 static void print_ts(void)
 {
 	struct timeval t;
 
 	gettimeofday(&t, NULL);
-	timediff(&start, &t);
-	snprintf(buffer, TS_BUF_OFF,
-			"(%02u.%06u)", (unsigned)t.tv_sec, (unsigned)t.tv_usec);
-	buffer[TS_BUF_OFF - 1] = ' '; /* kill the '\0' produced by snprintf */
+	__print_ts(&t);
 }
 
 int log_get_fd(void)
@@ -122,6 +130,466 @@ char *log_first_err(void)
 	return first_err->s;
 }
 
+/*
+ * Deferred logging (--log-deferred). Instead of formatting every message
+ * and writing it out right away, the format pointer and the arguments are
+ * put into a per-process buffer and formatted in bulk later: when the
+ * buffer is full, before an error is printed, before the restored task
+ * jumps into the restorer and on exit. The parasite and forked tasks
+ * write to the log directly, so to keep the order it's also flushed
+ * before a parasite runs and before forking a task. The formats must
+ * stay around till the flush, so plugins flush it before they are
+ * unloaded. Nothing is shared between tasks, so no locking is needed.
+ * The records can also be decoded from a core file with
+ * scripts/criu-log-gdb.py.
+ */
+#define DLOG_BUF_SIZE		(16 << 20)
+
+struct dlog_rec {
+	u32		size;		/* with args, aligned to 8 */
+	u32		loglevel;
+	int		err;		/* errno for %m */
+	int		pad;
+	struct timeval	ts;
+	const char	*fmt;
+	u64		args[0];
+};
+
+static char *dlog_buf;
+static size_t dlog_head;
+static pid_t dlog_pid;
+
+enum {
+	DARG_NONE,	/* %% and %m */
+	DARG_INT,
+	DARG_LONG,
+	DARG_LLONG,
+	DARG_SIZE,
+	DARG_PTR,
+	DARG_DOUBLE,
+	DARG_STR,
+	DARG_BAD,	/* can't be deferred */
+};
+
+struct dlog_spec {
+	const char	*start;
+	int		len;
+	int		nr_stars;
+	bool		prec_star;
+	int		prec;
+	int		type;
+};
+
+/*
+ * Parses the conversion @p points to (the '%' char) and
+ * returns the pointer to the first char after it.
+ */
+static const char *dlog_parse_spec(const char *p, struct dlog_spec *s)
+{
+	int lng = 0;
+
+	s->start = p++;
+	s->nr_stars = 0;
+	s->prec_star = false;
+	s->prec = -1;
+	s->type = DARG_BAD;
+
+	while (*p && strchr("#0- +'", *p))
+		p++;
+
+	if (*p == '*') {
+		s->nr_stars++;
+		p++;
+	} else
+		while (isdigit(*p))
+			p++;
+
+	if (*p == '$') /* positional args */
+		goto out;
+
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			s->nr_stars++;
+			s->prec_star = true;
+			p++;
+		} else {
+			s->prec = 0;
+			while (isdigit(*p))
+				s->prec = s->prec * 10 + *p++ - '0';
+		}
+	}
+
+	switch (*p) {
+	case 'h':
+		if (*++p == 'h')
+			p++;
+		break;
+	case 'l':
+		lng = 1;
+		if (*++p == 'l') {
+			lng = 2;
+			p++;
+		}
+		break;
+	case 'j':
+		lng = 2;
+		p++;
+		break;
+	case 'z':
+	case 't':
+		lng = 3;
+		p++;
+		break;
+	case 'L':
+		lng = 4;
+		p++;
+		break;
+	}
+
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+		if (lng == 0)
+			s->type = DARG_INT;
+		else if (lng == 1)
+			s->type = DARG_LONG;
+		else if (lng == 2)
+			s->type = DARG_LLONG;
+		else if (lng == 3)
+			s->type = DARG_SIZE;
+		break;
+	case 'c':
+		if (lng == 0)
+			s->type = DARG_INT;
+		break;
+	case 'p':
+		if (lng == 0)
+			s->type = DARG_PTR;
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		if (lng == 0 || lng == 1)
+			s->type = DARG_DOUBLE;
+		break;
+	case 's':
+		if (lng == 0)
+			s->type = DARG_STR;
+		break;
+	case '%':
+	case 'm':
+		if (s->nr_stars == 0)
+			s->type = DARG_NONE;
+		break;
+	}
+
+	if (*p)
+		p++;
+out:
+	s->len = p - s->start;
+	return p;
+}
+
+static int dlog_write(int fd, char *buf, int size)
+{
+	int ret, off = 0;
+
+	while (off < size) {
+		ret = write(fd, buf + off, size - off);
+		if (ret <= 0)
+			return -1;
+		off += ret;
+	}
+
+	return 0;
+}
+
+static int dlog_put(char *to, int room, const char *from, int len)
+{
+	if (len > room)
+		len = room;
+	memcpy(to, from, len);
+	return len;
+}
+
+#define dlog_snprintf(o, n, fmt, st, ns, arg)			\
+	((ns) == 0 ? snprintf(o, n, fmt, arg) :			\
+	 (ns) == 1 ? snprintf(o, n, fmt, st[0], arg) :		\
+		     snprintf(o, n, fmt, st[0], st[1], arg))
+
+/*
+ * Formats the record the same way __print_on_level() would,
+ * returns the message length (with timestamp and pid prefix).
+ */
+static int dlog_format(struct dlog_rec *r)
+{
+	char *out = buffer + buf_off, spec[32];
+	int room = sizeof(buffer) - buf_off - 1, len = 0, ret;
+	const char *p = r->fmt, *lit;
+	u64 *a = r->args;
+	struct dlog_spec s;
+	int st[2], i;
+	double d;
+
+	if (current_loglevel >= LOG_TIMESTAMP)
+		__print_ts(&r->ts);
+
+	while (*p && len < room) {
+		lit = strchrnul(p, '%');
+		len += dlog_put(out + len, room - len, p, lit - p);
+		if (!*lit)
+			break;
+
+		p = dlog_parse_spec(lit, &s);
+		if (s.len >= sizeof(spec)) {
+			/* can't be, dlog_record() took care of it */
+			len += dlog_put(out + len, room - len, s.start, s.len);
+			continue;
+		}
+
+		memcpy(spec, s.start, s.len);
+		spec[s.len] = '\0';
+
+		for (i = 0; i < s.nr_stars; i++)
+			st[i] = (int)*a++;
+
+		ret = 0;
+		switch (s.type) {
+		case DARG_NONE:
+			if (spec[s.len - 1] == '%')
+				ret = dlog_put(out + len, room - len, "%", 1);
+			else {
+				const char *e = strerror(r->err);
+
+				ret = dlog_put(out + len, room - len, e, strlen(e));
+			}
+			break;
+		case DARG_INT:
+			ret = dlog_snprintf(out + len, room - len + 1, spec, st, s.nr_stars, (int)*a++);
+			break;
+		case DARG_LONG:
+			ret = dlog_snprintf(out + len, room - len + 1, spec, st, s.nr_stars, (long)*a++);
+			break;
+		case DARG_LLONG:
+			ret = dlog_snprintf(out + len, room - len + 1, spec, st, s.nr_stars, (long long)*a++);
+			break;
+		case DARG_SIZE:
+			ret = dlog_snprintf(out + len, room - len + 1, spec, st, s.nr_stars, (size_t)*a++);
+			break;
+		case DARG_PTR:
+			ret = dlog_snprintf(out + len, room - len + 1, spec, st, s.nr_stars, (void *)(unsigned long)*a++);
+			break;
+		case DARG_DOUBLE:
+			memcpy(&d, a++, sizeof(d));
+			ret = dlog_snprintf(out + len, room - len + 1, spec, st, s.nr_stars, d);
+			break;
+		case DARG_STR:
+			if (*a == (u64)-1) {
+				ret = dlog_snprintf(out + len, room - len + 1, spec, st, s.nr_stars, (char *)NULL);
+				a++;
+			} else {
+				u64 slen = *a++;
+
+				ret = dlog_snprintf(out + len, room - len + 1, spec, st, s.nr_stars, (char *)a);
+				a += round_up(slen + 1, sizeof(u64)) / sizeof(u64);
+			}
+			break;
+		}
+
+		if (ret > 0)
+			len += min(ret, room - len);
+	}
+
+	return buf_off + len;
+}
+
+void log_flush(void)
+{
+	static char out[64 << 10];
+	size_t pos = 0, olen = 0;
+	int fd, size, __errno = errno;
+
+	if (!dlog_buf || dlog_pid != getpid())
+		goto out;
+
+	fd = log_get_fd();
+	while (pos < dlog_head) {
+		struct dlog_rec *r = (struct dlog_rec *)(dlog_buf + pos);
+
+		size = dlog_format(r);
+		if (olen + size > sizeof(out)) {
+			dlog_write(fd, out, olen);
+			olen = 0;
+		}
+		memcpy(out + olen, buffer, size);
+		olen += size;
+		pos += r->size;
+	}
+
+	if (olen)
+		dlog_write(fd, out, olen);
+out:
+	dlog_head = 0;
+	errno = __errno;
+}
+
+/*
+ * Puts the message into the buffer, returns -1 if
+ * it should be printed right away.
+ */
+static int dlog_record(unsigned int loglevel, const char *format, va_list params)
+{
+	struct dlog_rec *r;
+	const char *p;
+	struct dlog_spec s;
+	char *pos, *end;
+	va_list args;
+	int i, val = 0;
+
+	if (dlog_pid != getpid()) {
+		/* We're forked, the records are not ours */
+		dlog_pid = getpid();
+		dlog_head = 0;
+	}
+
+again:
+	r = (struct dlog_rec *)(dlog_buf + dlog_head);
+	pos = (char *)r->args;
+	end = dlog_buf + DLOG_BUF_SIZE;
+	if (pos > end)
+		goto full;
+
+	va_copy(args, params);
+	p = format;
+	while ((p = strchr(p, '%'))) {
+		p = dlog_parse_spec(p, &s);
+		if (s.type == DARG_BAD || s.len >= 32)
+			goto bad;
+		if (s.type == DARG_NONE)
+			continue;
+
+		if (pos + (s.nr_stars + 1) * sizeof(u64) > end)
+			goto full_va;
+
+		for (i = 0; i < s.nr_stars; i++) {
+			val = va_arg(args, int);
+			*(u64 *)pos = val;
+			pos += sizeof(u64);
+		}
+		if (s.prec_star)
+			s.prec = val;
+
+		switch (s.type) {
+		case DARG_INT:
+			*(u64 *)pos = va_arg(args, int);
+			break;
+		case DARG_LONG:
+			*(u64 *)pos = va_arg(args, long);
+			break;
+		case DARG_LLONG:
+			*(u64 *)pos = va_arg(args, long long);
+			break;
+		case DARG_SIZE:
+			*(u64 *)pos = va_arg(args, size_t);
+			break;
+		case DARG_PTR:
+			*(u64 *)pos = (unsigned long)va_arg(args, void *);
+			break;
+		case DARG_DOUBLE: {
+			double d = va_arg(args, double);
+
+			memcpy(pos, &d, sizeof(d));
+			break;
+		}
+		case DARG_STR: {
+			char *str = va_arg(args, char *);
+			size_t len;
+
+			if (!str) {
+				*(u64 *)pos = (u64)-1;
+				break;
+			}
+
+			len = s.prec >= 0 ? strnlen(str, s.prec) : strlen(str);
+			if (pos + sizeof(u64) + len + 1 > end)
+				goto full_va;
+
+			*(u64 *)pos = len;
+			memcpy(pos + sizeof(u64), str, len);
+			pos[sizeof(u64) + len] = '\0';
+			pos += round_up(len + 1, sizeof(u64));
+			break;
+		}
+		}
+		pos += sizeof(u64);
+	}
+	va_end(args);
+
+	r->size = round_up(pos - (char *)r, sizeof(u64));
+	r->loglevel = loglevel;
+	r->err = errno;
+	gettimeofday(&r->ts, NULL);
+	r->fmt = format;
+	dlog_head += r->size;
+	return 0;
+
+full_va:
+	va_end(args);
+full:
+	if (dlog_head == 0)
+		/* The message is too big to be deferred */
+		return -1;
+
+	log_flush();
+	goto again;
+bad:
+	va_end(args);
+	return -1;
+}
+
+/*
+ * Formatting the records is not async-signal-safe, and we may well be
+ * in the middle of malloc() here, so they are only left in the core.
+ * Errors flush the buffer before being printed, so the log has all up
+ * to the last one anyway.
+ */
+static void dlog_sighandler(int sig)
+{
+	static char msg[] = "Deferred log records are left in the core, "
+			    "see scripts/criu-log-gdb.py\n";
+
+	if (dlog_head && dlog_pid == getpid())
+		dlog_write(log_get_fd(), msg, sizeof(msg) - 1);
+	raise(sig);
+}
+
+static int dlog_init(void)
+{
+	struct sigaction sa = {
+		.sa_handler	= dlog_sighandler,
+		.sa_flags	= SA_RESETHAND | SA_NODEFER,
+	};
+	int sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT }, i;
+
+	if (dlog_buf)
+		return 0;
+
+	dlog_buf = mmap(NULL, DLOG_BUF_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (dlog_buf == MAP_FAILED) {
+		dlog_buf = NULL;
+		pr_perror("Can't allocate deferred log buffer");
+		return -1;
+	}
+
+	dlog_pid = getpid();
+
+	sigemptyset(&sa.sa_mask);
+	for (i = 0; i < ARRAY_SIZE(sigs); i++)
+		sigaction(sigs[i], &sa, NULL);
+
+	atexit(log_flush);
+	return 0;
+}
+
 int log_init(const char *output)
 {
 	int new_logfd, fd;
@@ -129,6 +597,9 @@ int log_init(const char *output)
 	gettimeofday(&start, NULL);
 	reset_buf_off();
 
+	if (opts.log_deferred && dlog_init())
+		return -1;
+
 	if (output && !strncmp(output, "-", 2)) {
 		new_logfd = dup(STDOUT_FILENO);
 		if (new_logfd < 0) {
@@ -171,6 +642,10 @@ int log_init_by_pid(void)
 	 */
 	reset_buf_off();
 
+	/* The deferred records left are the parent's ones */
+	dlog_pid = getpid();
+	dlog_head = 0;
+
 	if (!opts.log_file_per_pid) {
 		buf_off += snprintf(buffer + buf_off, sizeof buffer - buf_off, "%6d: ", getpid());
 		return 0;
@@ -186,6 +661,7 @@ int log_init_by_pid(void)
 
 void log_fini(void)
 {
+	log_flush();
 	close_service_fd(LOG_FD_OFF);
 }
 
@@ -213,6 +689,15 @@ static void __print_on_level(unsigned int loglevel, const char *format, va_list
 	} else {
 		if (loglevel > current_loglevel)
 			return;
+
+		if (dlog_buf) {
+			if (loglevel != LOG_ERROR &&
+			    !dlog_record(loglevel, format, params))
+				return;
+			/* Keep the order of messages */
+			log_flush();
+		}
+
 		fd = log_get_fd();
 		if (current_loglevel >= LOG_TIMESTAMP)
 			print_ts();
@@ -24,6 +24,7 @@
 #include "files-reg.h"
 #include "pagemap-cache.h"
 #include "fault-injection.h"
+#include "mempolicy.h"
 
 #include "protobuf.h"
 #include "images/pagemap.pb-c.h"
@@ -256,7 +257,9 @@ static int xfer_pages(struct page_pipe *pp, struct page_xfer *xfer)
 	 *           pre-dump action (see pre_dump_one_task)
 	 */
 	timing_start(TIME_MEMWRITE);
+	span_start(SPAN_PAGE_XFER);
 	ret = page_xfer_dump_pages(xfer, pp, 0);
+	span_stop(SPAN_PAGE_XFER);
 	timing_stop(TIME_MEMWRITE);
 
 	return ret;
@@ -314,7 +317,7 @@ static int __parasite_dump_pages_seized(struct pstree_item *item,
 		 * right here. For pre-dumps the pp will be taken by the
 		 * caller and handled later.
 		 */
-		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, item->pid.virt);
+		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, item->pid.virt, 0);
 		if (ret < 0)
 			goto out_pp;
 	} else {
@@ -350,6 +353,12 @@ static int __parasite_dump_pages_seized(struct pstree_item *item,
 		if (vma_area_is(vma_area, VMA_ANON_SHARED))
 			ret = add_shmem_area(item->pid.real, vma_area->e, map);
 		else {
+			if (!mdc->pre_dump &&
+			    !vma_entry_is(vma_area->e, VMA_AREA_AIORING)) {
+				ret = dump_vma_page_nodes(item->pid.real, vma_area, map);
+				if (ret)
+					goto out_xfer;
+			}
 again:
 			ret = generate_iovs(vma_area, pp, map, &off,
 				has_parent);
@@ -499,6 +508,9 @@ int prepare_mm_pid(struct pstree_item *i)
 			ri->vmas.priv_size += vma_area_len(vma);
 			if (vma->e->flags & MAP_GROWSDOWN)
 				ri->vmas.priv_size += PAGE_SIZE;
+			/* A room to align the vma in premap_priv_vmas() */
+			if (vma_entry_can_thp(vma->e, kdat.thp_size))
+				ri->vmas.priv_size += kdat.thp_size - PAGE_SIZE;
 		}
 
 		pr_info("vma 0x%"PRIx64" 0x%"PRIx64"\n", vma->e->start, vma->e->end);
@@ -519,6 +531,36 @@ int prepare_mm_pid(struct pstree_item *i)
 	return ret;
 }
 
+/*
+ * Huge page advises should be set before the vma content is
+ * restored, otherwise page faults from restore_priv_vma_content()
+ * populate it with small pages and the restored task gets its
+ * huge pages back only when (and if) khugepaged collapses them.
+ * The rest of madvise() bits are set by restorer.
+ */
+static int vma_premap_madvise(struct vma_area *vma, void *addr, unsigned long size)
+{
+	int adv;
+
+	if (!kdat.thp_size || !vma->e->has_madv)
+		return 0;
+
+	if (vma->e->madv & (1ul << MADV_HUGEPAGE))
+		adv = MADV_HUGEPAGE;
+	else if (vma->e->madv & (1ul << MADV_NOHUGEPAGE))
+		adv = MADV_NOHUGEPAGE;
+	else
+		return 0;
+
+	if (madvise(addr, size, adv)) {
+		pr_perror("Unable to set huge page advise %d on %p-%p",
+				adv, addr, addr + size);
+		return -1;
+	}
+
+	return 0;
+}
+
 /* Map a private vma, if it is not mapped by a parent yet */
 static int map_private_vma(struct pstree_item *t,
 		struct vma_area *vma, void **tgt_addr,
@@ -528,6 +570,7 @@ static int map_private_vma(struct pstree_item *t,
 	void *addr, *paddr = NULL;
 	unsigned long nr_pages, size;
 	struct vma_area *p = *pvma;
+	bool thp = vma_entry_can_thp(vma->e, kdat.thp_size);
 
 	if (vma_area_is(vma, VMA_FILE_PRIVATE)) {
 		ret = vma->vm_open(t->pid.virt, vma);
@@ -581,6 +624,19 @@ static int map_private_vma(struct pstree_item *t,
 	}
 
 	size = vma_entry_len(vma->e);
+	if (thp) {
+		unsigned long off;
+
+		/*
+		 * Put the vma at the same offset within a huge page
+		 * as it will have in the restored task. The parent's
+		 * copy (if any) is aligned the same way, so mremap()
+		 * below moves whole huge pages too.
+		 */
+		off = (vma->e->start - (unsigned long)*tgt_addr) & (kdat.thp_size - 1);
+		*tgt_addr += off;
+	}
+
 	if (paddr == NULL) {
 		int flag = 0;
 		/*
@@ -625,6 +681,12 @@ static int map_private_vma(struct pstree_item *t,
 		*pvma = list_entry(p->list.next, struct vma_area, list);
 	}
 
+	if (vma_premap_madvise(vma, addr, size))
+		return -1;
+
+	if (premap_vma_mempolicy(vma, addr))
+		return -1;
+
 	vma->premmaped_addr = (unsigned long) addr;
 	pr_debug("\tpremap %#016"PRIx64"-%#016"PRIx64" -> %016lx\n",
 		vma->e->start, vma->e->end, (unsigned long)addr);
@@ -694,7 +756,10 @@ static int restore_priv_vma_content(struct pstree_item *t)
 
 	vma = list_first_entry(vmas, struct vma_area, list);
 
+	/* Loads the pagemaps of the parent images as well */
+	span_start(SPAN_RST_PAGEMAPS);
 	ret = open_page_read(t->pid.virt, &pr, PR_TASK);
+	span_stop(SPAN_RST_PAGEMAPS);
 	if (ret <= 0)
 		return -1;
 
@@ -746,6 +811,7 @@ static int restore_priv_vma_content(struct pstree_item *t)
 			set_bit(off, vma->page_bitmap);
 			if (vma->ppage_bitmap) { /* inherited vma */
 				clear_bit(off, vma->ppage_bitmap);
+				vma_prefer_page_node(vma, va, 1);
 
 				ret = pr.read_pages(&pr, va, 1, buf);
 				if (ret < 0)
@@ -774,6 +840,7 @@ static int restore_priv_vma_content(struct pstree_item *t)
 				 */
 
 				nr = min_t(int, nr_pages - i, (vma->e->end - va) / PAGE_SIZE);
+				nr = vma_prefer_page_node(vma, va, nr);
 
 				ret = pr.read_pages(&pr, va, nr, p);
 				if (ret < 0)
@@ -874,6 +941,10 @@ int prepare_mappings(struct pstree_item *t)
 	if (ret < 0)
 		goto out;
 
+	ret = restore_vmas_mempolicy(vmas);
+	if (ret < 0)
+		goto out;
+
 	if (old_premmapped_addr) {
 		ret = munmap(old_premmapped_addr, old_premmapped_len);
 		if (ret < 0)
@@ -0,0 +1,424 @@
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "asm/bitops.h"
+#include "asm/types.h"
+#include "cr_options.h"
+#include "kerndat.h"
+#include "xmalloc.h"
+#include "mman.h"
+#include "vma.h"
+#include "mem.h"
+#include "parasite.h"
+#include "parasite-syscall.h"
+#include "mempolicy.h"
+
+#include "images/core.pb-c.h"
+#include "images/vma.pb-c.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "mpol: "
+
+/*
+ * Nodemasks are kept in images as arrays of 64-bit words, so
+ * that they do not depend on the sizeof(long) of the dumper.
+ */
+#define MPOL_WORD_BITS		64
+
+unsigned int mpol_nodemask_longs(void)
+{
+	return BITS_TO_LONGS(kdat.numa_nodes);
+}
+
+static inline bool vma_has_mpol(VmaEntry *e)
+{
+	return vma_entry_is(e, VMA_AREA_REGULAR) && e->end <= kdat.task_size;
+}
+
+unsigned long mempolicy_args_size(struct vm_area_list *vmas)
+{
+	unsigned long mask_size = mpol_nodemask_longs() * sizeof(long);
+
+	if (!kdat.has_numa)
+		return 0;
+
+	return sizeof(struct parasite_dump_mpol_args) + mask_size +
+		vmas->nr * (sizeof(struct parasite_vma_mpol) + mask_size);
+}
+
+static int mpol_to_image(int mode, unsigned long *nodes,
+		protobuf_c_boolean *has_mode, uint32_t *img_mode,
+		size_t *n_img_nodes, uint64_t **img_nodes)
+{
+	unsigned int i, nr;
+
+	if (mode == MPOL_DEFAULT)
+		return 0;
+
+	nr = DIV_ROUND_UP(kdat.numa_nodes, MPOL_WORD_BITS);
+	*img_nodes = xzalloc(nr * sizeof(uint64_t));
+	if (!*img_nodes)
+		return -1;
+
+	for (i = 0; i < kdat.numa_nodes; i++)
+		if (test_bit(i, nodes))
+			(*img_nodes)[i / MPOL_WORD_BITS] |= 1ULL << (i % MPOL_WORD_BITS);
+
+	*n_img_nodes = nr;
+	*has_mode = true;
+	*img_mode = mode;
+
+	return 0;
+}
+
+static unsigned long *mpol_from_image(size_t n_img_nodes, uint64_t *img_nodes,
+		unsigned int *nr_longs)
+{
+	unsigned int i, nr_bits = n_img_nodes * MPOL_WORD_BITS;
+	unsigned long *nodes;
+
+	*nr_longs = max(mpol_nodemask_longs(), (unsigned int)BITS_TO_LONGS(nr_bits));
+	nodes = xzalloc(*nr_longs * sizeof(long));
+	if (!nodes)
+		return NULL;
+
+	for (i = 0; i < nr_bits; i++)
+		if (img_nodes[i / MPOL_WORD_BITS] & (1ULL << (i % MPOL_WORD_BITS)))
+			set_bit(i, nodes);
+
+	return nodes;
+}
+
+int parasite_dump_mempolicy_seized(struct parasite_ctl *ctl,
+		struct vm_area_list *vmas, TaskCoreEntry *tc)
+{
+	struct parasite_dump_mpol_args *args;
+	struct parasite_vma_mpol *vm;
+	struct vma_area *vma;
+	int i;
+
+	if (!kdat.has_numa)
+		return 0;
+
+	args = parasite_args_s(ctl, mempolicy_args_size(vmas));
+	args->nr_longs = mpol_nodemask_longs();
+	args->nr_vmas = 0;
+
+	list_for_each_entry(vma, &vmas->h, list) {
+		if (!vma_has_mpol(vma->e))
+			continue;
+
+		vm = pargs_mpol_vma(args, args->nr_vmas++);
+		vm->start = vma->e->start;
+	}
+
+	if (parasite_execute_daemon(PARASITE_CMD_DUMP_MEMPOLICY, ctl))
+		return -1;
+
+	pr_info("Task memory policy %d\n", args->mode);
+	if (mpol_to_image(args->mode, args->nodes, &tc->has_mpol_mode,
+				&tc->mpol_mode, &tc->n_mpol_nodes, &tc->mpol_nodes))
+		return -1;
+
+	i = 0;
+	list_for_each_entry(vma, &vmas->h, list) {
+		if (!vma_has_mpol(vma->e))
+			continue;
+
+		vm = pargs_mpol_vma(args, i++);
+		if (vm->mode != MPOL_DEFAULT)
+			pr_info("Memory policy %d for %#016"PRIx64"\n",
+					vm->mode, vma->e->start);
+
+		if (mpol_to_image(vm->mode, vm->nodes, &vma->e->has_mpol_mode,
+					&vma->e->mpol_mode, &vma->e->n_mpol_nodes,
+					&vma->e->mpol_nodes))
+			return -1;
+	}
+
+	return 0;
+}
+
+static int add_node_run(VmaEntry *e, uint64_t off, uint32_t node)
+{
+	size_t nr = e->n_node_runs;
+	VmaNodeRun *r = nr ? e->node_runs[nr - 1] : NULL;
+
+	if (r && r->node == node && r->off + r->nr_pages == off) {
+		r->nr_pages++;
+		return 0;
+	}
+
+	/* Grow the array twice each time it gets full */
+	if (!(nr & (nr - 1))) {
+		void *m;
+
+		m = xrealloc(e->node_runs, (nr ? nr * 2 : 1) * sizeof(VmaNodeRun *));
+		if (!m)
+			return -1;
+		e->node_runs = m;
+	}
+
+	r = xmalloc(sizeof(*r));
+	if (!r)
+		return -1;
+
+	vma_node_run__init(r);
+	r->off = off;
+	r->nr_pages = 1;
+	r->node = node;
+
+	e->node_runs[e->n_node_runs++] = r;
+	return 0;
+}
+
+#define NODES_BATCH	512
+
+static int flush_page_nodes(pid_t pid, VmaEntry *e, void **pages, int nr)
+{
+	int status[NODES_BATCH], i;
+
+	if (!nr)
+		return 0;
+
+	/* With NULL nodes move_pages() only reports where the pages are */
+	if (syscall(SYS_move_pages, pid, nr, pages, NULL, status, 0)) {
+		pr_perror("Unable to get nodes of %d's pages", pid);
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		/* E.g. -ENOENT for a swapped out page */
+		if (status[i] < 0)
+			continue;
+
+		if (add_node_run(e, ((unsigned long)pages[i] - e->start) / PAGE_SIZE, status[i]))
+			return -1;
+	}
+
+	return 0;
+}
+
+int dump_vma_page_nodes(pid_t pid, struct vma_area *vma, u64 *map)
+{
+	unsigned long pfn, nr_pages = vma_area_len(vma) / PAGE_SIZE;
+	void *pages[NODES_BATCH];
+	int nr = 0;
+
+	if (!opts.numa_pages || !kdat.has_numa)
+		return 0;
+
+	for (pfn = 0; pfn < nr_pages; pfn++) {
+		if (!should_dump_page(vma->e, map[pfn]))
+			continue;
+
+		pages[nr++] = decode_pointer(vma->e->start + pfn * PAGE_SIZE);
+		if (nr == NODES_BATCH) {
+			if (flush_page_nodes(pid, vma->e, pages, nr))
+				return -1;
+			nr = 0;
+		}
+	}
+
+	if (flush_page_nodes(pid, vma->e, pages, nr))
+		return -1;
+
+	pr_debug("%zu node runs for %#016"PRIx64"\n",
+			vma->e->n_node_runs, vma->e->start);
+	return 0;
+}
+
+void free_vma_mempolicy(struct vma_area *vma)
+{
+	size_t i;
+
+	for (i = 0; i < vma->e->n_node_runs; i++)
+		xfree(vma->e->node_runs[i]);
+	xfree(vma->e->node_runs);
+	xfree(vma->e->mpol_nodes);
+}
+
+int prepare_task_mempolicy(TaskCoreEntry *tc)
+{
+	unsigned int nr_longs;
+	unsigned long *nodes;
+	int ret;
+
+	if (!tc->has_mpol_mode)
+		return 0;
+
+	if (!kdat.has_numa) {
+		pr_warn("No NUMA support, task memory policy is not restored\n");
+		return 0;
+	}
+
+	nodes = mpol_from_image(tc->n_mpol_nodes, tc->mpol_nodes, &nr_longs);
+	if (!nodes)
+		return -1;
+
+	ret = syscall(SYS_set_mempolicy, tc->mpol_mode, nodes, mpol_maxnode(nr_longs));
+	xfree(nodes);
+	if (ret) {
+		/* The nodes we need may be missing on this machine */
+		if (errno == EINVAL) {
+			pr_warn("Unable to restore task memory policy %d\n", tc->mpol_mode);
+			return 0;
+		}
+		pr_perror("Unable to restore task memory policy %d", tc->mpol_mode);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int restore_vma_mempolicy(struct vma_area *vma, void *addr)
+{
+	VmaEntry *e = vma->e;
+	unsigned int nr_longs;
+	unsigned long *nodes;
+	int ret;
+
+	if (!e->has_mpol_mode || !kdat.has_numa)
+		return 0;
+
+	nodes = mpol_from_image(e->n_mpol_nodes, e->mpol_nodes, &nr_longs);
+	if (!nodes)
+		return -1;
+
+	ret = syscall(SYS_mbind, addr, vma_area_len(vma), e->mpol_mode,
+			nodes, mpol_maxnode(nr_longs), 0);
+	xfree(nodes);
+	if (ret) {
+		if (errno == EINVAL) {
+			pr_warn("Unable to restore memory policy %d for %#016"PRIx64"\n",
+					e->mpol_mode, e->start);
+			return 0;
+		}
+		pr_perror("Unable to restore memory policy %d for %#016"PRIx64,
+				e->mpol_mode, e->start);
+		return -1;
+	}
+
+	return 0;
+}
+
+static inline bool vma_places_pages(struct vma_area *vma)
+{
+	return opts.numa_pages && kdat.has_numa && vma->e->n_node_runs;
+}
+
+/*
+ * The vma policy (if any) overrides the task one, so for vmas which
+ * pages are placed on their nodes, the policy is set after the content
+ * is restored, see restore_vmas_mempolicy().
+ */
+int premap_vma_mempolicy(struct vma_area *vma, void *addr)
+{
+	if (vma_places_pages(vma))
+		return 0;
+
+	return restore_vma_mempolicy(vma, addr);
+}
+
+static int preferred_node = -1;
+static bool placement_failed;
+
+static int prefer_node(int node)
+{
+	unsigned long *nodes = NULL;
+	unsigned int nr_longs = 0;
+	int ret, mode = MPOL_DEFAULT;
+
+	if (node == preferred_node)
+		return 0;
+
+	if (node >= 0) {
+		nr_longs = max(mpol_nodemask_longs(), (unsigned int)BITS_TO_LONGS(node + 1));
+		nodes = xzalloc(nr_longs * sizeof(long));
+		if (!nodes)
+			return -1;
+
+		set_bit(node, nodes);
+		mode = MPOL_PREFERRED;
+	}
+
+	ret = syscall(SYS_set_mempolicy, mode, nodes, nodes ? mpol_maxnode(nr_longs) : 0);
+	xfree(nodes);
+	if (ret) {
+		pr_perror("Unable to prefer node %d", node);
+		return -1;
+	}
+
+	preferred_node = node;
+	return 0;
+}
+
+/*
+ * Called before @nr pages at @va are read into the premapped @vma.
+ * Makes the kernel allocate them on the node they were dumped from
+ * and returns how many of them live on this node.
+ */
+unsigned long vma_prefer_page_node(struct vma_area *vma, unsigned long va,
+		unsigned long nr)
+{
+	VmaEntry *e = vma->e;
+	uint64_t off = (va - e->start) / PAGE_SIZE;
+	size_t l = 0, r = e->n_node_runs;
+	VmaNodeRun *run;
+
+	if (!vma_places_pages(vma) || placement_failed)
+		return nr;
+
+	/* Find the first run which ends after the @off */
+	while (l < r) {
+		size_t m = (l + r) / 2;
+
+		run = e->node_runs[m];
+		if (run->off + run->nr_pages <= off)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	if (l == e->n_node_runs) {
+		/* The page wasn't seen on any node, let kernel decide */
+		if (prefer_node(-1) == 0)
+			return nr;
+	} else {
+		run = e->node_runs[l];
+		if (run->off > off) {
+			if (prefer_node(-1) == 0)
+				return min_t(unsigned long, nr, run->off - off);
+		} else if (prefer_node(run->node) == 0)
+			return min_t(unsigned long, nr, run->off + run->nr_pages - off);
+	}
+
+	/* Don't fail the restore, just stop placing pages */
+	pr_warn("Pages placement is turned off\n");
+	placement_failed = true;
+	return nr;
+}
+
+int restore_vmas_mempolicy(struct vm_area_list *vmas)
+{
+	struct vma_area *vma;
+
+	if (!opts.numa_pages || !kdat.has_numa)
+		return 0;
+
+	if (prefer_node(-1))
+		return -1;
+
+	list_for_each_entry(vma, &vmas->h, list) {
+		if (!vma_area_is_private(vma, kdat.task_size) ||
+				!vma_places_pages(vma))
+			continue;
+
+		if (restore_vma_mempolicy(vma, decode_pointer(vma->premmaped_addr)))
+			return -1;
+	}
+
+	return 0;
+}
@@ -93,18 +93,86 @@ static struct ext_mount *ext_mount_make_auto(char *val)
  */
 struct mount_info *mntinfo;
 
-static void mntinfo_add_list(struct mount_info *new)
+/*
+ * Mounts from the mntinfo list are hashed by mnt_id and s_dev, since
+ * they are looked up for every file, vma and socket. Children are
+ * hashed by the parent and the mountpoint for mount_resolve_path().
+ */
+#define MNT_HASH_BITS	12
+#define MNT_HASH_SIZE	(1 << MNT_HASH_BITS)
+
+static struct hlist_head mnt_id_hash[MNT_HASH_SIZE];
+static struct hlist_head mnt_sdev_hash[MNT_HASH_SIZE];
+static struct hlist_head mnt_path_hash[MNT_HASH_SIZE];
+
+static inline unsigned int mnt_hashfn(u32 key)
+{
+	return (key * 0x9e370001U) >> (32 - MNT_HASH_BITS);
+}
+
+static void mntinfo_hash(struct mount_info *m)
+{
+	/* The first mount in the list wins, as with the plain list walk */
+	if (!lookup_mnt_id(m->mnt_id))
+		hlist_add_head(&m->id_hash, &mnt_id_hash[mnt_hashfn(m->mnt_id)]);
+	if (!lookup_mnt_sdev(m->s_dev))
+		hlist_add_head(&m->sdev_hash, &mnt_sdev_hash[mnt_hashfn(m->s_dev)]);
+}
+
+void mntinfo_add_list(struct mount_info *new)
 {
+	struct mount_info *pm;
+
 	if (!mntinfo)
 		mntinfo = new;
 	else {
-		struct mount_info *pm;
-
 		/* Add to the tail. (FIXME -- make O(1) ) */
 		for (pm = mntinfo; pm->next != NULL; pm = pm->next)
 			;
 		pm->next = new;
 	}
+
+	for (pm = new; pm != NULL; pm = pm->next)
+		mntinfo_hash(pm);
+}
+
+#define MNT_PATH_HASH_INIT	2166136261U
+
+static inline unsigned int mnt_path_hash_add(unsigned int h, char c)
+{
+	return (h ^ (unsigned char)c) * 16777619U;
+}
+
+static inline struct hlist_head *mnt_path_chain(struct mount_info *parent, unsigned int h)
+{
+	return &mnt_path_hash[mnt_hashfn(h ^ (u32)((unsigned long)parent >> 4))];
+}
+
+/* Finds parent's child mounted at the first n chars of path */
+static struct mount_info *mnt_path_lookup(struct mount_info *parent,
+					  const char *path, size_t n, unsigned int h)
+{
+	struct mount_info *c;
+
+	hlist_for_each_entry(c, mnt_path_chain(parent, h), path_hash)
+		if (c->parent == parent && strlen(c->mountpoint + 1) == n &&
+		    !strncmp(c->mountpoint + 1, path, n))
+			return c;
+
+	return NULL;
+}
+
+static void mnt_path_hash_add_child(struct mount_info *c)
+{
+	unsigned int h = MNT_PATH_HASH_INIT;
+	size_t n;
+
+	for (n = 0; c->mountpoint[n + 1]; n++)
+		h = mnt_path_hash_add(h, c->mountpoint[n + 1]);
+
+	hlist_del_init(&c->path_hash);
+	if (!mnt_path_lookup(c->parent, c->mountpoint + 1, n, h))
+		hlist_add_head(&c->path_hash, mnt_path_chain(c->parent, h));
 }
 
 static struct mount_info *mnt_build_tree(struct mount_info *list, struct mount_info *roots_mp);
@@ -186,34 +254,29 @@ struct mount_info *lookup_overlayfs(char *rpath, unsigned int st_dev,
 	struct mount_info *m;
 
 	/* If the mnt_id and device number match for some entry, no fixup is needed */
-	for (m = mntinfo; m != NULL; m = m->next)
-		if (st_dev == kdev_to_odev(m->s_dev) && mnt_id == m->mnt_id)
-			return NULL;
+	m = lookup_mnt_id(mnt_id);
+	if (m && st_dev == kdev_to_odev(m->s_dev))
+		return NULL;
 
 	return __lookup_overlayfs(mntinfo, rpath, st_dev, st_ino, mnt_id);
 }
 
-static struct mount_info *__lookup_mnt_id(struct mount_info *list, int id)
+struct mount_info *lookup_mnt_id(unsigned int id)
 {
 	struct mount_info *m;
 
-	for (m = list; m != NULL; m = m->next)
+	hlist_for_each_entry(m, &mnt_id_hash[mnt_hashfn(id)], id_hash)
 		if (m->mnt_id == id)
 			return m;
 
 	return NULL;
 }
 
-struct mount_info *lookup_mnt_id(unsigned int id)
-{
-	return __lookup_mnt_id(mntinfo, id);
-}
-
 struct mount_info *lookup_mnt_sdev(unsigned int s_dev)
 {
 	struct mount_info *m;
 
-	for (m = mntinfo; m != NULL; m = m->next)
+	hlist_for_each_entry(m, &mnt_sdev_hash[mnt_hashfn(s_dev)], sdev_hash)
 		if (m->s_dev == s_dev)
 			return m;
 
@@ -222,27 +285,28 @@ struct mount_info *lookup_mnt_sdev(unsigned int s_dev)
 
 static struct mount_info *mount_resolve_path(struct mount_info *mntinfo_tree, const char *path)
 {
-	size_t pathlen = strlen(path);
 	struct mount_info *m = mntinfo_tree, *c;
+	unsigned int h = MNT_PATH_HASH_INIT;
+	size_t n = 0;
 
+	/*
+	 * Try the path prefixes ending at component boundaries, the
+	 * shortest first: if two siblings cover the path, the shorter
+	 * one was mounted later over the longer one. After going down
+	 * the same prefix is tried again for overmounts.
+	 */
 	while (1) {
-		list_for_each_entry(c, &m->children, siblings) {
-			size_t n;
-
-			n = strlen(c->mountpoint + 1);
-			if (n > pathlen)
+		if (!path[n] || path[n] == '/') {
+			c = mnt_path_lookup(m, path, n, h);
+			if (c) {
+				m = c;
 				continue;
-
-			if (strncmp(c->mountpoint + 1, path, min(n, pathlen)))
-				continue;
-			if (n < pathlen && path[n] != '/')
-				continue;
-
-			m = c;
-			break;
+			}
 		}
-		if (&c->siblings == &m->children)
+
+		if (!path[n])
 			break;
+		h = mnt_path_hash_add(h, path[n++]);
 	}
 
 	pr_debug("Path `%s' resolved to `%s' mountpoint\n", path, m->mountpoint);
@@ -340,14 +404,80 @@ static bool mounts_equal(struct mount_info *a, struct mount_info *b)
  */
 static char *mnt_roots;
 
+/*
+ * The list being built may be not in the mnt_id hash yet, so
+ * the parents are looked up in a sorted array of its mounts.
+ */
+struct mnt_id_ent {
+	int			mnt_id;
+	int			pos;
+	struct mount_info	*m;
+};
+
+static int mnt_id_ent_cmp(const void *a, const void *b)
+{
+	const struct mnt_id_ent *ea = a, *eb = b;
+
+	if (ea->mnt_id != eb->mnt_id)
+		return ea->mnt_id < eb->mnt_id ? -1 : 1;
+	return ea->pos - eb->pos;
+}
+
+static struct mnt_id_ent *mnt_id_sort(struct mount_info *list, int *nr)
+{
+	struct mnt_id_ent *ents;
+	struct mount_info *m;
+	int n = 0;
+
+	for (m = list; m != NULL; m = m->next)
+		n++;
+
+	ents = xmalloc(sizeof(*ents) * max(n, 1));
+	if (!ents)
+		return NULL;
+
+	for (n = 0, m = list; m != NULL; m = m->next, n++) {
+		ents[n].mnt_id = m->mnt_id;
+		ents[n].pos = n;
+		ents[n].m = m;
+	}
+
+	qsort(ents, n, sizeof(*ents), mnt_id_ent_cmp);
+	*nr = n;
+	return ents;
+}
+
+/* The first mount in the list with this id, as a list walk would find */
+static struct mount_info *mnt_id_find(struct mnt_id_ent *ents, int nr, int id)
+{
+	int lo = 0, hi = nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (ents[mid].mnt_id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo < nr && ents[lo].mnt_id == id) ? ents[lo].m : NULL;
+}
+
 static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mount_info *tmp_root_mount)
 {
 	struct mount_info *m, *root = NULL;
+	struct mnt_id_ent *ents;
+	int nr;
 
 	/*
 	 * Just resolve the mnt_id:parent_mnt_id relations
 	 */
 
+	ents = mnt_id_sort(list, &nr);
+	if (!ents)
+		return NULL;
+
 	pr_debug("\tBuilding plain mount tree\n");
 	for (m = list; m != NULL; m = m->next) {
 		struct mount_info *parent;
@@ -355,7 +485,7 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 		pr_debug("\t\tWorking on %d->%d\n", m->mnt_id, m->parent_mnt_id);
 
 		if (m->mnt_id != m->parent_mnt_id)
-			parent = __lookup_mnt_id(list, m->parent_mnt_id);
+			parent = mnt_id_find(ents, nr, m->parent_mnt_id);
 		else /* a circular mount reference. It's rootfs or smth like it. */
 			parent = NULL;
 
@@ -376,7 +506,7 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 					       "roots %d (@%s %s) %d (@%s %s) are not supported yet\n",
 					       root->mnt_id, root->mountpoint, root->root,
 					       m->mnt_id, m->mountpoint, m->root);
-					return NULL;
+					goto err;
 				}
 
 				/*
@@ -389,7 +519,7 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 				if (unlikely(!tmp_root_mount)) {
 					pr_err("Nested mount %d (@%s %s) w/o root insertion detected\n",
 					       m->mnt_id, m->mountpoint, m->root);
-					return NULL;
+					goto err;
 				}
 
 				pr_debug("Mountpoint %d (@%s) get parent %d (@%s)\n",
@@ -398,14 +528,17 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 			} else {
 				pr_err("No root found for mountpoint %d (@%s)\n",
 					m->mnt_id, m->mountpoint);
-				return NULL;
+				goto err;
 			}
 		}
 
 		m->parent = parent;
 		list_add_tail(&m->siblings, &parent->children);
+		mnt_path_hash_add_child(m);
 	}
 
+	xfree(ents);
+
 	if (!root) {
 		pr_err("No root found for tree\n");
 		return NULL;
@@ -414,9 +547,14 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 	if (tmp_root_mount) {
 		tmp_root_mount->parent = root;
 		list_add_tail(&tmp_root_mount->siblings, &root->children);
+		mnt_path_hash_add_child(tmp_root_mount);
 	}
 
 	return root;
+
+err:
+	xfree(ents);
+	return NULL;
 }
 
 static unsigned int mnt_depth(struct mount_info *m)
@@ -1186,6 +1324,7 @@ static int add_cr_time_mount(struct mount_info *root, char *fsname, const char *
 	mi->next = parent->next;
 	parent->next = mi;
 	list_add(&mi->siblings, &parent->children);
+	mnt_path_hash_add_child(mi);
 	pr_info("Add cr-time mountpoint %s with parent %s(%u)\n",
 		mi->mountpoint, parent->mountpoint, parent->mnt_id);
 	return 0;
@@ -2227,6 +2366,9 @@ struct mount_info *mnt_entry_alloc()
 void mnt_entry_free(struct mount_info *mi)
 {
 	if (mi) {
+		hlist_del_init(&mi->id_hash);
+		hlist_del_init(&mi->sdev_hash);
+		hlist_del_init(&mi->path_hash);
 		xfree(mi->root);
 		xfree(mi->mountpoint);
 		xfree(mi->source);
@@ -2288,16 +2430,19 @@ out:
 
 static int rst_collect_local_mntns(enum ns_type typ)
 {
+	struct mount_info *pms;
 	struct ns_id *nsid;
 
 	nsid = rst_new_ns_id(0, getpid(), &mnt_ns_desc, typ);
 	if (!nsid)
 		return -1;
 
-	mntinfo = collect_mntinfo(nsid, false);
-	if (!mntinfo)
+	pms = collect_mntinfo(nsid, false);
+	if (!pms)
 		return -1;
 
+	mntinfo_add_list(pms);
+
 	nsid->ns_populated = true;
 	return 0;
 }
@@ -2488,7 +2633,7 @@ int read_mnt_ns_img(void)
 			return -1;
 	}
 
-	mntinfo = pms;
+	mntinfo_add_list(pms);
 	return 0;
 }
 
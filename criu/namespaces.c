@@ -593,6 +593,10 @@ int predump_task_ns_ids(struct pstree_item *item)
 	if (!get_ns_id(pid, &mnt_ns_desc, NULL))
 		return -1;
 
+	/* SysV shmem contents are pre-dumped as well */
+	if (!get_ns_id(pid, &ipc_ns_desc, NULL))
+		return -1;
+
 	return 0;
 }
 
@@ -2,6 +2,7 @@
 #include <sys/socket.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/fib_rules.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nfnetlink_conntrack.h>
 #include <linux/netfilter/nf_conntrack_tcp.h>
@@ -29,6 +30,7 @@
 #include "string.h"
 #include "sysctl.h"
 #include "kerndat.h"
+#include "stats.h"
 
 #include "protobuf.h"
 #include "images/netdev.pb-c.h"
@@ -1043,28 +1045,6 @@ exit:
 	return ret;
 }
 
-static int run_ip_tool(char *arg1, char *arg2, char *arg3, int fdin, int fdout, unsigned flags)
-{
-	char *ip_tool_cmd;
-	int ret;
-
-	pr_debug("\tRunning ip %s %s\n", arg1, arg2);
-
-	ip_tool_cmd = getenv("CR_IP_TOOL");
-	if (!ip_tool_cmd)
-		ip_tool_cmd = "ip";
-
-	ret = cr_system(fdin, fdout, -1, ip_tool_cmd,
-				(char *[]) { "ip", arg1, arg2, arg3, NULL }, flags);
-	if (ret) {
-		if (!(flags & CRS_CAN_FAIL))
-			pr_err("IP tool failed on %s %s\n", arg1, arg2);
-		return -1;
-	}
-
-	return 0;
-}
-
 static int run_iptables_tool(char *def_cmd, int fdin, int fdout)
 {
 	int ret;
@@ -1081,29 +1061,99 @@ static int run_iptables_tool(char *def_cmd, int fdin, int fdout)
 	return ret;
 }
 
+/*
+ * Addresses, routes and rules images are in the "ip ... save" format,
+ * i.e. a magic followed by RTM_NEW* messages as the kernel dumps them,
+ * so the images and iproute2 understand each other both ways.
+ */
+#define IFADDR_DUMP_MAGIC	0x47361222
+#define ROUTE_DUMP_MAGIC	0x45311224
+#define RULE_DUMP_MAGIC		0x71706986
+
+struct rtnl_dump {
+	struct cr_img	*img;
+	bool		(*filter)(struct nlmsghdr *h);
+};
+
+static int dump_one_rtnl(struct nlmsghdr *h, void *arg)
+{
+	struct rtnl_dump *d = arg;
+
+	if (d->filter && !d->filter(h))
+		return 0;
+
+	return write_img_buf(d->img, h, h->nlmsg_len);
+}
+
+static int dump_rtnl_objs(struct cr_img *img, int type, int family, int hdrlen,
+		u32 magic, bool (*filter)(struct nlmsghdr *h))
+{
+	struct rtnl_dump d = { .img = img, .filter = filter, };
+	struct {
+		struct nlmsghdr nlh;
+		struct rtmsg r;	/* the longest of ifaddrmsg, rtmsg and fib_rule_hdr */
+	} req;
+	int sk, ret;
+
+	if (lazy_image(img) && open_image_lazy(img))
+		return -1;
+
+	if (write_img_buf(img, &magic, sizeof(magic)))
+		return -1;
+
+	sk = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (sk < 0) {
+		pr_perror("Can't open rtnl sock for net dump");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(hdrlen);
+	req.nlh.nlmsg_type = type;
+	req.nlh.nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST;
+	req.nlh.nlmsg_seq = CR_NLMSG_SEQ;
+	req.r.rtm_family = family;
+
+	ret = do_rtnl_req(sk, &req, req.nlh.nlmsg_len, dump_one_rtnl, NULL, &d);
+	close(sk);
+	return ret;
+}
+
 static inline int dump_ifaddr(struct cr_imgset *fds)
 {
-	struct cr_img *img = img_from_set(fds, CR_FD_IFADDR);
-	return run_ip_tool("addr", "save", NULL, -1, img_raw_fd(img), 0);
+	return dump_rtnl_objs(img_from_set(fds, CR_FD_IFADDR), RTM_GETADDR,
+			AF_UNSPEC, sizeof(struct ifaddrmsg), IFADDR_DUMP_MAGIC, NULL);
 }
 
-static inline int dump_route(struct cr_imgset *fds)
+/* Same as "ip route save" does: the main table only, no cache */
+static bool route_filter(struct nlmsghdr *h)
 {
-	struct cr_img *img;
+	struct rtmsg *r = NLMSG_DATA(h);
+	struct nlattr *tb[RTA_MAX + 1];
+	u32 table = r->rtm_table;
+
+	if (r->rtm_flags & RTM_F_CLONED)
+		return false;
+
+	if (nlmsg_parse(h, sizeof(*r), tb, RTA_MAX, NULL) < 0)
+		return true;
+	if (tb[RTA_TABLE])
+		table = nla_get_u32(tb[RTA_TABLE]);
+
+	return table == RT_TABLE_MAIN;
+}
 
-	img = img_from_set(fds, CR_FD_ROUTE);
-	if (run_ip_tool("route", "save", NULL, -1, img_raw_fd(img), 0))
+static inline int dump_route(struct cr_imgset *fds)
+{
+	if (dump_rtnl_objs(img_from_set(fds, CR_FD_ROUTE), RTM_GETROUTE,
+			AF_INET, sizeof(struct rtmsg), ROUTE_DUMP_MAGIC, route_filter))
 		return -1;
 
-	/* If ipv6 is disabled, "ip -6 route dump" dumps all routes */
 	if (!kdat.ipv6)
 		return 0;
 
-	img = img_from_set(fds, CR_FD_ROUTE6);
-	if (run_ip_tool("-6", "route", "save", -1, img_raw_fd(img), 0))
-		return -1;
-
-	return 0;
+	return dump_rtnl_objs(img_from_set(fds, CR_FD_ROUTE6), RTM_GETROUTE,
+			AF_INET6, sizeof(struct rtmsg), ROUTE_DUMP_MAGIC, route_filter);
 }
 
 static inline int dump_rule(struct cr_imgset *fds)
@@ -1117,8 +1167,9 @@ static inline int dump_rule(struct cr_imgset *fds)
 	if (!path)
 		return -1;
 
-	if (run_ip_tool("rule", "save", NULL, -1, img_raw_fd(img), CRS_CAN_FAIL)) {
-		pr_warn("Check if \"ip rule save\" is supported!\n");
+	if (dump_rtnl_objs(img, RTM_GETRULE, AF_INET, sizeof(struct fib_rule_hdr),
+				RULE_DUMP_MAGIC, NULL)) {
+		pr_warn("Can't dump rules\n");
 		unlinkat(get_service_fd(IMG_FD_OFF), path, 0);
 	}
 
@@ -1238,67 +1289,289 @@ err_free:
 	return ret;
 }
 
-static int restore_ip_dump(int type, int pid, char *cmd)
+#define RTNL_BATCH_SIZE		(32 << 10)
+#define RTNL_BATCH_MSGS		128
+
+/*
+ * Requests are sent in batches, the kernel handles them one by one
+ * and replies with an ACK for each. Each ACK is a separate skb, so
+ * there shouldn't be too many of them not to overflow the socket.
+ */
+struct rtnl_batch {
+	int	sk;
+	char	*what;
+	int	len;
+	int	nr;
+	char	buf[RTNL_BATCH_SIZE];
+};
+
+static int rtnl_restore_err(int err, void *arg)
+{
+	/* Some objects are there already, e.g. routes of the addresses */
+	if (err == -EEXIST)
+		return 0;
+
+	pr_err("Can't restore %s: %d\n", (char *)arg, err);
+	return err;
+}
+
+static int rtnl_batch_flush(struct rtnl_batch *b)
+{
+	int ret;
+
+	if (!b->nr)
+		return 0;
+
+	ret = do_rtnl_batch(b->sk, b->buf, b->len, b->nr, rtnl_restore_err, b->what);
+	b->len = 0;
+	b->nr = 0;
+	return ret;
+}
+
+static int rtnl_batch_add(struct rtnl_batch *b, struct nlmsghdr *h)
+{
+	if ((b->nr == RTNL_BATCH_MSGS ||
+	     b->len + NLMSG_ALIGN(h->nlmsg_len) > RTNL_BATCH_SIZE) &&
+	    rtnl_batch_flush(b))
+		return -1;
+
+	if (h->nlmsg_len > RTNL_BATCH_SIZE) {
+		pr_err("Too long %s message (%u)\n", b->what, h->nlmsg_len);
+		return -1;
+	}
+
+	memcpy(b->buf + b->len, h, h->nlmsg_len);
+	h = (struct nlmsghdr *)(b->buf + b->len);
+	h->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE;
+	h->nlmsg_seq = CR_NLMSG_SEQ;
+	h->nlmsg_pid = 0;
+
+	b->len += NLMSG_ALIGN(h->nlmsg_len);
+	b->nr++;
+	return 0;
+}
+
+/*
+ * Reads all the messages from an "ip ... save" image. Returns 0 if
+ * there's no image at all, 1 if there is (maybe with no messages).
+ */
+static int read_rtnl_image(int type, int pid, u32 magic, char **msgs, int *len)
 {
-	int ret = -1;
 	struct cr_img *img;
+	struct nlmsghdr h;
+	char *buf = NULL;
+	int size = 0, ret;
+	u32 m;
+
+	*msgs = NULL;
+	*len = 0;
 
 	img = open_image(type, O_RSTR, pid);
+	if (!img)
+		return -1;
+
 	if (empty_image(img)) {
 		close_image(img);
 		return 0;
 	}
-	if (img) {
-		ret = run_ip_tool(cmd, "restore", NULL, img_raw_fd(img), -1, 0);
-		close_image(img);
+
+	ret = read_img_buf_eof(img, &m, sizeof(m));
+	if (ret > 0 && m != magic) {
+		pr_err("Bad magic %#x in rtnl image %d\n", m, type);
+		ret = -1;
 	}
 
+	while (ret > 0) {
+		ret = read_img_buf_eof(img, &h, sizeof(h));
+		if (ret <= 0)
+			break;
+
+		ret = -1;
+		if (h.nlmsg_len < sizeof(h)) {
+			pr_err("Corrupted rtnl image %d\n", type);
+			break;
+		}
+
+		if (*len + NLMSG_ALIGN(h.nlmsg_len) > size) {
+			char *p;
+
+			size = max(2 * size, *len + (int)NLMSG_ALIGN(h.nlmsg_len));
+			p = xrealloc(buf, size);
+			if (!p)
+				break;
+			buf = p;
+		}
+
+		memcpy(buf + *len, &h, sizeof(h));
+		ret = read_img_buf(img, buf + *len + sizeof(h), h.nlmsg_len - sizeof(h));
+		*len += NLMSG_ALIGN(h.nlmsg_len);
+	}
+
+	close_image(img);
+
+	if (ret < 0) {
+		xfree(buf);
+		return -1;
+	}
+
+	*msgs = buf;
+	return 1;
+}
+
+/*
+ * Sends the messages in @nr_passes passes, each one sends the
+ * messages @pass_fn selects for it.
+ */
+static int send_rtnl_objs(int sk, char *msgs, int len, char *what,
+		int nr_passes, bool (*pass_fn)(struct nlmsghdr *h, int pass))
+{
+	struct rtnl_batch *b;
+	struct nlmsghdr *h;
+	int pass, rem, ret = -1;
+
+	b = xmalloc(sizeof(*b));
+	if (!b)
+		return -1;
+
+	b->sk = sk;
+	b->what = what;
+	b->len = 0;
+	b->nr = 0;
+
+	for (pass = 0; pass < nr_passes; pass++) {
+		rem = len;
+		for (h = (struct nlmsghdr *)msgs; NLMSG_OK(h, rem); h = NLMSG_NEXT(h, rem)) {
+			if (pass_fn && !pass_fn(h, pass))
+				continue;
+			if (rtnl_batch_add(b, h))
+				goto out;
+		}
+	}
+
+	ret = rtnl_batch_flush(b);
+out:
+	xfree(b);
+	return ret;
+}
+
+static int restore_rtnl_objs(int sk, int type, int pid, u32 magic, char *what,
+		int nr_passes, bool (*pass_fn)(struct nlmsghdr *h, int pass))
+{
+	char *msgs;
+	int len, ret;
+
+	ret = read_rtnl_image(type, pid, magic, &msgs, &len);
+	if (ret <= 0)
+		return ret;
+
+	ret = send_rtnl_objs(sk, msgs, len, what, nr_passes, pass_fn);
+	xfree(msgs);
 	return ret;
 }
 
+static int open_rtnl_sk(void)
+{
+	int sk;
+
+	sk = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (sk < 0)
+		pr_perror("Can't open rtnl sock for net restore");
+	return sk;
+}
+
 static inline int restore_ifaddr(int pid)
 {
-	return restore_ip_dump(CR_FD_IFADDR, pid, "addr");
+	int sk, ret;
+
+	sk = open_rtnl_sk();
+	if (sk < 0)
+		return -1;
+
+	ret = restore_rtnl_objs(sk, CR_FD_IFADDR, pid, IFADDR_DUMP_MAGIC,
+			"address", 1, NULL);
+	close(sk);
+	return ret;
+}
+
+/*
+ * Routes to local addresses go first, then the ones to local networks
+ * and then the rest, for gateways to be reachable by the time.
+ */
+static bool route_pass(struct nlmsghdr *h, int pass)
+{
+	struct rtmsg *r = NLMSG_DATA(h);
+	struct nlattr *tb[RTA_MAX + 1];
+
+	if (r->rtm_type == RTN_LOCAL)
+		return pass == 0;
+
+	if (nlmsg_parse(h, sizeof(*r), tb, RTA_MAX, NULL) < 0)
+		return pass == 2;
+
+	if (!tb[RTA_GATEWAY] && !tb[RTA_MULTIPATH])
+		return pass == 1;
+
+	return pass == 2;
 }
 
 static inline int restore_route(int pid)
 {
-	if (restore_ip_dump(CR_FD_ROUTE, pid, "route"))
-		return -1;
+	int sk, ret;
 
-	if (restore_ip_dump(CR_FD_ROUTE6, pid, "route"))
+	sk = open_rtnl_sk();
+	if (sk < 0)
 		return -1;
 
+	ret = restore_rtnl_objs(sk, CR_FD_ROUTE, pid, ROUTE_DUMP_MAGIC,
+			"route", 3, route_pass);
+	if (!ret)
+		ret = restore_rtnl_objs(sk, CR_FD_ROUTE6, pid, ROUTE_DUMP_MAGIC,
+				"route", 3, route_pass);
+	close(sk);
+	return ret;
+}
+
+static int rtnl_ignore_err(int err, void *arg)
+{
 	return 0;
 }
 
 static inline int restore_rule(int pid)
 {
-	struct cr_img *img;
-	int ret = 0;
+	struct {
+		struct nlmsghdr nlh;
+		struct fib_rule_hdr frh;
+	} req[3];
+	int i, sk, len, ret;
+	char *msgs;
 
-	img = open_image(CR_FD_RULE, O_RSTR, pid);
-	if (!img) {
-		ret = -1;
-		goto out;
-	}
+	ret = read_rtnl_image(CR_FD_RULE, pid, RULE_DUMP_MAGIC, &msgs, &len);
+	if (ret <= 0)
+		return ret;
 
-	if (empty_image(img))
-		goto close;
+	ret = sk = open_rtnl_sk();
+	if (sk < 0)
+		goto out;
 
 	/*
 	 * Delete 3 default rules to prevent duplicates. See kernel's
-	 * function fib_default_rules_init() for the details.
+	 * function fib_default_rules_init() for the details. A request
+	 * without selectors deletes the first rule.
 	 */
-	run_ip_tool("rule", "delete", NULL, -1, -1, 0);
-	run_ip_tool("rule", "delete", NULL, -1, -1, 0);
-	run_ip_tool("rule", "delete", NULL, -1, -1, 0);
+	memset(req, 0, sizeof(req));
+	for (i = 0; i < 3; i++) {
+		req[i].nlh.nlmsg_len = sizeof(req[i]);
+		req[i].nlh.nlmsg_type = RTM_DELRULE;
+		req[i].nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+		req[i].nlh.nlmsg_seq = CR_NLMSG_SEQ;
+		req[i].frh.family = AF_INET;
+	}
+	do_rtnl_batch(sk, req, sizeof(req), 3, rtnl_ignore_err, NULL);
 
-	if (restore_ip_dump(CR_FD_RULE, pid, "rule"))
-		ret = -1;
-close:
-	close_image(img);
+	ret = send_rtnl_objs(sk, msgs, len, "rule", 1, NULL);
+	close(sk);
 out:
+	xfree(msgs);
 	return ret;
 }
 
@@ -1609,8 +1882,10 @@ void network_unlock(void)
 {
 	pr_info("Unlock network\n");
 
+	span_start(SPAN_NET_UNLOCK);
 	cpt_unlock_tcp_connections();
 	rst_unlock_tcp_connections();
+	span_stop(SPAN_NET_UNLOCK);
 
 	if (root_ns_mask & CLONE_NEWNET) {
 		run_scripts(ACT_NET_UNLOCK);
@@ -1716,7 +1991,10 @@ static int collect_net_ns(struct ns_id *ns, void *oarg)
 	if (!for_dump)
 		return 0;
 
-	return collect_sockets(ns);
+	span_start(SPAN_COLLECT_SOCKETS);
+	ret = collect_sockets(ns);
+	span_stop(SPAN_COLLECT_SOCKETS);
+	return ret;
 }
 
 int collect_net_namespaces(bool for_dump)
@@ -4,6 +4,11 @@
 #include <string.h>
 #include <sys/wait.h>
 #include <stdlib.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
 
 #include "asm/types.h"
 #include "util.h"
@@ -13,6 +18,7 @@
 #include "sockets.h"
 #include "sk-inet.h"
 #include "kerndat.h"
+#include "libnetlink.h"
 
 static char buf[512];
 
@@ -46,7 +52,7 @@ void preload_netfilter_modules(void)
 	close_safe(&fd);
 }
 
-static int nf_connection_switch_raw(int family, u32 *src_addr, u16 src_port,
+static int ipt_connection_switch_raw(int family, u32 *src_addr, u16 src_port,
 						u32 *dst_addr, u16 dst_port,
 						bool input, bool lock)
 {
@@ -96,50 +102,693 @@ static int nf_connection_switch_raw(int family, u32 *src_addr, u16 src_port,
 	return 0;
 }
 
-static int nf_connection_switch(struct inet_sk_desc *sk, bool lock)
+static int ipt_connection_switch(int family, u32 *src_addr, u16 src_port,
+		u32 *dst_addr, u16 dst_port, bool lock)
 {
-	int ret = 0;
+	int ret;
 
-	ret = nf_connection_switch_raw(sk->sd.family,
-			sk->src_addr, sk->src_port,
-			sk->dst_addr, sk->dst_port, true, lock);
-	if (ret)
+	ret = ipt_connection_switch_raw(family, src_addr, src_port,
+			dst_addr, dst_port, true, lock);
+	if (ret && lock)
 		return -1;
 
-	ret = nf_connection_switch_raw(sk->sd.family,
-			sk->dst_addr, sk->dst_port,
-			sk->src_addr, sk->src_port, false, lock);
-	if (ret) /* rollback */
-		nf_connection_switch_raw(sk->sd.family,
-			sk->src_addr, sk->src_port,
-			sk->dst_addr, sk->dst_port, true, !lock);
+	/*
+	 * Unlocking doesn't stop on errors, nobody
+	 * checks them for restored connections.
+	 */
+	ret |= ipt_connection_switch_raw(family, dst_addr, dst_port,
+			src_addr, src_port, false, lock);
+	if (ret && lock) /* rollback */
+		ipt_connection_switch_raw(family, src_addr, src_port,
+				dst_addr, dst_port, true, !lock);
+	return ret;
+}
+
+/*
+ * Running iptables twice per connection takes minutes when there
+ * are tens of thousands of them, so if the kernel has nf_tables,
+ * connections are locked natively: the "criu" inet table has sets
+ * of locked connections and rules dropping their packets, and
+ * (un)locking a connection is adding (removing) a set element with
+ * a netlink message. Unlocking connections in bulk goes in batches.
+ *
+ * Set keys are local addr . local port . remote addr . remote port,
+ * with ports padded to 32 bits as nftables registers are.
+ */
+
+#define NFT_TABLE		"criu"
+#define NFT_SET4		"conn4"
+#define NFT_SET6		"conn6"
+#define NFT_KEY4_LEN		16
+#define NFT_KEY6_LEN		40
+
+#define NFT_BATCH_SIZE		(128 << 10)
+#define NFT_ELEMS_MSG_MAX	(32 << 10)
+#define NFT_BATCH_CONNS		2048
+
+enum {
+	NFT_UNKNOWN,
+	NFT_READY,
+	NFT_UNAVAIL,
+};
+
+static int nft_state = NFT_UNKNOWN;
+
+struct nft_batch {
+	char		buf[NFT_BATCH_SIZE];
+	int		len;
+	struct nlmsghdr	*cur;
+	struct nlmsghdr	*last;
+	bool		err;
+};
+
+struct nf_conn {
+	int		family;
+	u32		src_addr[4];
+	u32		dst_addr[4];
+	u16		src_port;
+	u16		dst_port;
+};
+
+static struct nft_batch *nft_batch;
+
+static void nft_msg_hdr(struct nft_batch *b, int type, int flags, int family, int res_id)
+{
+	struct nfgenmsg *g;
+
+	b->cur = (struct nlmsghdr *)(b->buf + b->len);
+	b->cur->nlmsg_len = NLMSG_LENGTH(sizeof(*g));
+	b->cur->nlmsg_type = type;
+	b->cur->nlmsg_flags = NLM_F_REQUEST | flags;
+	b->cur->nlmsg_seq = CR_NLMSG_SEQ;
+	b->cur->nlmsg_pid = 0;
+
+	g = NLMSG_DATA(b->cur);
+	g->nfgen_family = family;
+	g->version = NFNETLINK_V0;
+	g->res_id = htons(res_id);
+}
+
+static void nft_msg_end(struct nft_batch *b)
+{
+	b->len += NLMSG_ALIGN(b->cur->nlmsg_len);
+	b->last = b->cur;
+}
+
+static void nft_batch_init(struct nft_batch *b)
+{
+	b->len = 0;
+	b->err = false;
+	b->last = NULL;
+	nft_msg_hdr(b, NFNL_MSG_BATCH_BEGIN, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+	b->len += NLMSG_ALIGN(b->cur->nlmsg_len);
+}
+
+static void nft_msg(struct nft_batch *b, int type, int flags)
+{
+	nft_msg_hdr(b, (NFNL_SUBSYS_NFTABLES << 8) | type, flags, NFPROTO_INET, 0);
+}
+
+static void nft_attr(struct nft_batch *b, int type, const void *data, int len)
+{
+	if (addattr_l(b->cur, NFT_BATCH_SIZE - b->len, type, data, len))
+		b->err = true;
+}
+
+static void nft_attr_str(struct nft_batch *b, int type, const char *str)
+{
+	nft_attr(b, type, str, strlen(str) + 1);
+}
+
+static void nft_attr_u32(struct nft_batch *b, int type, u32 val)
+{
+	val = htonl(val);
+	nft_attr(b, type, &val, sizeof(val));
+}
+
+static struct rtattr *nft_nest(struct nft_batch *b, int type)
+{
+	struct rtattr *nest = NLMSG_TAIL(b->cur);
+
+	nft_attr(b, type | NLA_F_NESTED, NULL, 0);
+	return nest;
+}
+
+static void nft_nest_end(struct nft_batch *b, struct rtattr *nest)
+{
+	nest->rta_len = (void *)NLMSG_TAIL(b->cur) - (void *)nest;
+}
+
+struct nft_expr {
+	struct rtattr	*elem;
+	struct rtattr	*data;
+};
+
+static void nft_expr(struct nft_batch *b, const char *name, struct nft_expr *e)
+{
+	e->elem = nft_nest(b, NFTA_LIST_ELEM);
+	nft_attr_str(b, NFTA_EXPR_NAME, name);
+	e->data = nft_nest(b, NFTA_EXPR_DATA);
+}
+
+static void nft_expr_end(struct nft_batch *b, struct nft_expr *e)
+{
+	nft_nest_end(b, e->data);
+	nft_nest_end(b, e->elem);
+}
+
+static void nft_expr_meta_cmp(struct nft_batch *b, u32 key, u8 val)
+{
+	struct nft_expr e;
+	struct rtattr *cmp;
+
+	nft_expr(b, "meta", &e);
+	nft_attr_u32(b, NFTA_META_KEY, key);
+	nft_attr_u32(b, NFTA_META_DREG, NFT_REG_1);
+	nft_expr_end(b, &e);
+
+	nft_expr(b, "cmp", &e);
+	nft_attr_u32(b, NFTA_CMP_SREG, NFT_REG_1);
+	nft_attr_u32(b, NFTA_CMP_OP, NFT_CMP_EQ);
+	cmp = nft_nest(b, NFTA_CMP_DATA);
+	nft_attr(b, NFTA_DATA_VALUE, &val, sizeof(val));
+	nft_nest_end(b, cmp);
+	nft_expr_end(b, &e);
+}
+
+static void nft_expr_payload(struct nft_batch *b, u32 base, u32 off, u32 len, u32 reg)
+{
+	struct nft_expr e;
+
+	nft_expr(b, "payload", &e);
+	nft_attr_u32(b, NFTA_PAYLOAD_DREG, NFT_REG32_00 + reg);
+	nft_attr_u32(b, NFTA_PAYLOAD_BASE, base);
+	nft_attr_u32(b, NFTA_PAYLOAD_OFFSET, off);
+	nft_attr_u32(b, NFTA_PAYLOAD_LEN, len);
+	nft_expr_end(b, &e);
+}
+
+/*
+ * [meta nfproto == family] [meta l4proto == tcp] [load key]
+ * [lookup key in set] [drop]
+ */
+static void nft_add_rule(struct nft_batch *b, const char *chain, bool ipv6,
+		bool input, u32 set_id)
+{
+	/* Address offset and length in the network header */
+	u32 saddr = ipv6 ? 8 : 12, daddr = ipv6 ? 24 : 16, alen = ipv6 ? 16 : 4;
+	u32 local = input ? daddr : saddr, remote = input ? saddr : daddr;
+	u32 lport = input ? 2 : 0, rport = input ? 0 : 2;
+	u32 reg = 0;
+	struct rtattr *exprs, *imm, *verdict;
+	struct nft_expr e;
+
+	nft_msg(b, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+	nft_attr_str(b, NFTA_RULE_TABLE, NFT_TABLE);
+	nft_attr_str(b, NFTA_RULE_CHAIN, chain);
+	exprs = nft_nest(b, NFTA_RULE_EXPRESSIONS);
+
+	nft_expr_meta_cmp(b, NFT_META_NFPROTO, ipv6 ? NFPROTO_IPV6 : NFPROTO_IPV4);
+	nft_expr_meta_cmp(b, NFT_META_L4PROTO, IPPROTO_TCP);
+
+	nft_expr_payload(b, NFT_PAYLOAD_NETWORK_HEADER, local, alen, reg);
+	reg += alen / 4;
+	nft_expr_payload(b, NFT_PAYLOAD_TRANSPORT_HEADER, lport, 2, reg++);
+	nft_expr_payload(b, NFT_PAYLOAD_NETWORK_HEADER, remote, alen, reg);
+	reg += alen / 4;
+	nft_expr_payload(b, NFT_PAYLOAD_TRANSPORT_HEADER, rport, 2, reg++);
+
+	nft_expr(b, "lookup", &e);
+	nft_attr_str(b, NFTA_LOOKUP_SET, ipv6 ? NFT_SET6 : NFT_SET4);
+	nft_attr_u32(b, NFTA_LOOKUP_SET_ID, set_id);
+	nft_attr_u32(b, NFTA_LOOKUP_SREG, NFT_REG32_00);
+	nft_expr_end(b, &e);
+
+	nft_expr(b, "immediate", &e);
+	nft_attr_u32(b, NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+	imm = nft_nest(b, NFTA_IMMEDIATE_DATA);
+	verdict = nft_nest(b, NFTA_DATA_VERDICT);
+	nft_attr_u32(b, NFTA_VERDICT_CODE, NF_DROP);
+	nft_nest_end(b, verdict);
+	nft_nest_end(b, imm);
+	nft_expr_end(b, &e);
+
+	nft_nest_end(b, exprs);
+	nft_msg_end(b);
+}
+
+static void nft_add_set(struct nft_batch *b, const char *name, u32 key_len, u32 id)
+{
+	nft_msg(b, NFT_MSG_NEWSET, NLM_F_CREATE);
+	nft_attr_str(b, NFTA_SET_TABLE, NFT_TABLE);
+	nft_attr_str(b, NFTA_SET_NAME, name);
+	nft_attr_u32(b, NFTA_SET_KEY_LEN, key_len);
+	nft_attr_u32(b, NFTA_SET_ID, id);
+	nft_msg_end(b);
+}
+
+static void nft_add_chain(struct nft_batch *b, const char *name, u32 hook)
+{
+	struct rtattr *h;
+
+	nft_msg(b, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+	nft_attr_str(b, NFTA_CHAIN_TABLE, NFT_TABLE);
+	nft_attr_str(b, NFTA_CHAIN_NAME, name);
+	h = nft_nest(b, NFTA_CHAIN_HOOK);
+	nft_attr_u32(b, NFTA_HOOK_HOOKNUM, hook);
+	nft_attr_u32(b, NFTA_HOOK_PRIORITY, 0);
+	nft_nest_end(b, h);
+	nft_attr_str(b, NFTA_CHAIN_TYPE, "filter");
+	nft_msg_end(b);
+}
+
+static int nft_recv_cb(struct nlmsghdr *h, void *arg)
+{
+	return 0;
+}
+
+static int nft_err_cb(int err, void *arg)
+{
+	return err;
+}
+
+/* Returns 0 or -errno of the first failed message */
+static int nft_batch_send(struct nft_batch *b)
+{
+	int sk, ret;
+
+	if (b->err || !b->last) {
+		ret = b->err ? -ENOSPC : 0;
+		nft_batch_init(b);
+		return ret;
+	}
+
+	/* Only the last message is ACK-ed, errors are reported anyway */
+	b->last->nlmsg_flags |= NLM_F_ACK;
+	nft_msg_hdr(b, NFNL_MSG_BATCH_END, 0, AF_UNSPEC, NFNL_SUBSYS_NFTABLES);
+	b->len += NLMSG_ALIGN(b->cur->nlmsg_len);
+
+	/* A fresh socket, not to get errors from a failed batch later */
+	sk = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+	if (sk < 0) {
+		ret = -errno;
+		nft_batch_init(b);
+		return ret;
+	}
+
+	ret = do_rtnl_req(sk, b->buf, b->len, nft_recv_cb, nft_err_cb, NULL);
+	close(sk);
+
+	nft_batch_init(b);
 	return ret;
 }
 
+static int nft_setup(void)
+{
+	struct nft_batch *b;
+	int ret;
+
+	b = xmalloc(sizeof(*b));
+	if (!b)
+		return -1;
+
+	nft_batch_init(b);
+
+	nft_msg(b, NFT_MSG_NEWTABLE, NLM_F_CREATE | NLM_F_EXCL);
+	nft_attr_str(b, NFTA_TABLE_NAME, NFT_TABLE);
+	nft_msg_end(b);
+
+	nft_add_set(b, NFT_SET4, NFT_KEY4_LEN, 1);
+	nft_add_set(b, NFT_SET6, NFT_KEY6_LEN, 2);
+	nft_add_chain(b, "input", NF_INET_LOCAL_IN);
+	nft_add_chain(b, "output", NF_INET_LOCAL_OUT);
+	nft_add_rule(b, "input", false, true, 1);
+	nft_add_rule(b, "output", false, false, 1);
+	nft_add_rule(b, "input", true, true, 2);
+	nft_add_rule(b, "output", true, false, 2);
+
+	ret = nft_batch_send(b);
+	if (ret == -EEXIST) {
+		/* Somebody has locked connections already */
+		pr_info("nft: Table %s exists\n", NFT_TABLE);
+		ret = 0;
+	}
+
+	if (ret) {
+		pr_info("nft: Can't create table (%d), using iptables\n", ret);
+		nft_state = NFT_UNAVAIL;
+		xfree(b);
+		return 0;
+	}
+
+	pr_info("nft: Locking connections with nftables\n");
+	nft_state = NFT_READY;
+	nft_batch = b;
+	return 0;
+}
+
+static int nft_elems_cb(struct nlmsghdr *h, void *arg)
+{
+	struct rtattr *rta = NLMSG_DATA(h) + NLMSG_ALIGN(sizeof(struct nfgenmsg));
+	int len = h->nlmsg_len - NLMSG_SPACE(sizeof(struct nfgenmsg));
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if ((rta->rta_type & ~NLA_F_NESTED) == NFTA_SET_ELEM_LIST_ELEMENTS &&
+		    RTA_PAYLOAD(rta))
+			*(bool *)arg = true;
+
+	return 0;
+}
+
+/* Tells whether there are connections locked in the set */
+static int nft_set_busy(struct nft_batch *b, const char *set, bool *busy)
+{
+	int sk, ret;
+
+	b->len = 0;
+	nft_msg(b, NFT_MSG_GETSETELEM, NLM_F_DUMP);
+	nft_attr_str(b, NFTA_SET_ELEM_LIST_TABLE, NFT_TABLE);
+	nft_attr_str(b, NFTA_SET_ELEM_LIST_SET, set);
+	nft_msg_end(b);
+
+	sk = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+	if (sk < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = do_rtnl_req(sk, b->buf, b->len, nft_elems_cb, nft_err_cb, busy);
+	close(sk);
+out:
+	nft_batch_init(b);
+	return ret;
+}
+
+/*
+ * The base chains of the table cost a set lookup for every packet
+ * of the host, so the table is deleted once nothing is locked in it.
+ * Another criu may lock connections in it right between the check
+ * and the deletion, nftables can't delete a table only if its sets
+ * are empty.
+ */
+static void nft_cleanup(void)
+{
+	bool busy = false;
+	int ret;
+
+	ret = nft_set_busy(nft_batch, NFT_SET4, &busy);
+	if (!ret && !busy)
+		ret = nft_set_busy(nft_batch, NFT_SET6, &busy);
+	if (ret == -ENOENT)
+		return;
+	if (ret) {
+		pr_warn("nft: Can't check table %s (%d)\n", NFT_TABLE, ret);
+		return;
+	}
+	if (busy) {
+		pr_info("nft: Table %s is still in use\n", NFT_TABLE);
+		return;
+	}
+
+	nft_msg(nft_batch, NFT_MSG_DELTABLE, 0);
+	nft_attr_str(nft_batch, NFTA_TABLE_NAME, NFT_TABLE);
+	nft_msg_end(nft_batch);
+
+	ret = nft_batch_send(nft_batch);
+	if (ret && ret != -ENOENT)
+		pr_warn("nft: Can't delete table %s (%d)\n", NFT_TABLE, ret);
+	else if (!ret)
+		pr_info("nft: Deleted table %s\n", NFT_TABLE);
+}
+
+static bool ipv6_addr_mapped(u32 *addr)
+{
+	return addr[0] == 0 && addr[1] == 0 && addr[2] == htonl(0xffff);
+}
+
+/* Fills the set key of the connection, returns its set */
+static bool nft_elem_key(struct nf_conn *c, u32 *buf, int *len)
+{
+	u32 *src = c->src_addr, *dst = c->dst_addr;
+	int alen = 1, i = 0;
+	bool ipv6 = false;
+
+	if (c->family == AF_INET6) {
+		if (ipv6_addr_mapped(src)) {
+			/* The packets are IPv4 ones */
+			src += 3;
+			dst += 3;
+		} else {
+			ipv6 = true;
+			alen = 4;
+		}
+	}
+
+	memset(buf, 0, NFT_KEY6_LEN);
+	memcpy(buf + i, src, alen * sizeof(u32));
+	i += alen;
+	*(u16 *)(buf + i++) = htons(c->src_port);
+	memcpy(buf + i, dst, alen * sizeof(u32));
+	i += alen;
+	*(u16 *)(buf + i++) = htons(c->dst_port);
+
+	*len = i * sizeof(u32);
+	return ipv6;
+}
+
+static struct rtattr *nft_elems(struct nft_batch *b, bool ipv6, bool lock)
+{
+	if (lock)
+		nft_msg(b, NFT_MSG_NEWSETELEM, NLM_F_CREATE);
+	else
+		nft_msg(b, NFT_MSG_DELSETELEM, 0);
+	nft_attr_str(b, NFTA_SET_ELEM_LIST_TABLE, NFT_TABLE);
+	nft_attr_str(b, NFTA_SET_ELEM_LIST_SET, ipv6 ? NFT_SET6 : NFT_SET4);
+	return nft_nest(b, NFTA_SET_ELEM_LIST_ELEMENTS);
+}
+
+static void nft_elems_end(struct nft_batch *b, struct rtattr *elems)
+{
+	nft_nest_end(b, elems);
+	nft_msg_end(b);
+}
+
+static void nft_elem(struct nft_batch *b, u32 *key, int len)
+{
+	struct rtattr *elem, *k;
+
+	elem = nft_nest(b, NFTA_LIST_ELEM);
+	k = nft_nest(b, NFTA_SET_ELEM_KEY);
+	nft_attr(b, NFTA_DATA_VALUE, key, len);
+	nft_nest_end(b, k);
+	nft_nest_end(b, elem);
+}
+
+static void nft_add_elem(struct nft_batch *b, struct nf_conn *c, bool lock)
+{
+	u32 key[NFT_KEY6_LEN / 4];
+	struct rtattr *elems;
+	bool ipv6;
+	int len;
+
+	ipv6 = nft_elem_key(c, key, &len);
+	elems = nft_elems(b, ipv6, lock);
+	nft_elem(b, key, len);
+	nft_elems_end(b, elems);
+}
+
+/*
+ * Puts the elements of one set into as few messages as possible, each
+ * transaction costs much more than an element in it. The elements list
+ * is a nested attribute, so a message can't be longer than 64K.
+ */
+static void nft_del_elems(struct nft_batch *b, struct nf_conn *conns, int nr, bool ipv6)
+{
+	struct rtattr *elems = NULL;
+	u32 key[NFT_KEY6_LEN / 4];
+	int i, len;
+
+	for (i = 0; i < nr; i++) {
+		if (nft_elem_key(&conns[i], key, &len) != ipv6)
+			continue;
+
+		if (elems && b->cur->nlmsg_len > NFT_ELEMS_MSG_MAX) {
+			nft_elems_end(b, elems);
+			elems = NULL;
+		}
+
+		if (!elems)
+			elems = nft_elems(b, ipv6, false);
+		nft_elem(b, key, len);
+	}
+
+	if (elems)
+		nft_elems_end(b, elems);
+}
+
+static void nf_conn_fill(struct nf_conn *c, int family, u32 *src_addr, u16 src_port,
+		u32 *dst_addr, u16 dst_port)
+{
+	int alen = family == AF_INET6 ? 4 : 1;
+
+	memset(c, 0, sizeof(*c));
+	c->family = family;
+	memcpy(c->src_addr, src_addr, alen * sizeof(u32));
+	memcpy(c->dst_addr, dst_addr, alen * sizeof(u32));
+	c->src_port = src_port;
+	c->dst_port = dst_port;
+}
+
+static int nf_conn_switch_ipt(struct nf_conn *c, bool lock)
+{
+	return ipt_connection_switch(c->family, c->src_addr, c->src_port,
+			c->dst_addr, c->dst_port, lock);
+}
+
+/* The connection may be locked with either of the backends */
+static int nf_unlock_one(struct nf_conn *c)
+{
+	int ret;
+
+	nft_add_elem(nft_batch, c, false);
+	ret = nft_batch_send(nft_batch);
+	if (ret == 0)
+		return 0;
+
+	return nf_conn_switch_ipt(c, false);
+}
+
+/*
+ * Connections being unlocked in a batch, to be unlocked with
+ * iptables if the batch fails, i.e. they were locked by it.
+ */
+static struct nf_conn *nf_pending;
+static int nf_nr_pending;
+static bool nf_batching;
+
+static int nf_flush_pending(void)
+{
+	int i, ret;
+
+	if (!nf_nr_pending)
+		return 0;
+
+	nft_del_elems(nft_batch, nf_pending, nf_nr_pending, false);
+	nft_del_elems(nft_batch, nf_pending, nf_nr_pending, true);
+	ret = nft_batch_send(nft_batch);
+	if (ret == 0) {
+		pr_info("nft: Unlocked %d connections\n", nf_nr_pending);
+		nf_nr_pending = 0;
+		return 0;
+	}
+
+	/*
+	 * One missing element fails the whole transaction, so the
+	 * connections are unlocked one by one, with iptables for the
+	 * ones nftables doesn't know about.
+	 */
+	pr_info("nft: Can't unlock %d connections (%d), unlocking one by one\n",
+			nf_nr_pending, ret);
+	for (i = 0, ret = 0; i < nf_nr_pending; i++)
+		ret |= nf_unlock_one(&nf_pending[i]);
+	nf_nr_pending = 0;
+
+	return ret;
+}
+
+static int nf_connection_switch(int family, u32 *src_addr, u16 src_port,
+		u32 *dst_addr, u16 dst_port, bool lock)
+{
+	struct nf_conn c;
+	int ret;
+
+	nf_conn_fill(&c, family, src_addr, src_port, dst_addr, dst_port);
+
+	if (nft_state == NFT_UNKNOWN && lock && nft_setup())
+		return -1;
+
+	/*
+	 * On restore the table may be there from the dump, so
+	 * unlocking tries nftables first anyway.
+	 */
+	if (nft_state == NFT_UNKNOWN && !lock) {
+		nft_batch = xmalloc(sizeof(*nft_batch));
+		if (!nft_batch)
+			return -1;
+		nft_batch_init(nft_batch);
+		nft_state = NFT_READY;
+	}
+
+	if (nft_state != NFT_READY)
+		return nf_conn_switch_ipt(&c, lock);
+
+	if (!lock && nf_batching) {
+		if (!nf_pending) {
+			nf_pending = xmalloc(NFT_BATCH_CONNS * sizeof(*nf_pending));
+			if (!nf_pending)
+				return -1;
+		}
+
+		nf_pending[nf_nr_pending++] = c;
+		if (nf_nr_pending == NFT_BATCH_CONNS)
+			return nf_flush_pending();
+		return 0;
+	}
+
+	if (!lock)
+		return nf_unlock_one(&c);
+
+	nft_add_elem(nft_batch, &c, true);
+	ret = nft_batch_send(nft_batch);
+	if (ret) {
+		/* Don't mix backends within one dump */
+		pr_err("nft: Can't lock connection: %d\n", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
 int nf_lock_connection(struct inet_sk_desc *sk)
 {
-	return nf_connection_switch(sk, true);
+	return nf_connection_switch(sk->sd.family,
+			sk->src_addr, sk->src_port,
+			sk->dst_addr, sk->dst_port, true);
 }
 
 int nf_unlock_connection(struct inet_sk_desc *sk)
 {
-	return nf_connection_switch(sk, false);
+	return nf_connection_switch(sk->sd.family,
+			sk->src_addr, sk->src_port,
+			sk->dst_addr, sk->dst_port, false);
 }
 
 int nf_unlock_connection_info(struct inet_sk_info *si)
 {
-	int ret = 0;
-
-	ret |= nf_connection_switch_raw(si->ie->family,
+	return nf_connection_switch(si->ie->family,
 			si->ie->src_addr, si->ie->src_port,
-			si->ie->dst_addr, si->ie->dst_port, true, false);
-	ret |= nf_connection_switch_raw(si->ie->family,
-			si->ie->dst_addr, si->ie->dst_port,
-			si->ie->src_addr, si->ie->src_port, false, false);
-	/*
-	 * rollback nothing in case of any error,
-	 * because nobody checks errors of this function
-	 */
+			si->ie->dst_addr, si->ie->dst_port, false);
+}
+
+/*
+ * Unlocks between nf_unlock_batch_start() and nf_unlock_batch_end()
+ * are queued and sent in batches. Errors of the queued ones are only
+ * reported by nf_unlock_batch_end().
+ */
+void nf_unlock_batch_start(void)
+{
+	nf_batching = true;
+}
+
+int nf_unlock_batch_end(void)
+{
+	int ret;
+
+	ret = nf_flush_pending();
+	nf_batching = false;
+
+	if (nft_state == NFT_READY)
+		nft_cleanup();
 
 	return ret;
 }
@@ -7,12 +7,15 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <string.h>
 
 #include "cr_options.h"
 #include "servicefd.h"
 #include "image.h"
 #include "page-xfer.h"
 #include "page-pipe.h"
+#include "img-stream.h"
 #include "util.h"
 #include "protobuf.h"
 #include "images/pagemap.pb-c.h"
@@ -150,7 +153,7 @@ static int write_pagemap_loc(struct page_xfer *xfer,
 		struct iovec *iov)
 {
 	int ret;
-	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+	struct pagemap_packed pe = { };
 
 	iovec2pagemap(iov, &pe);
 	if (opts.auto_dedup && xfer->parent != NULL) {
@@ -160,7 +163,7 @@ static int write_pagemap_loc(struct page_xfer *xfer,
 			return ret;
 		}
 	}
-	return pb_write_one(xfer->pmi, &pe, PB_PAGEMAP);
+	return write_img(xfer->pmi, &pe);
 }
 
 static int write_pages_loc(struct page_xfer *xfer,
@@ -181,6 +184,153 @@ static int write_pages_loc(struct page_xfer *xfer,
 	return 0;
 }
 
+static int write_pages_stream(struct page_xfer *xfer,
+		int p, unsigned long len)
+{
+	return img_stream_splice(xfer->pi->stream_name, p, len);
+}
+
+/*
+ * With --pages-direct pages go to the image with O_DIRECT writes, so
+ * that dumping lots of memory doesn't wash the host's page cache out.
+ * Direct IO needs aligned buffers, so the data is read from the pipe
+ * into a bounce buffer first. The page server feeds us with whatever
+ * the socket gives, thus an unaligned tail is kept in the buffer till
+ * the next call.
+ */
+#define DIRECT_BUF_SIZE		(1 << 20)
+
+static void *direct_buf;
+static unsigned long direct_fill;
+
+static int flush_direct_buf(int fd, unsigned long len)
+{
+	ssize_t ret;
+
+	ret = write(fd, direct_buf, len);
+	if (ret != len) {
+		pr_perror("Unable to write %lu bytes of pages (%zd)", len, ret);
+		return -1;
+	}
+
+	direct_fill -= len;
+	if (direct_fill)
+		memmove(direct_buf, direct_buf + len, direct_fill);
+
+	return 0;
+}
+
+static int write_pages_direct(struct page_xfer *xfer,
+		int p, unsigned long len)
+{
+	int fd = img_raw_fd(xfer->pi);
+	ssize_t ret;
+
+	while (len) {
+		ret = read(p, direct_buf + direct_fill,
+				min(len, DIRECT_BUF_SIZE - direct_fill));
+		if (ret <= 0) {
+			pr_perror("Unable to read pages from pipe");
+			return -1;
+		}
+
+		direct_fill += ret;
+		len -= ret;
+
+		if (direct_fill == DIRECT_BUF_SIZE &&
+				flush_direct_buf(fd, DIRECT_BUF_SIZE))
+			return -1;
+	}
+
+	return flush_direct_buf(fd, direct_fill & ~(PAGE_SIZE - 1));
+}
+
+/*
+ * When the images filesystem doesn't do O_DIRECT the pages are spliced
+ * as usual, but the written back data is dropped from the page cache
+ * behind us. Writeback of the just written chunk is started right away
+ * and the previous one is waited for, so the disk is kept busy while
+ * the next chunk is being collected.
+ */
+static int write_pages_dropbehind(struct page_xfer *xfer,
+		int p, unsigned long len)
+{
+	int fd = img_raw_fd(xfer->pi);
+	off_t off;
+
+	off = lseek(fd, 0, SEEK_CUR);
+	if (off < 0) {
+		pr_perror("Unable to get pages image position");
+		return -1;
+	}
+
+	if (write_pages_loc(xfer, p, len))
+		return -1;
+
+	if (sync_file_range(fd, off, len, SYNC_FILE_RANGE_WRITE)) {
+		pr_perror("Unable to start pages writeback");
+		return -1;
+	}
+
+	if (off > xfer->pi_dropped) {
+		if (sync_file_range(fd, xfer->pi_dropped, off - xfer->pi_dropped,
+					SYNC_FILE_RANGE_WAIT_BEFORE |
+					SYNC_FILE_RANGE_WRITE |
+					SYNC_FILE_RANGE_WAIT_AFTER)) {
+			pr_perror("Unable to write pages back");
+			return -1;
+		}
+
+		posix_fadvise(fd, xfer->pi_dropped, off - xfer->pi_dropped,
+				POSIX_FADV_DONTNEED);
+		xfer->pi_dropped = off;
+	}
+
+	return 0;
+}
+
+static int setup_pages_direct(struct page_xfer *xfer)
+{
+	static bool warned;
+	int fd, flags;
+
+	xfer->pi_dropped = 0;
+
+	fd = img_raw_fd(xfer->pi);
+	if (fd < 0)
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT)) {
+		if (errno != EINVAL) {
+			pr_perror("Unable to turn O_DIRECT on for pages image");
+			return -1;
+		}
+
+		if (!warned) {
+			pr_warn("No O_DIRECT for images, dropping pages from cache\n");
+			warned = true;
+		}
+
+		xfer->write_pages = write_pages_dropbehind;
+		return 0;
+	}
+
+	if (!direct_buf) {
+		direct_buf = mmap(NULL, DIRECT_BUF_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (direct_buf == MAP_FAILED) {
+			pr_perror("Unable to allocate pages buffer");
+			direct_buf = NULL;
+			return -1;
+		}
+	}
+
+	direct_fill = 0;
+	xfer->write_pages = write_pages_direct;
+	return 0;
+}
+
 static int check_pagehole_in_parent(struct page_read *p, struct iovec *iov)
 {
 	int ret;
@@ -225,7 +375,7 @@ static int check_pagehole_in_parent(struct page_read *p, struct iovec *iov)
 
 static int write_pagehole_loc(struct page_xfer *xfer, struct iovec *iov)
 {
-	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
+	struct pagemap_packed pe = { };
 
 	if (xfer->parent != NULL) {
 		int ret;
@@ -239,10 +389,9 @@ static int write_pagehole_loc(struct page_xfer *xfer, struct iovec *iov)
 	}
 
 	iovec2pagemap(iov, &pe);
-	pe.has_in_parent = true;
-	pe.in_parent = true;
+	pe.flags = PE_PARENT;
 
-	if (pb_write_one(xfer->pmi, &pe, PB_PAGEMAP) < 0)
+	if (write_img(xfer->pmi, &pe))
 		return -1;
 
 	return 0;
@@ -250,6 +399,15 @@ static int write_pagehole_loc(struct page_xfer *xfer, struct iovec *iov)
 
 static void close_page_xfer(struct page_xfer *xfer)
 {
+	if (xfer->write_pages == write_pages_direct && direct_fill)
+		pr_err("%lu bytes of pages left unwritten\n", direct_fill);
+	else if (xfer->write_pages == write_pages_dropbehind) {
+		int fd = img_raw_fd(xfer->pi);
+
+		if (!fdatasync(fd))
+			posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
+
 	if (xfer->parent != NULL) {
 		xfer->parent->close(xfer->parent);
 		xfree(xfer->parent);
@@ -259,13 +417,17 @@ static void close_page_xfer(struct page_xfer *xfer)
 	close_image(xfer->pmi);
 }
 
-static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
+static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id,
+		unsigned long pages_id)
 {
 	xfer->pmi = open_image(fd_type, O_DUMP, id);
 	if (!xfer->pmi)
 		return -1;
 
-	xfer->pi = open_pages_image(O_DUMP, xfer->pmi);
+	if (pages_id)
+		xfer->pi = open_pages_image_id(xfer->pmi, pages_id);
+	else
+		xfer->pi = open_pages_image(O_DUMP, xfer->pmi, NULL);
 	if (!xfer->pi) {
 		close_image(xfer->pmi);
 		return -1;
@@ -279,10 +441,18 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
 	 *    to exist in parent (either pagemap or hole)
 	 */
 	xfer->parent = NULL;
-	if (fd_type == CR_FD_PAGEMAP || fd_type == CR_FD_SHMEM_PAGEMAP) {
+	if (fd_type == CR_FD_PAGEMAP || fd_type == CR_FD_SHMEM_PAGEMAP ||
+			fd_type == CR_FD_SYSV_SHMEM_PAGEMAP) {
 		int ret;
 		int pfd;
-		int pr_flags = (fd_type == CR_FD_PAGEMAP) ? PR_TASK : PR_SHMEM;
+		int pr_flags;
+
+		if (fd_type == CR_FD_PAGEMAP)
+			pr_flags = PR_TASK;
+		else if (fd_type == CR_FD_SHMEM_PAGEMAP)
+			pr_flags = PR_SHMEM;
+		else
+			pr_flags = PR_SYSV_SHMEM;
 
 		pfd = openat(get_service_fd(IMG_FD_OFF), CR_PARENT_LINK, O_RDONLY);
 		if (pfd < 0 && errno == ENOENT)
@@ -310,15 +480,29 @@ out:
 	xfer->write_pages = write_pages_loc;
 	xfer->write_hole = write_pagehole_loc;
 	xfer->close = close_page_xfer;
+
+	if (xfer->pi->stream_name)
+		xfer->write_pages = write_pages_stream;
+
+	if (opts.pages_direct && setup_pages_direct(xfer)) {
+		close_page_xfer(xfer);
+		return -1;
+	}
+
 	return 0;
 }
 
-int open_page_xfer(struct page_xfer *xfer, int fd_type, long id)
+/*
+ * The @pages_id is the pages image ID got from reserve_page_ids(),
+ * 0 means the next free one. The page server picks IDs itself.
+ */
+int open_page_xfer(struct page_xfer *xfer, int fd_type, long id,
+		unsigned long pages_id)
 {
 	if (opts.use_page_server)
 		return open_page_server_xfer(xfer, fd_type, id);
 	else
-		return open_page_local_xfer(xfer, fd_type, id);
+		return open_page_local_xfer(xfer, fd_type, id, pages_id);
 }
 
 static int page_xfer_dump_hole(struct page_xfer *xfer,
@@ -490,6 +674,7 @@ static void page_server_close(void)
 {
 	if (cxfer.dst_id != ~0)
 		cxfer.loc_xfer.close(&cxfer.loc_xfer);
+	cxfer.dst_id = ~0;
 }
 
 static int page_server_open(int sk, struct page_server_iov *pi)
@@ -503,7 +688,7 @@ static int page_server_open(int sk, struct page_server_iov *pi)
 
 	page_server_close();
 
-	if (open_page_local_xfer(&cxfer.loc_xfer, type, id))
+	if (open_page_local_xfer(&cxfer.loc_xfer, type, id, 0))
 		return -1;
 
 	cxfer.dst_id = pi->dst_id;
@@ -642,7 +827,15 @@ static int page_server_serve(int sk)
 		{
 			int32_t status = 0;
 
-			ret = 0;
+			/*
+			 * The client considers images done once the answer
+			 * arrives, so they should be on disk by then.
+			 */
+			if (opts.fsync_images) {
+				page_server_close();
+				status = ret = fsync_images();
+			} else
+				ret = 0;
 
 			/*
 			 * An answer must be sent back to inform another side,
@@ -9,15 +9,25 @@
 #include "vma.h"
 #include "mem.h"
 #include "kerndat.h"
+#include "stats.h"
 
 #undef	LOG_PREFIX
 #define LOG_PREFIX "pagemap-cache: "
 
-/* To carry up to 2M of physical memory */
-#define PMC_SHIFT		(21)
-#define PMC_SIZE		(1ul << PMC_SHIFT)
-#define PMC_MASK		(~(PMC_SIZE - 1))
-#define PMC_SIZE_GAP		(PMC_SIZE / 4)
+/*
+ * The window grows up to 256M of address space (512K of pagemap)
+ * over VMAs separated by holes of up to PMC_HOLE, see pmc_fill_cache().
+ */
+#define PMC_MAX_SHIFT		(28)
+#define PMC_MAX_SIZE		(1ul << PMC_MAX_SHIFT)
+
+/*
+ * Holes of up to 2M are read through. This costs at most 4K of
+ * pagemap per hole, and makes sure that VMAs which would fit one
+ * 2M-aligned window (how the cache used to work) never take more
+ * than one pread().
+ */
+#define PMC_HOLE		(2ul << 20)
 
 #define PAGEMAP_LEN(addr)	(PAGE_PFN(addr) * sizeof(u64))
 
@@ -28,6 +38,13 @@
 */
 static bool pagemap_cache_disabled;
 
+/*
+ * Tasks are dumped one by one, so the buffer is shared by all of
+ * them. One grown for a huge VMA is not kept, see pmc_fini().
+ */
+static u64 *pmc_buf;
+static size_t pmc_buf_len;
+
 static inline void pmc_reset(pmc_t *pmc)
 {
 	memzero(pmc, sizeof(*pmc));
@@ -41,18 +58,22 @@ static inline void pmc_zap(pmc_t *pmc)
 
 int pmc_init(pmc_t *pmc, pid_t pid, const struct list_head *vma_head, size_t size)
 {
-	size_t map_size = max(size, (size_t)PMC_SIZE);
+	size_t map_size = max(size, (size_t)PMC_MAX_SIZE);
 	pmc_reset(pmc);
 
 	BUG_ON(!vma_head);
 
 	pmc->pid	= pid;
-	pmc->map_len	= PAGEMAP_LEN(map_size);
 	pmc->vma_head	= vma_head;
 
-	pmc->map = xmalloc(pmc->map_len);
-	if (!pmc->map)
-		goto err;
+	if (pmc_buf_len < PAGEMAP_LEN(map_size)) {
+		if (xrealloc_safe(&pmc_buf, PAGEMAP_LEN(map_size)))
+			goto err;
+		pmc_buf_len = PAGEMAP_LEN(map_size);
+	}
+
+	pmc->map	= pmc_buf;
+	pmc->map_len	= pmc_buf_len;
 
 	if (pagemap_cache_disabled)
 		pr_debug("The pagemap cache is disabled\n");
@@ -93,60 +114,45 @@ static inline u64 *__pmc_get_map(pmc_t *pmc, unsigned long addr)
 
 static int pmc_fill_cache(pmc_t *pmc, const struct vma_area *vma)
 {
-	unsigned long low = vma->e->start & PMC_MASK;
-	unsigned long high = low + PMC_SIZE;
-	size_t len = vma_area_len(vma);
+	unsigned long max_end, size_cov = vma_area_len(vma);
 	size_t size_map;
 
-	if (high > kdat.task_size)
-		high = kdat.task_size;
-
 	pmc->start = vma->e->start;
 	pmc->end = vma->e->end;
 
-	pr_debug("filling VMA %lx-%lx (%zuK) [l:%lx h:%lx]\n",
-		 (long)vma->e->start, (long)vma->e->end, len >> 10, low, high);
+	pr_debug("filling VMA %lx-%lx (%luK)\n",
+		 (long)vma->e->start, (long)vma->e->end, size_cov >> 10);
 
 	/*
-	 * If we meet a small VMA, lets try to fit 2M cache
-	 * window at least 75% full, otherwise left as a plain
-	 * "one vma at a time" read. Note the VMAs in cache must
-	 * fit in solid manner, iow -- either the whole vma fits
-	 * the cache window, either plain read is used.
-	 *
-	 * The benefit (apart redusing the number of read() calls)
-	 * is to walk page tables less.
+	 * Take the following VMAs into the window while the buffer
+	 * allows and the holes between them are cheaper to read than
+	 * to skip with another pread(). This way clusters of small VMAs,
+	 * and the whole address space of a small task, are read at
+	 * once, while sparse layouts don't make us read (and walk) the
+	 * holes. Note the VMAs in cache must fit in solid manner, iow --
+	 * either the whole vma fits the window, or it's left out.
 	 */
-	if (!pagemap_cache_disabled &&
-            len < PMC_SIZE && (vma->e->start - low) < PMC_SIZE_GAP) {
-		size_t size_cov = len;
-		size_t nr_vmas = 1;
+	max_end = pmc->start + PAGE_SIZE * (pmc->map_len / sizeof(u64));
+	if (max_end > kdat.task_size || max_end < pmc->start)
+		max_end = kdat.task_size;
 
-		pr_debug("\t%16lx-%-16lx nr:%-5zu cov:%zu\n",
-			 (long)vma->e->start, (long)vma->e->end, nr_vmas, size_cov);
+	if (!pagemap_cache_disabled) {
+		size_t nr_vmas = 1;
 
 		list_for_each_entry_continue(vma, pmc->vma_head, list) {
-			if (vma->e->start > high || vma->e->end > high)
+			if (vma->e->end > max_end)
+				break;
+			if (vma->e->start - pmc->end > PMC_HOLE)
 				break;
 
-			BUG_ON(vma->e->start < low);
+			pmc->end = vma->e->end;
 			size_cov += vma_area_len(vma);
 			nr_vmas++;
-
-			pr_debug("\t%16lx-%-16lx nr:%-5zu cov:%zu\n",
-				 (long)vma->e->start, (long)vma->e->end, nr_vmas, size_cov);
 		}
 
-		if (nr_vmas > 1) {
-			/*
-			 * Note we don't touch low bound since it's set
-			 * to first VMA start already and not updating it
-			 * allows us to save a couple of code bytes.
-			 */
-			pmc->end = high;
-			pr_debug("\tcache  mode [l:%lx h:%lx]\n", pmc->start, pmc->end);
-		} else
-			pr_debug("\tsimple mode [l:%lx h:%lx]\n", pmc->start, pmc->end);
+		pr_debug("\t%s mode [l:%lx h:%lx] nr:%zu cov:%lu\n",
+			 nr_vmas > 1 ? "cache " : "simple", pmc->start, pmc->end,
+			 nr_vmas, size_cov);
 	}
 
 	size_map = PAGEMAP_LEN(pmc->end - pmc->start);
@@ -159,6 +165,8 @@ static int pmc_fill_cache(pmc_t *pmc, const struct vma_area *vma)
 		return -1;
 	}
 
+	cnt_add(CNT_PAGEMAP_READS, 1);
+	cnt_add(CNT_PAGEMAP_BYTES, size_map);
 	return 0;
 }
 
@@ -182,8 +190,13 @@ u64 *pmc_get_map(pmc_t *pmc, const struct vma_area *vma)
 void pmc_fini(pmc_t *pmc)
 {
 	close_safe(&pmc->fd);
-	xfree(pmc->map);
 	pmc_reset(pmc);
+
+	if (pmc_buf_len > PAGEMAP_LEN(PMC_MAX_SIZE)) {
+		xfree(pmc_buf);
+		pmc_buf = NULL;
+		pmc_buf_len = 0;
+	}
 }
 
 static void __attribute__((constructor)) pagemap_cache_init(void)
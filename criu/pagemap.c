@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <linux/falloc.h>
+#include <sys/sendfile.h>
 
 #include "image.h"
 #include "cr_options.h"
@@ -18,13 +19,13 @@
 
 #define MAX_BUNCH_SIZE 256
 
-void pagemap2iovec(PagemapEntry *pe, struct iovec *iov)
+void pagemap2iovec(struct pagemap_packed *pe, struct iovec *iov)
 {
 	iov->iov_base = decode_pointer(pe->vaddr);
 	iov->iov_len = pe->nr_pages * PAGE_SIZE;
 }
 
-void iovec2pagemap(struct iovec *iov, PagemapEntry *pe)
+void iovec2pagemap(struct iovec *iov, struct pagemap_packed *pe)
 {
 	pe->vaddr = encode_pointer(iov->iov_base);
 	pe->nr_pages = iov->iov_len / PAGE_SIZE;
@@ -95,7 +96,7 @@ int dedup_one_iovec(struct page_read *pr, struct iovec *iov)
 			return -1;
 		pagemap2iovec(pr->pe, &piov);
 		piov_end = (unsigned long)piov.iov_base + piov.iov_len;
-		if (!pr->pe->in_parent) {
+		if (!pagemap_in_parent(pr->pe)) {
 			ret = punch_hole(pr, pr->pi_off, min(piov_end, iov_end) - off, false);
 			if (ret == -1)
 				return ret;
@@ -123,19 +124,19 @@ int dedup_one_iovec(struct page_read *pr, struct iovec *iov)
 
 static int get_pagemap(struct page_read *pr, struct iovec *iov)
 {
-	PagemapEntry *pe;
+	struct pagemap_packed *pe;
 
 	if (pr->curr_pme >= pr->nr_pmes)
 		return 0;
 
-	pe = pr->pmes[pr->curr_pme];
+	pe = &pr->pmes[pr->curr_pme];
 
 	pagemap2iovec(pe, iov);
 
 	pr->pe = pe;
 	pr->cvaddr = (unsigned long)iov->iov_base;
 
-	if (pe->in_parent && !pr->parent) {
+	if (pagemap_in_parent(pe) && !pr->parent) {
 		pr_err("No parent for snapshot pagemap\n");
 		return -1;
 	}
@@ -154,7 +155,7 @@ static void skip_pagemap_pages(struct page_read *pr, unsigned long len)
 		return;
 
 	pr_debug("\tpr%u Skip %lu bytes from page-dump\n", pr->id, len);
-	if (!pr->pe->in_parent)
+	if (!pagemap_in_parent(pr->pe))
 		pr->pi_off += len;
 	pr->cvaddr += len;
 }
@@ -197,7 +198,7 @@ new_pagemap:
 	}
 }
 
-static inline void pagemap_bound_check(PagemapEntry *pe, unsigned long vaddr, int nr)
+static inline void pagemap_bound_check(struct pagemap_packed *pe, unsigned long vaddr, int nr)
 {
 	if (vaddr < pe->vaddr || (vaddr - pe->vaddr) / PAGE_SIZE + nr > pe->nr_pages) {
 		pr_err("Page read err %"PRIx64":%u vs %lx:%u\n",
@@ -214,7 +215,7 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 	pr_info("pr%u Read %lx %u pages\n", pr->id, vaddr, nr);
 	pagemap_bound_check(pr->pe, vaddr, nr);
 
-	if (pr->pe->in_parent) {
+	if (pagemap_in_parent(pr->pe)) {
 		struct page_read *ppr = pr->parent;
 
 		/*
@@ -269,7 +270,7 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 
 		pr->pi_off += len;
 
-		if (opts.auto_dedup) {
+		if (pr->dedup) {
 			ret = punch_hole(pr, current_vaddr, len, false);
 			if (ret == -1) {
 				return -1;
@@ -282,13 +283,55 @@ static int read_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr,
 	return 1;
 }
 
-static void free_pagemaps(struct page_read *pr)
+/*
+ * Copies pages from the current pagemap right into @fd at offset @vaddr,
+ * without mapping them. Only the pages sitting in this very image can
+ * be sent this way, for those in parent (or if the kernel can't do the
+ * sendfile) 0 is returned and the caller should go via ->read_pages.
+ */
+static int send_pagemap_page(struct page_read *pr, unsigned long vaddr, int nr, int fd)
 {
-	int i;
+	unsigned long len = nr * PAGE_SIZE;
+	off_t off = pr->pi_off;
+	ssize_t ret;
+
+	pagemap_bound_check(pr->pe, vaddr, nr);
+
+	if (pagemap_in_parent(pr->pe))
+		return 0;
 
-	for (i = 0; i < pr->nr_pmes; i++)
-		pagemap_entry__free_unpacked(pr->pmes[i], NULL);
+	pr_info("pr%u Send %lx %u pages\n", pr->id, vaddr, nr);
 
+	if (lseek(fd, vaddr, SEEK_SET) != vaddr) {
+		pr_perror("Can't seek to %lx", vaddr);
+		return -1;
+	}
+
+	while (len) {
+		ret = sendfile(fd, img_raw_fd(pr->pi), &off, len);
+		if (ret <= 0) {
+			if (ret < 0 && errno == EINVAL && off == pr->pi_off)
+				return 0;
+
+			pr_perror("Can't send pages %ld", (long)ret);
+			return -1;
+		}
+
+		len -= ret;
+	}
+
+	len = nr * PAGE_SIZE;
+	if (pr->dedup && punch_hole(pr, pr->pi_off, len, false) == -1)
+		return -1;
+
+	pr->pi_off += len;
+	pr->cvaddr += len;
+
+	return 1;
+}
+
+static void free_pagemaps(struct page_read *pr)
+{
 	xfree(pr->pmes);
 }
 
@@ -360,15 +403,11 @@ err_cl:
  */
 #define PAGEMAP_ENTRY_SIZE_ESTIMATE 16
 
-static int init_pagemaps(struct page_read *pr)
+/* Old images keep entries as separate pagemap_entry-s */
+static int read_pb_pagemaps(struct page_read *pr, off_t fsize)
 {
-	off_t fsize;
 	int nr_pmes, nr_realloc;
 
-	fsize = img_raw_size(pr->pmi);
-	if (fsize < 0)
-		return -1;
-
 	nr_pmes = fsize / PAGEMAP_ENTRY_SIZE_ESTIMATE + 1;
 	nr_realloc = nr_pmes / 2;
 
@@ -376,15 +415,18 @@ static int init_pagemaps(struct page_read *pr)
 	if (!pr->pmes)
 		return -1;
 
-	pr->nr_pmes = pr->curr_pme = 0;
-
 	while (1) {
-		int ret = pb_read_one_eof(pr->pmi, &pr->pmes[pr->nr_pmes],
-					  PB_PAGEMAP);
-		if (ret < 0)
-			goto free_pagemaps;
-		if (ret == 0)
-			break;
+		PagemapEntry *pe;
+		int ret;
+
+		ret = pb_read_one_eof(pr->pmi, &pe, PB_PAGEMAP);
+		if (ret <= 0)
+			return ret;
+
+		pr->pmes[pr->nr_pmes].vaddr = pe->vaddr;
+		pr->pmes[pr->nr_pmes].nr_pages = pe->nr_pages;
+		pr->pmes[pr->nr_pmes].flags = pe->in_parent ? PE_PARENT : 0;
+		pagemap_entry__free_unpacked(pe, NULL);
 
 		pr->nr_pmes++;
 		if (pr->nr_pmes >= nr_pmes) {
@@ -392,26 +434,69 @@ static int init_pagemaps(struct page_read *pr)
 			pr->pmes = xrealloc(pr->pmes,
 					    nr_pmes * sizeof(*pr->pmes));
 			if (!pr->pmes)
-				goto free_pagemaps;
+				return -1;
 		}
 	}
+}
+
+static int read_packed_pagemaps(struct page_read *pr, off_t fsize)
+{
+	int ret;
+
+	/* The rest of the image is the array, the file size is the upper bound */
+	pr->pmes = xmalloc(fsize);
+	if (!pr->pmes)
+		return -1;
+
+	ret = bread(&pr->pmi->_x, pr->pmes, fsize);
+	if (ret < 0)
+		return -1;
+
+	if (ret % sizeof(*pr->pmes)) {
+		pr_err("Corrupted packed pagemap (%d bytes)\n", ret);
+		return -1;
+	}
+
+	pr->nr_pmes = ret / sizeof(*pr->pmes);
+	return 0;
+}
+
+static int init_pagemaps(struct page_read *pr, bool packed)
+{
+	off_t fsize;
+	int ret;
+
+	fsize = img_raw_size(pr->pmi);
+	if (fsize < 0)
+		return -1;
+
+	pr->nr_pmes = pr->curr_pme = 0;
+
+	if (packed)
+		ret = read_packed_pagemaps(pr, fsize);
+	else
+		ret = read_pb_pagemaps(pr, fsize);
+	if (ret < 0) {
+		free_pagemaps(pr);
+		pr->pmes = NULL;
+		return -1;
+	}
+
+	pr_debug("Loaded %d pagemap entries\n", pr->nr_pmes);
 
 	close_image(pr->pmi);
 	pr->pmi = NULL;
 
 	return 0;
-
-free_pagemaps:
-	free_pagemaps(pr);
-	return -1;
 }
 
 int open_page_read_at(int dfd, int id, struct page_read *pr, int pr_flags)
 {
 	int flags, i_typ;
+	bool packed;
 	static unsigned ids = 1;
 
-	if (opts.auto_dedup)
+	if (opts.auto_dedup && !(pr_flags & PR_RO))
 		pr_flags |= PR_MOD;
 	if (pr_flags & PR_MOD)
 		flags = O_RDWR;
@@ -425,6 +510,9 @@ int open_page_read_at(int dfd, int id, struct page_read *pr, int pr_flags)
 	case PR_SHMEM:
 		i_typ = CR_FD_SHMEM_PAGEMAP;
 		break;
+	case PR_SYSV_SHMEM:
+		i_typ = CR_FD_SYSV_SHMEM_PAGEMAP;
+		break;
 	default:
 		BUG();
 		return -1;
@@ -437,6 +525,7 @@ int open_page_read_at(int dfd, int id, struct page_read *pr, int pr_flags)
 	pr->bunch.iov_len = 0;
 	pr->bunch.iov_base = NULL;
 	pr->pmes = NULL;
+	pr->dedup = opts.auto_dedup && !(pr_flags & PR_RO);
 
 	pr->pmi = open_image_at(dfd, i_typ, O_RSTR, (long)id);
 	if (!pr->pmi)
@@ -452,13 +541,13 @@ int open_page_read_at(int dfd, int id, struct page_read *pr, int pr_flags)
 		return -1;
 	}
 
-	pr->pi = open_pages_image_at(dfd, flags, pr->pmi);
+	pr->pi = open_pages_image_at(dfd, flags, pr->pmi, &packed);
 	if (!pr->pi) {
 		close_page_read(pr);
 		return -1;
 	}
 
-	if (init_pagemaps(pr)) {
+	if (init_pagemaps(pr, packed)) {
 		close_page_read(pr);
 		return -1;
 	}
@@ -466,6 +555,7 @@ int open_page_read_at(int dfd, int id, struct page_read *pr, int pr_flags)
 	pr->get_pagemap = get_pagemap;
 	pr->put_pagemap = put_pagemap;
 	pr->read_pages = read_pagemap_page;
+	pr->send_pages = send_pagemap_page;
 	pr->close = close_page_read;
 	pr->seek_page = seek_pagemap_page;
 	pr->id = ids++;
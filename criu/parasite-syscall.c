@@ -28,6 +28,7 @@
 #include "vma.h"
 #include "proc_parse.h"
 #include "aio.h"
+#include "mempolicy.h"
 #include "fault-injection.h"
 #include "syscall-codes.h"
 #include "signal.h"
@@ -122,6 +123,9 @@ static int parasite_run(pid_t pid, int cmd, unsigned long ip, void *stack,
 {
 	k_rtsigset_t block;
 
+	/* The parasite writes to the log itself */
+	log_flush();
+
 	ksigfillset(&block);
 	if (ptrace(PTRACE_SETSIGMASK, pid, sizeof(k_rtsigset_t), &block)) {
 		pr_perror("Can't block signals for %d", pid);
@@ -335,6 +339,7 @@ int __parasite_execute_daemon(unsigned int cmd, struct parasite_ctl *ctl)
 {
 	struct ctl_msg m;
 
+	log_flush();
 	m = ctl_msg_cmd(cmd);
 	return __parasite_send_cmd(ctl->tsock, &m);
 }
@@ -1366,6 +1371,7 @@ struct parasite_ctl *parasite_infect_seized(pid_t pid, struct pstree_item *item,
 
 	parasite_ensure_args_size(dump_pages_args_size(vma_area_list));
 	parasite_ensure_args_size(aio_rings_args_size(vma_area_list));
+	parasite_ensure_args_size(mempolicy_args_size(vma_area_list));
 
 	/*
 	 * Inject a parasite engine. Ie allocate memory inside alien
@@ -17,6 +17,8 @@
 #include "log.h"
 #include "tty.h"
 #include "aio.h"
+#include "mman.h"
+#include "mempolicy.h"
 
 #include <string.h>
 
@@ -524,6 +526,32 @@ static inline int parasite_check_vdso_mark(struct parasite_vdso_vma_entry *args)
 }
 #endif
 
+static int parasite_dump_mempolicy(struct parasite_dump_mpol_args *args)
+{
+	unsigned long maxnode = mpol_maxnode(args->nr_longs);
+	int i, ret;
+
+	ret = sys_get_mempolicy(&args->mode, args->nodes, maxnode, 0, 0);
+	if (ret) {
+		pr_err("Unable to get task memory policy: %d\n", ret);
+		return -1;
+	}
+
+	for (i = 0; i < args->nr_vmas; i++) {
+		struct parasite_vma_mpol *vm = pargs_mpol_vma(args, i);
+
+		ret = sys_get_mempolicy(&vm->mode, vm->nodes, maxnode,
+					vm->start, MPOL_F_ADDR);
+		if (ret) {
+			pr_err("Unable to get memory policy at %lx: %d\n",
+					vm->start, ret);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int parasite_dump_cgroup(struct parasite_dump_cgroup_args *args)
 {
 	int proc, cgroup, len;
@@ -692,6 +720,9 @@ static noinline __used int noinline parasite_daemon(void *args)
 		case PARASITE_CMD_DUMP_CGROUP:
 			ret = parasite_dump_cgroup(args);
 			break;
+		case PARASITE_CMD_DUMP_MEMPOLICY:
+			ret = parasite_dump_mempolicy(args);
+			break;
 		default:
 			pr_err("Unknown command in parasite daemon thread leader: %d\n", m.cmd);
 			ret = -1;
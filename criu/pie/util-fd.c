@@ -21,6 +21,87 @@
 
 #include "bug.h"
 
+#ifdef CR_NOGLIBC
+/*
+ * The kernel's struct statx (Linux 4.11), the stx_mnt_id
+ * is there since 5.8.
+ */
+struct pie_statx {
+	u32	stx_mask;
+	u32	stx_blksize;
+	u64	stx_attributes;
+	u32	stx_nlink;
+	u32	stx_uid;
+	u32	stx_gid;
+	u16	stx_mode;
+	u16	__spare0;
+	u64	stx_ino;
+	u64	stx_size;
+	u64	stx_blocks;
+	u64	stx_attributes_mask;
+	u64	stx_time[8];
+	u32	stx_rdev_major;
+	u32	stx_rdev_minor;
+	u32	stx_dev_major;
+	u32	stx_dev_minor;
+	u64	stx_mnt_id;
+	u64	__spare2[13];
+};
+
+#ifndef AT_EMPTY_PATH
+# define AT_EMPTY_PATH		0x1000
+#endif
+#define STATX_MNT_ID		0x1000
+
+static s32 fd_mnt_id(int fd)
+{
+	struct pie_statx stx;
+
+	if (sys_statx(fd, "", AT_EMPTY_PATH, STATX_MNT_ID, &stx))
+		return -1;
+	if (!(stx.stx_mask & STATX_MNT_ID))
+		return -1;
+
+	return stx.stx_mnt_id;
+}
+#else
+static s32 fd_mnt_id(int fd)
+{
+	return -1;
+}
+#endif
+
+static int fill_fdinfo_opts(int fd, struct fd_opts *p)
+{
+	long ret;
+
+	/* No llseek means the pos is never changed and stays zero */
+	ret = __sys(lseek)(fd, 0, SEEK_CUR);
+	if (ret == -ESPIPE)
+		ret = 0;
+	p->has_pos = ret >= 0 || ret < -4095;
+	p->pos = p->has_pos ? ret : 0;
+
+	ret = __sys(fcntl)(fd, F_GETFL, 0);
+	if (ret < 0) {
+		pr_err("fcntl(%d, F_GETFL) -> %ld\n", fd, ret);
+		return -1;
+	}
+	p->fl_flags = ret;
+	if (p->flags & FD_CLOEXEC)
+		p->fl_flags |= O_CLOEXEC;
+
+	ret = __sys(fcntl)(fd, F_GETSIG, 0);
+	if (ret < 0) {
+		pr_err("fcntl(%d, F_GETSIG) -> %ld\n", fd, ret);
+		return -1;
+	}
+	p->fown.signum = ret;
+
+	p->mnt_id = fd_mnt_id(fd);
+	return 0;
+}
+
 static void scm_fdset_init_chunk(struct scm_fdset *fdset, int nr_fds)
 {
 	struct cmsghdr *cmsg;
@@ -87,6 +168,9 @@ int send_fds(int sock, struct sockaddr_un *saddr, int len,
 
 				p->flags = (char)flags;
 
+				if (fill_fdinfo_opts(fd, p))
+					return -1;
+
 				ret = __sys(fcntl)(fd, F_GETOWN_EX, (long)&owner_ex);
 				if (ret) {
 					pr_err("fcntl(%d, F_GETOWN_EX) -> %d\n", fd, ret);
@@ -4,6 +4,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <string.h>
 
 #include "crtools.h"
 #include "imgset.h"
@@ -402,10 +403,147 @@ struct collect_image_info pipe_data_cinfo = {
 	.collect = collect_pipe_data,
 };
 
+#define PD_IDS_MIN_BITS		8
+
+static inline unsigned int pd_ids_hashfn(u32 id, unsigned int bits)
+{
+	return (id * 0x9e370001U) >> (32 - bits);
+}
+
+static void pd_ids_insert(u32 *ids, unsigned int bits, u32 id)
+{
+	unsigned int mask = (1 << bits) - 1, i;
+
+	for (i = pd_ids_hashfn(id, bits); ids[i]; i = (i + 1) & mask)
+		;
+	ids[i] = id;
+}
+
+/*
+ * Remembers the pipe as dumped. Returns 1 if it was there already.
+ * Pipe ids are inode numbers and thus never zero, so zero marks
+ * free slots.
+ */
+static int pd_ids_add(struct pipe_data_dump *pd, u32 id)
+{
+	unsigned int mask, i;
+
+	if (pd->ids) {
+		mask = (1 << pd->hash_bits) - 1;
+		for (i = pd_ids_hashfn(id, pd->hash_bits); pd->ids[i]; i = (i + 1) & mask)
+			if (pd->ids[i] == id)
+				return 1;
+	}
+
+	/* Keep the set at most half full */
+	if (!pd->ids || (pd->nr + 1) * 2 > (1 << pd->hash_bits)) {
+		unsigned int bits = pd->ids ? pd->hash_bits + 1 : PD_IDS_MIN_BITS;
+		u32 *ids;
+
+		ids = xzalloc(sizeof(u32) << bits);
+		if (!ids)
+			return -1;
+
+		if (pd->ids) {
+			for (i = 0; i < (1 << pd->hash_bits); i++)
+				if (pd->ids[i])
+					pd_ids_insert(ids, bits, pd->ids[i]);
+			xfree(pd->ids);
+		}
+
+		pd->ids = ids;
+		pd->hash_bits = bits;
+	}
+
+	pd_ids_insert(pd->ids, pd->hash_bits, id);
+	pd->nr++;
+	return 0;
+}
+
+/*
+ * Pipes of event-driven services usually carry a few bytes, so
+ * entries with small payloads are collected in a buffer and written
+ * into the (unbuffered) image in batches. Bigger payloads are spliced
+ * right into the image.
+ */
+#define PIPE_DATA_INLINE	PAGE_SIZE
+#define PIPE_DATA_BATCH		(16 * PAGE_SIZE)
+
+static struct pipe_data_dump *pd_batched;
+
+static int pd_batch_flush(struct pipe_data_dump *pd)
+{
+	struct cr_img *img;
+
+	if (!pd->batch_len)
+		return 0;
+
+	img = img_from_set(glob_imgset, pd->img_type);
+	if (img_raw_fd(img) < 0)
+		return -1;
+
+	if (write_img_buf(img, pd->batch, pd->batch_len))
+		return -1;
+
+	pd->batch_len = 0;
+	return 0;
+}
+
+static int pd_batch_entry(struct pipe_data_dump *pd, PipeDataEntry *pde, int steal_fd)
+{
+	u32 size = pipe_data_entry__get_packed_size(pde);
+	unsigned int need = sizeof(size) + size + pde->bytes;
+	int ret;
+
+	if (!pd->batch) {
+		pd->batch = xmalloc(PIPE_DATA_BATCH);
+		if (!pd->batch)
+			return -1;
+		pd->next = pd_batched;
+		pd_batched = pd;
+	}
+
+	if (pd->batch_len + need > PIPE_DATA_BATCH && pd_batch_flush(pd))
+		return -1;
+
+	memcpy(pd->batch + pd->batch_len, &size, sizeof(size));
+	pipe_data_entry__pack(pde, (void *)pd->batch + pd->batch_len + sizeof(size));
+
+	if (pde->bytes) {
+		ret = read(steal_fd, pd->batch + pd->batch_len + sizeof(size) + size, pde->bytes);
+		if (ret != pde->bytes) {
+			pr_perror("%#x: Wanted to read %u bytes, but got %d",
+					pde->pipe_id, pde->bytes, ret);
+			return -1;
+		}
+	}
+
+	pd->batch_len += need;
+	return 0;
+}
+
+int flush_pipes_data(void)
+{
+	struct pipe_data_dump *pd;
+	int ret = 0;
+
+	while (pd_batched) {
+		pd = pd_batched;
+		pd_batched = pd->next;
+
+		if (pd_batch_flush(pd))
+			ret = -1;
+		xfree(pd->batch);
+		pd->batch = NULL;
+	}
+
+	return ret;
+}
+
 int dump_one_pipe_data(struct pipe_data_dump *pd, int lfd, const struct fd_parms *p)
 {
 	struct cr_img *img;
-	int pipe_size, i, bytes;
+	int pipe_size, bytes;
 	int steal_pipe[2];
 	int ret = -1;
 	PipeDataEntry pde = PIPE_DATA_ENTRY__INIT;
@@ -414,20 +552,14 @@ int dump_one_pipe_data(struct pipe_data_dump *pd, int lfd, const struct fd_parms
 		return 0;
 
 	/* Maybe we've dumped it already */
-	for (i = 0; i < pd->nr; i++) {
-		if (pd->ids[i] == pipe_id(p))
-			return 0;
-	}
+	ret = pd_ids_add(pd, pipe_id(p));
+	if (ret)
+		return ret < 0 ? -1 : 0;
+	ret = -1;
 
 	pr_info("Dumping data from pipe %#x fd %d\n", pipe_id(p), lfd);
 
-	if (pd->nr >= NR_PIPES_WITH_DATA) {
-		pr_err("OOM storing pipe\n");
-		return -1;
-	}
-
 	img = img_from_set(glob_imgset, pd->img_type);
-	pd->ids[pd->nr++] = pipe_id(p);
 
 	pipe_size = fcntl(lfd, F_GETPIPE_SZ);
 	if (pipe_size < 0) {
@@ -455,12 +587,19 @@ int dump_one_pipe_data(struct pipe_data_dump *pd, int lfd, const struct fd_parms
 	pde.has_size	= true;
 	pde.size	= pipe_size;
 
-	if (pb_write_one(img, &pde, PB_PIPE_DATA))
-		goto err_close;
-
-	if (bytes) {
+	if (bytes <= PIPE_DATA_INLINE) {
+		if (pd_batch_entry(pd, &pde, steal_pipe[0]))
+			goto err_close;
+	} else {
 		int wrote;
 
+		/* Keep the entries in order */
+		if (pd_batch_flush(pd))
+			goto err_close;
+
+		if (pb_write_one(img, &pde, PB_PIPE_DATA))
+			goto err_close;
+
 		wrote = splice(steal_pipe[0], NULL, img_raw_fd(img), NULL, bytes, 0);
 		if (wrote < 0) {
 			pr_perror("Can't push pipe data");
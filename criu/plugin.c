@@ -170,6 +170,9 @@ void cr_plugin_fini(int stage, int ret)
 {
 	plugin_desc_t *this, *tmp;
 
+	/* The deferred log records may point to the plugins' formats */
+	log_flush();
+
 	list_for_each_entry_safe(this, tmp, &cr_plugin_ctl.head, list) {
 		void *h = this->dlhandle;
 		size_t i;
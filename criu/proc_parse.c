@@ -2020,12 +2020,9 @@ int parse_file_locks(void)
 	struct file_lock *fl;
 
 	FILE	*fl_locks;
-	int	exit_code = -1;
+	int	exit_code = -1, ret;
 	bool	is_blocked;
 
-	if (kdat.has_fdinfo_lock)
-		return 0;
-
 	fl_locks = fopen_proc(PROC_GEN, "locks");
 	if (!fl_locks) {
 		pr_perror("Can't open file locks file!");
@@ -2046,6 +2043,15 @@ int parse_file_locks(void)
 			goto err;
 		}
 
+		/* The locks themselves are collected from fdinfo-s then */
+		if (kdat.has_fdinfo_lock) {
+			ret = note_locked_inode(fl->i_no);
+			xfree(fl);
+			if (ret)
+				goto err;
+			continue;
+		}
+
 		pr_info("lockinfo: %lld:%d %x %d %02x:%02x:%ld %lld %s\n",
 			fl->fl_id, fl->fl_kind, fl->fl_ltype,
 			fl->fl_owner, fl->maj, fl->min, fl->i_no,
@@ -2082,6 +2088,8 @@ int parse_file_locks(void)
 		list_add_tail(&fl->list, &file_lock_list);
 	}
 
+	if (kdat.has_fdinfo_lock)
+		locked_inodes_collected();
 	exit_code = 0;
 err:
 	fclose(fl_locks);
@@ -2510,56 +2518,77 @@ int aufs_parse(struct mount_info *new)
 	return ret;
 }
 
-int parse_children(pid_t pid, pid_t **_c, int *_n)
+static int parse_thread_children(pid_t pid, pid_t tid, pid_t **_c, int *_n)
 {
-	pid_t *ch = NULL;
-	int nr = 0;
-	DIR *dir;
-	struct dirent *de;
+	pid_t *ch = *_c;
+	int nr = *_n;
 	struct bfd f;
 
-	dir = opendir_proc(pid, "task");
-	if (dir == NULL)
+	f.fd = open_proc(pid, "task/%d/children", tid);
+	if (f.fd < 0)
 		return -1;
 
-	while ((de = readdir(dir))) {
-		char *pos, *end;
+	if (bfdopenr(&f))
+		return -1;
 
-		if (dir_dots(de))
-			continue;
+	while (1) {
+		char *pos, *end;
+		pid_t val;
 
-		f.fd = open_proc(pid, "task/%s/children", de->d_name);
-		if (f.fd < 0)
+		pos = breadchr(&f, ' ');
+		if (IS_ERR(pos))
 			goto err;
+		if (pos == NULL)
+			break;
+
+		val = strtol(pos, &end, 0);
 
-		if (bfdopenr(&f))
+		if (*end != 0 && *end != ' ') {
+			pr_err("Unable to parse %s\n", end);
 			goto err;
+		}
 
-		while (1) {
-			pid_t val, *tmp;
+		/* Double the array, there can be thousands of children */
+		if (!(nr & (nr - 1))) {
+			pid_t *tmp;
 
-			pos = breadchr(&f, ' ');
-			if (IS_ERR(pos))
-				goto err_close;
-			if (pos == NULL)
-				break;
+			tmp = xrealloc(ch, (nr ? 2 * nr : 1) * sizeof(pid_t));
+			if (!tmp)
+				goto err;
+			ch = tmp;
+		}
 
-			val = strtol(pos, &end, 0);
+		ch[nr++] = val;
+	}
 
-			if (*end != 0 && *end != ' ') {
-				pr_err("Unable to parse %s\n", end);
-				goto err_close;
-			}
+	bclose(&f);
+	*_c = ch;
+	*_n = nr;
+	return 0;
 
-			tmp = xrealloc(ch, (nr + 1) * sizeof(pid_t));
-			if (!tmp)
-				goto err_close;
+err:
+	bclose(&f);
+	*_c = ch;
+	return -1;
+}
 
-			ch = tmp;
-			ch[nr] = val;
-			nr++;
-		}
-		bclose(&f);
+int parse_children(pid_t pid, pid_t **_c, int *_n)
+{
+	pid_t *ch = NULL;
+	int nr = 0;
+	DIR *dir;
+	struct dirent *de;
+
+	dir = opendir_proc(pid, "task");
+	if (dir == NULL)
+		return -1;
+
+	while ((de = readdir(dir))) {
+		if (dir_dots(de))
+			continue;
+
+		if (parse_thread_children(pid, atoi(de->d_name), &ch, &nr))
+			goto err;
 	}
 
 	*_c = ch;
@@ -2567,11 +2596,30 @@ int parse_children(pid_t pid, pid_t **_c, int *_n)
 
 	closedir(dir);
 	return 0;
-err_close:
-	bclose(&f);
 err:
 	closedir(dir);
 	xfree(ch);
 	return -1;
 }
 
+/*
+ * Same as parse_children(), but for a task with all the threads
+ * seized, so that the task directory doesn't need to be read.
+ */
+int parse_threads_children(pid_t pid, struct pid *threads, int nr_threads,
+			   pid_t **_c, int *_n)
+{
+	pid_t *ch = NULL;
+	int i, nr = 0;
+
+	for (i = 0; i < nr_threads; i++)
+		if (parse_thread_children(pid, threads[i].real, &ch, &nr)) {
+			xfree(ch);
+			return -1;
+		}
+
+	*_c = ch;
+	*_n = nr;
+	return 0;
+}
+
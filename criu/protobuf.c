@@ -18,6 +18,7 @@
 #include "sockets.h"
 #include "cr_options.h"
 #include "bfd.h"
+#include "stats.h"
 #include "protobuf.h"
 
 /*
@@ -27,6 +28,134 @@
  */
 #define PB_PKOBJ_LOCAL_SIZE	1024
 
+/*
+ * Bump allocator for unpacked objects. Collected messages are never
+ * freed one by one, so instead of calling malloc for every string and
+ * repeated field of every entry we carve them from big chunks and drop
+ * the whole arena at once.
+ */
+#define PB_ARENA_CHUNK		(64 << 10)
+#define PB_ARENA_ALIGN		sizeof(u64)
+
+struct pb_arena_chunk {
+	struct pb_arena_chunk	*next;
+	size_t			size;
+	size_t			used;
+	char			data[0];
+};
+
+struct pb_arena {
+	struct pb_arena_chunk	*chunks;
+};
+
+static struct pb_arena_chunk *pb_arena_chunk_alloc(size_t size)
+{
+	struct pb_arena_chunk *c;
+
+	c = xmalloc(sizeof(*c) + size);
+	if (!c)
+		return NULL;
+
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+static void *pb_arena_alloc(void *data, size_t size)
+{
+	struct pb_arena *a = data;
+	struct pb_arena_chunk *c = a->chunks;
+	void *ptr;
+
+	size = round_up(size, PB_ARENA_ALIGN);
+
+	if (!c || c->size - c->used < size) {
+		/*
+		 * Big objects get their own chunk behind the current one,
+		 * so that the rest of the current chunk is not wasted.
+		 */
+		if (c && size > PB_ARENA_CHUNK / 4) {
+			struct pb_arena_chunk *big;
+
+			big = pb_arena_chunk_alloc(size);
+			if (!big)
+				return NULL;
+
+			big->used = size;
+			big->next = c->next;
+			c->next = big;
+			return big->data;
+		}
+
+		c = pb_arena_chunk_alloc(max_t(size_t, size, PB_ARENA_CHUNK));
+		if (!c)
+			return NULL;
+
+		c->next = a->chunks;
+		a->chunks = c;
+	}
+
+	ptr = c->data + c->used;
+	c->used += size;
+	return ptr;
+}
+
+static void pb_arena_free(void *data, void *ptr)
+{
+	/* Everything goes away in pb_arena_reset() */
+}
+
+/*
+ * Drops all the objects from the arena, but keeps the
+ * first chunk around for the next user.
+ */
+static void pb_arena_reset(struct pb_arena *a, bool keep)
+{
+	struct pb_arena_chunk *c = a->chunks, *n;
+
+	if (keep && c) {
+		c->used = 0;
+		n = c->next;
+		c->next = NULL;
+		c = n;
+	} else
+		a->chunks = NULL;
+
+	while (c) {
+		n = c->next;
+		xfree(c);
+		c = n;
+	}
+}
+
+/*
+ * The scratch arena holds messages that are freed right after
+ * the collect callback, the collect one holds the messages that
+ * live till the end of restore (see COLLECT_ARENA).
+ */
+static struct pb_arena scratch_arena, collect_arena;
+
+/* To compare with the default allocator, see test/others/pb-arena */
+static bool pb_arena_disabled;
+
+static ProtobufCAllocator scratch_allocator = {
+	.alloc		= pb_arena_alloc,
+	.free		= pb_arena_free,
+	.allocator_data	= &scratch_arena,
+};
+
+static ProtobufCAllocator collect_allocator = {
+	.alloc		= pb_arena_alloc,
+	.free		= pb_arena_free,
+	.allocator_data	= &collect_arena,
+};
+
+void pb_collect_arena_fini(void)
+{
+	pb_arena_reset(&scratch_arena, false);
+	pb_arena_reset(&collect_arena, false);
+}
+
 static char *image_name(struct cr_img *img)
 {
 	int fd = img->_x.fd;
@@ -39,7 +168,8 @@ static char *image_name(struct cr_img *img)
 
 /*
  * Reads PB record (header + packed object) from file @fd and unpack
- * it with @unpack procedure to the pointer @pobj
+ * it with @unpack procedure to the pointer @pobj. Memory for the object
+ * is taken from @allocator, NULL means the default malloc-based one.
  *
  *  1 on success
  * -1 on error (or EOF met and @eof set to false)
@@ -48,7 +178,8 @@ static char *image_name(struct cr_img *img)
  * Don't forget to free memory granted to unpacked object in calling code if needed
  */
 
-int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
+int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof,
+		   ProtobufCAllocator *allocator)
 {
 	u8 local[PB_PKOBJ_LOCAL_SIZE];
 	void *buf = (void *)&local;
@@ -101,7 +232,7 @@ int do_pb_read_one(struct cr_img *img, void **pobj, int type, bool eof)
 		goto err;
 	}
 
-	*pobj = cr_pb_descs[type].unpack(NULL, size, buf);
+	*pobj = cr_pb_descs[type].unpack(allocator, size, buf);
 	if (!*pobj) {
 		ret = -1;
 		pr_err("Failed unpacking object %p from %s\n",
@@ -178,6 +309,7 @@ int collect_image(struct collect_image_info *cinfo)
 	struct cr_img *img;
 	void *(*o_alloc)(size_t size) = malloc;
 	void (*o_free)(void *ptr) = free;
+	ProtobufCAllocator *pb_alloc = NULL;
 
 	pr_info("Collecting %d/%d (flags %x)\n",
 			cinfo->fd_type, cinfo->pb_type, cinfo->flags);
@@ -192,6 +324,15 @@ int collect_image(struct collect_image_info *cinfo)
 		o_free = shfree_last;
 	}
 
+	if (!pb_arena_disabled) {
+		if (!cinfo->priv_size)
+			pb_alloc = &scratch_allocator;
+		else if (cinfo->flags & COLLECT_ARENA)
+			pb_alloc = &collect_allocator;
+	}
+
+	span_start(SPAN_RST_COLLECT);
+
 	while (1) {
 		void *obj;
 		ProtobufCMessage *msg;
@@ -204,7 +345,8 @@ int collect_image(struct collect_image_info *cinfo)
 		} else
 			obj = NULL;
 
-		ret = pb_read_one_eof(img, &msg, cinfo->pb_type);
+		ret = do_pb_read_one(img, (void **)&msg, cinfo->pb_type,
+				     true, pb_alloc);
 		if (ret <= 0) {
 			o_free(obj);
 			break;
@@ -213,15 +355,26 @@ int collect_image(struct collect_image_info *cinfo)
 		ret = cinfo->collect(obj, msg, img);
 		if (ret < 0) {
 			o_free(obj);
-			cr_pb_descs[cinfo->pb_type].free(msg, NULL);
+			if (!pb_alloc)
+				cr_pb_descs[cinfo->pb_type].free(msg, NULL);
 			break;
 		}
 
-		if (!cinfo->priv_size)
+		if (cinfo->priv_size)
+			continue;
+		if (pb_alloc)
+			pb_arena_reset(&scratch_arena, true);
+		else
 			cr_pb_descs[cinfo->pb_type].free(msg, NULL);
 	}
 
+	span_stop(SPAN_RST_COLLECT);
 	close_image(img);
 	pr_debug(" `- ... done\n");
 	return ret;
 }
+
+static void __attribute__((constructor)) pb_arena_init(void)
+{
+	pb_arena_disabled = (getenv("CRIU_PB_ARENA_OFF") != NULL);
+}
@@ -23,6 +23,8 @@ void core_entry_free(CoreEntry *core)
 {
 	if (core->tc && core->tc->timers)
 		xfree(core->tc->timers->posix);
+	if (core->tc)
+		xfree(core->tc->mpol_nodes);
 	if (core->thread_core)
 		xfree(core->thread_core->creds->groups);
 	arch_free_thread_info(core);
@@ -427,42 +427,68 @@ static inline bool child_collected(struct pstree_item *i, pid_t pid)
 static int collect_task(struct pstree_item *item);
 static int collect_children(struct pstree_item *item)
 {
+	struct pstree_item **new = NULL;
 	pid_t *ch;
-	int ret, i, nr_children, nr_inprogress;
+	int ret, i, nr_children, nr_new = 0, nr_inprogress;
 
-	ret = parse_children(item->pid.real, &ch, &nr_children);
+	/* The threads are all seized, so the set of them is stable */
+	span_start(SPAN_SEIZE_SCAN);
+	ret = parse_threads_children(item->pid.real, item->threads,
+				     item->nr_threads, &ch, &nr_children);
+	span_stop(SPAN_SEIZE_SCAN);
 	if (ret < 0)
 		return ret;
 
+	if (nr_children) {
+		new = xmalloc(nr_children * sizeof(*new));
+		if (!new) {
+			ret = -1;
+			goto free;
+		}
+	}
+
+	/*
+	 * Interrupt all the new children before waiting for any,
+	 * so that they get to their stops in parallel rather than
+	 * one after another.
+	 */
 	nr_inprogress = 0;
+	span_start(SPAN_SEIZE_INTERRUPT);
+	for (i = 0; i < nr_children; i++) {
+		/* Is it already frozen? */
+		if (child_collected(item, ch[i])) {
+			ch[i] = 0;
+			continue;
+		}
+
+		nr_inprogress++;
+
+		if (!opts.freeze_cgroup)
+			/* fails when meets a zombie */
+			seize_catch_task(ch[i]);
+	}
+	span_stop(SPAN_SEIZE_INTERRUPT);
+
+	span_start(SPAN_SEIZE_WAIT);
 	for (i = 0; i < nr_children; i++) {
 		struct pstree_item *c;
 		struct proc_status_creds *creds;
 		pid_t pid = ch[i];
 
-		/* Is it already frozen? */
-		if (child_collected(item, pid))
+		if (!pid)
 			continue;
 
-		nr_inprogress++;
-
 		if (alarm_timeouted()) {
 			ret = -1;
 			goto free;
 		}
 
-		pr_info("Seized task %d, state %d\n", pid, ret);
-
 		c = alloc_pstree_item();
 		if (c == NULL) {
 			ret = -1;
 			goto free;
 		}
 
-		if (!opts.freeze_cgroup)
-			/* fails when meets a zombie */
-			seize_catch_task(pid);
-
 		creds = xzalloc(sizeof(*creds));
 		if (!creds) {
 			ret = -1;
@@ -484,6 +510,8 @@ static int collect_children(struct pstree_item *item)
 			continue;
 		}
 
+		pr_info("Seized task %d, state %d\n", pid, ret);
+
 		if (ret == TASK_ZOMBIE)
 			ret = TASK_DEAD;
 		else
@@ -494,13 +522,19 @@ static int collect_children(struct pstree_item *item)
 		c->parent = item;
 		c->pid.state = ret;
 		list_add_tail(&c->sibling, &item->children);
+		new[nr_new++] = c;
+	}
+	span_stop(SPAN_SEIZE_WAIT);
 
-		/* Here is a recursive call (Depth-first search) */
-		ret = collect_task(c);
+	/* Here is a recursive call (Depth-first search) */
+	for (i = 0; i < nr_new; i++) {
+		ret = collect_task(new[i]);
 		if (ret < 0)
 			goto free;
 	}
 free:
+	span_stop(SPAN_SEIZE_WAIT);
+	xfree(new);
 	xfree(ch);
 	return ret < 0 ? ret : nr_inprogress;
 }
@@ -578,11 +612,13 @@ void pstree_switch_state(struct pstree_item *root_item, int st)
 	freezer_detach();
 
 	pr_info("Unfreezing tasks into %d\n", st);
+	span_start(SPAN_UNFREEZE);
 	for_each_pstree_item(item)
 		unseize_task_and_threads(item, st);
 
 	if (st == TASK_DEAD)
 		pstree_wait(root_item);
+	span_stop(SPAN_UNFREEZE);
 }
 
 static pid_t item_ppid(const struct pstree_item *item)
@@ -591,18 +627,40 @@ static pid_t item_ppid(const struct pstree_item *item)
 	return item ? item->pid.real : -1;
 }
 
-static inline bool thread_collected(struct pstree_item *i, pid_t tid)
+static int cmp_pid(const void *a, const void *b)
 {
+	pid_t x = *(pid_t *)a, y = *(pid_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Sorted tids of the collected threads, so that checking
+ * thousands of threads on a rescan isn't quadratic.
+ */
+static pid_t *collected_tids(struct pstree_item *i)
+{
+	pid_t *tids;
 	int t;
 
-	if (i->pid.real == tid) /* thread leader is collected as task */
-		return true;
+	tids = xmalloc(i->nr_threads * sizeof(pid_t));
+	if (!tids)
+		return NULL;
 
 	for (t = 0; t < i->nr_threads; t++)
-		if (tid == i->threads[t].real)
-			return true;
+		tids[t] = i->threads[t].real;
+	qsort(tids, i->nr_threads, sizeof(pid_t), cmp_pid);
 
-	return false;
+	return tids;
+}
+
+static inline bool thread_collected(struct pstree_item *i, pid_t *tids,
+				    int nr_tids, pid_t tid)
+{
+	if (i->pid.real == tid) /* thread leader is collected as task */
+		return true;
+
+	return bsearch(&tid, tids, nr_tids, sizeof(pid_t), cmp_pid) != NULL;
 }
 
 static bool creds_dumpable(struct proc_status_creds *parent,
@@ -657,9 +715,12 @@ static bool creds_dumpable(struct proc_status_creds *parent,
 static int collect_threads(struct pstree_item *item)
 {
 	struct pid *threads = NULL;
-	int nr_threads = 0, i = 0, ret, nr_inprogress, nr_stopped = 0;
+	pid_t *tids = NULL;
+	int nr_threads = 0, nr_tids, i = 0, ret, nr_inprogress, nr_stopped = 0;
 
+	span_start(SPAN_SEIZE_SCAN);
 	ret = parse_threads(item->pid.real, &threads, &nr_threads);
+	span_stop(SPAN_SEIZE_SCAN);
 	if (ret < 0)
 		goto err;
 
@@ -678,13 +739,21 @@ static int collect_threads(struct pstree_item *item)
 		item->nr_threads = 1;
 	}
 
+	tids = collected_tids(item);
+	if (!tids)
+		goto err;
+	nr_tids = item->nr_threads;
+
+	/* Interrupt all the new threads first, as collect_children() does */
 	nr_inprogress = 0;
+	span_start(SPAN_SEIZE_INTERRUPT);
 	for (i = 0; i < nr_threads; i++) {
 		pid_t pid = threads[i].real;
-		struct proc_status_creds t_creds = {};
 
-		if (thread_collected(item, pid))
+		if (thread_collected(item, tids, nr_tids, pid)) {
+			threads[i].real = 0;
 			continue;
+		}
 
 		nr_inprogress++;
 
@@ -692,6 +761,16 @@ static int collect_threads(struct pstree_item *item)
 				item->pid.real, pid);
 
 		if (!opts.freeze_cgroup && seize_catch_task(pid))
+			threads[i].real = 0;
+	}
+	span_stop(SPAN_SEIZE_INTERRUPT);
+
+	span_start(SPAN_SEIZE_WAIT);
+	for (i = 0; i < nr_threads; i++) {
+		pid_t pid = threads[i].real;
+		struct proc_status_creds t_creds = {};
+
+		if (!pid)
 			continue;
 
 		ret = seize_wait_task(pid, item_ppid(item), &t_creds);
@@ -727,16 +806,20 @@ static int collect_threads(struct pstree_item *item)
 			nr_stopped++;
 		}
 	}
+	span_stop(SPAN_SEIZE_WAIT);
 
 	if (nr_stopped && nr_stopped != nr_inprogress) {
 		pr_err("Individually stopped threads not supported\n");
 		goto err;
 	}
 
+	xfree(tids);
 	xfree(threads);
 	return nr_inprogress;
 
 err:
+	span_stop(SPAN_SEIZE_WAIT);
+	xfree(tids);
 	xfree(threads);
 	return -1;
 }
@@ -820,8 +903,12 @@ int collect_pstree(void)
 	 */
 	alarm(opts.timeout);
 
-	if (opts.freeze_cgroup && freeze_processes())
-		goto err;
+	if (opts.freeze_cgroup) {
+		span_start(SPAN_FREEZE_CGROUP);
+		if (freeze_processes())
+			goto err;
+		span_stop(SPAN_FREEZE_CGROUP);
+	}
 
 	if (!opts.freeze_cgroup && seize_catch_task(pid)) {
 		set_cr_errno(ESRCH);
@@ -832,7 +919,9 @@ int collect_pstree(void)
 	if (!creds)
 		goto err;
 
+	span_start(SPAN_SEIZE_WAIT);
 	ret = seize_wait_task(pid, -1, creds);
+	span_stop(SPAN_SEIZE_WAIT);
 	if (ret < 0)
 		goto err;
 
@@ -3,12 +3,20 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <sys/wait.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 #include "list.h"
 #include "pid.h"
 #include "shmem.h"
 #include "image.h"
+#include "stats.h"
 #include "cr_options.h"
+#include "servicefd.h"
+#include "namespaces.h"
+#include "ipc_ns.h"
+#include "pstree.h"
 #include "kerndat.h"
 #include "page-pipe.h"
 #include "page-xfer.h"
@@ -19,6 +27,8 @@
 #include "syscall-codes.h"
 #include "asm/bitops.h"
 #include "criu-log.h"
+#include "log.h"
+#include "asm/atomic.h"
 
 #include "protobuf.h"
 #include "images/pagemap.pb-c.h"
@@ -85,6 +95,7 @@ struct shmem_info {
 			unsigned long	start;
 			unsigned long	end;
 			unsigned long	*pstate_map;
+			unsigned long	pages_id;
 		};
 	};
 };
@@ -453,12 +464,20 @@ static int shmem_wait_and_open(int pid, struct shmem_info *si, VmaEntry *vi)
 	return 0;
 }
 
-static int restore_shmem_content(void *addr, struct shmem_info *si)
+/*
+ * With memfd the pages sitting in the image itself are sent right
+ * into the file, only those from parent images are read via the
+ * mapping. This saves us the page faults on the fresh mapping.
+ */
+static int restore_shmem_content(void *addr, unsigned long size,
+		unsigned long shmid, int fd, int pr_flags)
 {
 	int ret = 0;
 	struct page_read pr;
 
-	ret = open_page_read(si->shmid, &pr, PR_SHMEM);
+	span_start(SPAN_RST_PAGEMAPS);
+	ret = open_page_read(shmid, &pr, pr_flags);
+	span_stop(SPAN_RST_PAGEMAPS);
 	if (ret <= 0)
 		return -1;
 
@@ -474,10 +493,16 @@ static int restore_shmem_content(void *addr, struct shmem_info *si)
 		vaddr = (unsigned long)iov.iov_base;
 		nr_pages = iov.iov_len / PAGE_SIZE;
 
-		if (vaddr + nr_pages * PAGE_SIZE > si->size)
+		if (vaddr + nr_pages * PAGE_SIZE > round_up(size, PAGE_SIZE))
 			break;
 
-		pr.read_pages(&pr, vaddr, nr_pages, addr + vaddr);
+		ret = 0;
+		if (fd >= 0)
+			ret = pr.send_pages(&pr, vaddr, nr_pages, fd);
+		if (ret == 0)
+			ret = pr.read_pages(&pr, vaddr, nr_pages, addr + vaddr);
+		if (ret < 0)
+			break;
 
 		if (pr.put_pagemap)
 			pr.put_pagemap(&pr);
@@ -487,6 +512,11 @@ static int restore_shmem_content(void *addr, struct shmem_info *si)
 	return ret;
 }
 
+int restore_sysv_shmem_content(void *addr, unsigned long size, unsigned long shmid)
+{
+	return restore_shmem_content(addr, size, shmid, -1, PR_SYSV_SHMEM);
+}
+
 static int open_shmem(int pid, struct vma_area *vma)
 {
 	VmaEntry *vi = vma->e;
@@ -547,7 +577,7 @@ static int open_shmem(int pid, struct vma_area *vma)
 		goto err;
 	}
 
-	if (restore_shmem_content(addr, si) < 0) {
+	if (restore_shmem_content(addr, si->size, si->shmid, f, PR_SHMEM) < 0) {
 		pr_err("Can't restore shmem content\n");
 		goto err;
 	}
@@ -628,52 +658,247 @@ static int dump_pages(struct page_pipe *pp, struct page_xfer *xfer, void *addr)
 	return page_xfer_dump_pages(xfer, pp, (unsigned long)addr);
 }
 
-static int dump_one_shmem(struct shmem_info *si)
+/*
+ * Soft-dirty bits don't work for shared memory (see the comment near
+ * is_shmem_tracking_en). So a dump that may become a parent one (with
+ * --track-mem, which pre-dump turns on) keeps a 64-bit hash of each
+ * page in the shmem-hashes image, one per pfn with 0 for pages not
+ * present. The next dump reads the parent's copy of the pages which
+ * hashes match and only skips those which contents are the same.
+ */
+struct shmem_hashes {
+	struct cr_img		*img;
+	struct cr_img		*parent;
+	struct page_read	*pr;	/* pages of the parent dump */
+	void			*page;
+};
+
+#define HASH_PRIME1	0x9e3779b185ebca87ULL
+#define HASH_PRIME2	0xc2b2ae3d27d4eb4fULL
+
+static inline u64 hash_round(u64 h, u64 v)
 {
-	struct page_pipe *pp;
-	struct page_xfer xfer;
-	int err, ret = -1, fd;
-	unsigned char *mc_map = NULL;
-	void *addr = NULL;
-	unsigned long pfn, nrpages;
+	h += v * HASH_PRIME2;
+	h = (h << 31) | (h >> 33);
+	return h * HASH_PRIME1;
+}
 
-	pr_info("Dumping shared memory %ld\n", si->shmid);
+static u64 shmem_page_hash(void *page)
+{
+	u64 *p = page, h[4] = { 1, 2, 3, 4 };
+	int i;
 
-	fd = open_proc(si->pid, "map_files/%lx-%lx", si->start, si->end);
-	if (fd < 0)
+	/* Four lanes not to wait for each multiplication */
+	for (i = 0; i < PAGE_SIZE / sizeof(u64); i += 4) {
+		h[0] = hash_round(h[0], p[i]);
+		h[1] = hash_round(h[1], p[i + 1]);
+		h[2] = hash_round(h[2], p[i + 2]);
+		h[3] = hash_round(h[3], p[i + 3]);
+	}
+
+	h[0] = hash_round(hash_round(hash_round(h[0], h[1]), h[2]), h[3]);
+	h[0] ^= h[0] >> 29;
+
+	return h[0] ? : 1;
+}
+
+static int open_parent_pages(struct shmem_hashes *sh, int pfd, int pr_type,
+		unsigned long shmid)
+{
+	struct page_read *pr;
+	int ret;
+
+	sh->page = xmalloc(PAGE_SIZE);
+	pr = xmalloc(sizeof(*pr));
+	if (!sh->page || !pr) {
+		xfree(pr);
+		return -1;
+	}
+
+	/* The pages we skip stay in the parent, so it's not deduped */
+	ret = open_page_read_at(pfd, shmid, pr, pr_type | PR_RO);
+	if (ret > 0)
+		sh->pr = pr;
+	else
+		xfree(pr);
+
+	return ret;
+}
+
+static void close_shmem_hashes(struct shmem_hashes *sh)
+{
+	if (sh->pr) {
+		sh->pr->close(sh->pr);
+		xfree(sh->pr);
+	}
+	xfree(sh->page);
+	if (sh->parent)
+		close_image(sh->parent);
+	if (sh->img)
+		close_image(sh->img);
+}
+
+static int open_shmem_hashes(struct shmem_hashes *sh, int type, int pr_type,
+		unsigned long shmid, bool parent)
+{
+	int pfd;
+
+	memzero(sh, sizeof(*sh));
+
+	/* The parent images are not here with page server */
+	if (opts.use_page_server)
+		return 0;
+
+	if (opts.track_mem) {
+		sh->img = open_image(type, O_DUMP, shmid);
+		if (!sh->img)
+			return -1;
+	}
+
+	if (!parent)
+		return 0;
+
+	pfd = openat(get_service_fd(IMG_FD_OFF), CR_PARENT_LINK, O_RDONLY);
+	if (pfd < 0)
+		return 0;
+
+	sh->parent = open_image_at(pfd, type, O_RSTR, shmid);
+	if (!sh->parent)
 		goto err;
 
-	addr = mmap(NULL, si->size, PROT_READ, MAP_SHARED, fd, 0);
-	close(fd);
-	if (addr == MAP_FAILED) {
-		pr_err("Can't map shmem 0x%lx (0x%lx-0x%lx)\n",
-				si->shmid, si->start, si->end);
+	if (!empty_image(sh->parent) &&
+			open_parent_pages(sh, pfd, pr_type, shmid) < 0)
 		goto err;
+	if (!sh->pr) {
+		close_image(sh->parent);
+		sh->parent = NULL;
+	}
+
+	close(pfd);
+	return 0;
+
+err:
+	close(pfd);
+	close_shmem_hashes(sh);
+	return -1;
+}
+
+/*
+ * Records the hash of the next page (NULL if it's not present) and
+ * reports whether the parent dump has the same page.
+ */
+static int shmem_hash_page(struct shmem_hashes *sh, unsigned long pfn,
+		void *page, bool *same)
+{
+	u64 hash = 0, phash = 0;
+	int ret;
+
+	*same = false;
+	if (!sh->img && !sh->parent)
+		return 0;
+
+	if (page)
+		hash = shmem_page_hash(page);
+
+	if (sh->img && write_img_buf(sh->img, &hash, sizeof(hash)))
+		return -1;
+
+	if (!sh->parent)
+		return 0;
+
+	ret = read_img_buf_eof(sh->parent, &phash, sizeof(phash));
+	if (ret < 0)
+		return -1;
+	if (ret == 0) {
+		close_image(sh->parent);
+		sh->parent = NULL;
+		return 0;
+	}
+
+	if (!hash || hash != phash)
+		return 0;
+
+	/* Equal hashes don't prove anything, compare the pages themselves */
+	ret = sh->pr->seek_page(sh->pr, pfn * PAGE_SIZE, false);
+	if (ret <= 0)
+		return ret;
+
+	if (sh->pr->read_pages(sh->pr, pfn * PAGE_SIZE, 1, sh->page) < 0)
+		return -1;
+
+	*same = !memcmp(page, sh->page, PAGE_SIZE);
+	return 0;
+}
+
+/*
+ * Shared by the shmem dump workers, each one sums its pages counters
+ * into its own slot and the parent accounts them in stats.
+ */
+#define SHMEM_MAX_WORKERS	8
+
+struct shmem_dump_ctl {
+	atomic_t	next;
+	struct {
+		unsigned long	written;
+		unsigned long	skipped_parent;
+	} pages[SHMEM_MAX_WORKERS];
+};
+
+static int do_dump_one_shmem(struct shmem_info *si, void *addr,
+		struct shmem_dump_ctl *ctl, int slot)
+{
+	struct page_pipe *pp;
+	struct page_xfer xfer;
+	struct shmem_hashes sh;
+	int err, ret = -1;
+	int pm_type = CR_FD_SHMEM_PAGEMAP, hash_type = CR_FD_SHMEM_HASHES;
+	int pr_type = PR_SHMEM;
+	bool tracking = is_shmem_tracking_en();
+	unsigned char *mc_map = NULL;
+	unsigned long pfn, nrpages;
+
+	if (si->pid == SYSVIPC_SHMEM_PID) {
+		pm_type = CR_FD_SYSV_SHMEM_PAGEMAP;
+		hash_type = CR_FD_SYSV_SHMEM_HASHES;
+		pr_type = PR_SYSV_SHMEM;
+		/* Nobody maps them into tasks' pagemaps */
+		tracking = false;
 	}
 
 	nrpages = (si->size + PAGE_SIZE - 1) / PAGE_SIZE;
 	mc_map = xmalloc(nrpages * sizeof(*mc_map));
 	if (!mc_map)
-		goto err_unmap;
+		goto err;
 	/* We can't rely only on PME bits for anon shmem */
 	err = mincore(addr, si->size, mc_map);
 	if (err)
-		goto err_unmap;
+		goto err;
 
 	pp = create_page_pipe((nrpages + 1) / 2, NULL, PP_CHUNK_MODE);
 	if (!pp)
-		goto err_unmap;
+		goto err;
 
-	err = open_page_xfer(&xfer, CR_FD_SHMEM_PAGEMAP, si->shmid);
+	err = open_page_xfer(&xfer, pm_type, si->shmid, si->pages_id);
 	if (err)
 		goto err_pp;
 
+	err = open_shmem_hashes(&sh, hash_type, pr_type, si->shmid,
+			xfer.parent != NULL);
+	if (err)
+		goto err_xfer;
+
 	for (pfn = 0; pfn < nrpages; pfn++) {
 		unsigned int pgstate = PST_DIRTY;
-		bool use_mc = true;
+		bool use_mc = true, same, hole;
 		unsigned long pgaddr;
 
-		if (is_shmem_tracking_en()) {
+		pgaddr = (unsigned long)addr + pfn * PAGE_SIZE;
+		ret = shmem_hash_page(&sh, pfn, (mc_map[pfn] & PAGE_RSS) ?
+				(void *)pgaddr : NULL, &same);
+		if (ret)
+			goto err_hashes;
+
+		if (tracking) {
 			pgstate = get_pstate(si->pstate_map, pfn);
 			use_mc = pgstate == PST_DONT_DUMP;
 		}
@@ -681,9 +906,9 @@ static int dump_one_shmem(struct shmem_info *si)
 		if (use_mc && !(mc_map[pfn] & PAGE_RSS))
 			continue;
 
-		pgaddr = (unsigned long)addr + pfn * PAGE_SIZE;
+		hole = xfer.parent && (same || page_in_parent(pgstate == PST_DIRTY));
 again:
-		if (xfer.parent && page_in_parent(pgstate == PST_DIRTY))
+		if (hole)
 			ret = page_pipe_add_hole(pp, pgaddr);
 		else
 			ret = page_pipe_add_page(pp, pgaddr);
@@ -691,36 +916,274 @@ again:
 		if (ret == -EAGAIN) {
 			ret = dump_pages(pp, &xfer, addr);
 			if (ret)
-				goto err_xfer;
+				goto err_hashes;
 			page_pipe_reinit(pp);
 			goto again;
 		} else if (ret)
-			goto err_xfer;
+			goto err_hashes;
+
+		if (hole)
+			ctl->pages[slot].skipped_parent++;
+		else
+			ctl->pages[slot].written++;
 	}
 
 	ret = dump_pages(pp, &xfer, addr);
 
+err_hashes:
+	close_shmem_hashes(&sh);
 err_xfer:
 	xfer.close(&xfer);
 err_pp:
 	destroy_page_pipe(pp);
-err_unmap:
-	munmap(addr,  si->size);
 err:
 	xfree(mc_map);
 	return ret;
 }
 
+static int dump_one_shmem(struct shmem_info *si, struct shmem_dump_ctl *ctl, int slot)
+{
+	void *addr;
+	int fd, ret;
+
+	pr_info("Dumping shared memory %ld\n", si->shmid);
+
+	fd = open_proc(si->pid, "map_files/%lx-%lx", si->start, si->end);
+	if (fd < 0)
+		return -1;
+
+	addr = mmap(NULL, si->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		pr_err("Can't map shmem 0x%lx (0x%lx-0x%lx)\n",
+				si->shmid, si->start, si->end);
+		return -1;
+	}
+
+	ret = do_dump_one_shmem(si, addr, ctl, slot);
+	munmap(addr, si->size);
+	return ret;
+}
+
+static int dump_one_sysv_shmem(struct shmem_info *si, struct shmem_dump_ctl *ctl, int slot)
+{
+	void *addr;
+	int ret;
+
+	pr_info("Dumping SysV shared memory %ld\n", si->shmid);
+
+	addr = shmat(si->shmid, NULL, SHM_RDONLY);
+	if (addr == (void *)-1) {
+		pr_perror("Can't attach SysV shmem %ld", si->shmid);
+		return -1;
+	}
+
+	ret = do_dump_one_shmem(si, addr, ctl, slot);
+	if (shmdt(addr)) {
+		pr_perror("Can't detach SysV shmem %ld", si->shmid);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * SysV segments don't belong to tasks, they are collected right
+ * from the IPC namespace we're in. They are kept out of the hash,
+ * as their ids may clash with anon shmem inode numbers.
+ */
+static HLIST_HEAD(sysv_shmems);
+
+static int collect_dump_sysv_shmems(void)
+{
+	struct shm_info info;
+	int i, maxid;
+
+	maxid = shmctl(0, SHM_INFO, (void *)&info);
+	if (maxid < 0) {
+		pr_perror("shmctl(SHM_INFO) failed");
+		return -1;
+	}
+
+	for (i = 0; i <= maxid; i++) {
+		struct shmem_info *si;
+		struct shmid_ds ds;
+		int id;
+
+		id = shmctl(i, SHM_STAT, &ds);
+		if (id < 0) {
+			if (errno == EINVAL)
+				continue;
+			pr_perror("Failed to get stats for IPC shared memory");
+			return -1;
+		}
+
+		si = xzalloc(sizeof(*si));
+		if (!si)
+			return -1;
+
+		si->shmid = id;
+		si->pid = SYSVIPC_SHMEM_PID;
+		si->size = ds.shm_segsz;
+		hlist_add_head(&si->h, &sysv_shmems);
+	}
+
+	return 0;
+}
+
+static int shmem_size_cmp(const void *a, const void *b)
+{
+	const struct shmem_info *sa = *(struct shmem_info **)a;
+	const struct shmem_info *sb = *(struct shmem_info **)b;
+
+	if (sa->size == sb->size)
+		return 0;
+
+	return sa->size > sb->size ? -1 : 1;
+}
+
+static int dump_shmem_list(struct shmem_info **sis, int nr,
+		struct shmem_dump_ctl *ctl, int slot)
+{
+	int idx;
+
+	while ((idx = atomic_inc_return(&ctl->next) - 1) < nr) {
+		struct shmem_info *si = sis[idx];
+
+		if (si->pid == SYSVIPC_SHMEM_PID) {
+			if (dump_one_sysv_shmem(si, ctl, slot))
+				return -1;
+		} else if (dump_one_shmem(si, ctl, slot))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Segments are independent from each other, so when there are
+ * several of them they are dumped by a bunch of forked workers,
+ * each taking the next biggest segment. The pages image IDs are
+ * reserved for the segments before forking. The page server socket
+ * and the images stream can't be shared, so with them the dump
+ * goes in one process.
+ */
+static int dump_shmems(void)
+{
+	int ret = 0, i, nr = 0, nr_workers = 0;
+	struct shmem_info *si, **sis;
+	struct shmem_dump_ctl *ctl;
+	unsigned long pages_id;
+	pid_t *pids;
+
+	for_each_shmem(i, si)
+		nr++;
+	hlist_for_each_entry(si, &sysv_shmems, h)
+		nr++;
+	if (!nr)
+		return 0;
+
+	sis = xmalloc(nr * sizeof(*sis));
+	if (!sis)
+		return -1;
+
+	nr = 0;
+	for_each_shmem(i, si)
+		sis[nr++] = si;
+	hlist_for_each_entry(si, &sysv_shmems, h)
+		sis[nr++] = si;
+	qsort(sis, nr, sizeof(*sis), shmem_size_cmp);
+
+	pages_id = reserve_page_ids(nr);
+	for (i = 0; i < nr; i++)
+		sis[i]->pages_id = pages_id + i;
+
+	ctl = mmap(NULL, sizeof(*ctl), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ctl == MAP_FAILED) {
+		pr_perror("Can't map shmem workers control");
+		xfree(sis);
+		return -1;
+	}
+	atomic_set(&ctl->next, 0);
+
+	if (!opts.use_page_server && !opts.stream_images) {
+		nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+		nr_workers = min(nr_workers, SHMEM_MAX_WORKERS);
+		nr_workers = min(nr_workers, nr) - 1;
+	}
+
+	pids = xzalloc(max(nr_workers, 1) * sizeof(*pids));
+	if (!pids) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			pr_perror("Can't fork shmem worker");
+			break;
+		}
+
+		if (pids[i] == 0) {
+			ret = dump_shmem_list(sis, nr, ctl, i + 1);
+			log_flush();
+			_exit(ret ? 1 : 0);
+		}
+	}
+
+	pr_info("Dumping %d shmem segments with %d workers\n", nr, i + 1);
+	ret = dump_shmem_list(sis, nr, ctl, 0);
+
+	for (i = 0; i < nr_workers && pids[i] > 0; i++) {
+		int status;
+
+		if (waitpid(pids[i], &status, 0) < 0) {
+			pr_perror("Can't wait shmem worker %d", pids[i]);
+			ret = -1;
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			pr_err("Shmem worker %d failed (%#x)\n", pids[i], status);
+			ret = -1;
+		}
+	}
+
+	for (i = 0; i < SHMEM_MAX_WORKERS; i++) {
+		cnt_add(CNT_PAGES_WRITTEN, ctl->pages[i].written);
+		cnt_add(CNT_PAGES_SKIPPED_PARENT, ctl->pages[i].skipped_parent);
+	}
+
+	xfree(pids);
+out:
+	munmap(ctl, sizeof(*ctl));
+	xfree(sis);
+	return ret;
+}
+
 int cr_dump_shmem(void)
 {
-	int ret = 0, i;
-	struct shmem_info *si;
+	int ret, rst = -1;
 
-	for_each_shmem(i, si) {
-		ret = dump_one_shmem(si);
-		if (ret)
+	/*
+	 * Workers are forked after we get into the IPC namespace,
+	 * so they can shmat() the SysV segments too.
+	 */
+	if (root_ns_mask & CLONE_NEWIPC) {
+		if (switch_ns(root_item->pid.real, &ipc_ns_desc, &rst))
+			return -1;
+
+		if (collect_dump_sysv_shmems()) {
+			ret = -1;
 			goto out;
+		}
 	}
+
+	ret = dump_shmems();
 out:
+	if (rst >= 0 && restore_ns(rst, &ipc_ns_desc))
+		ret = -1;
 	return ret;
 }
@@ -4,11 +4,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "asm/types.h"
 #include "list.h"
@@ -59,10 +62,63 @@ struct collect_image_info sk_queues_cinfo = {
 	.collect = collect_one_packet,
 };
 
-int dump_sk_queue(int sock_fd, int sock_id)
+/*
+ * Queued packets are peeked and restored in batches with recvmmsg()
+ * and sendmmsg() to save syscalls on deep datagram queues.
+ */
+#define SK_QUEUE_BATCH		64
+#define SK_QUEUE_BATCH_BUF	(32 << 20)	/* virtual, touched as peeked */
+#define SK_QUEUE_RST_BUF	(1 << 20)
+#define SK_PACKET_HDR_MAX	16
+
+struct sk_queue_batch {
+	struct mmsghdr		msgs[SK_QUEUE_BATCH];
+	struct iovec		iovs[SK_QUEUE_BATCH];
+	u32			sizes[SK_QUEUE_BATCH];
+	u8			hdrs[SK_QUEUE_BATCH][SK_PACKET_HDR_MAX];
+	struct iovec		wiovs[3 * SK_QUEUE_BATCH];
+};
+
+static int write_sk_queue_batch(struct sk_queue_batch *b, int nr, int sock_id)
 {
 	SkPacketEntry pe = SK_PACKET_ENTRY__INIT;
-	int ret, size, orig_peek_off;
+	struct cr_img *img;
+	ssize_t total = 0, ret;
+	int i;
+
+	pe.id_for = sock_id;
+	for (i = 0; i < nr; i++) {
+		pe.length = b->msgs[i].msg_len;
+
+		b->sizes[i] = sk_packet_entry__get_packed_size(&pe);
+		BUG_ON(b->sizes[i] > SK_PACKET_HDR_MAX);
+		sk_packet_entry__pack(&pe, b->hdrs[i]);
+
+		b->wiovs[3 * i].iov_base = &b->sizes[i];
+		b->wiovs[3 * i].iov_len = sizeof(b->sizes[i]);
+		b->wiovs[3 * i + 1].iov_base = b->hdrs[i];
+		b->wiovs[3 * i + 1].iov_len = b->sizes[i];
+		b->wiovs[3 * i + 2].iov_base = b->iovs[i].iov_base;
+		b->wiovs[3 * i + 2].iov_len = pe.length;
+
+		total += sizeof(b->sizes[i]) + b->sizes[i] + pe.length;
+	}
+
+	img = img_from_set(glob_imgset, CR_FD_SK_QUEUES);
+	ret = writev(img_raw_fd(img), b->wiovs, 3 * nr);
+	if (ret != total) {
+		pr_perror("Can't write %d packets (%zd/%zd)", nr, ret, total);
+		return -1;
+	}
+
+	return 0;
+}
+
+int dump_sk_queue(int sock_fd, int sock_id)
+{
+	struct sk_queue_batch *b;
+	int ret, size, orig_peek_off, nr_slots, i;
+	unsigned long nr_pkts = 0;
 	void *data;
 	socklen_t tmp;
 
@@ -91,12 +147,27 @@ int dump_sk_queue(int sock_fd, int sock_id)
 	size -= 32;
 
 	/*
-	 * Allocate data for a stream.
+	 * Allocate data for a batch of max sized packets. Only the
+	 * pages the peeked data gets into are really allocated.
 	 */
-	data = xmalloc(size);
-	if (!data)
+	nr_slots = SK_QUEUE_BATCH_BUF / size;
+	if (nr_slots > SK_QUEUE_BATCH)
+		nr_slots = SK_QUEUE_BATCH;
+	else if (nr_slots < 1)
+		nr_slots = 1;
+
+	b = xmalloc(sizeof(*b));
+	if (!b)
 		return -1;
 
+	data = mmap(NULL, (size_t)size * nr_slots, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (data == MAP_FAILED) {
+		pr_perror("Can't allocate %d packets buffer", nr_slots);
+		xfree(b);
+		return -1;
+	}
+
 	/*
 	 * Enable peek offset incrementation.
 	 */
@@ -106,54 +177,59 @@ int dump_sk_queue(int sock_fd, int sock_id)
 		goto err_brk;
 	}
 
-	pe.id_for = sock_id;
-
 	while (1) {
-		struct iovec iov = {
-			.iov_base	= data,
-			.iov_len	= size,
-		};
-		struct msghdr msg = {
-			.msg_iov	= &iov,
-			.msg_iovlen	= 1,
-		};
-
-		ret = pe.length = recvmsg(sock_fd, &msg, MSG_DONTWAIT | MSG_PEEK);
-		if (!ret)
-			/*
-			 * It means, that peer has performed an
-			 * orderly shutdown, so we're done.
-			 */
-			break;
-		else if (ret < 0) {
-			if (errno == EAGAIN)
+		int nr;
+
+		for (i = 0; i < nr_slots; i++) {
+			b->iovs[i].iov_base = data + (size_t)size * i;
+			b->iovs[i].iov_len = size;
+			memzero(&b->msgs[i], sizeof(b->msgs[i]));
+			b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+			b->msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = recvmmsg(sock_fd, b->msgs, nr_slots, MSG_DONTWAIT | MSG_PEEK, NULL);
+		if (ret < 0) {
+			if (errno == EAGAIN) {
+				ret = 0;
 				break; /* we're done */
-			pr_perror("recvmsg fail: error");
+			}
+			pr_perror("recvmmsg fail: error");
 			goto err_set_sock;
 		}
-		if (msg.msg_flags & MSG_TRUNC) {
-			/*
-			 * DGRAM truncated. This should not happen. But we have
-			 * to check...
-			 */
-			pr_err("sys_recvmsg failed: truncated\n");
-			ret = -E2BIG;
-			goto err_set_sock;
+
+		for (nr = 0; nr < ret; nr++) {
+			if (!b->msgs[nr].msg_len)
+				/*
+				 * It means, that peer has performed an
+				 * orderly shutdown, so we're done.
+				 */
+				break;
+
+			if (b->msgs[nr].msg_hdr.msg_flags & MSG_TRUNC) {
+				/*
+				 * DGRAM truncated. This should not happen. But we have
+				 * to check...
+				 */
+				pr_err("sys_recvmsg failed: truncated\n");
+				ret = -E2BIG;
+				goto err_set_sock;
+			}
 		}
 
-		ret = pb_write_one(img_from_set(glob_imgset, CR_FD_SK_QUEUES), &pe, PB_SK_QUEUES);
-		if (ret < 0) {
+		if (nr && write_sk_queue_batch(b, nr, sock_id)) {
 			ret = -EIO;
 			goto err_set_sock;
 		}
+		nr_pkts += nr;
 
-		ret = write_img_buf(img_from_set(glob_imgset, CR_FD_SK_QUEUES), data, pe.length);
-		if (ret < 0) {
-			ret = -EIO;
-			goto err_set_sock;
+		if (nr < ret) {
+			ret = 0;
+			break;
 		}
 	}
-	ret = 0;
+
+	pr_info("Dumped %lu packets for %#x\n", nr_pkts, sock_id);
 
 err_set_sock:
 	/*
@@ -164,15 +240,69 @@ err_set_sock:
 		ret = -1;
 	}
 err_brk:
-	xfree(data);
+	munmap(data, (size_t)size * nr_slots);
+	xfree(b);
 	return ret;
 }
 
+static int send_sk_queue_batch(int fd, struct sk_queue_batch *b, int nr,
+		struct cr_img *img, void *buf, off_t start, size_t len)
+{
+	int i, done = 0, ret;
+
+	ret = pread(img_raw_fd(img), buf, len, start);
+	if (ret != len) {
+		pr_perror("Can't read %zu bytes of packets", len);
+		return -1;
+	}
+
+	/*
+	 * Don't try to use sendfile here, because it use sendpage() and
+	 * all data are split on pages and a new skb is allocated for
+	 * each page. It creates a big overhead on SNDBUF.
+	 * sendfile() isn't suitable for DGRAM sockets, because message
+	 * boundaries messages should be saved.
+	 */
+	while (done < nr) {
+		ret = sendmmsg(fd, b->msgs + done, nr - done, 0);
+		if (ret < 0) {
+			pr_perror("Failed to send packet");
+			return -1;
+		}
+
+		for (i = done; i < done + ret; i++) {
+			if (b->msgs[i].msg_len != b->iovs[i].iov_len) {
+				pr_err("Restored skb trimmed to %u/%zu\n",
+				       b->msgs[i].msg_len, b->iovs[i].iov_len);
+				return -1;
+			}
+		}
+		done += ret;
+	}
+
+	return 0;
+}
+
+static void free_sk_packets(struct sk_packet **pkts, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		list_del(&pkts[i]->list);
+		sk_packet_entry__free_unpacked(pkts[i]->entry, NULL);
+		xfree(pkts[i]);
+	}
+}
+
 int restore_sk_queue(int fd, unsigned int peer_id)
 {
-	struct sk_packet *pkt, *tmp;
-	int ret;
+	struct sk_packet *pkt, *tmp, *batch[SK_QUEUE_BATCH];
+	struct sk_queue_batch *b;
 	struct cr_img *img;
+	size_t buf_size = 0;
+	off_t start = 0, end = 0;
+	char *buf = NULL;
+	int nr = 0, ret = -1;
 
 	pr_info("Trying to restore recv queue for %u\n", peer_id);
 
@@ -183,9 +313,17 @@ int restore_sk_queue(int fd, unsigned int peer_id)
 	if (!img)
 		return -1;
 
+	b = xmalloc(sizeof(*b));
+	if (!b)
+		goto err;
+
+	/*
+	 * Packets of one socket lie one after another in the image, so
+	 * a batch is read with one pread() and the payloads are sent
+	 * right from where they are in the buffer.
+	 */
 	list_for_each_entry_safe(pkt, tmp, &packets_list, list) {
 		SkPacketEntry *entry = pkt->entry;
-		char *buf;
 
 		if (entry->id_for != peer_id)
 			continue;
@@ -193,47 +331,43 @@ int restore_sk_queue(int fd, unsigned int peer_id)
 		pr_info("\tRestoring %d-bytes skb for %u\n",
 			(unsigned int)entry->length, peer_id);
 
-		/*
-		 * Don't try to use sendfile here, because it use sendpage() and
-		 * all data are split on pages and a new skb is allocated for
-		 * each page. It creates a big overhead on SNDBUF.
-		 * sendfile() isn't suitable for DGRAM sockets, because message
-		 * boundaries messages should be saved.
-		 */
-
-		buf = xmalloc(entry->length);
-		if (buf ==NULL)
-			goto err;
-
-		if (lseek(img_raw_fd(img), pkt->img_off, SEEK_SET) == -1) {
-			pr_perror("lseek() failed");
-			xfree(buf);
-			goto err;
-		}
-		if (read_img_buf(img, buf, entry->length) != 1) {
-			xfree(buf);
-			goto err;
-		}
+		if (nr && (nr == SK_QUEUE_BATCH ||
+			   pkt->img_off + entry->length - start > buf_size)) {
+			if (send_sk_queue_batch(fd, b, nr, img, buf, start, end - start))
+				goto err;
 
-		ret = write(fd, buf, entry->length);
-		xfree(buf);
-		if (ret < 0) {
-			pr_perror("Failed to send packet");
-			goto err;
+			free_sk_packets(batch, nr);
+			nr = 0;
 		}
-		if (ret != entry->length) {
-			pr_err("Restored skb trimmed to %d/%d\n",
-			       ret, (unsigned int)entry->length);
-			goto err;
+
+		if (!nr) {
+			if (entry->length > buf_size) {
+				buf_size = max_t(size_t, entry->length, SK_QUEUE_RST_BUF);
+				xfree(buf);
+				buf = xmalloc(buf_size);
+				if (!buf)
+					goto err;
+			}
+			start = pkt->img_off;
 		}
-		list_del(&pkt->list);
-		sk_packet_entry__free_unpacked(entry, NULL);
-		xfree(pkt);
+		end = pkt->img_off + entry->length;
+
+		b->iovs[nr].iov_base = buf + (pkt->img_off - start);
+		b->iovs[nr].iov_len = entry->length;
+		memzero(&b->msgs[nr], sizeof(b->msgs[nr]));
+		b->msgs[nr].msg_hdr.msg_iov = &b->iovs[nr];
+		b->msgs[nr].msg_hdr.msg_iovlen = 1;
+		batch[nr++] = pkt;
 	}
 
-	close_image(img);
-	return 0;
+	if (nr && send_sk_queue_batch(fd, b, nr, img, buf, start, end - start))
+		goto err;
+
+	free_sk_packets(batch, nr);
+	ret = 0;
 err:
+	xfree(buf);
+	xfree(b);
 	close_image(img);
-	return -1;
+	return ret;
 }
@@ -24,6 +24,7 @@
 #include "kerndat.h"
 #include "restorer.h"
 #include "rst-malloc.h"
+#include "stats.h"
 
 #include "protobuf.h"
 #include "images/tcp-stream.pb-c.h"
@@ -150,7 +151,9 @@ static int tcp_repair_establised(int fd, struct inet_sk_desc *sk)
 	}
 
 	if (!(root_ns_mask & CLONE_NEWNET)) {
+		span_start(SPAN_NET_LOCK);
 		ret = nf_lock_connection(sk);
+		span_stop(SPAN_NET_LOCK);
 		if (ret < 0)
 			goto err2;
 	}
@@ -198,8 +201,11 @@ void cpt_unlock_tcp_connections(void)
 {
 	struct inet_sk_desc *sk, *n;
 
+	nf_unlock_batch_start();
 	list_for_each_entry_safe(sk, n, &cpt_tcp_repair_sockets, rlist)
 		tcp_unlock_one(sk);
+	if (nf_unlock_batch_end())
+		pr_err("Failed to unlock TCP connections\n");
 }
 
 /*
@@ -793,8 +799,10 @@ void rst_unlock_tcp_connections(void)
 	if (root_ns_mask & CLONE_NEWNET)
 		return;
 
+	nf_unlock_batch_start();
 	list_for_each_entry(ii, &rst_tcp_repair_sockets, rlist)
 		nf_unlock_connection_info(ii);
+	nf_unlock_batch_end();
 }
 
 int check_tcp(void)
@@ -1375,7 +1375,7 @@ struct collect_image_info unix_sk_cinfo = {
 	.pb_type = PB_UNIX_SK,
 	.priv_size = sizeof(struct unix_sk_info),
 	.collect = collect_one_unixsk,
-	.flags = COLLECT_SHARED,
+	.flags = COLLECT_SHARED | COLLECT_ARENA,
 };
 
 static void interconnected_pair(struct unix_sk_info *ui, struct unix_sk_info *peer)
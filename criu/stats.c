@@ -1,9 +1,13 @@
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include "asm/atomic.h"
 #include "rst-malloc.h"
 #include "protobuf.h"
+#include "cr_options.h"
 #include "stats.h"
 #include "image.h"
 #include "images/stats.pb-c.h"
@@ -13,9 +17,18 @@ struct timing {
 	struct timeval total;
 };
 
+struct task_files_stat {
+	u32		pid;
+	u32		fds;
+	u64		time;
+};
+
 struct dump_stats {
 	struct timing	timings[DUMP_TIME_NR_STATS];
 	unsigned long	counts[DUMP_CNT_NR_STATS];
+
+	struct task_files_stat	*task_files;
+	unsigned int		nr_task_files;
 };
 
 struct restore_stats {
@@ -26,6 +39,76 @@ struct restore_stats {
 struct dump_stats *dstats;
 struct restore_stats *rstats;
 
+struct span {
+	u64	start;
+	u64	end;
+	s32	pid;
+	u32	type;
+};
+
+/*
+ * The time is in usecs and summed over all the tasks, so it doesn't
+ * fit 32 bits on big trees. There's no 64-bit atomic_t, thus it's
+ * added to with the compiler builtin.
+ */
+struct span_stats {
+	atomic_t	count;
+	u64		time;
+};
+
+/*
+ * Lives in shared memory, so that tasks forked on restore
+ * can account their spans too. The ring is only there with
+ * --trace and keeps the last SPANS_RING_SIZE spans.
+ */
+#define SPANS_RING_SIZE		(1 << 16)
+
+struct spans {
+	pid_t			criu_pid;
+	u64			base;
+	unsigned int		ring_size;
+	atomic_t		head;
+	struct span_stats	stats[SPAN_NR_STATS];
+	struct span		ring[0];
+};
+
+static struct spans *spans;
+static u64 span_starts[SPAN_NR_STATS];
+static int span_task;
+
+static const char *span_names[SPAN_NR_STATS] = {
+	[SPAN_COLLECT_MAPPINGS]		= "collect_mappings",
+	[SPAN_INFECT]			= "parasite_infect",
+	[SPAN_DUMP_FILES]		= "dump_files",
+	[SPAN_DUMP_PAGES]		= "dump_pages",
+	[SPAN_PAGE_XFER]		= "page_xfer",
+	[SPAN_CURE]			= "parasite_cure",
+	[SPAN_COLLECT_SOCKETS]		= "collect_sockets",
+	[SPAN_MNT_NS]			= "dump_mnt_ns",
+	[SPAN_CGROUPS]			= "dump_cgroups",
+	[SPAN_NET_LOCK]			= "net_lock",
+	[SPAN_NET_UNLOCK]		= "net_unlock",
+	[SPAN_FREEZE_CGROUP]		= "freeze_cgroup",
+	[SPAN_SEIZE_SCAN]		= "seize_scan_proc",
+	[SPAN_SEIZE_INTERRUPT]		= "seize_interrupt",
+	[SPAN_SEIZE_WAIT]		= "seize_wait",
+	[SPAN_UNFREEZE]			= "unfreeze",
+	[SPAN_RST_SHARED]		= "prepare_shared",
+	[SPAN_RST_MAPPINGS]		= "prepare_mappings",
+	[SPAN_RST_FORK]			= "fork_children",
+	[SPAN_RST_FILES]		= "prepare_fds",
+	[SPAN_RST_VMAS]			= "open_vmas",
+	[SPAN_RST_SIGRETURN]		= "prepare_sigreturn",
+	[SPAN_RST_COLLECT]		= "collect_images",
+	[SPAN_RST_PAGEMAPS]		= "load_pagemaps",
+	[SPAN_STAGE_RESTORE_NS]		= "stage_restore_ns",
+	[SPAN_STAGE_RESTORE_SHARED]	= "stage_restore_shared",
+	[SPAN_STAGE_FORKING]		= "stage_forking",
+	[SPAN_STAGE_RESTORE]		= "stage_restore",
+	[SPAN_STAGE_RESTORE_SIGCHLD]	= "stage_restore_sigchld",
+	[SPAN_STAGE_RESTORE_CREDS]	= "stage_restore_creds",
+};
+
 void cnt_add(int c, unsigned long val)
 {
 	if (dstats != NULL) {
@@ -92,6 +175,193 @@ void timing_stop(int t)
 	timeval_accumulate(&tm->start, &now, &tm->total);
 }
 
+static u64 span_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+void span_start(int s)
+{
+	BUG_ON(s >= SPAN_NR_STATS);
+	span_starts[s] = span_now();
+}
+
+/*
+ * Returns the span's duration in usecs, or 0 if the span
+ * wasn't started or spans are off.
+ */
+u64 span_stop(int s)
+{
+	struct span *sp;
+	u64 took;
+	u64 now;
+	int idx;
+
+	BUG_ON(s >= SPAN_NR_STATS);
+	if (!spans || !span_starts[s])
+		return 0;
+
+	now = span_now();
+	took = (now - span_starts[s]) / 1000;
+	atomic_inc(&spans->stats[s].count);
+	__sync_fetch_and_add(&spans->stats[s].time, took);
+
+	if (spans->ring_size) {
+		idx = atomic_add_return(1, &spans->head) - 1;
+		sp = &spans->ring[idx % spans->ring_size];
+		sp->start = span_starts[s];
+		sp->end = now;
+		sp->pid = span_task ? : getpid();
+		sp->type = s;
+	}
+
+	span_starts[s] = 0;
+	return took;
+}
+
+/*
+ * Dump runs all the tasks from one criu process, so spans
+ * are attributed to the task being dumped explicitly.
+ */
+void span_set_task(int pid)
+{
+	span_task = pid;
+}
+
+static int init_spans(void)
+{
+	unsigned int ring_size = opts.trace ? SPANS_RING_SIZE : 0;
+	size_t size;
+
+	size = sizeof(*spans) + ring_size * sizeof(struct span);
+	spans = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (spans == MAP_FAILED) {
+		pr_perror("Can't allocate spans");
+		spans = NULL;
+		return -1;
+	}
+
+	spans->criu_pid = getpid();
+	spans->base = span_now();
+	spans->ring_size = ring_size;
+	return 0;
+}
+
+static void encode_spans(PhaseStatsEntry *ent, PhaseStatsEntry **ents, size_t *n)
+{
+	int i;
+
+	*n = 0;
+	if (!spans)
+		return;
+
+	for (i = 0; i < SPAN_NR_STATS; i++) {
+		if (!atomic_read(&spans->stats[i].count))
+			continue;
+
+		phase_stats_entry__init(ent);
+		ent->name = (char *)span_names[i];
+		ent->count = atomic_read(&spans->stats[i].count);
+		ent->time = spans->stats[i].time;
+		ents[(*n)++] = ent++;
+	}
+}
+
+/*
+ * Spans in the chrome://tracing (and Perfetto) JSON format,
+ * one track per task.
+ */
+static void write_trace(char *name)
+{
+	char path[32];
+	unsigned int i, head, nr;
+	FILE *f;
+
+	if (!spans || !spans->ring_size)
+		return;
+
+	snprintf(path, sizeof(path), "trace-%s.json", name);
+	f = fopen(path, "w");
+	if (!f) {
+		pr_perror("Can't create %s", path);
+		return;
+	}
+
+	head = atomic_read(&spans->head);
+	nr = min(head, spans->ring_size);
+	if (head > nr)
+		pr_warn("%u spans lost from trace\n", head - nr);
+
+	fprintf(f, "{\"traceEvents\":[");
+	for (i = head - nr; i != head; i++) {
+		struct span *sp = &spans->ring[i % spans->ring_size];
+		u64 ts = sp->start - spans->base;
+		u64 dur = sp->end - sp->start;
+
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+				"\"ts\":%llu.%03llu,\"dur\":%llu.%03llu}",
+				i == head - nr ? "" : ",", span_names[sp->type],
+				spans->criu_pid, sp->pid,
+				(unsigned long long)ts / 1000, (unsigned long long)ts % 1000,
+				(unsigned long long)dur / 1000, (unsigned long long)dur % 1000);
+	}
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+	if (fclose(f))
+		pr_perror("Can't write %s", path);
+}
+
+/*
+ * Files are dumped task by task, so a long dump_files phase is
+ * usually one task with lots of fds. Keep the time per task.
+ */
+void stats_task_files(int pid, unsigned int nr_fds, u64 usec)
+{
+	struct task_files_stat *tf;
+
+	if (!dstats)
+		return;
+
+	if (!(dstats->nr_task_files & (dstats->nr_task_files + 1)) &&
+	    xrealloc_safe(&dstats->task_files,
+			  2 * (dstats->nr_task_files + 1) * sizeof(*tf)))
+		return;
+
+	tf = &dstats->task_files[dstats->nr_task_files++];
+	tf->pid = pid;
+	tf->fds = nr_fds;
+	tf->time = usec;
+}
+
+static int encode_task_files(DumpStatsEntry *ds)
+{
+	TaskFilesStatsEntry *ents;
+	unsigned int i, nr = dstats->nr_task_files;
+
+	if (!nr)
+		return 0;
+
+	ents = xmalloc(nr * (sizeof(*ents) + sizeof(TaskFilesStatsEntry *)));
+	if (!ents)
+		return -1;
+
+	ds->task_files = (TaskFilesStatsEntry **)(ents + nr);
+	for (i = 0; i < nr; i++) {
+		task_files_stats_entry__init(&ents[i]);
+		ents[i].pid = dstats->task_files[i].pid;
+		ents[i].fds = dstats->task_files[i].fds;
+		ents[i].time = dstats->task_files[i].time;
+		ds->task_files[i] = &ents[i];
+	}
+	ds->n_task_files = nr;
+
+	return 0;
+}
+
 static void encode_time(int t, u_int32_t *to)
 {
 	struct timing *tm;
@@ -105,6 +375,7 @@ void write_stats(int what)
 	StatsEntry stats = STATS_ENTRY__INIT;
 	DumpStatsEntry ds_entry = DUMP_STATS_ENTRY__INIT;
 	RestoreStatsEntry rs_entry = RESTORE_STATS_ENTRY__INIT;
+	PhaseStatsEntry phases[SPAN_NR_STATS], *phase_ents[SPAN_NR_STATS];
 	char *name;
 	struct cr_img *img;
 
@@ -122,6 +393,18 @@ void write_stats(int what)
 		ds_entry.pages_scanned = dstats->counts[CNT_PAGES_SCANNED];
 		ds_entry.pages_skipped_parent = dstats->counts[CNT_PAGES_SKIPPED_PARENT];
 		ds_entry.pages_written = dstats->counts[CNT_PAGES_WRITTEN];
+		ds_entry.has_kcmp_calls = true;
+		ds_entry.kcmp_calls = dstats->counts[CNT_KCMP_CALLS];
+		ds_entry.has_pagemap_reads = true;
+		ds_entry.pagemap_reads = dstats->counts[CNT_PAGEMAP_READS];
+		ds_entry.has_pagemap_bytes = true;
+		ds_entry.pagemap_bytes = dstats->counts[CNT_PAGEMAP_BYTES];
+
+		encode_spans(phases, phase_ents, &ds_entry.n_phases);
+		ds_entry.phases = phase_ents;
+
+		if (encode_task_files(&ds_entry))
+			pr_warn("Per-task files stats are not written\n");
 
 		name = "dump";
 	} else if (what == RESTORE_STATS) {
@@ -135,6 +418,9 @@ void write_stats(int what)
 		encode_time(TIME_FORK, &rs_entry.forking_time);
 		encode_time(TIME_RESTORE, &rs_entry.restore_time);
 
+		encode_spans(phases, phase_ents, &rs_entry.n_phases);
+		rs_entry.phases = phase_ents;
+
 		name = "restore";
 	} else
 		return;
@@ -144,10 +430,18 @@ void write_stats(int what)
 		pb_write_one(img, &stats, PB_STATS);
 		close_image(img);
 	}
+
+	if (ds_entry.n_task_files)
+		xfree(ds_entry.task_files[0]);
+
+	write_trace(name);
 }
 
 int init_stats(int what)
 {
+	if (init_spans())
+		return -1;
+
 	if (what == DUMP_STATS) {
 		dstats = xzalloc(sizeof(*dstats));
 		return dstats ? 0 : -1;
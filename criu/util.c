@@ -50,6 +50,7 @@
 #include "servicefd.h"
 #include "cr-service.h"
 #include "files.h"
+#include "syscall-codes.h"
 
 #include "cr-errno.h"
 
@@ -288,6 +289,18 @@ int close_pid_proc(void)
 	return 0;
 }
 
+/*
+ * A child sharing the fd table with us must not close the cached
+ * /proc fds, they are not its own. This makes it open its own ones,
+ * which it then closes with close_pid_proc().
+ */
+void forget_pid_proc(void)
+{
+	open_proc_self_fd = -1;
+	open_proc_pid = PROC_NONE;
+	open_proc_fd = -1;
+}
+
 void close_proc()
 {
 	close_pid_proc();
@@ -537,6 +550,68 @@ int copy_file(int fd_in, int fd_out, size_t bytes)
 	return 0;
 }
 
+/*
+ * Copies @len bytes between files at given offsets, or at the current
+ * file positions if the offsets are NULL. copy_file_range() lets the
+ * file system share the blocks (reflink) or at least saves the copy
+ * to user space; sendfile() is used with old kernels or when the files
+ * are on different file systems.
+ */
+int copy_file_chunk(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len)
+{
+	static bool no_cfr;
+	ssize_t ret;
+
+	while (len && !no_cfr) {
+		loff_t *li = (loff_t *)off_in, *lo = (loff_t *)off_out;
+
+		ret = syscall(__NR_copy_file_range, fd_in, li, fd_out, lo, len, 0);
+		if (ret > 0) {
+			len -= ret;
+			continue;
+		}
+
+		if (ret == 0)
+			goto short_file;
+
+		if (errno == ENOSYS) {
+			no_cfr = true;
+			break;
+		}
+		if (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+			break;
+
+		pr_perror("Can't copy file data");
+		return -1;
+	}
+
+	if (len && off_out && lseek(fd_out, *off_out, SEEK_SET) != *off_out) {
+		pr_perror("Can't seek file");
+		return -1;
+	}
+
+	while (len) {
+		ret = sendfile(fd_out, fd_in, off_in, len);
+		if (ret < 0) {
+			pr_perror("Can't send file data");
+			return -1;
+		}
+
+		if (ret == 0)
+			goto short_file;
+
+		if (off_out)
+			*off_out += ret;
+		len -= ret;
+	}
+
+	return 0;
+
+short_file:
+	pr_err("File is shorter than expected, %zu bytes left\n", len);
+	return -1;
+}
+
 int read_fd_link(int lfd, char *buf, size_t size)
 {
 	char t[32];
@@ -179,21 +179,41 @@ class pagemap_handler:
 	"""
 	Special entry handler for pagemap.img, which is unique in a way
 	that it has a header of pagemap_head type followed by entries
-	of pagemap_entry type.
+	of pagemap_entry type. When the header has the packed flag set,
+	entries are fixed-size (vaddr, nr_pages, flags) structures.
 	"""
+	packed_fmt = 'QII'
+	packed_parent = 1
+
 	def load(self, f, pretty = False, no_payload = False):
 		entries = []
 
+		buf = f.read(4)
+		if buf == '':
+			return entries
+		size, = struct.unpack('i', buf)
 		pb = pagemap_head()
-		while True:
-			buf = f.read(4)
-			if buf == '':
-				break
-			size, = struct.unpack('i', buf)
-			pb.ParseFromString(f.read(size))
-			entries.append(pb2dict.pb2dict(pb, pretty))
+		pb.ParseFromString(f.read(size))
+		entries.append(pb2dict.pb2dict(pb, pretty))
+		packed = pb.packed
 
+		psize = struct.calcsize(self.packed_fmt)
+		while True:
 			pb = pagemap_entry()
+			if packed:
+				buf = f.read(psize)
+				if buf == '':
+					break
+				pb.vaddr, pb.nr_pages, flags = struct.unpack(self.packed_fmt, buf)
+				if flags & self.packed_parent:
+					pb.in_parent = True
+			else:
+				buf = f.read(4)
+				if buf == '':
+					break
+				size, = struct.unpack('i', buf)
+				pb.ParseFromString(f.read(size))
+			entries.append(pb2dict.pb2dict(pb, pretty))
 
 		return entries
 
@@ -203,13 +223,20 @@ class pagemap_handler:
 
 	def dump(self, entries, f):
 		pb = pagemap_head()
+		packed = False
 		for item in entries:
 			pb2dict.dict2pb(item, pb)
-			pb_str = pb.SerializeToString()
-			size = len(pb_str)
-			f.write(struct.pack('i', size))
-			f.write(pb_str)
-
+			if packed:
+				flags = self.packed_parent if pb.in_parent else 0
+				f.write(struct.pack(self.packed_fmt, pb.vaddr, pb.nr_pages, flags))
+			else:
+				pb_str = pb.SerializeToString()
+				size = len(pb_str)
+				f.write(struct.pack('i', size))
+				f.write(pb_str)
+
+			if isinstance(pb, pagemap_head):
+				packed = pb.packed
 			pb = pagemap_entry()
 
 	def dumps(self, entries):
@@ -218,7 +245,7 @@ class pagemap_handler:
 		return f.read()
 
 	def count(self, f):
-		return entry_handler(None).count(f) - 1
+		return len(self.load(f)) - 1
 
 
 # In following extra handlers we use base64 encoding
@@ -257,12 +284,36 @@ class sk_queues_extra_handler:
 
 class ghost_file_extra_handler:
 	def load(self, f, pb):
-		data = f.read()
-		return data.encode('base64')
+		if not pb.chunks:
+			data = f.read()
+			return data.encode('base64')
+
+		chunks = []
+		while True:
+			buf = f.read(4)
+			if buf == '':
+				break
+			size, = struct.unpack('i', buf)
+			gc = ghost_chunk_entry()
+			gc.ParseFromString(f.read(size))
+			data = f.read(gc.len)
+			chunks.append(pb2dict.pb2dict(gc))
+			chunks.append(data.encode('base64'))
+		return chunks
 
 	def dump(self, extra, f, pb):
-		data = extra.decode('base64')
-		f.write(data)
+		if not pb.chunks:
+			data = extra.decode('base64')
+			f.write(data)
+			return
+
+		for i in range (0, len(extra), 2):
+			gc = ghost_chunk_entry()
+			pb2dict.dict2pb(extra[i], gc)
+			gc_str = gc.SerializeToString()
+			f.write(struct.pack('i', len(gc_str)))
+			f.write(gc_str)
+			f.write(extra[i + 1].decode('base64'))
 
 	def skip(self, f, pb):
 		p = f.tell()
@@ -0,0 +1,112 @@
+#
+# Prints messages left in the deferred log buffer (see --log-deferred
+# in criu/log.c) of a crashed criu from its core file:
+#
+#   gdb -batch -x scripts/criu-log-gdb.py criu/criu core
+#
+# Only 64-bit little-endian cores are supported.
+#
+
+import os
+import re
+import struct
+
+import gdb
+
+# struct dlog_rec without args
+REC_HDR = "<IIiiqqQ"
+REC_HDR_SIZE = struct.calcsize(REC_HDR)
+
+spec_re = re.compile(r"%([#0\- +']*)(\*|\d*)(?:\.(\*|\d*))?(hh|h|ll|l|j|z|t|L)?([diuxXocpfFeEgGaAsm%])")
+
+levels = {1: "Error", 2: "Warn", 3: "Info", 4: "Debug"}
+
+
+def u64(data, off):
+	return struct.unpack_from("<Q", data, off)[0]
+
+
+def to_signed(v, bits):
+	v &= (1 << bits) - 1
+	if v >> (bits - 1):
+		v -= 1 << bits
+	return v
+
+
+def format_rec(fmt, err, data, off):
+	out = []
+	pos = 0
+
+	for m in spec_re.finditer(fmt):
+		out.append(fmt[pos:m.start()])
+		pos = m.end()
+
+		flags, width, prec, lng, conv = m.groups()
+		if conv == "%":
+			out.append("%")
+			continue
+		if conv == "m":
+			out.append(os.strerror(err))
+			continue
+
+		if width == "*":
+			width = str(to_signed(u64(data, off), 32))
+			off += 8
+		if prec == "*":
+			prec = str(to_signed(u64(data, off), 32))
+			off += 8
+
+		spec = "%" + flags.replace("'", "") + (width or "")
+		if prec is not None:
+			spec += "." + (prec or "0")
+
+		bits = 64 if lng in ("l", "ll", "j", "z", "t") else 32
+		v = u64(data, off)
+		off += 8
+
+		if conv in "di":
+			out.append((spec + "d") % to_signed(v, bits))
+		elif conv in "uxXo":
+			out.append((spec + conv.replace("u", "d")) % (v & ((1 << bits) - 1)))
+		elif conv == "c":
+			out.append((spec + "c") % chr(v & 0xff))
+		elif conv == "p":
+			out.append((spec + "s") % ("0x%x" % v if v else "(nil)"))
+		elif conv in "fFeEgGaA":
+			d = struct.unpack("<d", struct.pack("<Q", v))[0]
+			out.append((spec + conv.replace("a", "e").replace("A", "E")) % d)
+		elif conv == "s":
+			if v == (1 << 64) - 1:
+				s = "(null)"
+			else:
+				s = data[off:off + v].decode("utf-8", "replace")
+				off += (v + 1 + 7) & ~7
+			out.append((spec + "s") % s)
+
+	out.append(fmt[pos:])
+	return "".join(out)
+
+
+def main():
+	buf = int(gdb.parse_and_eval("(unsigned long)dlog_buf"))
+	head = int(gdb.parse_and_eval("dlog_head"))
+
+	if not buf or not head:
+		print("No deferred messages")
+		return
+
+	data = gdb.selected_inferior().read_memory(buf, head).tobytes()
+	pos = 0
+	while pos + REC_HDR_SIZE <= head:
+		size, level, err, _, sec, usec, fmt = struct.unpack_from(REC_HDR, data, pos)
+		if size < REC_HDR_SIZE:
+			print("Broken record at %d" % pos)
+			break
+
+		fmt = gdb.parse_and_eval("(const char *)%d" % fmt).string()
+		msg = format_rec(fmt, err, data, pos + REC_HDR_SIZE)
+		gdb.write("(%d.%06d) %-5s %s" % (sec, usec, levels.get(level, "?"), msg))
+		pos += size
+
+
+main()
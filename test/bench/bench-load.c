@@ -0,0 +1,427 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * Synthetic workloads for the benchmark. The workload is started
+ * in a new session in the background and its pid is written into
+ * the pidfile once everything is set up.
+ */
+
+#define PAGE_SZ		4096
+#define TREE_FANOUT	10
+#define DIR_FILES	1000
+#define DGRAM_QUEUE	1000
+#define DGRAM_SIZE	128
+#define TCP_PER_ADDR	16384	/* connections from one 127.0.x.1 address */
+#define ROUTES_PER_ADDR	100
+#define SHARED_TASKS	100	/* tasks sharing the same files */
+#define MOUNT_FILES	10	/* files opened via each bind mount */
+#define VMA_GAP		16	/* pages between the vmas workload's mappings */
+
+static int raise_nofile(unsigned long nr)
+{
+	struct rlimit rl = { .rlim_cur = nr + 64, .rlim_max = nr + 64, };
+
+	if (setrlimit(RLIMIT_NOFILE, &rl)) {
+		perror("Can't raise RLIMIT_NOFILE");
+		return -1;
+	}
+
+	return 0;
+}
+
+static char *heap(unsigned long mb)
+{
+	char *mem;
+
+	mem = mmap(NULL, mb << 20, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	return mem;
+}
+
+static void fill(char *mem, unsigned long size, unsigned long step, unsigned long gen)
+{
+	unsigned long off;
+
+	for (off = 0; off < size; off += step)
+		*(unsigned long *)(mem + off) = off * 2654435761u + gen;
+}
+
+static volatile unsigned int *tree_nr;
+
+static void tree_spawn(unsigned long idx, unsigned long nr)
+{
+	unsigned long i, child;
+
+	for (i = 1; i <= TREE_FANOUT; i++) {
+		child = idx * TREE_FANOUT + i;
+		if (child >= nr)
+			break;
+
+		switch (fork()) {
+		case -1:
+			perror("fork");
+			exit(1);
+		case 0:
+			__sync_fetch_and_add(tree_nr, 1);
+			tree_spawn(child, nr);
+			while (1)
+				pause();
+		}
+	}
+}
+
+static int setup(const char *mode, unsigned long size)
+{
+	unsigned long i;
+
+	if (!strcmp(mode, "heap-sparse")) {
+		char *mem = heap(size);
+
+		if (!mem)
+			return -1;
+		/* one page out of 64 */
+		fill(mem, size << 20, 64 * PAGE_SZ, 0);
+	} else if (!strcmp(mode, "heap-dense") || !strcmp(mode, "heap-dirty")) {
+		char *mem = heap(size);
+
+		if (!mem)
+			return -1;
+		fill(mem, size << 20, PAGE_SZ, 0);
+		if (!strcmp(mode, "heap-dense"))
+			return 0;
+
+		/*
+		 * Keep dirtying 1/16 of the heap every 100ms, so that
+		 * pre-dumps in a row always have something to do.
+		 */
+		if (fork())
+			return 0;
+		for (i = 1; ; i++) {
+			unsigned long chunk = (size << 20) / 16;
+
+			fill(mem + (i % 16) * chunk, chunk, PAGE_SZ, i);
+			usleep(100000);
+		}
+	} else if (!strcmp(mode, "tree")) {
+		tree_nr = mmap(NULL, PAGE_SZ, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (tree_nr == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+
+		tree_spawn(0, size);
+		while (*tree_nr < size - 1)
+			usleep(10000);
+	} else if (!strcmp(mode, "fds")) {
+		if (raise_nofile(size))
+			return -1;
+		for (i = 0; i < size; i++)
+			if (open("/dev/null", O_RDONLY) < 0) {
+				perror("open");
+				return -1;
+			}
+	} else if (!strcmp(mode, "shared-fds")) {
+		if (raise_nofile(size))
+			return -1;
+		for (i = 0; i < size; i++)
+			if (open("/dev/null", O_RDONLY) < 0) {
+				perror("open");
+				return -1;
+			}
+
+		/* Each file is restored by one task and sent to all the others */
+		for (i = 1; i < SHARED_TASKS; i++) {
+			switch (fork()) {
+			case -1:
+				perror("fork");
+				return -1;
+			case 0:
+				while (1)
+					pause();
+			}
+		}
+	} else if (!strcmp(mode, "unix")) {
+		int sk[2];
+
+		if (raise_nofile(size * 2))
+			return -1;
+		for (i = 0; i < size; i++)
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sk)) {
+				perror("socketpair");
+				return -1;
+			}
+	} else if (!strcmp(mode, "dgram")) {
+		int sk[2], buf = 64 << 20;
+		char msg[DGRAM_SIZE];
+
+		/* Queues of DGRAM_QUEUE packets, size packets in total */
+		if (raise_nofile(size / DGRAM_QUEUE * 2 + 2))
+			return -1;
+		memset(msg, 'x', sizeof(msg));
+		for (i = 0; i < size; i++) {
+			if (i % DGRAM_QUEUE == 0) {
+				if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sk)) {
+					perror("socketpair");
+					return -1;
+				}
+				if (setsockopt(sk[0], SOL_SOCKET, SO_SNDBUFFORCE, &buf, sizeof(buf))) {
+					perror("Can't set SO_SNDBUFFORCE");
+					return -1;
+				}
+			}
+
+			if (send(sk[0], msg, sizeof(msg), MSG_DONTWAIT) != sizeof(msg)) {
+				perror("send");
+				return -1;
+			}
+		}
+	} else if (!strcmp(mode, "tcp")) {
+		struct sockaddr_in addr = { .sin_family = AF_INET, };
+		socklen_t len = sizeof(addr);
+		int lsk, sk;
+
+		/* Established loopback connections, both ends are here */
+		if (raise_nofile(size * 2 + 1))
+			return -1;
+
+		lsk = socket(AF_INET, SOCK_STREAM, 0);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if (lsk < 0 || bind(lsk, (struct sockaddr *)&addr, sizeof(addr)) ||
+		    listen(lsk, 1024) ||
+		    getsockname(lsk, (struct sockaddr *)&addr, &len)) {
+			perror("Can't create listening socket");
+			return -1;
+		}
+
+		for (i = 0; i < size; i++) {
+			struct sockaddr_in src = { .sin_family = AF_INET, };
+
+			/* Spread over addresses not to run out of ports */
+			src.sin_addr.s_addr = htonl(0x7f000001 + ((i / TCP_PER_ADDR) << 8));
+			sk = socket(AF_INET, SOCK_STREAM, 0);
+			if (sk < 0 || bind(sk, (struct sockaddr *)&src, sizeof(src)) ||
+			    connect(sk, (struct sockaddr *)&addr, sizeof(addr)) ||
+			    accept(lsk, NULL, NULL) < 0) {
+				perror("Can't establish connection");
+				return -1;
+			}
+		}
+		close(lsk);
+	} else if (!strcmp(mode, "routes")) {
+		FILE *f;
+
+		/* Addresses and routes of the main table in a new netns */
+		if (unshare(CLONE_NEWNET)) {
+			perror("Can't create net namespace");
+			return -1;
+		}
+
+		f = popen("ip -batch -", "w");
+		if (!f) {
+			perror("popen");
+			return -1;
+		}
+
+		fprintf(f, "link set lo up\n");
+		for (i = 0; i < size; i++) {
+			if (i % ROUTES_PER_ADDR == 0)
+				fprintf(f, "addr add 10.%lu.%lu.1/24 dev lo\n",
+						i / ROUTES_PER_ADDR / 250,
+						i / ROUTES_PER_ADDR % 250);
+			if (i % 2 == 0)
+				fprintf(f, "route add 172.%lu.%lu.%lu dev lo\n",
+						16 + i / 62500, i / 250 % 250, i % 250);
+			else
+				fprintf(f, "route add 172.%lu.%lu.%lu via 172.%lu.%lu.%lu\n",
+						16 + i / 62500, i / 250 % 250, i % 250,
+						16 + (i - 1) / 62500, (i - 1) / 250 % 250, (i - 1) % 250);
+		}
+
+		if (pclose(f)) {
+			fprintf(stderr, "Can't set up routes\n");
+			return -1;
+		}
+	} else if (!strcmp(mode, "mounts") || !strcmp(mode, "mount-files")) {
+		int binds = !strcmp(mode, "mount-files");
+		char path[64];
+
+		if (unshare(CLONE_NEWNS) ||
+		    mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL)) {
+			perror("Can't create mount namespace");
+			return -1;
+		}
+
+		if (mkdir("mnt", 0700) && errno != EEXIST) {
+			perror("mkdir");
+			return -1;
+		}
+
+		if (mount("bench", "mnt", "tmpfs", 0, NULL)) {
+			perror("mount");
+			return -1;
+		}
+
+		if (binds && raise_nofile(size * MOUNT_FILES))
+			return -1;
+
+		/*
+		 * With binds all the mounts share one superblock and
+		 * every file is opened via its own mount.
+		 */
+		for (i = 1; i < size; i++) {
+			unsigned long j;
+
+			snprintf(path, sizeof(path), "mnt/%lu", i);
+			if (mkdir(path, 0700) ||
+			    (binds ? mount("mnt", path, NULL, MS_BIND, NULL) :
+				     mount("bench", path, "tmpfs", 0, NULL))) {
+				perror("Can't create mount");
+				return -1;
+			}
+
+			for (j = 0; binds && j < MOUNT_FILES; j++) {
+				snprintf(path, sizeof(path), "mnt/%lu/f%lu.%lu", i, i, j);
+				if (open(path, O_RDWR | O_CREAT, 0600) < 0) {
+					perror("Can't create file");
+					return -1;
+				}
+			}
+		}
+	} else if (!strcmp(mode, "vmas")) {
+		char *mem;
+
+		/*
+		 * Touched one-page mappings VMA_GAP pages apart. The area
+		 * is reserved first and then punched, not to have them
+		 * scattered by ASLR.
+		 */
+		mem = mmap(NULL, size * VMA_GAP * PAGE_SZ, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+
+		for (i = 0; i < size; i++) {
+			char *p = mem + i * VMA_GAP * PAGE_SZ;
+
+			if (mprotect(p, PAGE_SZ, PROT_READ | PROT_WRITE) ||
+			    munmap(p + PAGE_SZ, (VMA_GAP - 1) * PAGE_SZ)) {
+				perror("Can't create vma");
+				return -1;
+			}
+			*p = 1;
+		}
+	} else if (!strcmp(mode, "inotify")) {
+		char path[64];
+		int ifd, fd;
+
+		/*
+		 * A tree of files with every DIR_FILES-th one watched.
+		 * The watches are resolved by irmap when dumped with
+		 * --force-irmap --irmap-scan-path <dir>/files.
+		 */
+		ifd = inotify_init1(0);
+		if (ifd < 0) {
+			perror("inotify_init1");
+			return -1;
+		}
+
+		if (mkdir("files", 0700) && errno != EEXIST) {
+			perror("mkdir");
+			return -1;
+		}
+
+		for (i = 0; i < size; i++) {
+			if (i % DIR_FILES == 0) {
+				snprintf(path, sizeof(path), "files/%lu", i / DIR_FILES);
+				if (mkdir(path, 0700) && errno != EEXIST) {
+					perror("mkdir");
+					return -1;
+				}
+			}
+
+			snprintf(path, sizeof(path), "files/%lu/%lu", i / DIR_FILES, i);
+			fd = open(path, O_CREAT | O_WRONLY, 0600);
+			if (fd < 0) {
+				perror("open");
+				return -1;
+			}
+			close(fd);
+
+			if (i % DIR_FILES == DIR_FILES / 2 &&
+			    inotify_add_watch(ifd, path, IN_MODIFY) < 0) {
+				perror("inotify_add_watch");
+				return -1;
+			}
+		}
+	} else {
+		fprintf(stderr, "Unknown workload %s\n", mode);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char tmp[PATH_MAX];
+	FILE *f;
+	int fd;
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s <workload> <size> <pidfile>\n", argv[0]);
+		return 1;
+	}
+
+	/* The workload gets reparented to init and lives in its own session */
+	if (fork())
+		return 0;
+	setsid();
+
+	fd = open("/dev/null", O_RDWR);
+	dup2(fd, 0);
+	dup2(fd, 1);
+	close(fd);
+
+	if (setup(argv[1], strtoul(argv[2], NULL, 0)))
+		return 1;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", argv[3]);
+	f = fopen(tmp, "w");
+	if (!f) {
+		perror("fopen");
+		return 1;
+	}
+	fprintf(f, "%d", getpid());
+	fclose(f);
+	rename(tmp, argv[3]);
+
+	while (1)
+		pause();
+
+	return 0;
+}
@@ -0,0 +1,197 @@
+#!/usr/bin/env python2
+#
+# Performance benchmark: runs dump, pre-dump and restore of synthetic
+# workloads (see bench-load.c) and reports wall-clock times together
+# with criu's own stats-dump and stats-restore as JSON. The "rate" is
+# the workload size (files, packets, ...) per second. Needs root,
+# doesn't need network.
+#
+
+import argparse
+import json
+import os
+import shutil
+import signal
+import subprocess
+import sys
+import time
+
+bench_dir = os.path.dirname(os.path.abspath(__file__))
+criu_bin = os.path.join(bench_dir, "../../criu/criu")
+crit_bin = os.path.join(bench_dir, "../../crit/crit")
+load_bin = os.path.join(bench_dir, "bench-load")
+
+# name, bench-load workload, size, number of pre-dumps
+workloads = [
+	("heap-sparse",	"heap-sparse",	4096,	0),	# MB, 1/64 touched
+	("heap-dense",	"heap-dense",	1024,	0),	# MB
+	("tree",	"tree",		1000,	0),	# processes
+	("fds",		"fds",		100000,	0),	# open files
+	("shared-fds",	"shared-fds",	1000,	0),	# open files, shared by 100 tasks
+	("unix",	"unix",		10000,	0),	# socket pairs
+	("sk-queue",	"dgram",	100000,	0),	# queued unix datagrams
+	("tcp-1k",	"tcp",		1000,	0),	# established connections
+	("tcp-10k",	"tcp",		10000,	0),
+	("tcp-50k",	"tcp",		50000,	0),
+	("routes",	"routes",	10000,	0),	# routes in a netns, 1/100 addresses
+	("mounts",	"mounts",	5000,	0),	# tmpfs mounts
+	("mount-files",	"mount-files",	10000,	0),	# bind mounts, 10 open files via each
+	("pre-dump",	"heap-dirty",	1024,	5),	# MB, 1/16 dirtied each 100ms
+	("vmas",	"vmas",		30000,	1),	# one-page mappings, pre-dumped once
+	("irmap",	"inotify",	1000000, 0),	# files, 1/1000 watched
+	("irmap-pre",	"inotify",	1000000, 1),	# same with the pre-dumped index
+]
+
+# extra dump options, %(dir)s is the workload directory
+workload_opts = {
+	"inotify": ["--force-irmap", "--irmap-scan-path", "%(dir)s/files"],
+	"tcp": ["--tcp-established"],
+}
+
+# extra restore options
+workload_rst_opts = {
+	"tcp": ["--tcp-established"],
+}
+
+
+class bench_fail(Exception):
+	pass
+
+
+def wait_pidfile(path, timeout = 300):
+	start = time.time()
+	while not os.access(path, os.F_OK):
+		if time.time() - start > timeout:
+			raise bench_fail("Workload didn't start in %d seconds" % timeout)
+		time.sleep(0.1)
+	return int(open(path).read())
+
+
+def kill_tree(pid):
+	try:
+		os.killpg(pid, signal.SIGKILL)
+	except OSError:
+		pass
+
+
+def criu(action, wdir, args):
+	cmd = [criu_bin, action, "-D", wdir, "-o", "%s.log" % action, "-v4"] + args
+	start = time.time()
+	ret = subprocess.call(cmd)
+	took = time.time() - start
+	if ret != 0:
+		raise bench_fail("%s failed, see %s/%s.log" % (action, wdir, action))
+	return took
+
+
+def load_stats(wdir, what):
+	path = os.path.join(wdir, "stats-%s" % what)
+	if not os.access(path, os.F_OK):
+		return None
+
+	out = subprocess.check_output([crit_bin, "decode", "-i", path])
+	return json.loads(out)["entries"][0][what]
+
+
+def run_workload(name, mode, size, pre, top):
+	wdir = os.path.join(os.path.abspath(top), name)
+	shutil.rmtree(wdir, True)
+	os.makedirs(wdir)
+
+	res = {"workload": name, "size": size}
+	pidfile = os.path.join(wdir, "load.pid")
+	log = open(os.path.join(wdir, "load.log"), "w")
+	if subprocess.call([load_bin, mode, str(size), pidfile], cwd = wdir, stderr = log):
+		raise bench_fail("Can't start %s workload" % mode)
+	pid = wait_pidfile(pidfile)
+
+	try:
+		args = ["-t", str(pid)]
+		args += [o % {"dir": wdir} for o in workload_opts.get(mode, [])]
+		res["pre-dump"] = []
+		for i in range(pre):
+			d = os.path.join(wdir, "pre-%d" % i)
+			os.mkdir(d)
+			pargs = args + ["--track-mem"]
+			if i:
+				pargs += ["--prev-images-dir", "../pre-%d" % (i - 1)]
+			took = criu("pre-dump", d, pargs)
+			res["pre-dump"].append({"time": took, "stats": load_stats(d, "dump")})
+
+		d = os.path.join(wdir, "dump")
+		os.mkdir(d)
+		if pre:
+			args += ["--track-mem", "--prev-images-dir", "../pre-%d" % (pre - 1)]
+		took = criu("dump", d, args)
+		res["dump"] = {"time": took, "rate": size / took, "stats": load_stats(d, "dump")}
+	except:
+		kill_tree(pid)
+		raise
+
+	rpidfile = os.path.join(wdir, "restore.pid")
+	try:
+		rargs = ["-d", "--pidfile", rpidfile] + workload_rst_opts.get(mode, [])
+		took = criu("restore", d, rargs)
+		res["restore"] = {"time": took, "rate": size / took, "stats": load_stats(d, "restore")}
+	finally:
+		if os.access(rpidfile, os.F_OK):
+			kill_tree(int(open(rpidfile).read()))
+
+	return res
+
+
+def main():
+	p = argparse.ArgumentParser("CRIU performance benchmark")
+	p.add_argument("-w", "--workload", action = "append",
+			help = "workload to run (default all): %s" %
+			", ".join([w[0] for w in workloads]))
+	p.add_argument("--scale", type = float, default = 1.0,
+			help = "scale workload sizes by this factor")
+	p.add_argument("--iters", type = int, default = 1,
+			help = "number of runs of each workload")
+	p.add_argument("--dir", default = os.path.join(bench_dir, "dump"),
+			help = "where to put images")
+	p.add_argument("-o", "--output", help = "write results here (default stdout)")
+	p.add_argument("--netns", action = "store_true",
+			help = "run in a new network namespace, e.g. for tcp workloads "
+			"not to touch the host's netfilter rules")
+	opts = p.parse_args()
+
+	if opts.netns and not os.getenv("BENCH_NETNS"):
+		os.environ["BENCH_NETNS"] = "1"
+		os.execvp("unshare", ["unshare", "-n", "sh", "-c",
+				'ip link set lo up && exec "$0" "$@"'] + sys.argv)
+
+	results = []
+	failed = False
+	for name, mode, size, pre in workloads:
+		if opts.workload and name not in opts.workload:
+			continue
+
+		size = max(1, int(size * opts.scale))
+		for it in range(opts.iters):
+			sys.stderr.write("=== %s (%d), iteration %d\n" % (name, size, it))
+			try:
+				res = run_workload(name, mode, size, pre, opts.dir)
+			except bench_fail as e:
+				sys.stderr.write("FAIL: %s\n" % e)
+				res = {"workload": name, "size": size, "error": str(e)}
+				failed = True
+			res["iteration"] = it
+			results.append(res)
+
+	out = {
+		"kernel": os.uname()[2],
+		"date": time.strftime("%Y-%m-%dT%H:%M:%S"),
+		"results": results,
+	}
+
+	f = open(opts.output, "w") if opts.output else sys.stdout
+	json.dump(out, f, indent = 2, sort_keys = True)
+	f.write("\n")
+
+	return 1 if failed else 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/*
+ * Microbenchmark of the ways to collect what dump needs to know
+ * about an fd (pos, flags, mnt_id, owner signal): reading
+ * /proc/self/fdinfo/N per fd versus the syscalls the parasite
+ * makes. Prints the rates in fds per second as JSON.
+ */
+
+#define STATX_MNT_ID	0x1000
+
+struct bench_statx {
+	uint32_t	stx_mask;
+	uint32_t	stx_blksize;
+	uint64_t	stx_attributes;
+	uint32_t	stx_nlink;
+	uint32_t	stx_uid;
+	uint32_t	stx_gid;
+	uint16_t	stx_mode;
+	uint16_t	__spare0;
+	uint64_t	stx_ino;
+	uint64_t	stx_size;
+	uint64_t	stx_blocks;
+	uint64_t	stx_attributes_mask;
+	uint64_t	stx_time[8];
+	uint32_t	stx_rdev_major;
+	uint32_t	stx_rdev_minor;
+	uint32_t	stx_dev_major;
+	uint32_t	stx_dev_minor;
+	uint64_t	stx_mnt_id;
+	uint64_t	__spare2[13];
+};
+
+struct info {
+	unsigned long long	pos;
+	unsigned int		flags;
+	int			mnt_id;
+	int			signum;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_fds(int *fds, int nr)
+{
+	int i = 0, p[2];
+
+	/* files, pipes, sockets and dups, a quarter each */
+	while (i < nr) {
+		switch (i % 4) {
+		case 0:
+			fds[i++] = open("/dev/null", O_RDONLY);
+			break;
+		case 1:
+			if (pipe(p))
+				return -1;
+			fds[i++] = p[0];
+			if (i < nr)
+				fds[i++] = p[1];
+			continue;
+		case 2:
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, p))
+				return -1;
+			fds[i++] = p[0];
+			if (i < nr)
+				fds[i++] = p[1];
+			continue;
+		case 3:
+			fds[i] = dup(fds[i - 3]);
+			i++;
+			break;
+		}
+
+		if (fds[i - 1] < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int collect_fdinfo(int fd, struct info *in)
+{
+	char path[64], buf[4096], *s;
+	int pfd, ret;
+
+	snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", fd);
+	pfd = open(path, O_RDONLY);
+	if (pfd < 0)
+		return -1;
+	ret = read(pfd, buf, sizeof(buf) - 1);
+	close(pfd);
+	if (ret <= 0)
+		return -1;
+	buf[ret] = '\0';
+
+	for (s = buf; s && *s; s = strchr(s, '\n'), s = s ? s + 1 : NULL) {
+		if (!strncmp(s, "pos:", 4))
+			in->pos = strtoull(s + 4, NULL, 0);
+		else if (!strncmp(s, "flags:", 6))
+			in->flags = strtoul(s + 6, NULL, 0);
+		else if (!strncmp(s, "mnt_id:", 7))
+			in->mnt_id = strtol(s + 7, NULL, 0);
+	}
+
+	in->signum = fcntl(fd, F_GETSIG, 0);
+	return 0;
+}
+
+static int collect_syscalls(int fd, struct info *in)
+{
+	struct bench_statx stx;
+	off_t pos;
+
+	pos = lseek(fd, 0, SEEK_CUR);
+	in->pos = pos < 0 ? 0 : pos;
+	in->flags = fcntl(fd, F_GETFL);
+	if (fcntl(fd, F_GETFD) & FD_CLOEXEC)
+		in->flags |= O_CLOEXEC;
+	in->signum = fcntl(fd, F_GETSIG, 0);
+
+	in->mnt_id = -1;
+#ifdef SYS_statx
+	if (!syscall(SYS_statx, fd, "", AT_EMPTY_PATH, STATX_MNT_ID, &stx) &&
+	    (stx.stx_mask & STATX_MNT_ID))
+		in->mnt_id = stx.stx_mnt_id;
+#endif
+	return 0;
+}
+
+static double run(int *fds, int nr, int (*collect)(int, struct info *))
+{
+	struct info in;
+	double start = now();
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (collect(fds[i], &in)) {
+			fprintf(stderr, "Can't collect fd %d\n", fds[i]);
+			exit(1);
+		}
+
+	return nr / (now() - start);
+}
+
+int main(int argc, char **argv)
+{
+	int nr = argc > 1 ? atoi(argv[1]) : 100000;
+	struct rlimit rl = { .rlim_cur = nr + 64, .rlim_max = nr + 64, };
+	int *fds;
+
+	if (nr <= 0 || setrlimit(RLIMIT_NOFILE, &rl)) {
+		perror("Can't raise RLIMIT_NOFILE");
+		return 1;
+	}
+
+	fds = malloc(nr * sizeof(int));
+	if (!fds || open_fds(fds, nr)) {
+		perror("Can't open fds");
+		return 1;
+	}
+
+	printf("{\"fds\": %d, \"fdinfo\": %.0f, \"syscalls\": %.0f}\n", nr,
+			run(fds, nr, collect_fdinfo), run(fds, nr, collect_syscalls));
+	return 0;
+}
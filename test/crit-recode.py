@@ -57,6 +57,10 @@ for imgf in find.stdout.readlines():
 		continue
 	if imgf_b.startswith('rule-'):
 		continue
+	if imgf_b.startswith('shmem-hashes-'):
+		continue
+	if imgf_b.startswith('sysv-shmem-hashes-'):
+		continue
 
 	o_img = open(imgf).read()
 	if not recode_and_check(imgf, o_img, False):
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Fragment the given amount of anonymous memory as much as possible
+ * -- every other page is touched, so that each one becomes its own
+ * pagemap entry -- and sleep. The pid is written into a file once
+ * ready.
+ */
+int main(int argc, char **argv)
+{
+	unsigned long size, pg, i;
+	char *mem;
+	FILE *f;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <size MB> <pidfile>\n", argv[0]);
+		return 1;
+	}
+
+	pg = sysconf(_SC_PAGESIZE);
+	size = strtoul(argv[1], NULL, 0) << 20;
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	/* A huge page would fill the holes */
+	madvise(mem, size, MADV_NOHUGEPAGE);
+
+	for (i = 0; i < size / pg; i += 2)
+		mem[i * pg] = 1;
+
+	f = fopen(argv[2], "w");
+	if (!f) {
+		perror("fopen");
+		return 1;
+	}
+	fprintf(f, "%d", getpid());
+	fclose(f);
+
+	while (1)
+		pause();
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Measure how fast criu loads pagemap images on restore, with the
+# packed entries and with the old protobuf ones. A task with a
+# fragmented heap of SIZE MB is dumped once, then restored from the
+# packed images and from the same images re-encoded by crit without
+# the packed flag, and the load_pagemaps phase from stats-restore is
+# printed.
+#
+# Every other page of the heap is touched, so the default of 40G makes
+# 5M pagemap entries and needs 20G of memory and as much for images.
+#
+
+source ../env.sh || exit 1
+
+SIZE=${SIZE:-40960}
+ITERS=${ITERS:-3}
+DIR=$(pwd)/dump
+
+function fail {
+	echo "$@"
+	exit 1
+}
+
+function load_usec {
+	$CRIT decode -i "$1/stats-restore" | python -c '
+import json, sys
+st = json.load(sys.stdin)["entries"][0]["restore"]
+print([p["time"] for p in st.get("phases", []) if p["name"] == "load_pagemaps"][0])'
+}
+
+function restore {
+	local dir=$1
+
+	rm -f "$dir/restore.pid" "$dir/stats-restore"
+	$CRIU restore -D "$dir" -o restore.log -v4 -d --pidfile restore.pid ||
+		fail "Restore failed, see $dir/restore.log"
+
+	local pid=$(cat "$dir/restore.pid")
+	kill -9 $pid
+	while kill -0 $pid 2> /dev/null; do
+		sleep 0.1
+	done
+}
+
+function unpack_pagemaps {
+	local img
+
+	for img in "$DIR"/pb/pagemap-*.img; do
+		$CRIT decode -i "$img" | python -c '
+import json, sys
+img = json.load(sys.stdin)
+img["entries"][0].pop("packed", None)
+json.dump(img, sys.stdout)' | $CRIT encode -o "$img" ||
+			fail "Can't re-encode $img"
+	done
+}
+
+make fragheap || fail "Can't build fragheap"
+
+rm -rf "$DIR" fragheap.pid
+mkdir -p "$DIR"
+setsid ./fragheap $SIZE fragheap.pid < /dev/null &> /dev/null &
+while [ ! -s fragheap.pid ]; do
+	sleep 0.1
+done
+
+$CRIU dump -t $(cat fragheap.pid) -D "$DIR" -o dump.log -v4 ||
+	fail "Dump failed, see $DIR/dump.log"
+
+mkdir "$DIR/pb"
+cp "$DIR"/*.img "$DIR/pb/" || fail "Can't copy images"
+unpack_pagemaps
+
+nr=$($CRIT decode -i "$DIR/pb/pagemap-$(cat fragheap.pid).img" | python -c '
+import json, sys
+print(len(json.load(sys.stdin)["entries"]) - 1)')
+
+for i in $(seq $ITERS); do
+	restore "$DIR"
+	packed=$(load_usec "$DIR")
+	restore "$DIR/pb"
+	pb=$(load_usec "$DIR/pb")
+	printf "%d entries: load_pagemaps packed %8d us, protobuf %8d us\n" \
+		$nr $packed $pb
+done
+
+rm -rf "$DIR" fragheap.pid
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Occupy the given amount of anonymous memory with non-zero
+ * data and sleep, the pid is written into a file once ready.
+ */
+int main(int argc, char **argv)
+{
+	unsigned long size, i;
+	unsigned int *mem;
+	FILE *f;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <size MB> <pidfile>\n", argv[0]);
+		return 1;
+	}
+
+	size = strtoul(argv[1], NULL, 0) << 20;
+	mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	for (i = 0; i < size / sizeof(*mem); i++)
+		mem[i] = i * 2654435761u;
+
+	f = fopen(argv[2], "w");
+	if (!f) {
+		perror("fopen");
+		return 1;
+	}
+	fprintf(f, "%d", getpid());
+	fclose(f);
+
+	while (1)
+		pause();
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+#!/bin/bash
+#
+# Measure how fast pages images are written and how much page cache
+# the dump leaves behind. Images directories to test can be given as
+# arguments, by default a tmpfs one and one on the current filesystem
+# are used. SIZE sets the amount of memory (in MB) to dump.
+#
+
+source ../env.sh || exit 1
+
+SIZE=${SIZE:-1024}
+DIRS=${@:-/dev/shm/criu-pages-io $(pwd)/dump}
+
+function fail {
+	echo "$@"
+	exit 1
+}
+
+function cached_kb {
+	awk '/^Cached:/ { print $2 }' /proc/meminfo
+}
+
+function bench {
+	local dir=$1
+	shift
+
+	rm -rf "$dir"
+	mkdir -p "$dir" || fail "Can't create $dir"
+
+	rm -f memhog.pid
+	setsid ./memhog $SIZE memhog.pid < /dev/null &> /dev/null &
+	while [ ! -s memhog.pid ]; do
+		sleep 0.1
+	done
+
+	sync
+	echo 1 > /proc/sys/vm/drop_caches
+	local cached=$(cached_kb)
+	local start=$(date +%s%N)
+
+	$CRIU dump -t $(cat memhog.pid) -D "$dir" -o dump.log -v4 "$@" ||
+		fail "Dump failed, see $dir/dump.log"
+
+	local end=$(date +%s%N)
+	local grown=$(( $(cached_kb) - cached ))
+
+	printf "%-32s %-30s %8d MB/s %8d MB cached\n" "$dir" "${*:-default}" \
+		$(( SIZE * 1000000000 / (end - start) )) $(( grown / 1024 ))
+}
+
+make memhog || fail "Can't build memhog"
+
+for dir in $DIRS; do
+	bench $dir
+	bench $dir --pages-direct
+	bench $dir --pages-direct --fsync-images
+	bench $dir --fsync-images
+	rm -rf "$dir"
+done
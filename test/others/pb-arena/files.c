@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+/*
+ * Keep the given number of distinct files open and sleep, so that
+ * the dump has that many reg-files entries. The pid is written into
+ * a file once ready.
+ */
+int main(int argc, char **argv)
+{
+	unsigned long nr, i;
+	struct rlimit rl;
+	char path[64];
+	FILE *f;
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s <nr files> <dir> <pidfile>\n", argv[0]);
+		return 1;
+	}
+
+	nr = strtoul(argv[1], NULL, 0);
+	rl.rlim_cur = rl.rlim_max = nr + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rl)) {
+		perror("Can't raise RLIMIT_NOFILE");
+		return 1;
+	}
+
+	if (mkdir(argv[2], 0700) && access(argv[2], F_OK)) {
+		perror("mkdir");
+		return 1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		snprintf(path, sizeof(path), "%s/%lu", argv[2], i);
+		if (open(path, O_RDWR | O_CREAT, 0600) < 0) {
+			perror("open");
+			return 1;
+		}
+	}
+
+	f = fopen(argv[3], "w");
+	if (!f) {
+		perror("fopen");
+		return 1;
+	}
+	fprintf(f, "%d", getpid());
+	fclose(f);
+
+	while (1)
+		pause();
+
+	return 0;
+}
@@ -0,0 +1,61 @@
+#!/bin/bash
+#
+# Measure how fast criu collects images on restore with the arena
+# allocators and with the default one (CRIU_PB_ARENA_OFF). A task
+# with NR distinct open files is dumped once, then restored from the
+# same images dir with either allocator, and the collect_images phase
+# from stats-restore is printed.
+#
+
+source ../env.sh || exit 1
+
+NR=${NR:-100000}
+ITERS=${ITERS:-3}
+DIR=$(pwd)/dump
+
+function fail {
+	echo "$@"
+	exit 1
+}
+
+function collect_usec {
+	$CRIT decode -i "$DIR/stats-restore" | python -c '
+import json, sys
+st = json.load(sys.stdin)["entries"][0]["restore"]
+print([p["time"] for p in st.get("phases", []) if p["name"] == "collect_images"][0])'
+}
+
+function restore {
+	rm -f "$DIR/restore.pid" "$DIR/stats-restore"
+	$CRIU restore -D "$DIR" -o restore.log -v4 -d --pidfile restore.pid ||
+		fail "Restore failed, see $DIR/restore.log"
+
+	local pid=$(cat "$DIR/restore.pid")
+	kill -9 $pid
+	while kill -0 $pid 2> /dev/null; do
+		sleep 0.1
+	done
+}
+
+make files || fail "Can't build files"
+
+rm -rf "$DIR" files.d files.pid
+mkdir -p "$DIR"
+setsid ./files $NR files.d files.pid < /dev/null &> /dev/null &
+while [ ! -s files.pid ]; do
+	sleep 0.1
+done
+
+$CRIU dump -t $(cat files.pid) -D "$DIR" -o dump.log -v4 ||
+	fail "Dump failed, see $DIR/dump.log"
+
+for i in $(seq $ITERS); do
+	restore
+	arena=$(collect_usec)
+	CRIU_PB_ARENA_OFF=1 restore
+	malloc=$(collect_usec)
+	printf "%d files: collect_images arena %8d us, malloc %8d us\n" \
+		$NR $arena $malloc
+done
+
+rm -rf "$DIR" files.d files.pid
@@ -1562,6 +1562,14 @@ def run_tests(opts):
 					l.skip(t, "samens test in the same namespace")
 					continue
 
+			if (opts['pre'] or opts['snaps']) and test_flag(tdesc, 'nopre'):
+				l.skip(t, "no pre-dumps or snapshots")
+				continue
+
+			if opts['page_server'] and test_flag(tdesc, 'nopagesrv'):
+				l.skip(t, "no page server")
+				continue
+
 			test_flavs = tdesc.get('flavor', 'h ns uns').split()
 			opts_flavs = (opts['flavor'] or 'h,ns,uns').split(',')
 			if opts_flavs != ['best']:
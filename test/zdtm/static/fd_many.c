@@ -0,0 +1,92 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that a million of fds is restored";
+const char *test_author	= "CRIU team <criu@openvz.org>";
+
+#define NR_FDS		1000000
+#define FD_BASE		16
+
+/*
+ * Every even fd is a separate file, every odd one is its dup, so
+ * that there are both lots of files and lots of shared ones.
+ */
+static int fd_acc(int i)
+{
+	return (i / 2) % 4 ? O_RDONLY : O_WRONLY;
+}
+
+static int fd_cloexec(int i)
+{
+	return i % 3 ? 0 : FD_CLOEXEC;
+}
+
+int main(int argc, char **argv)
+{
+	struct rlimit rl;
+	int i, fd;
+
+	test_init(argc, argv);
+
+	rl.rlim_cur = rl.rlim_max = FD_BASE + NR_FDS + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rl)) {
+		pr_perror("Can't raise the fd limit");
+		return 1;
+	}
+
+	for (i = 0; i < NR_FDS; i++) {
+		if (i % 2)
+			fd = dup2(FD_BASE + i - 1, FD_BASE + i);
+		else {
+			fd = open("/dev/null", fd_acc(i));
+			if (fd >= 0 && fd != FD_BASE + i) {
+				if (dup2(fd, FD_BASE + i) < 0)
+					fd = -1;
+				else {
+					close(fd);
+					fd = FD_BASE + i;
+				}
+			}
+		}
+
+		if (fd < 0) {
+			pr_perror("Can't open fd %d", FD_BASE + i);
+			return 1;
+		}
+
+		if (fcntl(fd, F_SETFD, fd_cloexec(i))) {
+			pr_perror("Can't set flags on %d", fd);
+			return 1;
+		}
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < NR_FDS; i++) {
+		int flags;
+
+		fd = FD_BASE + i;
+		flags = fcntl(fd, F_GETFL);
+		if (flags < 0) {
+			fail("Fd %d is lost", fd);
+			return 1;
+		}
+
+		if ((flags & O_ACCMODE) != fd_acc(i)) {
+			fail("Fd %d has wrong mode %#x", fd, flags);
+			return 1;
+		}
+
+		if (fcntl(fd, F_GETFD) != fd_cloexec(i)) {
+			fail("Fd %d has wrong fd flags", fd);
+			return 1;
+		}
+	}
+
+	pass();
+	return 0;
+}
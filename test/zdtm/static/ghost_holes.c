@@ -0,0 +1,108 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that holes in unlinked files survive C/R";
+const char *test_author	= "CRIU team <criu@openvz.org>";
+
+char *filename;
+TEST_OPTION(filename, string, "file name", 1);
+
+/*
+ * The file is bigger than the default --ghost-limit, but the data
+ * in it is not, so it should be dumped without raising the limit.
+ */
+#define CHUNK_SIZE	(64 << 10)
+#define FILE_SIZE	(64 << 20)
+
+/* Data chunks, the rest of the file is holes including the tail */
+static off_t chunks[] = { 0, 4 << 20, 5 << 20, 32 << 20 };
+
+static int check_chunk(int fd, off_t off, char *buf, uint32_t *crc)
+{
+	if (pread(fd, buf, CHUNK_SIZE, off) != CHUNK_SIZE) {
+		pr_perror("Can't read data at %lld", (long long)off);
+		return -1;
+	}
+
+	if (datachk((uint8_t *)buf, CHUNK_SIZE, crc)) {
+		fail("Data corrupted at %lld", (long long)off);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char buf[CHUNK_SIZE], zero[CHUNK_SIZE];
+	struct stat st;
+	uint32_t crc;
+	int fd, i;
+
+	test_init(argc, argv);
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		pr_perror("Can't open %s", filename);
+		return 1;
+	}
+
+	crc = ~0;
+	for (i = 0; i < ARRAY_SIZE(chunks); i++) {
+		datagen((uint8_t *)buf, CHUNK_SIZE, &crc);
+		if (pwrite(fd, buf, CHUNK_SIZE, chunks[i]) != CHUNK_SIZE) {
+			pr_perror("Can't write %s", filename);
+			goto err;
+		}
+	}
+
+	if (ftruncate(fd, FILE_SIZE)) {
+		pr_perror("Can't truncate %s", filename);
+		goto err;
+	}
+
+	if (unlink(filename) < 0) {
+		pr_perror("Can't unlink %s", filename);
+		goto err;
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	if (fstat(fd, &st)) {
+		pr_perror("Can't stat %s", filename);
+		return 1;
+	}
+
+	if (st.st_size != FILE_SIZE) {
+		fail("File size is %lld, expected %d", (long long)st.st_size, FILE_SIZE);
+		return 1;
+	}
+
+	crc = ~0;
+	for (i = 0; i < ARRAY_SIZE(chunks); i++)
+		if (check_chunk(fd, chunks[i], buf, &crc))
+			return 1;
+
+	/* One of the holes */
+	memset(zero, 0, sizeof(zero));
+	if (pread(fd, buf, CHUNK_SIZE, 16 << 20) != CHUNK_SIZE ||
+	    memcmp(buf, zero, CHUNK_SIZE)) {
+		fail("Hole is not restored");
+		return 1;
+	}
+
+	close(fd);
+	pass();
+	return 0;
+err:
+	unlink(filename);
+	close(fd);
+	return 1;
+}
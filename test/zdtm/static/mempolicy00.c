@@ -0,0 +1,96 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that NUMA memory policies survive C/R";
+const char *test_author	= "CRIU team <criu@openvz.org>";
+
+#define MPOL_PREFERRED	1
+#define MPOL_BIND	2
+#define MPOL_F_ADDR	(1 << 1)
+
+#define MEM_SIZE	(64 << 10)
+#define MAXNODE		(8 * sizeof(unsigned long))
+
+static int get_policy(void *addr, int *mode, unsigned long *mask)
+{
+	*mask = 0;
+	return syscall(__NR_get_mempolicy, mode, mask, MAXNODE,
+			addr, addr ? MPOL_F_ADDR : 0);
+}
+
+static int check_policy(void *addr, int exp_mode)
+{
+	unsigned long mask;
+	int mode;
+
+	if (get_policy(addr, &mode, &mask)) {
+		pr_perror("Can't get memory policy for %p", addr);
+		return -1;
+	}
+
+	if (mode != exp_mode || mask != 1) {
+		fail("Policy for %p is %d/%lx, expected %d/1",
+				addr, mode, mask, exp_mode);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long node0 = 1;
+	uint32_t crc;
+	void *mem;
+	int mode;
+
+	test_init(argc, argv);
+
+	if (get_policy(NULL, &mode, &node0) && (errno == ENOSYS || errno == EPERM)) {
+		test_msg("NUMA is not supported, skipping\n");
+		test_daemon();
+		test_waitsig();
+		pass();
+		return 0;
+	}
+	node0 = 1;
+
+	mem = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		pr_perror("mmap failed");
+		return 1;
+	}
+
+	if (syscall(__NR_mbind, mem, MEM_SIZE, MPOL_BIND, &node0, MAXNODE, 0)) {
+		pr_perror("Can't bind memory to node 0");
+		return 1;
+	}
+
+	if (syscall(__NR_set_mempolicy, MPOL_PREFERRED, &node0, MAXNODE)) {
+		pr_perror("Can't prefer node 0");
+		return 1;
+	}
+
+	crc = ~0;
+	datagen(mem, MEM_SIZE, &crc);
+
+	test_daemon();
+	test_waitsig();
+
+	if (check_policy(mem, MPOL_BIND) || check_policy(NULL, MPOL_PREFERRED))
+		return 1;
+
+	crc = ~0;
+	if (datachk(mem, MEM_SIZE, &crc)) {
+		fail("Data corrupted");
+		return 1;
+	}
+
+	pass();
+	return 0;
+}
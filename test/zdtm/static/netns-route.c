@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that many addresses, routes and rules are preserved";
+const char *test_author	= "CRIU team <criu@openvz.org>";
+
+#define NR_ROUTES	1000
+
+#define SHOW_CMD	"ip addr && ip route && ip -6 route && ip rule"
+
+int main(int argc, char **argv)
+{
+	FILE *f;
+	int i;
+
+	test_init(argc, argv);
+
+	if (system("ip link set lo up")) {
+		fail("Can't set lo up");
+		return -1;
+	}
+
+	f = popen("ip -batch -", "w");
+	if (!f) {
+		pr_perror("Can't run ip");
+		return -1;
+	}
+
+	/* Local networks, routes to them and via them, for all the kinds */
+	for (i = 0; i < NR_ROUTES; i++) {
+		fprintf(f, "addr add 10.%d.%d.1/24 dev lo\n", i / 250, i % 250);
+		fprintf(f, "route add 172.16.%d.%d dev lo\n", i / 250, i % 250);
+		fprintf(f, "route add 192.168.%d.%d via 172.16.%d.%d\n",
+				i / 250, i % 250, i / 250, i % 250);
+	}
+	fprintf(f, "addr add fd00::1/64 dev lo\n");
+	fprintf(f, "route add fd01::/64 dev lo\n");
+	fprintf(f, "rule add from 10.0.0.0/8 table 100 pref 100\n");
+	fprintf(f, "rule add to 1.2.3.4 table 101 pref 200\n");
+
+	if (pclose(f)) {
+		fail("Can't configure the network");
+		return -1;
+	}
+
+	if (system(SHOW_CMD " > netns-route.dump.test")) {
+		fail("Can't save net config");
+		return -1;
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	if (system(SHOW_CMD " > netns-route.rst.test")) {
+		fail("Can't get net config");
+		return -1;
+	}
+
+	if (system("diff netns-route.rst.test netns-route.dump.test")) {
+		fail("Net config differs after restore");
+		return -1;
+	}
+
+	pass();
+	return 0;
+}
@@ -0,0 +1,76 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that data in lots of pipes is restored";
+const char *test_author	= "CRIU team <criu@openvz.org>";
+
+#define NR_PIPES	50000
+#define BIG_EVERY	1000	/* every such pipe has more than a page of data */
+#define BIG_SIZE	6000
+
+static int pipes[NR_PIPES][2];
+
+static int pipe_data(int i, char *buf)
+{
+	int len;
+
+	if (i % BIG_EVERY == 0) {
+		memset(buf, 'a' + i / BIG_EVERY % 26, BIG_SIZE);
+		len = BIG_SIZE;
+	} else
+		len = sprintf(buf, "pipe %d", i);
+
+	return len;
+}
+
+int main(int argc, char **argv)
+{
+	char buf[BIG_SIZE], rbuf[BIG_SIZE + 1];
+	struct rlimit rl;
+	int i, len;
+
+	test_init(argc, argv);
+
+	rl.rlim_cur = rl.rlim_max = 2 * NR_PIPES + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rl)) {
+		pr_perror("Can't raise the fd limit");
+		return 1;
+	}
+
+	for (i = 0; i < NR_PIPES; i++) {
+		if (pipe(pipes[i])) {
+			pr_perror("Can't create pipe %d", i);
+			return 1;
+		}
+
+		len = pipe_data(i, buf);
+		if (write(pipes[i][1], buf, len) != len) {
+			pr_perror("Can't write to pipe %d", i);
+			return 1;
+		}
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < NR_PIPES; i++) {
+		int ret;
+
+		len = pipe_data(i, buf);
+		close(pipes[i][1]);
+
+		ret = read(pipes[i][0], rbuf, sizeof(rbuf));
+		if (ret != len || memcmp(buf, rbuf, len)) {
+			fail("Data mismatch in pipe %d (%d bytes)", i, ret);
+			return 1;
+		}
+	}
+
+	pass();
+	return 0;
+}
@@ -0,0 +1,52 @@
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that several anonymous shared segments are C/R-ed";
+const char *test_author	= "CRIU team <criu@openvz.org>";
+
+#define NR_SEGS		6
+
+int main(int argc, char **argv)
+{
+	/* sizes in pages, odd segments are touched sparsely */
+	static const int sizes[NR_SEGS] = { 1, 256, 1024, 64, 2048, 16 };
+	uint32_t crc;
+	void *mem[NR_SEGS];
+	int i, j, step;
+
+	test_init(argc, argv);
+
+	for (i = 0; i < NR_SEGS; i++) {
+		mem[i] = mmap(NULL, sizes[i] * PAGE_SIZE, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (mem[i] == MAP_FAILED) {
+			pr_perror("Can't map segment %d", i);
+			return 1;
+		}
+
+		step = (i & 1) ? 8 : 1;
+		for (j = 0; j < sizes[i]; j += step) {
+			crc = ~0;
+			datagen(mem[i] + j * PAGE_SIZE, PAGE_SIZE, &crc);
+		}
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < NR_SEGS; i++) {
+		step = (i & 1) ? 8 : 1;
+		for (j = 0; j < sizes[i]; j += step) {
+			crc = ~0;
+			if (datachk(mem[i] + j * PAGE_SIZE, PAGE_SIZE, &crc)) {
+				fail("Segment %d page %d corrupted", i, j);
+				return 1;
+			}
+		}
+	}
+
+	pass();
+	return 0;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "zdtmtst.h"
+
+#ifndef MADV_HUGEPAGE
+# define MADV_HUGEPAGE 14
+#endif
+
+const char *test_doc	= "Check that transparent huge pages survive C/R";
+const char *test_author	= "CRIU team <criu@openvz.org>";
+
+#define HPAGE_SIZE	(2 << 20)
+#define MEM_SIZE	(8 * HPAGE_SIZE)
+
+static int thp_enabled(void)
+{
+	char buf[128];
+	FILE *f;
+
+	f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (!f)
+		return 0;
+
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = '\0';
+	fclose(f);
+
+	return strstr(buf, "[never]") == NULL;
+}
+
+struct thp_vma {
+	unsigned long	start;
+	unsigned long	end;
+	long		anon_huge_kb;
+};
+
+/* Find the VMA with the given address in smaps */
+static int get_thp_vma(unsigned long where, struct thp_vma *vma)
+{
+	unsigned long start, end;
+	bool found = false;
+	char buf[1024];
+	FILE *smaps;
+
+	smaps = fopen("/proc/self/smaps", "r");
+	if (!smaps) {
+		pr_perror("Can't open smaps");
+		return -1;
+	}
+
+	vma->anon_huge_kb = -1;
+	while (fgets(buf, sizeof(buf), smaps)) {
+		if (sscanf(buf, "%lx-%lx ", &start, &end) == 2) {
+			if (found)
+				break;
+			if (start <= where && where < end) {
+				vma->start = start;
+				vma->end = end;
+				found = true;
+			}
+			continue;
+		}
+
+		if (found && sscanf(buf, "AnonHugePages: %ld kB", &vma->anon_huge_kb) == 1)
+			break;
+	}
+
+	fclose(smaps);
+
+	if (vma->anon_huge_kb < 0) {
+		pr_err("AnonHugePages not found for %lx\n", where);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct thp_vma before, after;
+	uint32_t crc;
+	void *addr, *mem;
+
+	test_init(argc, argv);
+
+	if (!thp_enabled()) {
+		skip("Transparent huge pages are not available");
+		return 1;
+	}
+
+	/* Get a huge page aligned area, so that it can be fully backed by THP-s */
+	addr = mmap(NULL, MEM_SIZE + HPAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		pr_perror("mmap failed");
+		return 1;
+	}
+
+	mem = (void *)(((unsigned long)addr + HPAGE_SIZE - 1) & ~(HPAGE_SIZE - 1UL));
+	if (mem != addr)
+		munmap(addr, mem - addr);
+	munmap(mem + MEM_SIZE, addr + HPAGE_SIZE - mem);
+
+	if (madvise(mem, MEM_SIZE, MADV_HUGEPAGE)) {
+		pr_perror("madvise failed");
+		return 1;
+	}
+
+	crc = ~0;
+	datagen(mem, MEM_SIZE, &crc);
+
+	if (get_thp_vma((unsigned long)mem, &before))
+		return 1;
+	if (before.anon_huge_kb == 0) {
+		pr_err("No huge pages before C/R\n");
+		return 1;
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	crc = ~0;
+	if (datachk(mem, MEM_SIZE, &crc)) {
+		fail("Data mismatch");
+		return 1;
+	}
+
+	if (get_thp_vma((unsigned long)mem, &after))
+		return 1;
+
+	if (after.start != before.start || after.end != before.end) {
+		fail("VMA changed: %lx-%lx -> %lx-%lx",
+				before.start, before.end, after.start, after.end);
+		return 1;
+	}
+
+	if (after.start & (HPAGE_SIZE - 1)) {
+		fail("Restored VMA %lx-%lx is not huge page aligned",
+				after.start, after.end);
+		return 1;
+	}
+
+	/* Each 2M unit backed by a huge page should be such after restore */
+	if (after.anon_huge_kb < before.anon_huge_kb) {
+		fail("Huge pages are lost: %ld of %ld 2M units -> %ld",
+				before.anon_huge_kb / (HPAGE_SIZE >> 10),
+				(long)(MEM_SIZE / HPAGE_SIZE),
+				after.anon_huge_kb / (HPAGE_SIZE >> 10));
+		return 1;
+	}
+
+	test_msg("AnonHugePages: %ld kB -> %ld kB\n",
+			before.anon_huge_kb, after.anon_huge_kb);
+	pass();
+	return 0;
+}